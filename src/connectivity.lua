@@ -109,7 +109,7 @@ local function update_upnp(n, deadlines)
         u.checking = true
 
         n:explain('connectivity', "checking UPnP...")
-        u.worker:pcall(
+        n.worker:pcall_class('upnp',
             function(ok, ...)
                 u.checking = false
 
@@ -0,0 +1,233 @@
+#include "admission.h"
+#include "luawh.h"
+#include "os.h"
+#include "packet.h"
+
+#define MT "admission"
+#define WINDOW_MS 1000
+
+struct admission {
+    struct egress* egress;
+    uint16_t port;
+    uint32_t rate;
+
+    // count of verifications of unknown source keys, in the current and in the
+    // previous windows
+    uint64_t window;
+    uint32_t count;
+    uint32_t last_count;
+
+    // current and previous secrets
+    uint8_t secrets[2][crypto_generichash_KEYBYTES];
+    uint64_t rotated;
+
+    struct admission_stats st;
+};
+
+struct admission* admission_new(struct egress* egress, uint16_t port, uint32_t rate) {
+    struct admission* adm = sodium_malloc(sizeof(struct admission));
+    if (!adm) {
+        return NULL;
+    }
+
+    sodium_memzero(adm, sizeof(*adm));
+    adm->egress = egress;
+    adm->port = port;
+    adm->rate = rate;
+    adm->rotated = now_ms();
+    randombytes_buf(adm->secrets, sizeof(adm->secrets));
+
+    return adm;
+}
+
+void admission_free(struct admission* adm) {
+    sodium_free(adm);
+}
+
+static void _advance(struct admission* adm, uint64_t now) {
+    uint64_t window = now / WINDOW_MS;
+
+    if (window != adm->window) {
+        adm->last_count = window == adm->window+1 ? adm->count : 0;
+        adm->count = 0;
+        adm->window = window;
+    }
+
+    if (now >= adm->rotated + ADMISSION_COOKIE_MS) {
+        memcpy(adm->secrets[1], adm->secrets[0], sizeof(adm->secrets[0]));
+        randombytes_buf(adm->secrets[0], sizeof(adm->secrets[0]));
+        adm->rotated = now;
+    }
+}
+
+int admission_under_load(const struct admission* adm, uint64_t now) {
+    if (now / WINDOW_MS == adm->window) {
+        return adm->count >= adm->rate || adm->last_count >= adm->rate;
+    } else if (now / WINDOW_MS == adm->window+1) {
+        return adm->count >= adm->rate;
+    } else {
+        return 0;
+    }
+}
+
+static int _cookie(const struct admission* adm, int secret,
+                   const struct address* src, uint8_t* cookie) {
+    uint8_t packed[ADDRESS_PACKBYTES];
+    size_t l = address_pack(src, packed);
+    if (l == 0) {
+        return -1;
+    }
+
+    return crypto_generichash(cookie, WH_COOKIEBYTES, packed, l,
+                              adm->secrets[secret], sizeof(adm->secrets[secret]));
+}
+
+static int _valid_cookie(const struct admission* adm, const uint8_t* cookie,
+                         const struct address* src) {
+    uint8_t expected[WH_COOKIEBYTES];
+
+    for (int i=0; i<2; ++i) {
+        if (_cookie(adm, i, src, expected) == 0 &&
+            crypto_verify_16(expected, cookie) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void _challenge(struct admission* adm, const struct address* src) {
+    uint8_t reply[sizeof(wh_cookie_reply_hdr)+WH_COOKIEBYTES];
+    memcpy(reply, wh_cookie_reply_hdr, sizeof(wh_cookie_reply_hdr));
+
+    if (_cookie(adm, 0, src, reply+sizeof(wh_cookie_reply_hdr)) == 0 &&
+        egress_push(adm->egress, reply, sizeof(reply), adm->port, src) == 0) {
+        ++adm->st.challenged;
+    }
+}
+
+int admission_filter(struct admission* adm, struct keycache* kc, const uint8_t* sk,
+                     const uint8_t** p, size_t* l, const struct address* src,
+                     uint64_t now) {
+    const uint8_t* m = *p;
+    const uint8_t* cookie = NULL;
+
+    _advance(adm, now);
+
+    if (*l < sizeof(wh_pkt_hdr)) {
+        return 0;
+    }
+
+    if (memcmp(m, wh_cookie_reply_hdr, sizeof(wh_cookie_reply_hdr)) == 0) {
+        if (*l == sizeof(wh_cookie_reply_hdr)+WH_COOKIEBYTES &&
+            egress_accept_cookie(adm->egress, src, m+sizeof(wh_cookie_reply_hdr),
+                                 now, now+ADMISSION_COOKIE_MS)) {
+            ++adm->st.cookies;
+        }
+
+        return 0;
+    }
+
+    if (memcmp(m, wh_cookie_hdr, sizeof(wh_cookie_hdr)) == 0) {
+        if (*l < sizeof(wh_cookie_hdr)+WH_COOKIEBYTES) {
+            return 0;
+        }
+
+        cookie = m+sizeof(wh_cookie_hdr);
+        *p = m = cookie+WH_COOKIEBYTES;
+        *l -= sizeof(wh_cookie_hdr)+WH_COOKIEBYTES;
+    }
+
+    if (*l < packet_size(0) || keycache_contains(kc, sk, packet_src(m))) {
+        return 1;
+    }
+
+    if (cookie && _valid_cookie(adm, cookie, src)) {
+        ++adm->st.admitted;
+    } else if (admission_under_load(adm, now)) {
+        _challenge(adm, src);
+        return 0;
+    }
+
+    ++adm->count;
+    ++adm->st.verified;
+    return 1;
+}
+
+void admission_verified(struct admission* adm, const struct address* src) {
+    // the peer answered without challenging
+    egress_clear_cookie(adm->egress, src);
+}
+
+void admission_stats(const struct admission* adm, struct admission_stats* st) {
+    *st = adm->st;
+}
+
+/*** LUA *********************************************************************/
+
+static void _delete(void* ud) {
+    admission_free(ud);
+}
+
+static int _close(lua_State* L) {
+    _delete(luaW_ownptr(L, 1, MT));
+    return 0;
+}
+
+// wh.admission.new(egress, port, rate) -> adm
+//
+// egress must outlive the filter. rate is in verifications per second.
+static int _new(lua_State* L) {
+    struct egress* egress = luaW_checkptr(L, 1, "egress");
+    uint16_t port = luaW_checkport(L, 2);
+    lua_Integer rate = luaL_checkinteger(L, 3);
+
+    if (rate <= 0 || rate > UINT32_MAX) {
+        luaL_error(L, "bad rate: %d", (int)rate);
+    }
+
+    struct admission* adm = admission_new(egress, port, rate);
+    if (!adm) {
+        luaL_error(L, "out of memory");
+    }
+
+    luaW_pushptr(L, MT, adm);
+    return 1;
+}
+
+static int _stats(lua_State* L) {
+    struct admission* adm = luaW_checkptr(L, 1, MT);
+
+    struct admission_stats st;
+    admission_stats(adm, &st);
+
+    lua_newtable(L);
+    lua_pushinteger(L, st.admitted);
+    lua_setfield(L, -2, "admitted");
+    lua_pushinteger(L, st.challenged);
+    lua_setfield(L, -2, "challenged");
+    lua_pushinteger(L, st.cookies);
+    lua_setfield(L, -2, "cookies");
+    lua_pushboolean(L, admission_under_load(adm, now_ms()));
+    lua_setfield(L, -2, "under_load");
+    lua_pushinteger(L, st.verified);
+    lua_setfield(L, -2, "verified");
+
+    return 1;
+}
+
+static const luaL_Reg funcs[] = {
+    {"close", _close},
+    {"new", _new},
+    {"stats", _stats},
+    {NULL, NULL},
+};
+
+LUAMOD_API int luaopen_admission(lua_State* L) {
+    luaL_checkversion(L);
+    luaL_newlib(L, funcs);
+
+    luaW_declptr(L, MT, _delete);
+
+    return 1;
+}
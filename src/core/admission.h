@@ -0,0 +1,55 @@
+#ifndef WIREHUB_ADMISSION_H
+#define WIREHUB_ADMISSION_H
+
+#include "egress.h"
+#include "keycache.h"
+
+/** Admission of received WireHub packets before they are verified.
+ *
+ * Verifying a packet of an unknown source key costs one X25519 scalar
+ * multiplication. When more than `rate` of those are done per second, the node
+ * is under load: packets of source keys whose shared key is not cached are
+ * answered a cookie reply, and dropped.
+ *
+ * A cookie is a MAC of the source address, keyed by a secret rotated every
+ * ADMISSION_COOKIE_MS. Peers receiving a cookie reply prefix the next packets
+ * they send to that address with the cookie (see egress_accept_cookie());
+ * prefixed packets with a valid cookie are verified even under load.
+ *
+ * Cookie replies are not authenticated. They are accepted only from addresses
+ * a WireHub packet was recently sent to, which have no live cookie. A cookie is
+ * dropped as soon as a packet sent from its address is verified.
+ */
+#define ADMISSION_COOKIE_MS     (2*60*1000)
+
+struct admission;
+
+struct admission_stats {
+    uint64_t challenged;        // packets answered a cookie reply
+    uint64_t admitted;          // packets with a valid cookie
+    uint64_t cookies;           // cookie replies accepted
+    uint64_t verified;          // unknown source keys let through
+};
+
+// cookie replies are sent from port `port` through egress `egress`, which must
+// outlive the filter. `rate` is in verifications per second.
+struct admission* admission_new(struct egress* egress, uint16_t port, uint32_t rate);
+void admission_free(struct admission* adm);
+
+/** Filters the datagram `*p` of `*l` bytes, received from `src`.
+ *
+ * Cookie replies are handled. Cookie prefixes are removed from `*p`. Returns 1
+ * if the packet must be verified, else 0.
+ */
+int admission_filter(struct admission* adm, struct keycache* kc, const uint8_t* sk,
+                     const uint8_t** p, size_t* l, const struct address* src,
+                     uint64_t now);
+
+// drops the cookie of `src`, which sent a verified packet
+void admission_verified(struct admission* adm, const struct address* src);
+
+int admission_under_load(const struct admission* adm, uint64_t now);
+
+void admission_stats(const struct admission* adm, struct admission_stats* st);
+
+#endif  // WIREHUB_ADMISSION_H
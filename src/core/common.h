@@ -25,7 +25,14 @@
 
 #define crypto_scalarmult_curve25519_KEYBASE64BYTES 44
 
+// headers of datagrams received on the WireHub port. They only differ by
+// their first byte, whose 6 most significant bits are set.
 static const uint8_t wh_pkt_hdr[] = {0xff, 0x00, 0x00, 0x00};
+static const uint8_t wh_session_hdr[] = {0xfe, 0x00, 0x00, 0x00};
+static const uint8_t wh_cookie_hdr[] = {0xfd, 0x00, 0x00, 0x00};
+static const uint8_t wh_cookie_reply_hdr[] = {0xfc, 0x00, 0x00, 0x00};
+
+#define WH_COOKIEBYTES 16
 static const int wh_version[3] = {0, 1, 0};
 
 #endif  // WIREHUB_COMMON_H
@@ -11,5 +11,44 @@
 
 #define WH_TUN_ICMP 1
 
+// bytes. maximum size of a packet built and queued by the core
+#define WH_EGRESS_BUFSIZE 4096
+
+// bytes. size of the buffer of each datagram received by the native ingress
+#define WH_INGRESS_BUFSIZE 4096
+
+// count of packets queued by the shards of the sharded ingress to Lua. Power
+// of two.
+#define WH_SHARDS_QUEUE 1024
+
+// count of packets queued to each thread of the packet verifier, and of
+// verified packets queued to Lua. Power of two.
+#define WH_VERIFIER_QUEUE 1024
+
+// bytes. size of the buffers of the native fragment reassembly. Larger
+// fragments are dropped.
+#define WH_REASM_BUFSIZE 1536
+
+// count of fragment buffers and of sessions of the native fragment reassembly
+#define WH_REASM_FRAGMENTS 1024
+#define WH_REASM_SESSIONS 256
+
+// count of token buckets of the rate limiter of received packets
+#define WH_RATELIMIT_BUCKETS 4096
+
+// milliseconds. maximum time a block of the loopback capture ring is filled
+// before being handed over
+#define WH_LORING_RETIRE_MS 1
+
+// maximum count of sessions of a relay
+#define WH_RELAY_SESSIONS 1024
+
+// bytes. size of the queues of requests and responses of each worker. Power of
+// two.
+#define WH_WORKER_QUEUE (1024*1024)
+
+// maximum count of cached keys shared with remote peers
+#define WH_KEYCACHE_SIZE 1024
+
 #endif  // WIREHUB_CONFIG_H
 
@@ -0,0 +1,664 @@
+#include "datapath.h"
+#include "luawh.h"
+#include "os.h"
+#include "packet.h"
+
+#define MT "datapath"
+
+static int _same_address(const struct address* a, const struct address* b) {
+    uint8_t pa[ADDRESS_PACKBYTES], pb[ADDRESS_PACKBYTES];
+    size_t la = address_pack(a, pa);
+    size_t lb = address_pack(b, pb);
+
+    return la != 0 && la == lb && memcmp(pa, pb, la) == 0;
+}
+
+// returns 1 if peer r is reached directly through address src
+static int _is_route(const struct kadrec* r, const struct address* src, int is_nated) {
+    if ((r->flags & (KADTABLE_ADDR | KADTABLE_RELAY | KADTABLE_ALIAS)) != KADTABLE_ADDR) {
+        return 0;
+    }
+
+    // any change of the peer's state is handled by Lua
+    if (!!(r->flags & KADTABLE_NATED) != !!is_nated) {
+        return 0;
+    }
+
+    return _same_address(&r->addr, src);
+}
+
+// sends to peer `d` a packet of command `cmd`, whose body is `prefix` then `m`.
+// returns the size of the packet, or -1.
+static int _forward(struct datapath* dp, struct keycache* kc, const uint8_t* sk,
+                    const struct kadrec* d, uint8_t cmd,
+                    const uint8_t* prefix, size_t pl, const uint8_t* m, size_t l) {
+    size_t bl = 1 + pl + l;
+    if (packet_size(bl) > WH_EGRESS_BUFSIZE) {
+        return -1;
+    }
+
+    const uint8_t* pk = keycache_publickey(kc, sk);
+    if (!pk) {
+        return -1;
+    }
+
+    uint8_t dst_k[KADTABLE_KEYBYTES];
+    kadrec_key(d, dst_k);
+
+    uint8_t out[WH_EGRESS_BUFSIZE];
+    uint8_t* body = packet_body(out);
+    packet_init(out, pk, dp->is_nated);
+    body[0] = cmd;
+    memcpy(body+1, prefix, pl);
+    memcpy(body+1+pl, m, l);
+
+    if (auth_packet(kc, out, bl, sk, dst_k) != 0) {
+        return -1;
+    }
+
+    if (egress_push(dp->egress, out, packet_size(bl), dp->port, &d->addr) < 0) {
+        return -1;
+    }
+
+    return packet_size(bl);
+}
+
+// returns the record of peer `k` if it is reached directly
+static const struct kadrec* _direct(struct datapath* dp, const uint8_t* k) {
+    const struct kadrec* d = kadtable_get(dp->kad, k);
+    if (!d || (d->flags & (KADTABLE_ADDR | KADTABLE_RELAY | KADTABLE_ALIAS)) != KADTABLE_ADDR) {
+        return NULL;
+    }
+
+    return d;
+}
+
+// returns the record of peer `k` if it is NAT-ed, has a tunnel and is relayed
+// by peer `relay`
+static const struct kadrec* _tunnel(struct datapath* dp, const uint8_t* k,
+                                    const struct kadrec* relay) {
+    const struct kadrec* s = kadtable_get(dp->kad, k);
+    const unsigned int flags = KADTABLE_NATED | KADTABLE_RELAY | KADTABLE_TUNNEL;
+    uint8_t relay_k[KADTABLE_KEYBYTES];
+    kadrec_key(relay, relay_k);
+
+    if (!s || (s->flags & (flags | KADTABLE_ALIAS)) != flags ||
+        memcmp(s->relay_k, relay_k, sizeof(relay_k)) != 0) {
+        return NULL;
+    }
+
+    return s;
+}
+
+static int _relay(struct datapath* dp, struct keycache* kc, const uint8_t* sk,
+                  const uint8_t* pkt, size_t sz, const struct address* src,
+                  int is_nated) {
+    const uint8_t* m = packet_body(pkt)+1;
+    size_t l = sz - packet_size(1);
+
+    if (l < KADTABLE_KEYBYTES) {
+        return 0;
+    }
+
+    const uint8_t* dst_k = m;
+    m += KADTABLE_KEYBYTES;
+    l -= KADTABLE_KEYBYTES;
+
+    const struct kadrec* s = kadtable_get(dp->kad, packet_src(pkt));
+    if (!s || !_is_route(s, src, is_nated)) {
+        return 0;
+    }
+
+    // the destination must be reached directly. Lua reports other cases.
+    const struct kadrec* d = _direct(dp, dst_k);
+    if (!d) {
+        return 0;
+    }
+
+    uint8_t packed_src[ADDRESS_PACKBYTES];
+    size_t al = address_pack(src, packed_src);
+    int fl;
+    if (al == 0 ||
+        (fl = _forward(dp, kc, sk, d, packet_cmd_RELAYED, packed_src, al, m, l)) < 0) {
+        return 0;
+    }
+
+    kadtable_seen(dp->kad, s);
+    kadtable_traffic(dp->kad, s, sz, 0);
+    kadtable_traffic(dp->kad, d, 0, fl);
+    ++dp->st.relayed;
+    dp->st.relayed_bytes += sz;
+    return 1;
+}
+
+// binds a relay session from the source of BIND packet `pkt` to the requested
+// peer, and answers a BOUND packet
+static int _bind(struct datapath* dp, struct keycache* kc, const uint8_t* sk,
+                 const uint8_t* pkt, size_t sz, const struct address* src,
+                 int is_nated) {
+    if (!dp->sessions || sz != packet_size(1+KADTABLE_KEYBYTES)) {
+        return 0;
+    }
+
+    const uint8_t* src_k = packet_src(pkt);
+    const uint8_t* dst_k = packet_body(pkt)+1;
+
+    const struct kadrec* s = kadtable_get(dp->kad, src_k);
+    if (!s || !_is_route(s, src, is_nated) || !_direct(dp, dst_k)) {
+        return 0;
+    }
+
+    int is_new;
+    struct relaysession* rs = relaysessions_bind(dp->sessions, src_k, dst_k,
+                                                 now_ms(), &is_new);
+
+    if (is_new && session_key(kc, sk, src_k, rs->id, rs->key) != 0) {
+        relaysessions_remove(dp->sessions, rs);
+        return 1;
+    }
+
+    uint32_t id_b = htobe32(rs->id);
+    int fl = _forward(dp, kc, sk, s, packet_cmd_BOUND, dst_k, KADTABLE_KEYBYTES,
+                      (const uint8_t*)&id_b, sizeof(id_b));
+    if (fl < 0) {
+        return 1;
+    }
+
+    kadtable_seen(dp->kad, s);
+    kadtable_traffic(dp->kad, s, sz, fl);
+    ++dp->st.bound;
+    return 1;
+}
+
+// handles FRAGMENT message `m` of source `s`
+static int _fragment(struct datapath* dp, const struct kadrec* s,
+                     const uint8_t* m, size_t l) {
+    if (l < 4) {
+        return 0;
+    }
+
+    uint16_t id = (m[1] << 8) | m[2];
+    unsigned int num = m[3] & 0x7f;
+    int mf = !!(m[3] & 0x80);
+
+    ++dp->st.fragments;
+
+    uint8_t k[KADTABLE_KEYBYTES];
+    kadrec_key(s, k);
+
+    struct iovec iov[REASM_MAXFRAGS];
+    int count = reasm_add(dp->reasm, k, id, num, mf, m+4, l-4, now_ms(), iov);
+    if (count <= 0) {
+        return 1;
+    }
+
+    // datagram must be a WireGuard packet
+    const uint8_t* wg = iov[0].iov_base;
+    if (iov[0].iov_len < 4 || wg[0] < 1 || wg[0] > 4 || wg[1] != 0 || wg[2] != 0 || wg[3] != 0) {
+        ++dp->st.datagram_errors;
+        return 1;
+    }
+
+    if (sendto_raw_wg(dp->lo_fd, iov, count, &s->lo_addr, dp->port) < 0) {
+        ++dp->st.datagram_errors;
+        return 1;
+    }
+
+    ++dp->st.datagrams;
+    return 1;
+}
+
+// handles RELAYED packet `pkt`, relayed by peer `relay`
+static int _relayed(struct datapath* dp, struct keycache* kc, const uint8_t* sk,
+                    const uint8_t* pkt, size_t sz, const struct kadrec* relay) {
+    const uint8_t* m = packet_body(pkt)+1;
+    size_t l = sz - packet_size(1);
+
+    if (!dp->reasm) {
+        return 0;
+    }
+
+    struct address src_addr;
+    size_t al = address_unpack(&src_addr, m, l);
+    if (al == 0) {
+        return 0;
+    }
+
+    const uint8_t* me = m+al;
+    size_t mel = l-al;
+
+    if (mel < packet_size(1) || verify_packet(kc, me, mel, sk)) {
+        return 0;
+    }
+
+    // only FRAGMENT packets of NAT-ed peers with a tunnel through this relay
+    // are handled
+    if (packet_body(me)[0] != packet_cmd_FRAGMENT) {
+        return 0;
+    }
+
+    uint64_t flags_time;
+    memcpy(&flags_time, packet_flags_time(me), sizeof(flags_time));
+    int is_nated = (flags_time >> packet_flags_DIRECTSHIFT) & packet_flags_DIRECTMASK;
+
+    const struct kadrec* s = _tunnel(dp, packet_src(me), relay);
+    if (!is_nated || !s) {
+        return 0;
+    }
+
+    kadtable_seen(dp->kad, relay);
+    kadtable_seen(dp->kad, s);
+    kadtable_traffic(dp->kad, relay, sz, 0);
+
+    return _fragment(dp, s, packet_body(me), mel-packet_size(0));
+}
+
+// handles DATA packet `pkt`, forwarded by peer `relay` from a relay session
+static int _data(struct datapath* dp, const uint8_t* pkt, size_t sz,
+                 const struct kadrec* relay) {
+    const uint8_t* m = packet_body(pkt)+1;
+    size_t l = sz - packet_size(1);
+
+    if (!dp->reasm || l < KADTABLE_KEYBYTES+1 ||
+        m[KADTABLE_KEYBYTES] != packet_cmd_FRAGMENT) {
+        return 0;
+    }
+
+    const struct kadrec* s = _tunnel(dp, m, relay);
+    if (!s) {
+        return 0;
+    }
+
+    kadtable_seen(dp->kad, relay);
+    kadtable_seen(dp->kad, s);
+    kadtable_traffic(dp->kad, relay, sz, 0);
+
+    return _fragment(dp, s, m+KADTABLE_KEYBYTES, l-KADTABLE_KEYBYTES);
+}
+
+static int _handle(struct datapath* dp, struct keycache* kc, const uint8_t* sk,
+                   const uint8_t* pkt, size_t sz, const struct address* src) {
+    if (sz < packet_size(1)) {
+        return 0;
+    }
+
+    uint64_t flags_time;
+    memcpy(&flags_time, packet_flags_time(pkt), sizeof(flags_time));
+    int is_nated = (flags_time >> packet_flags_DIRECTSHIFT) & packet_flags_DIRECTMASK;
+
+    const struct kadrec* s;
+    switch (packet_body(pkt)[0]) {
+    case packet_cmd_RELAY:
+        return _relay(dp, kc, sk, pkt, sz, src, is_nated);
+
+    case packet_cmd_RELAYED:
+        s = kadtable_get(dp->kad, packet_src(pkt));
+        if (!s || !_is_route(s, src, is_nated)) {
+            return 0;
+        }
+
+        return _relayed(dp, kc, sk, pkt, sz, s);
+
+    case packet_cmd_BIND:
+        return _bind(dp, kc, sk, pkt, sz, src, is_nated);
+
+    case packet_cmd_DATA:
+        s = kadtable_get(dp->kad, packet_src(pkt));
+        if (!s || !_is_route(s, src, is_nated)) {
+            return 0;
+        }
+
+        return _data(dp, pkt, sz, s);
+
+    default:
+        return 0;
+    };
+}
+
+static void _session(struct datapath* dp, struct keycache* kc, const uint8_t* sk,
+                     const uint8_t* p, size_t sz, const struct address* src) {
+    if (!dp->sessions || sz < session_size(1)) {
+        return;
+    }
+
+    uint32_t id_b;
+    memcpy(&id_b, session_id(p), sizeof(id_b));
+
+    const struct relaysession* rs = relaysessions_get(dp->sessions, be32toh(id_b), now_ms());
+    if (!rs || session_verify(p, sz, rs->key) != 0) {
+        ++dp->st.session_errors;
+        return;
+    }
+
+    const uint8_t* m = session_body(p);
+    size_t l = sz - session_size(0);
+
+    // only FRAGMENT messages are forwarded, from the source's current address
+    const struct kadrec* s = kadtable_get(dp->kad, rs->src_k);
+    const struct kadrec* d = _direct(dp, rs->dst_k);
+    if (m[0] != packet_cmd_FRAGMENT || !s ||
+        !_is_route(s, src, s->flags & KADTABLE_NATED) || !d) {
+        ++dp->st.session_errors;
+        return;
+    }
+
+    int fl = _forward(dp, kc, sk, d, packet_cmd_DATA, rs->src_k, KADTABLE_KEYBYTES, m, l);
+    if (fl < 0) {
+        ++dp->st.session_errors;
+        return;
+    }
+
+    kadtable_seen(dp->kad, s);
+    kadtable_traffic(dp->kad, s, sz, 0);
+    kadtable_traffic(dp->kad, d, 0, fl);
+    ++dp->st.relayed;
+    dp->st.relayed_bytes += sz;
+}
+
+int datapath_handle(struct datapath* dp, struct keycache* kc, const uint8_t* sk,
+                    const uint8_t* pkt, size_t sz, const struct address* src) {
+    kadtable_rdlock(dp->kad);
+    int r = _handle(dp, kc, sk, pkt, sz, src);
+    kadtable_unlock(dp->kad);
+
+    return r;
+}
+
+void datapath_session(struct datapath* dp, struct keycache* kc, const uint8_t* sk,
+                      const uint8_t* p, size_t sz, const struct address* src) {
+    kadtable_rdlock(dp->kad);
+    _session(dp, kc, sk, p, sz, src);
+    kadtable_unlock(dp->kad);
+}
+
+int datapath_filter(struct datapath* dp, struct keycache* kc, const uint8_t* sk,
+                    struct ratelimit* rl, struct admission* adm,
+                    const uint8_t** p, size_t* l, const struct address* src) {
+    if (*l >= sizeof(wh_session_hdr) &&
+        memcmp(*p, wh_session_hdr, sizeof(wh_session_hdr)) == 0) {
+        if (dp && (!rl || ratelimit_check(rl, packet_cmd_RELAY, src, *l, now_ms()))) {
+            datapath_session(dp, kc, sk, *p, *l, src);
+        }
+
+        return 0;
+    }
+
+    if (adm && !admission_filter(adm, kc, sk, p, l, src, now_ms())) {
+        return 0;
+    }
+
+    // the source key is not verified yet
+    if (rl && *l >= packet_size(1) &&
+        !ratelimit_check(rl, packet_body(*p)[0], src, *l, now_ms())) {
+        return 0;
+    }
+
+    return *l >= packet_size(0);
+}
+
+int datapath_deliver(struct datapath* dp, struct keycache* kc, const uint8_t* sk,
+                     struct ratelimit* rl, struct admission* adm,
+                     const uint8_t* p, size_t l, const struct address* src) {
+    if (adm) {
+        admission_verified(adm, src);
+    }
+
+    if (rl && l >= packet_size(1) &&
+        !ratelimit_check_key(rl, packet_body(p)[0], packet_src(p), l, now_ms())) {
+        return 0;
+    }
+
+    return !dp || !datapath_handle(dp, kc, sk, p, l, src);
+}
+
+int datapath_receive(struct datapath* dp, struct keycache* kc, const uint8_t* sk,
+                     struct ratelimit* rl, struct admission* adm,
+                     const uint8_t** p, size_t* l, const struct address* src) {
+    return datapath_filter(dp, kc, sk, rl, adm, p, l, src) &&
+           verify_packet(kc, *p, *l, sk) == 0 &&
+           datapath_deliver(dp, kc, sk, rl, adm, *p, *l, src);
+}
+
+struct datapath* datapath_new(struct kadtable* kad, struct egress* egress, uint16_t port) {
+    struct datapath* dp = calloc(1, sizeof(struct datapath));
+    if (!dp) {
+        return NULL;
+    }
+
+    dp->kad = kad;
+    dp->egress = egress;
+    dp->port = port;
+    dp->lo_fd = -1;
+
+    return dp;
+}
+
+void datapath_free(struct datapath* dp) {
+    if (dp->reasm) {
+        reasm_free(dp->reasm);
+    }
+
+    if (dp->sessions) {
+        relaysessions_free(dp->sessions);
+    }
+
+    free(dp);
+}
+
+int datapath_set_lo(struct datapath* dp, int fd, unsigned int fragment_max,
+                    uint64_t fragment_timeout) {
+    if (dp->reasm) {
+        reasm_free(dp->reasm);
+        dp->reasm = NULL;
+    }
+
+    dp->lo_fd = -1;
+    dp->fragment_max = 0;
+    dp->fragment_timeout = 0;
+    ++dp->version;
+
+    if (fd == -1) {
+        return 0;
+    }
+
+    if (!(dp->reasm = reasm_new(fragment_max, fragment_timeout))) {
+        return -1;
+    }
+
+    dp->lo_fd = fd;
+    dp->fragment_max = fragment_max;
+    dp->fragment_timeout = fragment_timeout;
+    return 0;
+}
+
+int datapath_set_sessions(struct datapath* dp, uint64_t timeout) {
+    if (dp->sessions) {
+        relaysessions_free(dp->sessions);
+        dp->sessions = NULL;
+    }
+
+    dp->session_timeout = 0;
+    ++dp->version;
+
+    if (timeout == 0) {
+        return 0;
+    }
+
+    if (!(dp->sessions = relaysessions_new(timeout))) {
+        return -1;
+    }
+
+    dp->session_timeout = timeout;
+    return 0;
+}
+
+void datapath_set_nated(struct datapath* dp, int is_nated) {
+    is_nated = !!is_nated;
+
+    if (dp->is_nated != is_nated) {
+        dp->is_nated = is_nated;
+        ++dp->version;
+    }
+}
+
+int datapath_configure(struct datapath* dp, const struct datapath* from) {
+    datapath_set_nated(dp, from->is_nated);
+
+    if (dp->lo_fd != from->lo_fd || dp->fragment_max != from->fragment_max ||
+        dp->fragment_timeout != from->fragment_timeout) {
+        if (datapath_set_lo(dp, from->lo_fd, from->fragment_max, from->fragment_timeout) < 0) {
+            return -1;
+        }
+    }
+
+    if (dp->session_timeout != from->session_timeout) {
+        if (datapath_set_sessions(dp, from->session_timeout) < 0) {
+            return -1;
+        }
+    }
+
+    dp->version = from->version;
+    return 0;
+}
+
+/*** LUA *********************************************************************/
+
+static int _close(lua_State* L) {
+    datapath_free(luaW_ownptr(L, 1, MT));
+    return 0;
+}
+
+// wh.datapath.new(kadtable, egress, port) -> dp
+//
+// kadtable and egress must outlive the datapath.
+static int _new(lua_State* L) {
+    struct kadtable* kad = luaW_checkptr(L, 1, "kadtable");
+    struct egress* egress = luaW_checkptr(L, 2, "egress");
+    uint16_t port = luaW_checkport(L, 3);
+
+    struct datapath* dp = datapath_new(kad, egress, port);
+    if (!dp) {
+        luaL_error(L, "out of memory");
+    }
+
+    luaW_pushptr(L, MT, dp);
+    return 1;
+}
+
+// set_lo(dp, fd, fragment_max, fragment_timeout) enables loopback tunnels.
+// fd is a raw socket opened with wh.socket_raw_udp("ip4_hdrincl"). Timeout is
+// in seconds. set_lo(dp, nil) disables them.
+static int _set_lo(lua_State* L) {
+    struct datapath* dp = luaW_checkptr(L, 1, MT);
+
+    if (lua_isnoneornil(L, 2)) {
+        datapath_set_lo(dp, -1, 0, 0);
+        return 0;
+    }
+
+    int fd = luaW_getfd(L, 2);
+    lua_Integer fragment_max = luaL_checkinteger(L, 3);
+    lua_Number fragment_timeout = luaL_checknumber(L, 4);
+
+    if (fragment_max <= 0 || fragment_timeout <= 0) {
+        luaL_error(L, "bad fragment parameters");
+    }
+
+    if (datapath_set_lo(dp, fd, fragment_max, fragment_timeout*1000) < 0) {
+        luaL_error(L, "out of memory");
+    }
+
+    return 0;
+}
+
+// set_sessions(dp, timeout) enables relay sessions. Timeout is in seconds.
+// set_sessions(dp, nil) disables them.
+static int _set_sessions(lua_State* L) {
+    struct datapath* dp = luaW_checkptr(L, 1, MT);
+
+    if (lua_isnoneornil(L, 2)) {
+        datapath_set_sessions(dp, 0);
+        return 0;
+    }
+
+    lua_Number timeout = luaL_checknumber(L, 2);
+    if (timeout <= 0) {
+        luaL_error(L, "bad session timeout");
+    }
+
+    if (datapath_set_sessions(dp, timeout*1000) < 0) {
+        luaL_error(L, "out of memory");
+    }
+
+    return 0;
+}
+
+static int _set_nated(lua_State* L) {
+    struct datapath* dp = luaW_checkptr(L, 1, MT);
+    datapath_set_nated(dp, lua_toboolean(L, 2));
+    return 0;
+}
+
+static int _stats(lua_State* L) {
+    struct datapath* dp = luaW_checkptr(L, 1, MT);
+
+    lua_newtable(L);
+    lua_pushinteger(L, dp->st.bound);
+    lua_setfield(L, -2, "bound");
+    lua_pushinteger(L, dp->st.datagram_errors);
+    lua_setfield(L, -2, "datagram_errors");
+    lua_pushinteger(L, dp->st.datagrams);
+    lua_setfield(L, -2, "datagrams");
+    lua_pushinteger(L, dp->st.fragments);
+    lua_setfield(L, -2, "fragments");
+    lua_pushinteger(L, dp->st.relayed);
+    lua_setfield(L, -2, "relayed");
+    lua_pushinteger(L, dp->st.relayed_bytes);
+    lua_setfield(L, -2, "relayed_bytes");
+    lua_pushinteger(L, dp->st.session_errors);
+    lua_setfield(L, -2, "session_errors");
+
+    if (dp->sessions) {
+        lua_pushinteger(L, relaysessions_count(dp->sessions));
+        lua_setfield(L, -2, "sessions");
+    }
+
+    if (dp->reasm) {
+        struct reasm_stats st;
+        reasm_stats(dp->reasm, &st);
+
+        lua_newtable(L);
+        lua_pushinteger(L, st.completed);
+        lua_setfield(L, -2, "completed");
+        lua_pushinteger(L, st.dropped);
+        lua_setfield(L, -2, "dropped");
+        lua_pushinteger(L, st.expired);
+        lua_setfield(L, -2, "expired");
+        lua_pushinteger(L, st.fragments);
+        lua_setfield(L, -2, "fragments");
+        lua_pushinteger(L, st.sessions);
+        lua_setfield(L, -2, "sessions");
+        lua_setfield(L, -2, "reasm");
+    }
+
+    return 1;
+}
+
+static const luaL_Reg funcs[] = {
+    {"close", _close},
+    {"new", _new},
+    {"set_lo", _set_lo},
+    {"set_nated", _set_nated},
+    {"set_sessions", _set_sessions},
+    {"stats", _stats},
+    {NULL, NULL},
+};
+
+LUAMOD_API int luaopen_datapath(lua_State* L) {
+    luaL_checkversion(L);
+    luaL_newlib(L, funcs);
+
+    luaW_declptr(L, MT, (void(*)(void*))datapath_free);
+
+    return 1;
+}
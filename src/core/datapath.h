@@ -0,0 +1,122 @@
+#ifndef WIREHUB_DATAPATH_H
+#define WIREHUB_DATAPATH_H
+
+#include "admission.h"
+#include "egress.h"
+#include "kadtable.h"
+#include "keycache.h"
+#include "ratelimit.h"
+#include "reasm.h"
+#include "relaysession.h"
+
+/** Native datapath.
+ *
+ * Handles in the core the packets which do not need the Lua state of the node.
+ * A packet is handled natively only if its source and destination peers are
+ * known in the routing table; any other packet is passed to Lua.
+ *
+ * RELAY packets are forwarded as RELAYED packets to their destination.
+ *
+ * If relay sessions are enabled, BIND packets bind relay sessions, and
+ * FRAGMENT messages of session packets are forwarded as DATA packets to the
+ * destination of their session. Session packets are only authenticated with
+ * the session's key, which saves the source and the relay the WireHub packet
+ * wrapping the relayed one.
+ *
+ * If loopback tunnels are enabled, FRAGMENT messages of peers with a tunnel,
+ * relayed in RELAYED or DATA packets, are reassembled, and the WireGuard datagrams are sent to the local
+ * WireGuard port from the peers' loopback addresses.
+ */
+struct datapath_stats {
+    uint64_t bound;
+    uint64_t session_errors;
+    uint64_t relayed;
+    uint64_t relayed_bytes;
+    uint64_t fragments;
+    uint64_t datagrams;
+    uint64_t datagram_errors;
+};
+
+struct datapath {
+    struct kadtable* kad;
+    struct egress* egress;
+    uint16_t port;
+    int is_nated;
+
+    // loopback tunnels. lo_fd is -1 if disabled
+    int lo_fd;
+    unsigned int fragment_max;
+    uint64_t fragment_timeout;
+    struct reasm* reasm;
+
+    // relay sessions. NULL if disabled
+    uint64_t session_timeout;
+    struct relaysessions* sessions;
+
+    // incremented on each change of configuration
+    unsigned int version;
+
+    struct datapath_stats st;
+};
+
+// kadtable and egress must outlive the datapath
+struct datapath* datapath_new(struct kadtable* kad, struct egress* egress, uint16_t port);
+void datapath_free(struct datapath* dp);
+
+// enables loopback tunnels. fd is a raw socket opened with
+// wh.socket_raw_udp("ip4_hdrincl"). Timeout is in milliseconds. If fd is -1,
+// disables them. returns -1 if allocation failed.
+int datapath_set_lo(struct datapath* dp, int fd, unsigned int fragment_max,
+                    uint64_t fragment_timeout);
+
+// enables relay sessions. Timeout is in milliseconds. If 0, disables them.
+// returns -1 if allocation failed.
+int datapath_set_sessions(struct datapath* dp, uint64_t timeout);
+
+void datapath_set_nated(struct datapath* dp, int is_nated);
+
+// applies the configuration of `from` to `dp`, which keeps its own state.
+// returns -1 if allocation failed.
+int datapath_configure(struct datapath* dp, const struct datapath* from);
+
+// handles an opened WireHub packet `pkt` of size `sz`, received from `src`.
+// returns 1 if the packet was handled, or 0 if it must be passed to Lua.
+int datapath_handle(struct datapath* dp, struct keycache* kc, const uint8_t* sk,
+                    const uint8_t* pkt, size_t sz, const struct address* src);
+
+// handles a session packet `p` of size `sz`, received from `src`. Session
+// packets are never passed to Lua.
+void datapath_session(struct datapath* dp, struct keycache* kc, const uint8_t* sk,
+                      const uint8_t* p, size_t sz, const struct address* src);
+
+/** Receives the datagram `*p` of `*l` bytes, received from `src`.
+ *
+ * Session packets are only handled by the datapath. If `rl` is not NULL,
+ * packets over budget are dropped before being verified; session packets are
+ * accounted as RELAY packets of their source address. If `adm` is not NULL,
+ * packets are filtered by the admission stage before being verified. `dp` may
+ * be NULL.
+ *
+ * Returns 1 if `*p` is a verified WireHub packet of `*l` bytes which must be
+ * passed to Lua, else 0.
+ */
+int datapath_receive(struct datapath* dp, struct keycache* kc, const uint8_t* sk,
+                     struct ratelimit* rl, struct admission* adm,
+                     const uint8_t** p, size_t* l, const struct address* src);
+
+/** The stages of datapath_receive(), for packets verified by another thread.
+ *
+ * datapath_filter() returns 1 if `*p` must be verified, else 0. Once verified,
+ * datapath_deliver() returns 1 if the packet must be passed to Lua, else 0.
+ * Packets are rate limited by source IP address when filtered, and by source
+ * key when delivered. Delivered packets clear the cookie of their source
+ * address in `adm` (see admission_verified()).
+ */
+int datapath_filter(struct datapath* dp, struct keycache* kc, const uint8_t* sk,
+                    struct ratelimit* rl, struct admission* adm,
+                    const uint8_t** p, size_t* l, const struct address* src);
+int datapath_deliver(struct datapath* dp, struct keycache* kc, const uint8_t* sk,
+                     struct ratelimit* rl, struct admission* adm,
+                     const uint8_t* p, size_t l, const struct address* src);
+
+#endif  // WIREHUB_DATAPATH_H
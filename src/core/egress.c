@@ -0,0 +1,509 @@
+#define _GNU_SOURCE
+#include "egress.h"
+#include "luawh.h"
+#include "os.h"
+#include <pthread.h>
+#include <sodium.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define MT "egress"
+#define COOKIES 256     // power of two
+
+/* UDP headers are written into preallocated slots. Payloads pushed from Lua
+ * are referenced, not copied: the queue's user value is a table anchoring the
+ * payload strings until they are sent. Payloads pushed from the core are copied
+ * into the slot's buffer. Cookies are written in the slot, between the UDP
+ * header and the payload.
+ */
+
+struct egress_slot {
+    struct udphdr hdr;
+    uint8_t cookie[sizeof(wh_cookie_hdr)+WH_COOKIEBYTES];
+    int fd;
+    struct address dst;
+    struct iovec iov[3];
+    uint8_t* buf;           // allocated on first use
+};
+
+// cookies are stored in a direct-mapped table, by destination
+struct egress_cookie {
+    struct address dst;
+    uint64_t deadline;
+    uint8_t cookie[WH_COOKIEBYTES];
+};
+
+// last WireHub packet sent, by destination, in a table indexed like cookies
+struct egress_sent {
+    struct address dst;
+    uint64_t at;
+};
+
+// cookies are shared by the queues created with the same `shared` queue, which
+// may send from different threads (see egress_new())
+struct egress_cookies {
+    pthread_mutex_t lock;
+    unsigned int refs;
+
+    uint8_t hash_k[crypto_shorthash_KEYBYTES];
+    unsigned int count;
+    struct egress_cookie cookies[COOKIES];
+    struct egress_sent sent[COOKIES];
+};
+
+struct egress {
+    int fd4;
+    int fd6;
+    unsigned int depth;
+    unsigned int count;
+
+    struct egress_slot* slots;
+    struct mmsghdr* msgs;
+
+    struct egress_cookies* cookies;
+
+    // since last flush from Lua
+    unsigned int failed;
+    int last_errno;
+
+    struct {
+        uint64_t queued;
+        uint64_t sent;
+        uint64_t errors;
+        uint64_t flushes;
+        uint64_t full_flushes;
+        unsigned int max_depth;
+    } st;
+};
+
+static void _fail(struct egress* q, int err) {
+    ++q->failed;
+    ++q->st.errors;
+    q->last_errno = err;
+}
+
+static void _flush(struct egress* q) {
+    unsigned int i = 0;
+
+    if (q->count == 0) {
+        return;
+    }
+
+    if (q->count > q->st.max_depth) {
+        q->st.max_depth = q->count;
+    }
+
+    while (i < q->count) {
+        // messages are sent in order, per run of messages of a same family
+        int fd = q->slots[i].fd;
+        unsigned int j = i+1;
+        while (j < q->count && q->slots[j].fd == fd) {
+            ++j;
+        }
+
+        while (i < j) {
+            int r = sendmmsg(fd, &q->msgs[i], j-i, 0);
+
+            if (r < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (r <= 0) {
+                // skip the message which failed
+                _fail(q, r < 0 ? errno : EIO);
+                ++i;
+                continue;
+            }
+
+            for (int k=0; k<r; ++k, ++i) {
+                size_t l = q->slots[i].iov[0].iov_len + q->slots[i].iov[1].iov_len +
+                           q->slots[i].iov[2].iov_len;
+
+                if (q->msgs[i].msg_len != l) {
+                    _fail(q, EMSGSIZE);
+                } else {
+                    ++q->st.sent;
+                }
+            }
+        }
+    }
+
+    q->count = 0;
+    ++q->st.flushes;
+}
+
+static void _delete(void* ud) {
+    struct egress* q = ud;
+
+    if (q->slots) {
+        for (unsigned int i=0; i<q->depth; ++i) {
+            free(q->slots[i].buf);
+        }
+    }
+
+    if (q->cookies) {
+        pthread_mutex_lock(&q->cookies->lock);
+        unsigned int refs = --q->cookies->refs;
+        pthread_mutex_unlock(&q->cookies->lock);
+
+        if (refs == 0) {
+            pthread_mutex_destroy(&q->cookies->lock);
+            free(q->cookies);
+        }
+    }
+
+    free(q->slots);
+    free(q->msgs);
+    free(q);
+}
+
+struct egress* egress_new(int fd4, int fd6, unsigned int depth, struct egress* shared) {
+    assert(depth > 0);
+
+    struct egress* q = calloc(1, sizeof(struct egress));
+    if (!q) {
+        return NULL;
+    }
+
+    q->fd4 = fd4;
+    q->fd6 = fd6;
+    q->depth = depth;
+    q->slots = calloc(depth, sizeof(struct egress_slot));
+    q->msgs = calloc(depth, sizeof(struct mmsghdr));
+
+    if (!q->slots || !q->msgs) {
+        _delete(q);
+        return NULL;
+    }
+
+    for (unsigned int i=0; i<q->depth; ++i) {
+        struct egress_slot* s = &q->slots[i];
+        struct msghdr* hdr = &q->msgs[i].msg_hdr;
+
+        s->iov[0].iov_base = &s->hdr;
+        s->iov[0].iov_len = UDP_HDRLEN;
+        s->iov[1].iov_base = s->cookie;
+        hdr->msg_name = &s->dst.in;
+        hdr->msg_iov = s->iov;
+        hdr->msg_iovlen = 3;
+    }
+
+    if (shared) {
+        q->cookies = shared->cookies;
+        pthread_mutex_lock(&q->cookies->lock);
+        ++q->cookies->refs;
+        pthread_mutex_unlock(&q->cookies->lock);
+    } else {
+        if (!(q->cookies = calloc(1, sizeof(struct egress_cookies)))) {
+            _delete(q);
+            return NULL;
+        }
+
+        pthread_mutex_init(&q->cookies->lock, NULL);
+        q->cookies->refs = 1;
+        randombytes_buf(q->cookies->hash_k, sizeof(q->cookies->hash_k));
+    }
+
+    return q;
+}
+
+void egress_free(struct egress* q) {
+    _flush(q);
+    _delete(q);
+}
+
+void egress_flush(struct egress* q) {
+    _flush(q);
+}
+
+static int _close(lua_State* L) {
+    egress_free(luaW_ownptr(L, 1, MT));
+    return 0;
+}
+
+static int _flush_lua(lua_State* L) {
+    struct egress* q = luaW_checkptr(L, 1, MT);
+
+    uint64_t sent = q->st.sent;
+    _flush(q);
+
+    lua_pushinteger(L, q->st.sent - sent);
+    lua_pushinteger(L, q->failed);
+    if (q->failed) {
+        lua_pushstring(L, strerror(q->last_errno));
+    } else {
+        lua_pushnil(L);
+    }
+
+    q->failed = 0;
+    q->last_errno = 0;
+
+    return 3;
+}
+
+static int _fd(const struct egress* q, const struct address* dst) {
+    switch (dst->sa_family) {
+    case AF_INET:  return q->fd4;
+    case AF_INET6: return q->fd6;
+    default: return -1;
+    };
+}
+
+static int _index(const struct egress* q, const struct address* dst, unsigned int* i) {
+    uint8_t packed[ADDRESS_PACKBYTES];
+    size_t l = address_pack(dst, packed);
+    if (l == 0) {
+        return -1;
+    }
+
+    uint64_t h;
+    crypto_shorthash((uint8_t*)&h, packed, l, q->cookies->hash_k);
+    *i = h & (COOKIES-1);
+    return 0;
+}
+
+static int _same(const struct address* a, const struct address* b) {
+    return address_len(a) == address_len(b) &&
+           memcmp(&a->in, &b->in, address_len(b)) == 0;
+}
+
+// returns the cookie to send to `dst`, stored at index `i`, or NULL. cookies
+// must be locked.
+static const uint8_t* _get_cookie(struct egress_cookies* jar, unsigned int i,
+                                  const struct address* dst, uint64_t now) {
+    struct egress_cookie* c = &jar->cookies[i];
+    if (c->deadline == 0) {
+        return NULL;
+    }
+
+    if (c->deadline <= now) {
+        memset(c, 0, sizeof(*c));
+        __atomic_fetch_sub(&jar->count, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    return _same(&c->dst, dst) ? c->cookie : NULL;
+}
+
+int egress_accept_cookie(struct egress* q, const struct address* src,
+                         const uint8_t* cookie, uint64_t now, uint64_t deadline) {
+    unsigned int i;
+    if (_index(q, src, &i) < 0) {
+        return 0;
+    }
+
+    struct egress_cookies* jar = q->cookies;
+    int accepted = 0;
+
+    pthread_mutex_lock(&jar->lock);
+
+    const struct egress_sent* s = &jar->sent[i];
+    if (s->at != 0 && now <= s->at + EGRESS_RTO_MS && _same(&s->dst, src) &&
+        !_get_cookie(jar, i, src, now)) {
+        struct egress_cookie* c = &jar->cookies[i];
+        if (c->deadline == 0) {
+            __atomic_fetch_add(&jar->count, 1, __ATOMIC_RELAXED);
+        }
+
+        memcpy(&c->dst, src, sizeof(c->dst));
+        memcpy(c->cookie, cookie, sizeof(c->cookie));
+        c->deadline = deadline;
+        accepted = 1;
+    }
+
+    pthread_mutex_unlock(&jar->lock);
+    return accepted;
+}
+
+void egress_clear_cookie(struct egress* q, const struct address* dst) {
+    struct egress_cookies* jar = q->cookies;
+    unsigned int i;
+
+    // cookies set concurrently are not ones this packet answers
+    if (__atomic_load_n(&jar->count, __ATOMIC_RELAXED) == 0 ||
+        _index(q, dst, &i) < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&jar->lock);
+
+    struct egress_cookie* c = &jar->cookies[i];
+    if (c->deadline != 0 && _same(&c->dst, dst)) {
+        memset(c, 0, sizeof(*c));
+        __atomic_fetch_sub(&jar->count, 1, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_unlock(&jar->lock);
+}
+
+// returns a free slot for a message `m` of `l` bytes
+static unsigned int _slot(struct egress* q, int fd, const void* m, size_t l,
+                          uint16_t src_port, const struct address* dst) {
+    if (q->count == q->depth) {
+        ++q->st.full_flushes;
+        _flush(q);
+    }
+
+    unsigned int i = q->count++;
+    struct egress_slot* s = &q->slots[i];
+
+    // only WireHub packets are prefixed with cookies. their destinations are
+    // remembered to accept cookie replies.
+    s->iov[1].iov_len = 0;
+    unsigned int h;
+    if (l >= sizeof(wh_pkt_hdr) && memcmp(m, wh_pkt_hdr, sizeof(wh_pkt_hdr)) == 0 &&
+        _index(q, dst, &h) == 0) {
+        struct egress_cookies* jar = q->cookies;
+        uint64_t now = now_ms();
+
+        pthread_mutex_lock(&jar->lock);
+
+        const uint8_t* cookie = jar->count ? _get_cookie(jar, h, dst, now) : NULL;
+        if (cookie) {
+            memcpy(s->cookie, wh_cookie_hdr, sizeof(wh_cookie_hdr));
+            memcpy(s->cookie+sizeof(wh_cookie_hdr), cookie, WH_COOKIEBYTES);
+            s->iov[1].iov_len = sizeof(s->cookie);
+        }
+
+        memcpy(&jar->sent[h].dst, dst, sizeof(jar->sent[h].dst));
+        jar->sent[h].at = now;
+
+        pthread_mutex_unlock(&jar->lock);
+    }
+
+    s->hdr.uh_sport = htons(src_port);
+    s->hdr.uh_dport = htons(address_port(dst));
+    s->hdr.uh_ulen = htons(UDP_HDRLEN+s->iov[1].iov_len+l);
+    s->hdr.uh_sum = 0x0000;
+    s->fd = fd;
+    memcpy(&s->dst, dst, sizeof(s->dst));
+    s->iov[2].iov_len = l;
+
+    struct msghdr* hdr = &q->msgs[i].msg_hdr;
+    hdr->msg_namelen = address_len(&s->dst);
+    q->msgs[i].msg_len = 0;
+
+    ++q->st.queued;
+
+    return i;
+}
+
+int egress_push(struct egress* q, const void* m, size_t l, uint16_t src_port,
+                const struct address* dst) {
+    int fd = _fd(q, dst);
+
+    if (fd == -1 || l > WH_EGRESS_BUFSIZE) {
+        return -1;
+    }
+
+    // the buffer of the next slot is allocated before it is taken
+    struct egress_slot* s = &q->slots[q->count == q->depth ? 0 : q->count];
+    if (!s->buf && !(s->buf = malloc(WH_EGRESS_BUFSIZE))) {
+        return -1;
+    }
+
+    s = &q->slots[_slot(q, fd, m, l, src_port, dst)];
+    memcpy(s->buf, m, l);
+    s->iov[2].iov_base = s->buf;
+
+    return 0;
+}
+
+static int _push(lua_State* L) {
+    struct egress* q = luaW_checkptr(L, 1, MT);
+    size_t l;
+    const char* m = luaL_checklstring(L, 2, &l);
+    uint16_t src_port = luaW_checkport(L, 3);
+    struct address* dst_addr = luaL_checkudata(L, 4, "address");
+
+    if (l >= 0x10000 - UDP_HDRLEN - sizeof(((struct egress_slot*)0)->cookie)) {
+        luaL_error(L, "packet too long");
+    }
+
+    int fd = _fd(q, dst_addr);
+    if (fd == -1) {
+        return luaL_error(L, "bad address family");
+    }
+
+    unsigned int i = _slot(q, fd, m, l, src_port, dst_addr);
+    q->slots[i].iov[2].iov_base = (void*)m;
+
+    // anchor payload until sent
+    lua_getuservalue(L, 1);
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, -2, i+1);
+    lua_pop(L, 1);
+
+    return 0;
+}
+
+static int _stats(lua_State* L) {
+    struct egress* q = luaW_checkptr(L, 1, MT);
+
+    lua_newtable(L);
+    lua_pushinteger(L, q->depth);
+    lua_setfield(L, -2, "capacity");
+    lua_pushinteger(L, __atomic_load_n(&q->cookies->count, __ATOMIC_RELAXED));
+    lua_setfield(L, -2, "cookies");
+    lua_pushinteger(L, q->count);
+    lua_setfield(L, -2, "depth");
+    lua_pushinteger(L, q->st.errors);
+    lua_setfield(L, -2, "errors");
+    lua_pushinteger(L, q->st.flushes);
+    lua_setfield(L, -2, "flushes");
+    lua_pushinteger(L, q->st.full_flushes);
+    lua_setfield(L, -2, "full_flushes");
+    lua_pushinteger(L, q->st.max_depth);
+    lua_setfield(L, -2, "max_depth");
+    lua_pushinteger(L, q->st.queued);
+    lua_setfield(L, -2, "queued");
+    lua_pushinteger(L, q->st.sent);
+    lua_setfield(L, -2, "sent");
+
+    return 1;
+}
+
+// wh.egress.new(fd4, fd6, depth [, shared]) -> q
+//
+// q shares the cookies of egress queue `shared`, if set
+static int _new(lua_State* L) {
+    int fd4 = luaW_getfd(L, 1);
+    int fd6 = luaW_getfd(L, 2);
+    lua_Integer depth = luaL_checkinteger(L, 3);
+    struct egress* shared = lua_isnoneornil(L, 4) ? NULL : luaW_checkptr(L, 4, MT);
+
+    if (depth <= 0 || UIO_MAXIOV < depth) {
+        luaL_error(L, "bad queue depth: %d", (int)depth);
+    }
+
+    struct egress* q = egress_new(fd4, fd6, depth, shared);
+    if (!q) {
+        luaL_error(L, "out of memory");
+    }
+
+    luaW_pushptr(L, MT, q);
+    lua_createtable(L, depth, 0);
+    lua_setuservalue(L, -2);
+
+    return 1;
+}
+
+static const luaL_Reg funcs[] = {
+    {"close", _close},
+    {"flush", _flush_lua},
+    {"new", _new},
+    {"push", _push},
+    {"stats", _stats},
+    {NULL, NULL},
+};
+
+LUAMOD_API int luaopen_egress(lua_State* L) {
+    luaL_checkversion(L);
+    luaL_newlib(L, funcs);
+
+    luaW_declptr(L, MT, _delete);
+
+    return 1;
+}
+
@@ -0,0 +1,54 @@
+#ifndef WIREHUB_EGRESS_H
+#define WIREHUB_EGRESS_H
+
+#include "net.h"
+
+/** Egress queue of WireHub packets.
+ *
+ * Packets sent during one main loop iteration are queued and sent at once
+ * with sendmmsg() before polling.
+ *
+ * WireHub packets sent to a peer which answered a cookie (see admission.h) are
+ * prefixed with the cookie until it expires, or until the peer answers without
+ * a cookie reply.
+ */
+struct egress;
+
+/** Packets are sent through raw UDP sockets fd4 and fd6, in batches of at most
+ * `depth` messages.
+ *
+ * If `shared` is not NULL, the queue shares its cookies, so that a cookie reply
+ * received by any of them applies to packets sent by all. Queues sharing
+ * cookies may be used from different threads.
+ */
+struct egress* egress_new(int fd4, int fd6, unsigned int depth, struct egress* shared);
+
+// sends queued packets, then frees the queue
+void egress_free(struct egress* q);
+
+// sends queued packets
+void egress_flush(struct egress* q);
+
+// queues a copy of message `m`, at most WH_EGRESS_BUFSIZE long. returns -1 if
+// the message is too long or the address family is not supported.
+int egress_push(struct egress* q, const void* m, size_t l, uint16_t src_port,
+                const struct address* dst);
+
+// upper bound of the retransmission timeout, in milliseconds (see RTO_MAX in
+// wh.lua)
+#define EGRESS_RTO_MS 3000
+
+/** Prefixes the next WireHub packets sent to `src` with `cookie`, of
+ * WH_COOKIEBYTES bytes, until `deadline` in milliseconds.
+ *
+ * The cookie is accepted only if a WireHub packet was sent to `src` within the
+ * last EGRESS_RTO_MS, and if `src` has no live cookie. Returns 1 if accepted,
+ * else 0.
+ */
+int egress_accept_cookie(struct egress* q, const struct address* src,
+                         const uint8_t* cookie, uint64_t now, uint64_t deadline);
+
+// stops prefixing WireHub packets sent to `dst` with a cookie
+void egress_clear_cookie(struct egress* q, const struct address* dst);
+
+#endif  // WIREHUB_EGRESS_H
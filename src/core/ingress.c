@@ -0,0 +1,302 @@
+#define _GNU_SOURCE
+#include "ingress.h"
+#include "luawh.h"
+#include <fcntl.h>
+#include <linux/filter.h>
+#include <netinet/ip.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define MT "ingress"
+
+struct ingress {
+    int fd4;
+    int fd6;
+    unsigned int batch;
+
+    // last received batch
+    sa_family_t sa_family;
+    unsigned int count;
+
+    struct mmsghdr* msgs;
+    struct iovec* iovs;
+    struct sockaddr_in6* names;
+    uint8_t* bufs;
+};
+
+// placeholder of jumps to the last instruction of the filter, which drops
+// the datagram
+#define DROP 0xff
+
+// appends to filter `f` the instructions accepting the datagram if the hash of
+// the value of the accumulator is `shard`
+static size_t _shard(struct sock_filter* f, size_t n, unsigned int shard,
+                     unsigned int shard_count) {
+    if (shard_count > 1) {
+        f[n++] = (struct sock_filter)BPF_STMT(BPF_ALU|BPF_MUL|BPF_K, 0x9e3779b1);
+        f[n++] = (struct sock_filter)BPF_STMT(BPF_ALU|BPF_RSH|BPF_K, 16);
+        f[n++] = (struct sock_filter)BPF_STMT(BPF_ALU|BPF_MOD|BPF_K, shard_count);
+        f[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, shard, 0, DROP);
+    }
+
+    f[n++] = (struct sock_filter)BPF_STMT(BPF_RET|BPF_K, (uint32_t)-1);
+    f[n++] = (struct sock_filter)BPF_STMT(BPF_RET|BPF_K, 0);
+
+    for (size_t i=0; i<n; ++i) {
+        if (BPF_CLASS(f[i].code) != BPF_JMP) {
+            continue;
+        }
+
+        if (f[i].jt == DROP) {
+            f[i].jt = n-1 - (i+1);
+        }
+
+        if (f[i].jf == DROP) {
+            f[i].jf = n-1 - (i+1);
+        }
+    }
+
+    return n;
+}
+
+static int _attach_filter(int fd, sa_family_t sa_family, uint16_t port,
+                          unsigned int shard, unsigned int shard_count) {
+    uint32_t magic = ((uint32_t)wh_pkt_hdr[0] << 24) |
+                     ((uint32_t)wh_pkt_hdr[1] << 16) |
+                     ((uint32_t)wh_pkt_hdr[2] << 8) |
+                     ((uint32_t)wh_pkt_hdr[3] << 0);
+
+    // all WireHub headers (see common.h) match the header of WireHub packets
+    // once masked
+    const uint32_t mask = 0xfcffffff;
+
+    struct sock_filter f[32];
+    size_t n = 0;
+
+    // IPv4 raw sockets get the IP header, IPv6 ones start at the UDP header.
+    // Raw sockets only see datagrams reassembled by the kernel, so fragments
+    // are not filtered. Sources of IPv4 datagrams are hashed by address and
+    // port, sources of IPv6 ones by port. Hashed values are only loaded if
+    // sharded.
+    if (sa_family == AF_INET) {
+        struct sock_filter ip4[] = {
+            BPF_STMT(BPF_LDX|BPF_B|BPF_MSH, 0),             // IP header length
+            BPF_STMT(BPF_LD|BPF_H|BPF_IND, 2),              // UDP dst port
+            BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, port, 0, DROP),
+            BPF_STMT(BPF_LD|BPF_W|BPF_IND, UDP_HDRLEN),     // WireHub header
+            BPF_STMT(BPF_ALU|BPF_AND|BPF_K, mask),
+            BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, magic & mask, 0, DROP),
+            BPF_STMT(BPF_LD|BPF_H|BPF_IND, 0),              // UDP src port
+            BPF_STMT(BPF_MISC|BPF_TAX, 0),
+            BPF_STMT(BPF_LD|BPF_W|BPF_ABS, 12),             // IP src address
+            BPF_STMT(BPF_ALU|BPF_XOR|BPF_X, 0),
+        };
+
+        memcpy(f, ip4, sizeof(ip4));
+        n = sizeof(ip4) / sizeof(ip4[0]) - (shard_count > 1 ? 0 : 4);
+    } else {
+        struct sock_filter ip6[] = {
+            BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 2),              // UDP dst port
+            BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, port, 0, DROP),
+            BPF_STMT(BPF_LD|BPF_W|BPF_ABS, UDP_HDRLEN),     // WireHub header
+            BPF_STMT(BPF_ALU|BPF_AND|BPF_K, mask),
+            BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, magic & mask, 0, DROP),
+            BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 0),              // UDP src port
+        };
+
+        memcpy(f, ip6, sizeof(ip6));
+        n = sizeof(ip6) / sizeof(ip6[0]) - (shard_count > 1 ? 0 : 1);
+    }
+
+    struct sock_fprog prog;
+    prog.len = _shard(f, n, shard, shard_count);
+    prog.filter = f;
+
+    return setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+}
+
+static int _socket(sa_family_t sa_family, uint16_t port, unsigned int shard,
+                   unsigned int shard_count) {
+    int fd = socket(sa_family, SOCK_RAW, IPPROTO_UDP);
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) == -1 ||
+        _attach_filter(fd, sa_family, port, shard, shard_count) == -1) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+
+    return fd;
+}
+
+struct ingress* ingress_new(uint16_t port, unsigned int batch,
+                            unsigned int shard, unsigned int shard_count) {
+    assert(batch > 0);
+    assert(shard < shard_count);
+
+    struct ingress* in = calloc(1, sizeof(struct ingress));
+    if (!in) {
+        return NULL;
+    }
+
+    in->fd4 = in->fd6 = -1;
+    in->batch = batch;
+    in->msgs = calloc(batch, sizeof(struct mmsghdr));
+    in->iovs = calloc(batch, sizeof(struct iovec));
+    in->names = calloc(batch, sizeof(struct sockaddr_in6));
+    in->bufs = malloc(batch * WH_INGRESS_BUFSIZE);
+
+    if (!in->msgs || !in->iovs || !in->names || !in->bufs) {
+        ingress_free(in);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if ((in->fd4 = _socket(AF_INET, port, shard, shard_count)) == -1 ||
+        (in->fd6 = _socket(AF_INET6, port, shard, shard_count)) == -1) {
+        int err = errno;
+        ingress_free(in);
+        errno = err;
+        return NULL;
+    }
+
+    return in;
+}
+
+void ingress_free(struct ingress* in) {
+    if (in->fd4 != -1) {
+        close(in->fd4);
+    }
+
+    if (in->fd6 != -1) {
+        close(in->fd6);
+    }
+
+    free(in->msgs);
+    free(in->iovs);
+    free(in->names);
+    free(in->bufs);
+    free(in);
+}
+
+int ingress_fd(const struct ingress* in, sa_family_t sa_family) {
+    return sa_family == AF_INET ? in->fd4 : in->fd6;
+}
+
+unsigned int ingress_batch(const struct ingress* in) {
+    return in->batch;
+}
+
+int ingress_recv(struct ingress* in, int fd) {
+    assert(fd == in->fd4 || fd == in->fd6);
+
+    unsigned int i;
+    for (i=0; i<in->batch; ++i) {
+        in->iovs[i].iov_base = in->bufs + i*WH_INGRESS_BUFSIZE;
+        in->iovs[i].iov_len = WH_INGRESS_BUFSIZE;
+        in->msgs[i].msg_hdr.msg_name = &in->names[i];
+        in->msgs[i].msg_hdr.msg_namelen = sizeof(in->names[i]);
+        in->msgs[i].msg_hdr.msg_iov = &in->iovs[i];
+        in->msgs[i].msg_hdr.msg_iovlen = 1;
+        in->msgs[i].msg_hdr.msg_control = NULL;
+        in->msgs[i].msg_hdr.msg_controllen = 0;
+        in->msgs[i].msg_hdr.msg_flags = 0;
+    }
+
+    in->count = 0;
+    in->sa_family = fd == in->fd4 ? AF_INET : AF_INET6;
+
+    int r = recvmmsg(fd, in->msgs, in->batch, MSG_DONTWAIT, NULL);
+    if (r < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+
+    in->count = r;
+    return r;
+}
+
+int ingress_datagram(const struct ingress* in, int i,
+                     const void** m, size_t* l, struct address* src) {
+    assert(0 <= i && (unsigned int)i < in->count);
+
+    const struct msghdr* hdr = &in->msgs[i].msg_hdr;
+    const uint8_t* d = hdr->msg_iov->iov_base;
+    size_t sz = in->msgs[i].msg_len;
+
+    if (hdr->msg_flags & MSG_TRUNC) {
+        return -1;
+    }
+
+    memset(src, 0, sizeof(*src));
+
+    if (in->sa_family == AF_INET) {
+        *l = sz;
+        return ip4_to_udp(d, m, l, src, NULL);
+    }
+
+    if (sz < UDP_HDRLEN) {
+        return -1;
+    }
+
+    const struct sockaddr_in6* name = hdr->msg_name;
+    src->sa_family = src->in6.sin6_family = AF_INET6;
+    src->in6.sin6_addr = name->sin6_addr;
+    src->in6.sin6_scope_id = name->sin6_scope_id;
+    memcpy(&src->in6.sin6_port, d, sizeof(src->in6.sin6_port));
+
+    *m = d + UDP_HDRLEN;
+    *l = sz - UDP_HDRLEN;
+    return 0;
+}
+
+/*** LUA *********************************************************************/
+
+static int _close(lua_State* L) {
+    ingress_free(luaW_ownptr(L, 1, MT));
+    return 0;
+}
+
+static int _get_fds(lua_State* L) {
+    struct ingress* in = luaW_checkptr(L, 1, MT);
+    lua_pushinteger(L, in->fd4);
+    lua_pushinteger(L, in->fd6);
+    return 2;
+}
+
+static int _new(lua_State* L) {
+    uint16_t port = luaW_checkport(L, 1);
+    lua_Integer batch = luaL_checkinteger(L, 2);
+
+    if (batch <= 0 || UIO_MAXIOV < batch) {
+        luaL_error(L, "bad batch size: %d", (int)batch);
+    }
+
+    struct ingress* in = ingress_new(port, batch, 0, 1);
+    if (!in) {
+        luaL_error(L, "ingress failed: %s", strerror(errno));
+    }
+
+    luaW_pushptr(L, MT, in);
+    return 1;
+}
+
+static const luaL_Reg funcs[] = {
+    {"close", _close},
+    {"get_fds", _get_fds},
+    {"new", _new},
+    {NULL, NULL},
+};
+
+LUAMOD_API int luaopen_ingress(lua_State* L) {
+    luaL_checkversion(L);
+    luaL_newlib(L, funcs);
+
+    luaW_declptr(L, MT, (void(*)(void*))ingress_free);
+
+    return 1;
+}
+
@@ -0,0 +1,40 @@
+#ifndef WIREHUB_INGRESS_H
+#define WIREHUB_INGRESS_H
+
+#include "net.h"
+
+/** Native ingress of WireHub packets.
+ *
+ * Alternative to the libpcap ingress. WireHub packets are received on raw UDP
+ * sockets, which get a copy of the datagrams sent to the WireHub port while
+ * the port stays bound by the kernel WireGuard device. A BPF filter attached
+ * to the sockets only accepts WireHub packets sent to the port. Datagrams are
+ * read in batches with recvmmsg().
+ *
+ * Raw sockets all get a copy of each datagram. If the ingress is one of
+ * `shard_count` shards, its filter also only accepts the datagrams whose hash
+ * of the source address is `shard`, so that each source is received by one
+ * shard.
+ */
+struct ingress;
+
+struct ingress* ingress_new(uint16_t port, unsigned int batch,
+                            unsigned int shard, unsigned int shard_count);
+void ingress_free(struct ingress* in);
+
+// returns IPv4 and IPv6 sockets of the ingress
+int ingress_fd(const struct ingress* in, sa_family_t sa_family);
+
+// receives up to one batch of datagrams from socket fd. returns the count of
+// received datagrams, or -1 on error.
+int ingress_recv(struct ingress* in, int fd);
+
+// returns payload and source address of i-th datagram of the last received
+// batch. returns -1 if datagram is not a valid UDP datagram.
+int ingress_datagram(const struct ingress* in, int i,
+                     const void** m, size_t* l, struct address* src);
+
+unsigned int ingress_batch(const struct ingress* in);
+
+#endif  // WIREHUB_INGRESS_H
+
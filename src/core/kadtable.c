@@ -0,0 +1,1124 @@
+#include "kadtable.h"
+#include "luawh.h"
+#include "packet.h"
+#include <endian.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sodium.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MT "kadtable"
+#define NIL ((uint32_t)-1)
+#define WORDS (KADTABLE_KEYBYTES/8)
+
+struct kadbucket {
+    uint32_t* recs;
+    uint32_t count;
+    uint32_t capacity;
+};
+
+struct kadtable {
+    pthread_rwlock_t lock;
+    pthread_mutex_t seen_lock;
+
+    uint64_t root[WORDS];
+    uint8_t hash_k[crypto_shorthash_KEYBYTES];
+    size_t count;
+
+    struct kadrec* recs;
+    uint32_t capacity;
+    uint32_t free;
+
+    uint32_t* hbuckets;
+    uint32_t hmask;
+
+    struct kadbucket buckets[KADTABLE_BUCKETS];
+
+    // top-K selection heap of kadtable_kclosest()
+    uint32_t* heap;
+    size_t heap_capacity;
+
+    uint8_t (*seen)[KADTABLE_KEYBYTES];
+    size_t seen_count;
+    size_t seen_capacity;
+};
+
+static inline void _load(uint64_t* w, const uint8_t* k) {
+    for (int i=0; i<WORDS; ++i) {
+        uint64_t x;
+        memcpy(&x, k+i*8, sizeof(x));
+        w[i] = be64toh(x);
+    }
+}
+
+void kadrec_key(const struct kadrec* r, uint8_t* k) {
+    for (int i=0; i<WORDS; ++i) {
+        uint64_t x = htobe64(r->k[i]);
+        memcpy(k+i*8, &x, sizeof(x));
+    }
+}
+
+static inline int _eq(const uint64_t* a, const uint64_t* b) {
+    return a[0] == b[0] && a[1] == b[1] && a[2] == b[2] && a[3] == b[3];
+}
+
+// returns the bucket index of key w, as wh.bid()
+static unsigned int _bid(const struct kadtable* t, const uint64_t* w) {
+    for (int i=0; i<WORDS; ++i) {
+        uint64_t x = t->root[i] ^ w[i];
+        if (x) {
+            return i*64 + __builtin_clzll(x);
+        }
+    }
+
+    return KADTABLE_BUCKETS-1;
+}
+
+// compares XOR distances of a and b to k. returns <0 if a is closer.
+static inline int _cmp(const uint64_t* a, const uint64_t* b, const uint64_t* k) {
+    for (int i=0; i<WORDS; ++i) {
+        uint64_t da = a[i] ^ k[i], db = b[i] ^ k[i];
+        if (da != db) {
+            return da < db ? -1 : 1;
+        }
+    }
+
+    return 0;
+}
+
+static inline uint32_t* _hbucket(const struct kadtable* t, const uint64_t* w) {
+    uint64_t h;
+    crypto_shorthash((uint8_t*)&h, (const uint8_t*)w, WORDS*8, t->hash_k);
+    return &t->hbuckets[h & t->hmask];
+}
+
+static uint32_t _find(const struct kadtable* t, const uint64_t* w) {
+    uint32_t i;
+
+    for (i=*_hbucket(t, w); i!=NIL; i=t->recs[i].hnext) {
+        if (_eq(t->recs[i].k, w)) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+static int _rehash(struct kadtable* t, uint32_t hcount) {
+    uint32_t* hbuckets = malloc(hcount*sizeof(uint32_t));
+    if (!hbuckets) {
+        return -1;
+    }
+
+    free(t->hbuckets);
+    t->hbuckets = hbuckets;
+    t->hmask = hcount-1;
+
+    for (uint32_t i=0; i<hcount; ++i) {
+        t->hbuckets[i] = NIL;
+    }
+
+    for (int b=0; b<KADTABLE_BUCKETS; ++b) {
+        for (uint32_t j=0; j<t->buckets[b].count; ++j) {
+            uint32_t i = t->buckets[b].recs[j];
+            uint32_t* h = _hbucket(t, t->recs[i].k);
+            t->recs[i].hnext = *h;
+            *h = i;
+        }
+    }
+
+    return 0;
+}
+
+struct kadtable* kadtable_new(const uint8_t* root_k) {
+    struct kadtable* t = calloc(1, sizeof(struct kadtable));
+    if (!t) {
+        return NULL;
+    }
+
+    _load(t->root, root_k);
+    randombytes_buf(t->hash_k, sizeof(t->hash_k));
+    t->free = NIL;
+
+    if (_rehash(t, 64) < 0) {
+        free(t);
+        return NULL;
+    }
+
+    pthread_rwlock_init(&t->lock, NULL);
+    pthread_mutex_init(&t->seen_lock, NULL);
+
+    return t;
+}
+
+void kadtable_free(struct kadtable* t) {
+    for (int b=0; b<KADTABLE_BUCKETS; ++b) {
+        free(t->buckets[b].recs);
+    }
+
+    free(t->heap);
+    free(t->seen);
+    free(t->hbuckets);
+    free(t->recs);
+
+    pthread_rwlock_destroy(&t->lock);
+    pthread_mutex_destroy(&t->seen_lock);
+    free(t);
+}
+
+void kadtable_rdlock(struct kadtable* t) {
+    pthread_rwlock_rdlock(&t->lock);
+}
+
+void kadtable_wrlock(struct kadtable* t) {
+    pthread_rwlock_wrlock(&t->lock);
+}
+
+void kadtable_unlock(struct kadtable* t) {
+    pthread_rwlock_unlock(&t->lock);
+}
+
+size_t kadtable_count(const struct kadtable* t) {
+    return t->count;
+}
+
+static uint32_t _alloc(struct kadtable* t) {
+    if (t->free == NIL) {
+        uint32_t capacity = t->capacity ? t->capacity*2 : 64;
+        struct kadrec* recs = realloc(t->recs, capacity*sizeof(struct kadrec));
+        if (!recs) {
+            return NIL;
+        }
+
+        for (uint32_t i=capacity; i>t->capacity; --i) {
+            recs[i-1].hnext = t->free;
+            t->free = i-1;
+        }
+
+        t->recs = recs;
+        t->capacity = capacity;
+    }
+
+    uint32_t i = t->free;
+    t->free = t->recs[i].hnext;
+    return i;
+}
+
+static int _bucket_push(struct kadtable* t, uint32_t i) {
+    struct kadrec* r = &t->recs[i];
+    struct kadbucket* b = &t->buckets[r->bid];
+
+    if (b->count == b->capacity) {
+        uint32_t capacity = b->capacity ? b->capacity*2 : 8;
+        uint32_t* recs = realloc(b->recs, capacity*sizeof(uint32_t));
+        if (!recs) {
+            return -1;
+        }
+
+        b->recs = recs;
+        b->capacity = capacity;
+    }
+
+    r->pos = b->count++;
+    b->recs[r->pos] = i;
+    return 0;
+}
+
+int kadtable_set(struct kadtable* t, const uint8_t* k, unsigned int flags,
+                 const struct address* addr, const uint8_t* relay_k,
+                 const struct address* lo_addr, uint32_t first_seen,
+                 uint32_t last_seen) {
+    uint64_t w[WORDS];
+    _load(w, k);
+
+    if (_eq(w, t->root)) {
+        return -1;
+    }
+
+    uint32_t i = _find(t, w);
+    if (i == NIL) {
+        if (t->count > t->hmask && _rehash(t, (t->hmask+1)*2) < 0) {
+            return -1;
+        }
+
+        if ((i = _alloc(t)) == NIL) {
+            return -1;
+        }
+
+        struct kadrec* r = &t->recs[i];
+        memcpy(r->k, w, sizeof(r->k));
+        r->bid = _bid(t, w);
+        r->seen = r->heard = 0;
+        r->rx = r->tx = 0;
+
+        if (_bucket_push(t, i) < 0) {
+            r->hnext = t->free;
+            t->free = i;
+            return -1;
+        }
+
+        uint32_t* h = _hbucket(t, w);
+        r->hnext = *h;
+        *h = i;
+        ++t->count;
+    }
+
+    struct kadrec* r = &t->recs[i];
+    r->flags = flags;
+    r->first_seen = first_seen;
+    r->last_seen = last_seen;
+
+    if (flags & KADTABLE_ADDR) {
+        assert(addr);
+        memcpy(&r->addr, addr, sizeof(r->addr));
+    } else {
+        memset(&r->addr, 0, sizeof(r->addr));
+    }
+
+    if (flags & KADTABLE_RELAY) {
+        assert(relay_k);
+        memcpy(r->relay_k, relay_k, sizeof(r->relay_k));
+    } else {
+        memset(r->relay_k, 0, sizeof(r->relay_k));
+    }
+
+    if (flags & KADTABLE_TUNNEL) {
+        assert(lo_addr);
+        memcpy(&r->lo_addr, lo_addr, sizeof(r->lo_addr));
+    } else {
+        memset(&r->lo_addr, 0, sizeof(r->lo_addr));
+    }
+
+    return 0;
+}
+
+int kadtable_remove(struct kadtable* t, const uint8_t* k) {
+    uint64_t w[WORDS];
+    _load(w, k);
+
+    uint32_t* pi = _hbucket(t, w);
+    while (*pi != NIL && !_eq(t->recs[*pi].k, w)) {
+        pi = &t->recs[*pi].hnext;
+    }
+
+    if (*pi == NIL) {
+        return 0;
+    }
+
+    uint32_t i = *pi;
+    struct kadrec* r = &t->recs[i];
+    *pi = r->hnext;
+
+    // swap with last record of the bucket
+    struct kadbucket* b = &t->buckets[r->bid];
+    uint32_t last = b->recs[--b->count];
+    b->recs[r->pos] = last;
+    t->recs[last].pos = r->pos;
+
+    r->hnext = t->free;
+    t->free = i;
+    --t->count;
+
+    return 1;
+}
+
+const struct kadrec* kadtable_get(const struct kadtable* t, const uint8_t* k) {
+    uint64_t w[WORDS];
+    _load(w, k);
+
+    uint32_t i = _find(t, w);
+    return i != NIL ? &t->recs[i] : NULL;
+}
+
+// queues the key of record `r`, once until collected
+static void _queue(struct kadtable* t, const struct kadrec* r) {
+    // readers of the table may queue records concurrently
+    if (__atomic_load_n(&r->seen, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    pthread_mutex_lock(&t->seen_lock);
+
+    if (r->seen) {
+        goto out;
+    }
+
+    if (t->seen_count == t->seen_capacity) {
+        size_t capacity = t->seen_capacity ? t->seen_capacity*2 : 64;
+        void* seen = realloc(t->seen, capacity*KADTABLE_KEYBYTES);
+        if (!seen) {
+            goto out;
+        }
+
+        t->seen = seen;
+        t->seen_capacity = capacity;
+    }
+
+    kadrec_key(r, t->seen[t->seen_count++]);
+    __atomic_store_n(&t->recs[r-t->recs].seen, 1, __ATOMIC_RELAXED);
+
+out:
+    pthread_mutex_unlock(&t->seen_lock);
+}
+
+void kadtable_seen(struct kadtable* t, const struct kadrec* r) {
+    __atomic_store_n(&t->recs[r-t->recs].heard, 1, __ATOMIC_RELAXED);
+    _queue(t, r);
+}
+
+void kadtable_traffic(struct kadtable* t, const struct kadrec* r, size_t rx, size_t tx) {
+    struct kadrec* w = &t->recs[r-t->recs];
+
+    if (rx) {
+        __atomic_fetch_add(&w->rx, rx, __ATOMIC_RELAXED);
+    }
+
+    if (tx) {
+        __atomic_fetch_add(&w->tx, tx, __ATOMIC_RELAXED);
+    }
+
+    _queue(t, r);
+}
+
+static inline int _match(const struct kadrec* r, const uint64_t* k,
+                         enum kadtable_filter filter) {
+    if ((r->flags & (KADTABLE_ADDR | KADTABLE_ALIAS)) != KADTABLE_ADDR) {
+        return 0;
+    }
+
+    switch (filter) {
+    case KADTABLE_FILTER_ANY:
+        return 1;
+    case KADTABLE_FILTER_DIRECT:
+        return !(r->flags & (KADTABLE_NATED | KADTABLE_RELAY)) || _eq(r->k, k);
+    case KADTABLE_FILTER_BOOTSTRAP:
+        return !!(r->flags & KADTABLE_BOOTSTRAP);
+    default:
+        assert(0);
+        return 0;
+    };
+}
+
+// max-heap of the farthest selected records
+static void _heap_down(struct kadtable* t, size_t n, const uint64_t* k, size_t i) {
+    uint32_t* h = t->heap;
+
+    for (;;) {
+        size_t m = i, l = 2*i+1, r = 2*i+2;
+
+        if (l < n && _cmp(t->recs[h[l]].k, t->recs[h[m]].k, k) > 0) m = l;
+        if (r < n && _cmp(t->recs[h[r]].k, t->recs[h[m]].k, k) > 0) m = r;
+        if (m == i) break;
+
+        uint32_t x = h[i]; h[i] = h[m]; h[m] = x;
+        i = m;
+    }
+}
+
+static void _heap_up(struct kadtable* t, const uint64_t* k, size_t i) {
+    uint32_t* h = t->heap;
+
+    while (i > 0) {
+        size_t p = (i-1)/2;
+        if (_cmp(t->recs[h[i]].k, t->recs[h[p]].k, k) <= 0) break;
+
+        uint32_t x = h[i]; h[i] = h[p]; h[p] = x;
+        i = p;
+    }
+}
+
+static void _select(struct kadtable* t, size_t count, size_t* n,
+                    const uint64_t* k, enum kadtable_filter filter, int bid) {
+    const struct kadbucket* b = &t->buckets[bid];
+
+    for (uint32_t j=0; j<b->count; ++j) {
+        uint32_t i = b->recs[j];
+
+        if (!_match(&t->recs[i], k, filter)) {
+            continue;
+        }
+
+        if (*n < count) {
+            t->heap[*n] = i;
+            _heap_up(t, k, (*n)++);
+        } else if (_cmp(t->recs[i].k, t->recs[t->heap[0]].k, k) < 0) {
+            t->heap[0] = i;
+            _heap_down(t, count, k, 0);
+        }
+    }
+}
+
+size_t kadtable_kclosest(struct kadtable* t, const uint8_t* k, size_t count,
+                         enum kadtable_filter filter, const struct kadrec** out) {
+    uint64_t w[WORDS];
+    size_t n = 0;
+
+    if (count == 0) {
+        return 0;
+    }
+
+    if (count > t->heap_capacity) {
+        uint32_t* heap = realloc(t->heap, count*sizeof(uint32_t));
+        if (!heap) {
+            return 0;
+        }
+
+        t->heap = heap;
+        t->heap_capacity = count;
+    }
+
+    _load(w, k);
+    int bid = _bid(t, w);
+
+    // peers of buckets above `bid` share the highest bit of their distance to
+    // k; peers of buckets below are farther and farther.
+    for (int i=bid; i<KADTABLE_BUCKETS; ++i) {
+        _select(t, count, &n, w, filter, i);
+    }
+
+    for (int i=bid-1; i>=0 && n<count; --i) {
+        _select(t, count, &n, w, filter, i);
+    }
+
+    for (size_t i=n; i>0; --i) {
+        out[i-1] = &t->recs[t->heap[0]];
+        t->heap[0] = t->heap[i-1];
+        _heap_down(t, i-1, w, 0);
+    }
+
+    return n;
+}
+
+size_t kadtable_result(struct kadtable* t, const uint8_t* k, size_t count, uint8_t* out) {
+    const struct kadrec* stack_recs[32];
+    const struct kadrec** recs = stack_recs;
+    uint8_t* m = out;
+
+    *m++ = packet_cmd_RESULT;
+    memcpy(m, k, KADTABLE_KEYBYTES);
+    m += KADTABLE_KEYBYTES;
+
+    if (count > sizeof(stack_recs)/sizeof(stack_recs[0])) {
+        if (!(recs = malloc(count*sizeof(struct kadrec*)))) {
+            return m-out;
+        }
+    }
+
+    size_t n = kadtable_kclosest(t, k, count, KADTABLE_FILTER_DIRECT, recs);
+    for (size_t i=0; i<n; ++i) {
+        const struct kadrec* r = recs[i];
+        const struct kadrec* relay = NULL;
+        uint8_t* e = m;
+
+        if (r->flags & KADTABLE_RELAY) {
+            // skip peers whose relay is unknown
+            relay = kadtable_get(t, r->relay_k);
+            if (!relay || !(relay->flags & KADTABLE_ADDR)) {
+                continue;
+            }
+
+            *e++ = KADTABLE_RESULT_RELAY;
+        } else if (r->flags & KADTABLE_NATED) {
+            *e++ = KADTABLE_RESULT_NATED;
+        } else {
+            *e++ = KADTABLE_RESULT_DIRECT;
+        }
+
+        kadrec_key(r, e);
+        e += KADTABLE_KEYBYTES;
+        size_t l = address_pack(&r->addr, e);
+        if (l == 0) {
+            continue;
+        }
+        e += l;
+
+        if (relay) {
+            memcpy(e, r->relay_k, KADTABLE_KEYBYTES);
+            e += KADTABLE_KEYBYTES;
+            if ((l = address_pack(&relay->addr, e)) == 0) {
+                continue;
+            }
+            e += l;
+        }
+
+        m = e;
+    }
+
+    if (recs != stack_recs) {
+        free(recs);
+    }
+
+    return m-out;
+}
+
+static int _write(int fd, const void* m, size_t l) {
+    while (l > 0) {
+        ssize_t r = write(fd, m, l);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return -1;
+        }
+
+        m = (const uint8_t*)m + r;
+        l -= r;
+    }
+
+    return 0;
+}
+
+int kadtable_save(struct kadtable* t, const char* path) {
+    char tmp_path[PATH_MAX];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int)sizeof(tmp_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    kadtable_rdlock(t);
+
+    struct kadsnap_rec* recs = calloc(t->count ? t->count : 1, sizeof(struct kadsnap_rec));
+    if (!recs) {
+        kadtable_unlock(t);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    struct kadsnap_hdr hdr = {
+        .magic = KADSNAP_MAGIC,
+        .version = KADSNAP_VERSION,
+        .count = 0,
+        .rec_size = sizeof(struct kadsnap_rec),
+    };
+
+    for (int b=0; b<KADTABLE_BUCKETS; ++b) {
+        for (uint32_t j=0; j<t->buckets[b].count; ++j) {
+            const struct kadrec* r = &t->recs[t->buckets[b].recs[j]];
+            struct kadsnap_rec* sr = &recs[hdr.count];
+
+            unsigned int mask = KADTABLE_ADDR | KADTABLE_ALIAS | KADTABLE_BOOTSTRAP;
+            if ((r->flags & mask) != KADTABLE_ADDR ||
+                address_pack(&r->addr, sr->addr) == 0) {
+                continue;
+            }
+
+            kadrec_key(r, sr->k);
+            memcpy(sr->relay_k, r->relay_k, sizeof(sr->relay_k));
+            sr->flags = r->flags & (KADTABLE_NATED | KADTABLE_RELAY);
+            sr->first_seen = r->first_seen;
+            sr->last_seen = r->last_seen;
+            ++hdr.count;
+        }
+    }
+
+    kadtable_unlock(t);
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        free(recs);
+        return -1;
+    }
+
+    // not synced: the main loop must not wait for the disk. A snapshot lost or
+    // truncated by a crash is rejected when loaded.
+    if (_write(fd, &hdr, sizeof(hdr)) < 0 ||
+        _write(fd, recs, hdr.count*sizeof(struct kadsnap_rec)) < 0) {
+        int err = errno;
+        free(recs);
+        close(fd);
+        unlink(tmp_path);
+        errno = err;
+        return -1;
+    }
+
+    free(recs);
+
+    if (close(fd) < 0 || rename(tmp_path, path) < 0) {
+        int err = errno;
+        unlink(tmp_path);
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*** LUA *********************************************************************/
+
+static const uint8_t* _checkkey(lua_State* L, int idx) {
+    size_t l;
+    const char* k = luaL_checklstring(L, idx, &l);
+
+    if (l != KADTABLE_KEYBYTES) {
+        luaL_error(L, "bad key length");
+    }
+
+    return (const uint8_t*)k;
+}
+
+static int _close(lua_State* L) {
+    kadtable_free(luaW_ownptr(L, 1, MT));
+    return 0;
+}
+
+static int _count(lua_State* L) {
+    struct kadtable* t = luaW_checkptr(L, 1, MT);
+    lua_pushinteger(L, kadtable_count(t));
+    return 1;
+}
+
+// returns the keys of the closest peers, closest first
+static int _kclosest(lua_State* L) {
+    static const char* const filters[] = {"any", "direct", "bootstrap", NULL};
+
+    struct kadtable* t = luaW_checkptr(L, 1, MT);
+    const uint8_t* k = _checkkey(L, 2);
+    lua_Integer count = luaL_checkinteger(L, 3);
+    enum kadtable_filter filter = luaL_checkoption(L, 4, "any", filters);
+
+    if (count < 0) {
+        luaL_error(L, "bad count");
+    }
+
+    if ((size_t)count > t->count) {
+        count = t->count;
+    }
+
+    const struct kadrec** out = lua_newuserdata(L, (count ? count : 1)*sizeof(struct kadrec*));
+    uint8_t (*keys)[KADTABLE_KEYBYTES] = lua_newuserdata(L, (count ? count : 1)*KADTABLE_KEYBYTES);
+
+    // the selection heap is shared. Lua must not raise errors while the lock
+    // is held.
+    kadtable_wrlock(t);
+    size_t n = kadtable_kclosest(t, k, count, filter, out);
+    for (size_t i=0; i<n; ++i) {
+        kadrec_key(out[i], keys[i]);
+    }
+    kadtable_unlock(t);
+
+    lua_createtable(L, n, 0);
+    for (size_t i=0; i<n; ++i) {
+        lua_pushlstring(L, (const char*)keys[i], KADTABLE_KEYBYTES);
+        lua_rawseti(L, -2, i+1);
+    }
+
+    return 1;
+}
+
+// pushes the list of the records at index 1, whose count is at index 2. Called
+// protected, so that the snapshot is unmapped if an allocation fails.
+static int _push_snapshot(lua_State* L) {
+    const struct kadsnap_rec* recs = lua_touserdata(L, 1);
+    uint32_t count = lua_tointeger(L, 2);
+
+    lua_createtable(L, count, 0);
+    for (uint32_t i=0; i<count; ++i) {
+        const struct kadsnap_rec* r = &recs[i];
+
+        lua_createtable(L, 0, 6);
+
+        struct address* addr = luaW_newaddress(L);
+        if (address_unpack(addr, r->addr, sizeof(r->addr)) == 0) {
+            lua_pop(L, 2);
+            continue;
+        }
+        lua_setfield(L, -2, "addr");
+
+        lua_pushlstring(L, (const char*)r->k, sizeof(r->k));
+        lua_setfield(L, -2, "k");
+
+        lua_pushboolean(L, r->flags & KADTABLE_NATED);
+        lua_setfield(L, -2, "is_nated");
+
+        if (r->flags & KADTABLE_RELAY) {
+            lua_pushlstring(L, (const char*)r->relay_k, sizeof(r->relay_k));
+            lua_setfield(L, -2, "relay_k");
+        }
+
+        lua_pushinteger(L, r->first_seen);
+        lua_setfield(L, -2, "first_seen");
+
+        lua_pushinteger(L, r->last_seen);
+        lua_setfield(L, -2, "last_seen");
+
+        lua_rawseti(L, -2, lua_rawlen(L, -2)+1);
+    }
+
+    return 1;
+}
+
+// load(path) -> list of {k, addr, is_nated, relay_k, first_seen, last_seen}
+//
+// Returns nil and an error message if the snapshot cannot be read.
+static int _snapshot_load(lua_State* L) {
+    const char* path = luaL_checkstring(L, 1);
+    const char* err = NULL;
+    int ret = LUA_OK;
+    void* map = MAP_FAILED;
+    struct stat st;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        err = strerror(errno);
+        goto out;
+    }
+
+    if ((size_t)st.st_size < sizeof(struct kadsnap_hdr)) {
+        err = "truncated snapshot";
+        goto out;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        err = strerror(errno);
+        goto out;
+    }
+
+    const struct kadsnap_hdr* hdr = map;
+    if (hdr->magic != KADSNAP_MAGIC || hdr->version != KADSNAP_VERSION ||
+        hdr->rec_size != sizeof(struct kadsnap_rec)) {
+        err = "bad snapshot";
+        goto out;
+    }
+
+    if (hdr->count > (st.st_size-sizeof(*hdr)) / sizeof(struct kadsnap_rec)) {
+        err = "truncated snapshot";
+        goto out;
+    }
+
+    lua_pushcfunction(L, _push_snapshot);
+    lua_pushlightuserdata(L, (void*)(hdr+1));
+    lua_pushinteger(L, hdr->count);
+    ret = lua_pcall(L, 2, 1, 0);
+
+out:
+    if (map != MAP_FAILED) {
+        munmap(map, st.st_size);
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    if (ret != LUA_OK) {
+        return lua_error(L);
+    }
+
+    if (err) {
+        lua_pushnil(L);
+        lua_pushstring(L, err);
+        return 2;
+    }
+
+    return 1;
+}
+
+static int _new(lua_State* L) {
+    struct kadtable* t = kadtable_new(_checkkey(L, 1));
+    if (!t) {
+        luaL_error(L, "out of memory");
+    }
+
+    luaW_pushptr(L, MT, t);
+    return 1;
+}
+
+static int _remove(lua_State* L) {
+    struct kadtable* t = luaW_checkptr(L, 1, MT);
+    const uint8_t* k = _checkkey(L, 2);
+
+    kadtable_wrlock(t);
+    int r = kadtable_remove(t, k);
+    kadtable_unlock(t);
+
+    lua_pushboolean(L, r);
+    return 1;
+}
+
+// set(t, k, addr, is_nated, relay_k, alias, bootstrap, lo_addr, first_seen,
+//     last_seen)
+static int _set(lua_State* L) {
+    struct kadtable* t = luaW_checkptr(L, 1, MT);
+    const uint8_t* k = _checkkey(L, 2);
+    const struct address* addr = NULL;
+    const uint8_t* relay_k = NULL;
+    const struct address* lo_addr = NULL;
+    unsigned int flags = 0;
+
+    if (!lua_isnoneornil(L, 3)) {
+        addr = luaL_checkudata(L, 3, "address");
+        flags |= KADTABLE_ADDR;
+    }
+
+    if (lua_toboolean(L, 4)) {
+        flags |= KADTABLE_NATED;
+    }
+
+    if (!lua_isnoneornil(L, 5)) {
+        relay_k = _checkkey(L, 5);
+        flags |= KADTABLE_RELAY;
+    }
+
+    if (lua_toboolean(L, 6)) {
+        flags |= KADTABLE_ALIAS;
+    }
+
+    if (lua_toboolean(L, 7)) {
+        flags |= KADTABLE_BOOTSTRAP;
+    }
+
+    if (!lua_isnoneornil(L, 8)) {
+        lo_addr = luaL_checkudata(L, 8, "address");
+        flags |= KADTABLE_TUNNEL;
+    }
+
+    uint32_t first_seen = luaL_optnumber(L, 9, 0);
+    uint32_t last_seen = luaL_optnumber(L, 10, 0);
+
+    kadtable_wrlock(t);
+    int r = kadtable_set(t, k, flags, addr, relay_k, lo_addr, first_seen, last_seen);
+    kadtable_unlock(t);
+
+    if (r < 0) {
+        luaL_error(L, "kadtable_set() failed");
+    }
+
+    return 0;
+}
+
+// save(t, path) -> true, or nil and an error message
+static int _snapshot_save(lua_State* L) {
+    struct kadtable* t = luaW_checkptr(L, 1, MT);
+    const char* path = luaL_checkstring(L, 2);
+
+    if (kadtable_save(t, path) < 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        return 2;
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// encode_result(t, k, count) -> RESULT packet
+static int _encode_result(lua_State* L) {
+    struct kadtable* t = luaW_checkptr(L, 1, MT);
+    const uint8_t* k = _checkkey(L, 2);
+    lua_Integer count = luaL_checkinteger(L, 3);
+
+    if (count < 0) {
+        luaL_error(L, "bad count");
+    }
+
+    if ((size_t)count > t->count) {
+        count = t->count;
+    }
+
+    uint8_t* out = lua_newuserdata(L, KADTABLE_RESULT_BYTES(count));
+
+    // the selection heap is shared
+    kadtable_wrlock(t);
+    size_t l = kadtable_result(t, k, count, out);
+    kadtable_unlock(t);
+
+    lua_pushlstring(L, (const char*)out, l);
+    return 1;
+}
+
+// decode_result(t, m) -> searched key, list of peers
+//
+// Peers are returned as RESULT_STRIDE consecutive values: key, address, flag
+// ('direct', 'relay' or 'nated'), and for relayed peers, the key of the relay
+// and its address. The address of a relay known by the table is not returned,
+// as the known one is preferred. Other fields are false.
+//
+// Returns nil if the packet is malformed.
+#define RESULT_STRIDE 5
+static int _decode_result(lua_State* L) {
+    struct kadtable* t = luaW_checkptr(L, 1, MT);
+    size_t l;
+    const uint8_t* m = (const uint8_t*)luaL_checklstring(L, 2, &l);
+    const uint8_t* end = m+l;
+
+    if (l < 1+KADTABLE_KEYBYTES || m[0] != packet_cmd_RESULT) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    lua_pushlstring(L, (const char*)m+1, KADTABLE_KEYBYTES);
+    m += 1+KADTABLE_KEYBYTES;
+
+    lua_createtable(L, (l/KADTABLE_RESULT_ENTRYBYTES+1)*RESULT_STRIDE, 0);
+    int i = 1;
+
+    while (m < end) {
+        uint8_t flag = *m++;
+        struct address* a;
+
+        if ((flag != KADTABLE_RESULT_DIRECT && flag != KADTABLE_RESULT_RELAY &&
+             flag != KADTABLE_RESULT_NATED) || end-m < KADTABLE_KEYBYTES) {
+            goto malformed;
+        }
+
+        lua_pushlstring(L, (const char*)m, KADTABLE_KEYBYTES);
+        lua_rawseti(L, -2, i++);
+        m += KADTABLE_KEYBYTES;
+
+        a = luaW_newaddress(L);
+        if ((l = address_unpack(a, m, end-m)) == 0) {
+            goto malformed;
+        }
+        lua_rawseti(L, -2, i++);
+        m += l;
+
+        switch (flag) {
+        case KADTABLE_RESULT_DIRECT: lua_pushliteral(L, "direct"); break;
+        case KADTABLE_RESULT_RELAY: lua_pushliteral(L, "relay"); break;
+        case KADTABLE_RESULT_NATED: lua_pushliteral(L, "nated"); break;
+        };
+        lua_rawseti(L, -2, i++);
+
+        if (flag != KADTABLE_RESULT_RELAY) {
+            lua_pushboolean(L, 0);
+            lua_rawseti(L, -2, i++);
+            lua_pushboolean(L, 0);
+            lua_rawseti(L, -2, i++);
+            continue;
+        }
+
+        if (end-m < KADTABLE_KEYBYTES) {
+            goto malformed;
+        }
+
+        const uint8_t* relay_k = m;
+        lua_pushlstring(L, (const char*)relay_k, KADTABLE_KEYBYTES);
+        lua_rawseti(L, -2, i++);
+        m += KADTABLE_KEYBYTES;
+
+        a = luaW_newaddress(L);
+        if ((l = address_unpack(a, m, end-m)) == 0) {
+            goto malformed;
+        }
+        m += l;
+
+        kadtable_rdlock(t);
+        int known = kadtable_get(t, relay_k) != NULL;
+        kadtable_unlock(t);
+
+        if (known) {
+            lua_pop(L, 1);
+            lua_pushboolean(L, 0);
+        }
+        lua_rawseti(L, -2, i++);
+    }
+
+    return 2;
+
+malformed:
+    lua_pushnil(L);
+    return 1;
+}
+
+// seen(t [, now]) -> keys, traffic
+//
+// returns the keys of the peers seen by the core since last call, and the list
+// of {k, rx, tx} of the bytes received from and sent to peers by the core. If
+// set, `now` is the last time the seen peers were seen.
+static int _seen(lua_State* L) {
+    struct kadtable* t = luaW_checkptr(L, 1, MT);
+    uint32_t now = luaL_optnumber(L, 2, 0);
+
+    kadtable_wrlock(t);
+    size_t count = t->seen_count;
+    uint8_t (*keys)[KADTABLE_KEYBYTES] = t->seen;
+
+    struct {
+        uint8_t heard;
+        uint64_t rx;
+        uint64_t tx;
+    }* st = count ? calloc(count, sizeof(*st)) : NULL;
+
+    if (count && !st) {
+        kadtable_unlock(t);
+        luaL_error(L, "out of memory");
+    }
+
+    for (size_t i=0; i<count; ++i) {
+        uint64_t w[WORDS];
+        _load(w, keys[i]);
+
+        uint32_t j = _find(t, w);
+        if (j != NIL) {
+            struct kadrec* r = &t->recs[j];
+            st[i].heard = r->heard;
+            st[i].rx = r->rx;
+            st[i].tx = r->tx;
+            r->seen = r->heard = 0;
+            r->rx = r->tx = 0;
+
+            if (now && st[i].heard) {
+                r->last_seen = now;
+            }
+        }
+    }
+
+    // the queue is taken, so that keys are pushed without holding the lock
+    t->seen = NULL;
+    t->seen_count = t->seen_capacity = 0;
+    kadtable_unlock(t);
+
+    lua_newtable(L);
+    lua_newtable(L);
+
+    lua_Integer heard = 0, traffic = 0;
+    for (size_t i=0; i<count; ++i) {
+        if (st[i].heard) {
+            lua_pushlstring(L, (const char*)keys[i], KADTABLE_KEYBYTES);
+            lua_rawseti(L, -3, ++heard);
+        }
+
+        if (st[i].rx || st[i].tx) {
+            lua_createtable(L, 3, 0);
+            lua_pushlstring(L, (const char*)keys[i], KADTABLE_KEYBYTES);
+            lua_rawseti(L, -2, 1);
+            lua_pushinteger(L, st[i].rx);
+            lua_rawseti(L, -2, 2);
+            lua_pushinteger(L, st[i].tx);
+            lua_rawseti(L, -2, 3);
+            lua_rawseti(L, -2, ++traffic);
+        }
+    }
+
+    free(st);
+    free(keys);
+    return 2;
+}
+
+static const luaL_Reg funcs[] = {
+    {"close", _close},
+    {"count", _count},
+    {"decode_result", _decode_result},
+    {"encode_result", _encode_result},
+    {"kclosest", _kclosest},
+    {"load", _snapshot_load},
+    {"new", _new},
+    {"remove", _remove},
+    {"save", _snapshot_save},
+    {"seen", _seen},
+    {"set", _set},
+    {NULL, NULL},
+};
+
+LUAMOD_API int luaopen_kadtable(lua_State* L) {
+    luaL_checkversion(L);
+    luaL_newlib(L, funcs);
+
+    luaW_declptr(L, MT, (void(*)(void*))kadtable_free);
+
+    return 1;
+}
+
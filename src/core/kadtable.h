@@ -0,0 +1,153 @@
+#ifndef WIREHUB_KADTABLE_H
+#define WIREHUB_KADTABLE_H
+
+#include "net.h"
+
+/** Native index of the Kademilia routing table.
+ *
+ * Peers are stored as fixed-size records in the buckets of the node's key.
+ * Keys are stored as big-endian 64-bit words, so XOR distances are computed and
+ * compared four words at a time. Records only mirror the routing attributes of
+ * the peers (address, NAT, relay, alias and bootstrap flags, loopback tunnel);
+ * the peers' state stays in Lua.
+ *
+ * Peers seen by the core, and the bytes the core received from and sent to
+ * them, are queued until Lua collects them.
+ *
+ * The table may be read concurrently by the threads of the sharded ingress
+ * (see shards.h). The native datapath holds the read lock while it handles a
+ * packet; Lua functions modifying the table hold the write lock.
+ */
+#define KADTABLE_KEYBYTES   32
+#define KADTABLE_BUCKETS    (KADTABLE_KEYBYTES*8)
+
+#define KADTABLE_ADDR       0x01
+#define KADTABLE_NATED      0x02
+#define KADTABLE_RELAY      0x04
+#define KADTABLE_ALIAS      0x08
+#define KADTABLE_BOOTSTRAP  0x10
+#define KADTABLE_TUNNEL     0x20
+
+enum kadtable_filter {
+    // any peer with an address
+    KADTABLE_FILTER_ANY,
+    // the searched peer, or peers reachable directly
+    KADTABLE_FILTER_DIRECT,
+    // bootstrap peers
+    KADTABLE_FILTER_BOOTSTRAP,
+};
+
+struct kadrec {
+    uint64_t k[KADTABLE_KEYBYTES/8];
+    unsigned int flags;
+    struct address addr;
+    uint8_t relay_k[KADTABLE_KEYBYTES];
+    struct address lo_addr;
+
+    uint32_t first_seen;    // seconds since epoch, or 0 if unknown
+    uint32_t last_seen;
+
+    uint8_t seen;           // queued until collected
+    uint8_t heard;          // seen since collected
+    uint64_t rx;            // bytes received since collected
+    uint64_t tx;            // bytes sent since collected
+    uint32_t hnext;         // hash chain, or free list
+    uint16_t bid;
+    uint32_t pos;           // position in bucket
+};
+
+struct kadtable;
+
+struct kadtable* kadtable_new(const uint8_t* root_k);
+void kadtable_free(struct kadtable* t);
+
+// inserts or updates the record of peer `k`. `addr` is required if flag
+// KADTABLE_ADDR is set, `relay_k` if flag KADTABLE_RELAY is set, `lo_addr` if
+// flag KADTABLE_TUNNEL is set. returns -1 if allocation failed or if `k` is the
+// root key.
+int kadtable_set(struct kadtable* t, const uint8_t* k, unsigned int flags,
+                 const struct address* addr, const uint8_t* relay_k,
+                 const struct address* lo_addr, uint32_t first_seen,
+                 uint32_t last_seen);
+
+// removes the record of peer `k`. returns 1 if it existed, else 0.
+int kadtable_remove(struct kadtable* t, const uint8_t* k);
+
+// returns the record of peer `k`, or NULL. the pointer is valid until the
+// table is modified.
+const struct kadrec* kadtable_get(const struct kadtable* t, const uint8_t* k);
+
+// writes in `out` the `count` closest records to key `k`, closest first. returns
+// the count of written records. pointers are valid until the table is
+// modified.
+size_t kadtable_kclosest(struct kadtable* t, const uint8_t* k, size_t count,
+                         enum kadtable_filter filter, const struct kadrec** out);
+
+// queues the key of record `r` as seen, once until collected. May be called
+// while holding the read lock.
+void kadtable_seen(struct kadtable* t, const struct kadrec* r);
+
+// accounts `rx` bytes received from and `tx` bytes sent to the peer of record
+// `r`, until collected. May be called while holding the read lock.
+void kadtable_traffic(struct kadtable* t, const struct kadrec* r, size_t rx, size_t tx);
+
+void kadtable_rdlock(struct kadtable* t);
+void kadtable_wrlock(struct kadtable* t);
+void kadtable_unlock(struct kadtable* t);
+
+size_t kadtable_count(const struct kadtable* t);
+
+/** RESULT packets.
+ *
+ * A RESULT body is the command, the searched key, and one entry per peer: a
+ * flag, the key and the packed address of the peer, followed by the key and
+ * the packed address of its relay if flag is KADTABLE_RESULT_RELAY.
+ */
+#define KADTABLE_RESULT_DIRECT  0x00
+#define KADTABLE_RESULT_RELAY   0x01
+#define KADTABLE_RESULT_NATED   0x02    // reachable through the sender
+
+#define KADTABLE_RESULT_ENTRYBYTES (1+2*(KADTABLE_KEYBYTES+ADDRESS_PACKBYTES))
+#define KADTABLE_RESULT_BYTES(count) (1+KADTABLE_KEYBYTES+(count)*KADTABLE_RESULT_ENTRYBYTES)
+
+// writes in `out` the RESULT of a search of key `k`, with the `count` closest
+// peers which may be reached directly (and peer `k`). `out` must be
+// KADTABLE_RESULT_BYTES(count) long. returns the size of the RESULT. Must be
+// called with the write lock held.
+size_t kadtable_result(struct kadtable* t, const uint8_t* k, size_t count, uint8_t* out);
+
+/** Snapshots.
+ *
+ * Records with an address, which are neither aliases nor bootstrap peers, may
+ * be written in a snapshot file, to seed the table of a restarting node. The
+ * file is a header followed by fixed-size records, in host byte order, so it
+ * may be mapped in memory as is.
+ */
+#define KADSNAP_MAGIC       0x70616e73 // "snap"
+#define KADSNAP_VERSION     1
+
+struct kadsnap_hdr {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t rec_size;
+};
+
+struct kadsnap_rec {
+    uint8_t k[KADTABLE_KEYBYTES];
+    uint8_t relay_k[KADTABLE_KEYBYTES];
+    uint8_t addr[ADDRESS_PACKBYTES];
+    uint8_t flags;          // KADTABLE_NATED and KADTABLE_RELAY
+    uint32_t first_seen;
+    uint32_t last_seen;
+};
+
+// writes a snapshot of the table at `path`, atomically but not durably: the
+// file is not synced. Takes the read lock while records are copied. returns -1
+// and sets errno if it failed.
+int kadtable_save(struct kadtable* t, const char* path);
+
+void kadrec_key(const struct kadrec* r, uint8_t* k);
+
+#endif  // WIREHUB_KADTABLE_H
+
@@ -0,0 +1,247 @@
+#include "keycache.h"
+#include <sodium.h>
+
+#define NIL ((uint32_t)-1)
+#define LOCAL_COUNT 4
+
+struct keycache_entry {
+    uint8_t pk[crypto_scalarmult_curve25519_BYTES];
+    uint8_t k[crypto_scalarmult_curve25519_BYTES];
+    uint64_t sk_id;
+    uint32_t prev, next;    // LRU list, or free list
+    uint32_t hnext;         // hash chain
+};
+
+struct keycache_local {
+    uint64_t sk_id;
+    uint8_t pk[crypto_scalarmult_curve25519_BYTES];
+    int used;
+};
+
+struct keycache {
+    uint8_t hash_k[crypto_shorthash_KEYBYTES];
+    struct keycache_local locals[LOCAL_COUNT];
+    unsigned int next_local;
+
+    struct keycache_stats st;
+
+    uint32_t head, tail;    // most and least recently used
+    uint32_t free;
+    uint32_t mask;
+    uint32_t* buckets;
+    struct keycache_entry* entries;
+};
+
+static inline uint64_t _hash(const struct keycache* c, const uint8_t* x, size_t l) {
+    uint64_t h;
+    crypto_shorthash((uint8_t*)&h, x, l, c->hash_k);
+    return h;
+}
+
+static void _lru_unlink(struct keycache* c, uint32_t i) {
+    struct keycache_entry* e = &c->entries[i];
+
+    if (e->prev != NIL) {
+        c->entries[e->prev].next = e->next;
+    } else {
+        c->head = e->next;
+    }
+
+    if (e->next != NIL) {
+        c->entries[e->next].prev = e->prev;
+    } else {
+        c->tail = e->prev;
+    }
+}
+
+static void _lru_push(struct keycache* c, uint32_t i) {
+    struct keycache_entry* e = &c->entries[i];
+
+    e->prev = NIL;
+    e->next = c->head;
+
+    if (c->head != NIL) {
+        c->entries[c->head].prev = i;
+    } else {
+        c->tail = i;
+    }
+
+    c->head = i;
+}
+
+static uint32_t* _bucket(struct keycache* c, const uint8_t* pk) {
+    return &c->buckets[_hash(c, pk, crypto_scalarmult_curve25519_BYTES) & c->mask];
+}
+
+static void _hash_unlink(struct keycache* c, uint32_t i) {
+    uint32_t* pi = _bucket(c, c->entries[i].pk);
+
+    while (*pi != i) {
+        assert(*pi != NIL);
+        pi = &c->entries[*pi].hnext;
+    }
+
+    *pi = c->entries[i].hnext;
+}
+
+static void _release(struct keycache* c, uint32_t i) {
+    struct keycache_entry* e = &c->entries[i];
+
+    sodium_memzero(e, sizeof(*e));
+    e->next = c->free;
+    c->free = i;
+    --c->st.size;
+}
+
+struct keycache* keycache_new(size_t capacity) {
+    assert(0 < capacity && capacity < NIL);
+
+    size_t bucket_count = 1;
+    while (bucket_count < capacity) {
+        bucket_count <<= 1;
+    }
+
+    struct keycache* c = sodium_malloc(
+        sizeof(struct keycache) +
+        sizeof(struct keycache_entry) * capacity +
+        sizeof(uint32_t) * bucket_count
+    );
+
+    if (!c) {
+        return NULL;
+    }
+
+    memset(c, 0, sizeof(*c));
+    randombytes_buf(c->hash_k, sizeof(c->hash_k));
+    c->entries = (struct keycache_entry*)(c+1);
+    c->buckets = (uint32_t*)(c->entries+capacity);
+    c->mask = bucket_count-1;
+    c->head = c->tail = NIL;
+    c->st.capacity = capacity;
+
+    size_t i;
+    for (i=0; i<bucket_count; ++i) {
+        c->buckets[i] = NIL;
+    }
+
+    c->free = NIL;
+    for (i=capacity; i>0; --i) {
+        sodium_memzero(&c->entries[i-1], sizeof(struct keycache_entry));
+        c->entries[i-1].next = c->free;
+        c->free = i-1;
+    }
+
+    return c;
+}
+
+void keycache_free(struct keycache* c) {
+    sodium_free(c);
+}
+
+const uint8_t* keycache_shared(struct keycache* c, const uint8_t* sk, const uint8_t* pk) {
+    uint64_t sk_id = _hash(c, sk, crypto_scalarmult_curve25519_SCALARBYTES);
+    uint32_t* b = _bucket(c, pk);
+    uint32_t i;
+
+    for (i=*b; i!=NIL; i=c->entries[i].hnext) {
+        struct keycache_entry* e = &c->entries[i];
+
+        if (e->sk_id == sk_id && memcmp(e->pk, pk, sizeof(e->pk)) == 0) {
+            ++c->st.hits;
+            _lru_unlink(c, i);
+            _lru_push(c, i);
+            return e->k;
+        }
+    }
+
+    ++c->st.misses;
+
+    if (c->free != NIL) {
+        i = c->free;
+        c->free = c->entries[i].next;
+        ++c->st.size;
+    } else {
+        i = c->tail;
+        assert(i != NIL);
+        _lru_unlink(c, i);
+        _hash_unlink(c, i);
+        ++c->st.evictions;
+    }
+
+    struct keycache_entry* e = &c->entries[i];
+    if (crypto_scalarmult_curve25519(e->k, sk, pk) != 0) {
+        _release(c, i);
+        return NULL;
+    }
+
+    memcpy(e->pk, pk, sizeof(e->pk));
+    e->sk_id = sk_id;
+    e->hnext = *b;
+    *b = i;
+    _lru_push(c, i);
+
+    return e->k;
+}
+
+int keycache_contains(const struct keycache* c, const uint8_t* sk, const uint8_t* pk) {
+    uint64_t sk_id = _hash(c, sk, crypto_scalarmult_curve25519_SCALARBYTES);
+    uint32_t i = c->buckets[_hash(c, pk, crypto_scalarmult_curve25519_BYTES) & c->mask];
+
+    for (; i!=NIL; i=c->entries[i].hnext) {
+        const struct keycache_entry* e = &c->entries[i];
+
+        if (e->sk_id == sk_id && memcmp(e->pk, pk, sizeof(e->pk)) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+const uint8_t* keycache_publickey(struct keycache* c, const uint8_t* sk) {
+    uint64_t sk_id = _hash(c, sk, crypto_scalarmult_curve25519_SCALARBYTES);
+    unsigned int i;
+
+    for (i=0; i<LOCAL_COUNT; ++i) {
+        if (c->locals[i].used && c->locals[i].sk_id == sk_id) {
+            return c->locals[i].pk;
+        }
+    }
+
+    struct keycache_local* l = &c->locals[c->next_local];
+    if (crypto_scalarmult_curve25519_base(l->pk, sk) != 0) {
+        return NULL;
+    }
+
+    c->next_local = (c->next_local+1) % LOCAL_COUNT;
+    l->sk_id = sk_id;
+    l->used = 1;
+
+    return l->pk;
+}
+
+int keycache_forget(struct keycache* c, const uint8_t* pk) {
+    uint32_t* pi = _bucket(c, pk);
+    int count = 0;
+
+    while (*pi != NIL) {
+        uint32_t i = *pi;
+        struct keycache_entry* e = &c->entries[i];
+
+        if (memcmp(e->pk, pk, sizeof(e->pk)) == 0) {
+            *pi = e->hnext;
+            _lru_unlink(c, i);
+            _release(c, i);
+            ++count;
+        } else {
+            pi = &e->hnext;
+        }
+    }
+
+    return count;
+}
+
+void keycache_stats(const struct keycache* c, struct keycache_stats* st) {
+    *st = c->st;
+}
+
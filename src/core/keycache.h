@@ -0,0 +1,52 @@
+#ifndef WIREHUB_KEYCACHE_H
+#define WIREHUB_KEYCACHE_H
+
+#include "common.h"
+
+/** Cache of the HMAC keys shared with remote peers.
+ *
+ * Deriving the key shared between a local secret key and a remote public key
+ * costs one X25519 scalar multiplication. As WireHub peers are long-lived, the
+ * derived keys are cached in locked memory, indexed by the remote public key,
+ * and evicted in least-recently-used order when the cache is full.
+ */
+struct keycache;
+
+struct keycache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    size_t size;
+    size_t capacity;
+};
+
+struct keycache* keycache_new(size_t capacity);
+void keycache_free(struct keycache* c);
+
+/** Returns the key shared between secret key `sk` and public key `pk`.
+ *
+ * Returned pointer is valid until next call on the cache. Returns NULL if key
+ * exchange failed.
+ */
+const uint8_t* keycache_shared(struct keycache* c, const uint8_t* sk, const uint8_t* pk);
+
+// returns 1 if the key shared between `sk` and `pk` is cached, else 0. The
+// cache is left untouched.
+int keycache_contains(const struct keycache* c, const uint8_t* sk, const uint8_t* pk);
+
+/** Returns the public key of secret key `sk`.
+ *
+ * Returned pointer is valid until next call on the cache. Returns NULL if the
+ * secret key is invalid.
+ */
+const uint8_t* keycache_publickey(struct keycache* c, const uint8_t* sk);
+
+/** Removes all keys shared with public key `pk`. Returns the count of removed
+ * keys.
+ */
+int keycache_forget(struct keycache* c, const uint8_t* pk);
+
+void keycache_stats(const struct keycache* c, struct keycache_stats* st);
+
+#endif  // WIREHUB_KEYCACHE_H
+
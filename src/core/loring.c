@@ -0,0 +1,351 @@
+#include "loring.h"
+#include "luawh.h"
+#include <limits.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <net/if.h>
+#include <sys/mman.h>
+
+#define MT "loring"
+
+// nominal size of frames. Frames of TPACKET_V3 have a variable size; this is
+// only used to size the ring.
+#define FRAME_SIZE 2048
+
+struct loring {
+    int fd;
+    uint8_t* map;
+    size_t map_size;
+    unsigned int block_size;
+    unsigned int block_count;
+
+    // held block
+    unsigned int cur;
+    int held;
+    unsigned int left;
+    const uint8_t* frame;
+
+    struct loring_stats st;
+};
+
+static int _attach_filter(int fd, struct in_addr net, unsigned int cidr) {
+    uint32_t mask = cidr ? UINT32_C(0xffffffff) << (32-cidr) : 0;
+    uint32_t net_h = ntohl(net.s_addr) & mask;
+
+    // SOCK_DGRAM packet sockets get the packets from their IP header.
+    // WireGuard messages start with a type between 1 and 4, and three reserved
+    // zero bytes.
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD|BPF_B|BPF_ABS, SKF_AD_OFF+SKF_AD_PKTTYPE),
+        BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, PACKET_OUTGOING, 14, 0),
+        BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 9),              // protocol
+        BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, IPPROTO_UDP, 0, 12),
+        BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 6),              // fragment offset
+        BPF_JUMP(BPF_JMP|BPF_JSET|BPF_K, 0x1fff, 10, 0),
+        BPF_STMT(BPF_LD|BPF_W|BPF_ABS, 16),             // destination
+        BPF_STMT(BPF_ALU|BPF_AND|BPF_K, mask),
+        BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, net_h, 0, 7),
+        BPF_STMT(BPF_LDX|BPF_B|BPF_MSH, 0),             // IP header length
+        BPF_STMT(BPF_LD|BPF_W|BPF_IND, UDP_HDRLEN),     // WireGuard header
+        BPF_JUMP(BPF_JMP|BPF_JSET|BPF_K, 0x00ffffff, 4, 0),
+        BPF_STMT(BPF_ALU|BPF_RSH|BPF_K, 24),            // message type
+        BPF_JUMP(BPF_JMP|BPF_JGE|BPF_K, 1, 0, 2),
+        BPF_JUMP(BPF_JMP|BPF_JGT|BPF_K, 4, 1, 0),
+        BPF_STMT(BPF_RET|BPF_K, (uint32_t)-1),
+        BPF_STMT(BPF_RET|BPF_K, 0),
+    };
+
+    struct sock_fprog prog = {
+        .len = sizeof(code) / sizeof(code[0]),
+        .filter = code,
+    };
+
+    return setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+}
+
+struct loring* loring_new(struct in_addr net, unsigned int cidr,
+                          unsigned int block_size, unsigned int block_count) {
+    assert(cidr <= 32);
+
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (block_size < FRAME_SIZE || block_count == 0 ||
+        (page_size > 0 && block_size % page_size != 0) ||
+        SIZE_MAX / block_size < block_count) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct loring* r = calloc(1, sizeof(struct loring));
+    if (!r) {
+        return NULL;
+    }
+
+    r->map = MAP_FAILED;
+    r->block_size = block_size;
+    r->block_count = block_count;
+
+    // the socket receives nothing until bound, once the filter is attached
+    if ((r->fd = socket(AF_PACKET, SOCK_DGRAM|SOCK_NONBLOCK, 0)) == -1) {
+        goto err;
+    }
+
+    int version = TPACKET_V3;
+    if (setsockopt(r->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) == -1 ||
+        _attach_filter(r->fd, net, cidr) == -1) {
+        goto err;
+    }
+
+    struct tpacket_req3 req = {
+        .tp_block_size = block_size,
+        .tp_block_nr = block_count,
+        .tp_frame_size = FRAME_SIZE,
+        .tp_frame_nr = (block_size / FRAME_SIZE) * block_count,
+        .tp_retire_blk_tov = WH_LORING_RETIRE_MS,
+    };
+
+    if (setsockopt(r->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) == -1) {
+        goto err;
+    }
+
+    r->map_size = (size_t)block_size * block_count;
+    r->map = mmap(NULL, r->map_size, PROT_READ|PROT_WRITE,
+                  MAP_SHARED|MAP_LOCKED, r->fd, 0);
+    if (r->map == MAP_FAILED) {
+        // locking may exceed RLIMIT_MEMLOCK
+        r->map = mmap(NULL, r->map_size, PROT_READ|PROT_WRITE, MAP_SHARED, r->fd, 0);
+    }
+
+    if (r->map == MAP_FAILED) {
+        goto err;
+    }
+
+    struct sockaddr_ll sll = {
+        .sll_family = AF_PACKET,
+        .sll_protocol = htons(ETH_P_IP),
+        .sll_ifindex = if_nametoindex("lo"),
+    };
+
+    if (sll.sll_ifindex == 0 ||
+        bind(r->fd, (struct sockaddr*)&sll, sizeof(sll)) == -1) {
+        goto err;
+    }
+
+    return r;
+
+err:
+    {
+        int err = errno;
+        loring_free(r);
+        errno = err;
+    }
+    return NULL;
+}
+
+void loring_free(struct loring* r) {
+    if (r->map != MAP_FAILED) {
+        munmap(r->map, r->map_size);
+    }
+
+    if (r->fd != -1) {
+        close(r->fd);
+    }
+
+    free(r);
+}
+
+int loring_fd(const struct loring* r) {
+    return r->fd;
+}
+
+static struct tpacket_block_desc* _block(const struct loring* r) {
+    return (struct tpacket_block_desc*)(r->map + (size_t)r->cur*r->block_size);
+}
+
+int loring_recv(struct loring* r) {
+    for (;;) {
+        struct tpacket_block_desc* bd = _block(r);
+
+        if (r->held) {
+            __atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL,
+                             __ATOMIC_RELEASE);
+            r->held = 0;
+            r->cur = (r->cur + 1) % r->block_count;
+            bd = _block(r);
+        }
+
+        uint32_t status = __atomic_load_n(&bd->hdr.bh1.block_status,
+                                          __ATOMIC_ACQUIRE);
+        if (!(status & TP_STATUS_USER)) {
+            return 0;
+        }
+
+        r->held = 1;
+        r->left = bd->hdr.bh1.num_pkts;
+        r->frame = (const uint8_t*)bd + bd->hdr.bh1.offset_to_first_pkt;
+
+        if (r->left > 0) {
+            return r->left;
+        }
+    }
+}
+
+int loring_datagram(struct loring* r, const void** m, size_t* l,
+                    struct address* src, struct address* dst) {
+    if (!r->held || r->left == 0) {
+        return 0;
+    }
+
+    const struct tpacket3_hdr* h = (const struct tpacket3_hdr*)r->frame;
+    r->frame += h->tp_next_offset;
+    --r->left;
+
+    if (h->tp_snaplen != h->tp_len) {
+        return -1;
+    }
+
+    memset(src, 0, sizeof(*src));
+    memset(dst, 0, sizeof(*dst));
+
+    *l = h->tp_snaplen;
+    if (ip4_to_udp((const uint8_t*)h + h->tp_net, m, l, src, dst) == -1) {
+        return -1;
+    }
+
+    return 1;
+}
+
+int loring_stats(struct loring* r, struct loring_stats* st) {
+    // kernel counters are reset when read
+    struct tpacket_stats_v3 kst;
+    socklen_t len = sizeof(kst);
+    if (getsockopt(r->fd, SOL_PACKET, PACKET_STATISTICS, &kst, &len) == -1) {
+        return -1;
+    }
+
+    r->st.packets += kst.tp_packets;
+    r->st.drops += kst.tp_drops;
+    r->st.freezes += kst.tp_freeze_q_cnt;
+
+    *st = r->st;
+    return 0;
+}
+
+/*** LUA *********************************************************************/
+
+static int _close(lua_State* L) {
+    loring_free(luaW_ownptr(L, 1, MT));
+    return 0;
+}
+
+static int _get_fd(lua_State* L) {
+    struct loring* r = luaW_checkptr(L, 1, MT);
+    lua_pushinteger(L, r->fd);
+    return 1;
+}
+
+static int _new(lua_State* L) {
+    struct address* a = luaL_checkudata(L, 1, "address");
+    lua_Integer cidr = luaL_checkinteger(L, 2);
+    lua_Integer block_size = luaL_checkinteger(L, 3);
+    lua_Integer block_count = luaL_checkinteger(L, 4);
+
+    if (a->sa_family != AF_INET) {
+        luaL_error(L, "loopback subnet must be IPv4");
+    }
+
+    if (cidr < 0 || 32 < cidr) {
+        luaL_error(L, "bad cidr: %d", (int)cidr);
+    }
+
+    if (block_size <= 0 || UINT_MAX < block_size ||
+        block_count <= 0 || UINT_MAX < block_count) {
+        luaL_error(L, "bad ring size");
+    }
+
+    struct loring* r = loring_new(a->in4.sin_addr, cidr, block_size, block_count);
+    if (!r) {
+        luaL_error(L, "loring failed: %s", strerror(errno));
+    }
+
+    luaW_pushptr(L, MT, r);
+    return 1;
+}
+
+// wh.loring.recv(r) -> results, count
+//
+// Reads the next block of frames handed over by the kernel. results is a flat
+// list of source address, destination address and payload of each valid
+// datagram. count is the count of frames of the block, valid or not; if 0, no
+// block is available.
+static int _recv(lua_State* L) {
+    struct loring* r = luaW_checkptr(L, 1, MT);
+
+    int count = loring_recv(r);
+
+    lua_newtable(L);
+    lua_Integer n = 0;
+
+    for (;;) {
+        const void* m;
+        size_t l;
+        struct address src, dst;
+        int ret = loring_datagram(r, &m, &l, &src, &dst);
+
+        if (ret == 0) {
+            break;
+        }
+
+        if (ret == -1) {
+            continue;
+        }
+
+        memcpy(luaW_newaddress(L), &src, sizeof(src));
+        lua_rawseti(L, -2, ++n);
+        memcpy(luaW_newaddress(L), &dst, sizeof(dst));
+        lua_rawseti(L, -2, ++n);
+        lua_pushlstring(L, m, l);
+        lua_rawseti(L, -2, ++n);
+    }
+
+    lua_pushinteger(L, count);
+    return 2;
+}
+
+static int _stats(lua_State* L) {
+    struct loring* r = luaW_checkptr(L, 1, MT);
+    struct loring_stats st;
+
+    if (loring_stats(r, &st) == -1) {
+        luaL_error(L, "getsockopt() failed: %s", strerror(errno));
+    }
+
+    lua_newtable(L);
+    lua_pushinteger(L, st.packets);
+    lua_setfield(L, -2, "packets");
+    lua_pushinteger(L, st.drops);
+    lua_setfield(L, -2, "drops");
+    lua_pushinteger(L, st.freezes);
+    lua_setfield(L, -2, "freezes");
+
+    return 1;
+}
+
+static const luaL_Reg funcs[] = {
+    {"close", _close},
+    {"get_fd", _get_fd},
+    {"new", _new},
+    {"recv", _recv},
+    {"stats", _stats},
+    {NULL, NULL},
+};
+
+LUAMOD_API int luaopen_loring(lua_State* L) {
+    luaL_checkversion(L);
+    luaL_newlib(L, funcs);
+
+    luaW_declptr(L, MT, (void(*)(void*))loring_free);
+
+    return 1;
+}
+
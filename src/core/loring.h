@@ -0,0 +1,49 @@
+#ifndef WIREHUB_LORING_H
+#define WIREHUB_LORING_H
+
+#include "net.h"
+
+/** Native capture of WireGuard datagrams sent to loopback tunnels.
+ *
+ * Alternative to libpcap for the loopback sniffer. An AF_PACKET socket bound to
+ * the loopback interface maps a TPACKET_V3 ring of `block_count` blocks of
+ * `block_size` bytes. A classic BPF filter only accepts IPv4 WireGuard
+ * datagrams whose destination is in the tunnels' subnet, and drops the
+ * outgoing copy of looped-back packets.
+ *
+ * The kernel fills blocks with several frames, and hands a block over once it
+ * is full or after WH_LORING_RETIRE_MS. Frames are read in place, one whole
+ * block at a time.
+ */
+struct loring;
+
+struct loring_stats {
+    uint64_t packets;
+    uint64_t drops;
+    uint64_t freezes;
+};
+
+// `net` is the network address of the subnet, in network byte order.
+// `block_size` must be a multiple of the page size.
+struct loring* loring_new(struct in_addr net, unsigned int cidr,
+                          unsigned int block_size, unsigned int block_count);
+void loring_free(struct loring* r);
+
+int loring_fd(const struct loring* r);
+
+// returns the previous block to the kernel and holds the next one, if it was
+// handed over. returns the count of frames of the held block, or 0 if none
+// is available.
+int loring_recv(struct loring* r);
+
+// returns payload, source and destination addresses of the next frame of the
+// held block. returns 1 if a datagram was read, 0 if the block was entirely
+// read, -1 if the frame is not a valid IPv4 UDP datagram.
+int loring_datagram(struct loring* r, const void** m, size_t* l,
+                    struct address* src, struct address* dst);
+
+// returns the counters of the kernel since the ring was created
+int loring_stats(struct loring* r, struct loring_stats* st);
+
+#endif  // WIREHUB_LORING_H
+
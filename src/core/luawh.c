@@ -111,6 +111,17 @@ static int _address_addr(lua_State* L) {
     return 1;
 }
 
+// returns "ip4" or "ip6", as in wh.socket_raw_udp()
+static int _address_family(lua_State* L) {
+    struct address* a = luaL_checkudata(L, 1, "address");
+    switch (a->sa_family) {
+    case AF_INET:  lua_pushliteral(L, "ip4"); break;
+    case AF_INET6: lua_pushliteral(L, "ip6"); break;
+    default: return 0;
+    };
+    return 1;
+}
+
 static int _address_port(lua_State* L) {
     struct address* a = luaL_checkudata(L, 1, "address");
     lua_pushinteger(L, address_port(a));
@@ -210,27 +221,13 @@ static int _address_subnet_id(lua_State* L) {
 static int _address_pack(lua_State* L) {
     struct address* a = luaL_checkudata(L, 1, "address");
 
-    luaL_Buffer b;
-    luaL_buffinit(L, &b);
-
-    switch (a->sa_family) {
-    case AF_INET:
-        luaL_addstring(&b, "\x04");
-        luaL_addlstring(&b, (const void*)&a->in4.sin_addr, sizeof(a->in4.sin_addr));
-        luaL_addlstring(&b, (const void*)&a->in4.sin_port, sizeof(a->in4.sin_port));
-        break;
-
-    case AF_INET6:
-        luaL_addstring(&b, "\x06");
-        luaL_addlstring(&b, (const void*)&a->in6.sin6_addr, sizeof(a->in6.sin6_addr));
-        luaL_addlstring(&b, (const void*)&a->in6.sin6_port, sizeof(a->in6.sin6_port));
-        break;
-
-    default:
+    uint8_t b[ADDRESS_PACKBYTES];
+    size_t l = address_pack(a, b);
+    if (l == 0) {
         luaL_error(L, "bad address");
-    };
+    }
 
-    luaL_pushresult(&b);
+    lua_pushlstring(L, (const char*)b, l);
     return 1;
 }
 
@@ -252,6 +249,9 @@ struct address* luaW_newaddress(lua_State* L) {
         lua_pushcfunction(L, _address_addr);
         lua_setfield(L, -2, "addr");
 
+        lua_pushcfunction(L, _address_family);
+        lua_setfield(L, -2, "family");
+
         lua_pushcfunction(L, _address_port);
         lua_setfield(L, -2, "port");
 
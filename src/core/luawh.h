@@ -48,8 +48,18 @@ static inline uint16_t luaW_checkport(lua_State* L, int idx) {
 void luaW_pushfd(lua_State* L, int fd);
 int luaW_getfd(lua_State* L, int idx);
 
+LUAMOD_API int luaopen_admission(lua_State* L);
+LUAMOD_API int luaopen_datapath(lua_State* L);
+LUAMOD_API int luaopen_egress(lua_State* L);
+LUAMOD_API int luaopen_ingress(lua_State* L);
 LUAMOD_API int luaopen_ipc(lua_State* L);
 LUAMOD_API int luaopen_ipc_event(lua_State* L);
+LUAMOD_API int luaopen_kadtable(lua_State* L);
+LUAMOD_API int luaopen_loring(lua_State* L);
+LUAMOD_API int luaopen_poller(lua_State* L);
+LUAMOD_API int luaopen_ratelimit(lua_State* L);
+LUAMOD_API int luaopen_shards(lua_State* L);
+LUAMOD_API int luaopen_verifier(lua_State* L);
 LUAMOD_API int luaopen_wg(lua_State* L);
 LUAMOD_API int luaopen_whcore(lua_State* L);
 LUAMOD_API int luaopen_worker(lua_State* L);
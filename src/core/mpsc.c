@@ -0,0 +1,116 @@
+#include "mpsc.h"
+
+#define CACHELINE 64
+
+struct mpsc_slot {
+    uint64_t seq;
+    size_t len;
+    uint8_t data[];
+};
+
+struct mpsc {
+    uint64_t tail __attribute__((aligned(CACHELINE)));
+    uint64_t head __attribute__((aligned(CACHELINE)));
+
+    unsigned int mask;
+    size_t slot_size;
+    size_t stride;
+    uint8_t* slots;
+};
+
+static struct mpsc_slot* _slot(const struct mpsc* q, uint64_t pos) {
+    return (struct mpsc_slot*)(q->slots + (pos & q->mask)*q->stride);
+}
+
+struct mpsc* mpsc_new(unsigned int capacity, size_t slot_size) {
+    assert(capacity > 0 && (capacity & (capacity-1)) == 0);
+
+    struct mpsc* q = aligned_alloc(CACHELINE, sizeof(struct mpsc));
+    if (!q) {
+        return NULL;
+    }
+
+    memset(q, 0, sizeof(*q));
+    q->mask = capacity-1;
+    q->slot_size = slot_size;
+    q->stride = (sizeof(struct mpsc_slot) + slot_size + CACHELINE-1) & ~(size_t)(CACHELINE-1);
+
+    if (!(q->slots = aligned_alloc(CACHELINE, capacity*q->stride))) {
+        free(q);
+        return NULL;
+    }
+
+    // slot i is free for the producer reserving position i
+    for (unsigned int i=0; i<capacity; ++i) {
+        _slot(q, i)->seq = i;
+    }
+
+    return q;
+}
+
+void mpsc_free(struct mpsc* q) {
+    free(q->slots);
+    free(q);
+}
+
+int mpsc_push(struct mpsc* q, const struct iovec* iov, int iovcnt) {
+    size_t l = 0;
+    for (int i=0; i<iovcnt; ++i) {
+        l += iov[i].iov_len;
+    }
+
+    if (l > q->slot_size) {
+        return -1;
+    }
+
+    uint64_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    struct mpsc_slot* s;
+
+    for (;;) {
+        s = _slot(q, pos);
+        uint64_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)(seq - pos);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->tail, &pos, pos+1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // slot was not released by the consumer yet
+            return -1;
+        } else {
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    uint8_t* d = s->data;
+    for (int i=0; i<iovcnt; ++i) {
+        memcpy(d, iov[i].iov_base, iov[i].iov_len);
+        d += iov[i].iov_len;
+    }
+    s->len = l;
+
+    __atomic_store_n(&s->seq, pos+1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+const void* mpsc_front(struct mpsc* q, size_t* l) {
+    struct mpsc_slot* s = _slot(q, q->head);
+
+    if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != q->head+1) {
+        return NULL;
+    }
+
+    *l = s->len;
+    return s->data;
+}
+
+void mpsc_pop(struct mpsc* q) {
+    struct mpsc_slot* s = _slot(q, q->head);
+
+    assert(s->seq == q->head+1);
+    __atomic_store_n(&s->seq, q->head+q->mask+1, __ATOMIC_RELEASE);
+    ++q->head;
+}
+
@@ -0,0 +1,33 @@
+#ifndef WIREHUB_MPSC_H
+#define WIREHUB_MPSC_H
+
+#include "common.h"
+#include <sys/uio.h>
+
+/** Bounded lock-free multi-producer single-consumer queue of messages.
+ *
+ * Messages are copied in a ring of `capacity` slots of `slot_size` bytes.
+ * Producers reserve a slot by advancing the tail with a compare-and-swap, then
+ * publish it by setting its sequence number. The consumer reads slots in place
+ * and releases them in order.
+ */
+struct mpsc;
+
+// capacity must be a power of two
+struct mpsc* mpsc_new(unsigned int capacity, size_t slot_size);
+void mpsc_free(struct mpsc* q);
+
+// copies the concatenation of `iovcnt` buffers in a new message. May be called
+// from any thread. returns -1 if the queue is full or the message is too long.
+int mpsc_push(struct mpsc* q, const struct iovec* iov, int iovcnt);
+
+// returns the oldest message and sets its size `l`, or returns NULL if the
+// queue is empty. The message is valid until mpsc_pop(). Only one thread may
+// consume the queue.
+const void* mpsc_front(struct mpsc* q, size_t* l);
+
+// releases the oldest message
+void mpsc_pop(struct mpsc* q);
+
+#endif  // WIREHUB_MPSC_H
+
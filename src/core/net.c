@@ -100,6 +100,58 @@ socklen_t address_len(const struct address* a) {
     };
 }
 
+size_t address_pack(const struct address* a, uint8_t* out) {
+    switch (a->sa_family) {
+    case AF_INET:
+        out[0] = 0x04;
+        memcpy(out+1, &a->in4.sin_addr, 4);
+        memcpy(out+1+4, &a->in4.sin_port, 2);
+        return 1+4+2;
+
+    case AF_INET6:
+        out[0] = 0x06;
+        memcpy(out+1, &a->in6.sin6_addr, 16);
+        memcpy(out+1+16, &a->in6.sin6_port, 2);
+        return 1+16+2;
+
+    default:
+        return 0;
+    };
+}
+
+size_t address_unpack(struct address* a, const uint8_t* b, size_t l) {
+    memset(a, 0, sizeof(*a));
+
+    if (l < 1) {
+        return 0;
+    }
+
+    switch (b[0]) {
+    case 0x04:
+        if (l < 1+4+2) {
+            return 0;
+        }
+
+        a->sa_family = a->in4.sin_family = AF_INET;
+        memcpy(&a->in4.sin_addr, b+1, 4);
+        memcpy(&a->in4.sin_port, b+1+4, 2);
+        return 1+4+2;
+
+    case 0x06:
+        if (l < 1+16+2) {
+            return 0;
+        }
+
+        a->sa_family = a->in6.sin6_family = AF_INET6;
+        memcpy(&a->in6.sin6_addr, b+1, 16);
+        memcpy(&a->in6.sin6_port, b+1+16, 2);
+        return 1+16+2;
+
+    default:
+        return 0;
+    };
+}
+
 const char* format_address(const struct address* a, char* s, size_t sl) {
     assert(s);
     assert(a);
@@ -178,7 +230,7 @@ int socket_udp(const struct address* a) {
     return s;
 }
 
-int socket_raw_udp(sa_family_t sa_family, int hdrincl) {
+int socket_raw_udp(sa_family_t sa_family, int hdrincl, int dontfrag) {
     int s = socket(sa_family, SOCK_RAW, IPPROTO_UDP);
     if (s == -1) {
         return -1;
@@ -197,6 +249,27 @@ int socket_raw_udp(sa_family_t sa_family, int hdrincl) {
         }
     }
 
+    // datagrams are sent with DF, whatever the cached path MTU, so that routers
+    // drop those which do not fit instead of the kernel fragmenting them
+    if (dontfrag) {
+        int r;
+        if (sa_family == AF_INET6) {
+            int on = 1, probe = IPV6_PMTUDISC_PROBE;
+            r = setsockopt(s, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &probe, sizeof(probe));
+            if (r == 0) {
+                r = setsockopt(s, IPPROTO_IPV6, IPV6_DONTFRAG, &on, sizeof(on));
+            }
+        } else {
+            int probe = IP_PMTUDISC_PROBE;
+            r = setsockopt(s, IPPROTO_IP, IP_MTU_DISCOVER, &probe, sizeof(probe));
+        }
+
+        if (r < 0) {
+            close(s);
+            return -1;
+        }
+    }
+
     return s;
 }
 
@@ -316,3 +389,82 @@ uint16_t checksum_ip(const void* buf_, int count) {
     return answer;
 }
 
+ssize_t sendto_raw_udp(int fd, const struct iovec* iov, int iovcnt,
+                       uint16_t src_port, const struct address* dst) {
+    struct iovec iovs[1+iovcnt];
+    struct udphdr udp;
+    size_t l = 0;
+
+    for (int i=0; i<iovcnt; ++i) {
+        iovs[1+i] = iov[i];
+        l += iov[i].iov_len;
+    }
+
+    udp.uh_sport = htons(src_port);
+    udp.uh_dport = htons(address_port(dst));
+    udp.uh_ulen = htons(UDP_HDRLEN+l);
+    udp.uh_sum = 0x0000;
+
+    iovs[0].iov_base = &udp;
+    iovs[0].iov_len = UDP_HDRLEN;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = (void*)&dst->in;
+    msg.msg_namelen = address_len(dst);
+    msg.msg_iov = iovs;
+    msg.msg_iovlen = 1+iovcnt;
+
+    return sendmsg(fd, &msg, 0);
+}
+
+ssize_t sendto_raw_wg(int fd4, const struct iovec* iov, int iovcnt,
+                      const struct address* src_addr, uint16_t wg_port) {
+    struct iovec iovs[1+iovcnt];
+    uint8_t hdr[IP4_HDRLEN+UDP_HDRLEN];
+    size_t l = 0;
+
+    for (int i=0; i<iovcnt; ++i) {
+        iovs[1+i] = iov[i];
+        l += iov[i].iov_len;
+    }
+
+    struct sockaddr_in dst_addr;
+    memset(&dst_addr, 0, sizeof(dst_addr));
+    dst_addr.sin_family = AF_INET;
+    dst_addr.sin_addr.s_addr = htonl(0x7f000001);
+    dst_addr.sin_port = htons(wg_port);
+
+    struct ip* ip = (struct ip*)hdr;
+    memset(ip, 0, sizeof(struct ip));
+    ip->ip_hl = IP4_HDRLEN/sizeof(uint32_t);
+    ip->ip_v = 4;
+    ip->ip_tos = 0;
+    ip->ip_len = htons(IP4_HDRLEN+UDP_HDRLEN+l);
+    ip->ip_id = 0;
+    ip->ip_off = 0;
+    ip->ip_ttl = 255;
+    ip->ip_p = IPPROTO_UDP;
+    memcpy(&ip->ip_src, &src_addr->in4.sin_addr, 4);
+    memcpy(&ip->ip_dst, &dst_addr.sin_addr, 4);
+    ip->ip_sum = 0;
+    ip->ip_sum = checksum_ip(ip, IP4_HDRLEN);
+
+    struct udphdr* udp = (struct udphdr*)(hdr+IP4_HDRLEN);
+    udp->uh_sport = htons(address_port(src_addr));
+    udp->uh_dport = dst_addr.sin_port;
+    udp->uh_ulen = htons(UDP_HDRLEN+l);
+    udp->uh_sum = 0x0000;
+
+    iovs[0].iov_base = hdr;
+    iovs[0].iov_len = sizeof(hdr);
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &dst_addr;
+    msg.msg_namelen = sizeof(dst_addr);
+    msg.msg_iov = iovs;
+    msg.msg_iovlen = 1+iovcnt;
+
+    return sendmsg(fd4, &msg, 0);
+}
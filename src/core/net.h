@@ -6,12 +6,16 @@
 #include <netdb.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <pcap.h>
 
 #define IP4_HDRLEN 20
 #define UDP_HDRLEN 8
 
+// maximum size of a packed address
+#define ADDRESS_PACKBYTES (1+16+2)
+
 struct address {
     int sa_family;
     union {
@@ -33,10 +37,26 @@ int parse_address(struct address* a, const char* endpoint, uint16_t port, int nu
 const char* format_address(const struct address* a, char* s, size_t sl);
 int address_from_sockaddr(struct address* out, const struct sockaddr* in);
 socklen_t address_len(const struct address* a);
+// packs address in `out`, which must be ADDRESS_PACKBYTES long. returns the
+// packed size, or 0 if the address is invalid
+size_t address_pack(const struct address* a, uint8_t* out);
+// unpacks address from `l` bytes. returns the packed size, or 0 if invalid
+size_t address_unpack(struct address* a, const uint8_t* b, size_t l);
 void orchid(struct address* a, const void* cid, size_t cid_sz, const void* m, size_t l, uint16_t port);
 
 int socket_udp(const struct address* a);
-int socket_raw_udp(sa_family_t sa_family, int hdrincl);
+// opens a raw UDP socket. If `dontfrag` is set, datagrams are sent with DF and
+// are never fragmented by the host.
+int socket_raw_udp(sa_family_t sa_family, int hdrincl, int dontfrag);
+// sends a UDP datagram made of `iovcnt` buffers from port `src_port` to `dst`,
+// through the raw socket of its family. `iovcnt` is lower than UIO_MAXIOV.
+ssize_t sendto_raw_udp(int fd, const struct iovec* iov, int iovcnt,
+                       uint16_t src_port, const struct address* dst);
+// sends a UDP datagram made of `iovcnt` buffers from address `src_addr` to the
+// local WireGuard port, through a raw IPv4 socket opened with IP_HDRINCL.
+// `iovcnt` is lower than UIO_MAXIOV.
+ssize_t sendto_raw_wg(int fd4, const struct iovec* iov, int iovcnt,
+                      const struct address* src_addr, uint16_t wg_port);
 int ip4_to_udp(const void* d, const void** pdata, size_t* psize, struct address* src, struct address* dst);
 
 enum sniff_proto {
@@ -5,3 +5,8 @@ uint64_t now_seconds(void) {
     return time(NULL);
 }
 
+uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
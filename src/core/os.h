@@ -2,6 +2,8 @@
 #define WIREHUB_OS_H
 
 uint64_t now_seconds(void);
+// monotonic clock, in milliseconds
+uint64_t now_ms(void);
 
 #endif  // WIREHUB_OS_H
 
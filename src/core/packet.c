@@ -1,21 +1,45 @@
 #include "packet.h"
+#include "os.h"
+
+static int _auth(uint8_t* p, size_t l, const uint8_t* k) {
+    crypto_auth_hmacsha512256(packet_mac(p, l), p, packet_mac(p, l)-p, k);
+    return 0;
+}
+
+static int _verify(const uint8_t* p, size_t l, const uint8_t* k) {
+    return crypto_auth_hmacsha512256_verify(packet_mac(p, l), p, packet_mac(p, l)-p, k);
+}
+
+void packet_init(uint8_t* p, const uint8_t* src_pk, int is_nated) {
+    uint64_t flags_time_b = 0;
+    flags_time_b |= (htobe64(now_seconds()) & packet_flags_TIMEMASK) << packet_flags_TIMESHIFT;
+    flags_time_b |= ((uint64_t)(is_nated ? 1 : 0) & packet_flags_DIRECTMASK) << packet_flags_DIRECTSHIFT;
+
+    memcpy(packet_hdr(p), wh_pkt_hdr, sizeof(wh_pkt_hdr));
+    memcpy(packet_src(p), src_pk, crypto_scalarmult_curve25519_BYTES);
+    memcpy(packet_flags_time(p), &flags_time_b, sizeof(flags_time_b));
+}
+
+int auth_packet(struct keycache* kc, uint8_t* p, size_t l, const uint8_t* sk, const uint8_t* pk) {
+    if (kc) {
+        const uint8_t* k = keycache_shared(kc, sk, pk);
+        return k ? _auth(p, l, k) : -1;
+    }
 
-int auth_packet(uint8_t* p, size_t l, const uint8_t* sk, const uint8_t* pk) {
     uint8_t k[crypto_scalarmult_curve25519_SCALARBYTES];
     sodium_mlock(k, sizeof(k));
 
-    if (crypto_scalarmult_curve25519(k, sk, pk) != 0) {
-        return -1;
+    int r = -1;
+    if (crypto_scalarmult_curve25519(k, sk, pk) == 0) {
+        r = _auth(p, l, k);
     }
 
-    crypto_auth_hmacsha512256(packet_mac(p, l), p, packet_mac(p, l)-p, k);
-
     sodium_munlock(k, sizeof(k));
 
-    return 0;
+    return r;
 }
 
-int verify_packet(const uint8_t* p, size_t pl, const uint8_t* sk) {
+int verify_packet(struct keycache* kc, const uint8_t* p, size_t pl, const uint8_t* sk) {
     if (pl<packet_size(0)) {
         return -1;
     }
@@ -26,15 +50,65 @@ int verify_packet(const uint8_t* p, size_t pl, const uint8_t* sk) {
 
     size_t l = pl-packet_size(0);
 
+    if (kc) {
+        const uint8_t* k = keycache_shared(kc, sk, packet_src(p));
+        return k ? _verify(p, l, k) : -1;
+    }
+
     uint8_t k[crypto_scalarmult_curve25519_SCALARBYTES];
     sodium_mlock(k, sizeof(k));
-    if (crypto_scalarmult_curve25519(k, sk, packet_src(p))) {
-        return -1;
+
+    int r = -1;
+    if (crypto_scalarmult_curve25519(k, sk, packet_src(p)) == 0) {
+        r = _verify(p, l, k);
     }
 
-    int r = crypto_auth_hmacsha512256_verify(packet_mac(p, l), p, packet_mac(p, l)-p, k);
     sodium_munlock(k, sizeof(k));
 
     return r;
 }
 
+
+int session_key(struct keycache* kc, const uint8_t* sk, const uint8_t* pk,
+                uint32_t id, uint8_t* key) {
+    static const char ctx[] = "wirehub relay session";
+
+    const uint8_t* k = keycache_shared(kc, sk, pk);
+    if (!k) {
+        return -1;
+    }
+
+    uint8_t m[sizeof(ctx)-1+4];
+    uint32_t id_b = htobe32(id);
+    memcpy(m, ctx, sizeof(ctx)-1);
+    memcpy(m+sizeof(ctx)-1, &id_b, sizeof(id_b));
+
+    return crypto_generichash(key, SESSION_KEYBYTES, m, sizeof(m),
+                              k, crypto_scalarmult_curve25519_BYTES);
+}
+
+static void _session_tag(const uint8_t* p, size_t l, const uint8_t* key, uint8_t* tag) {
+    crypto_generichash_state st;
+    crypto_generichash_init(&st, key, SESSION_KEYBYTES, SESSION_TAGBYTES);
+    crypto_generichash_update(&st, session_hdr(p), session_tag(p)-session_hdr(p));
+    crypto_generichash_update(&st, session_body(p), l);
+    crypto_generichash_final(&st, tag, SESSION_TAGBYTES);
+}
+
+void session_auth(uint8_t* p, uint32_t id, size_t l, const uint8_t* key) {
+    uint32_t id_b = htobe32(id);
+    memcpy(session_hdr(p), wh_session_hdr, sizeof(wh_session_hdr));
+    memcpy(session_id(p), &id_b, sizeof(id_b));
+    _session_tag(p, l, key, session_tag(p));
+}
+
+int session_verify(const uint8_t* p, size_t pl, const uint8_t* key) {
+    if (pl < session_size(0) ||
+        memcmp(session_hdr(p), wh_session_hdr, sizeof(wh_session_hdr)) != 0) {
+        return -1;
+    }
+
+    uint8_t tag[SESSION_TAGBYTES];
+    _session_tag(p, pl-session_size(0), key, tag);
+    return crypto_verify_16(tag, session_tag(p));
+}
@@ -2,6 +2,7 @@
 #define WIREHUB_PACKET_H
 
 #include "common.h"
+#include "keycache.h"
 
 #include <sodium.h>
 
@@ -10,6 +11,20 @@
 #define packet_flags_DIRECTMASK     0x1
 #define packet_flags_DIRECTSHIFT    63
 
+// commands, as in src/packet.lua
+#define packet_cmd_PING     0
+#define packet_cmd_PONG     1
+#define packet_cmd_SEARCH   2
+#define packet_cmd_RESULT   3
+#define packet_cmd_RELAY    4
+#define packet_cmd_RELAYED  5
+#define packet_cmd_AUTH     6
+#define packet_cmd_AUTHED   7
+#define packet_cmd_FRAGMENT 8
+#define packet_cmd_BIND     9
+#define packet_cmd_BOUND    10
+#define packet_cmd_DATA     11
+
 #define packet_hdr(p)   (p+0)
 #define packet_src(p)   (packet_hdr(p)+4)
 #define packet_flags_time(p)  (packet_src(p)+crypto_scalarmult_curve25519_BYTES)
@@ -27,8 +42,38 @@ static inline size_t packet_size(size_t l) {
     );
 }
 
-int auth_packet(uint8_t* p, size_t l, const uint8_t* sk, const uint8_t* pk);
-int verify_packet(const uint8_t* p, size_t pl, const uint8_t* sk);
+/** Session packets.
+ *
+ * Messages sent through a relay session are not wrapped in WireHub packets. They
+ * only carry the id of the session and a tag keyed by the session's key.
+ */
+#define SESSION_KEYBYTES    32
+#define SESSION_TAGBYTES    crypto_generichash_BYTES_MIN
+
+#define session_hdr(p)  (p+0)
+#define session_id(p)   (session_hdr(p)+4)
+#define session_tag(p)  (session_id(p)+4)
+#define session_body(p) (session_tag(p)+SESSION_TAGBYTES)
+
+static inline size_t session_size(size_t l) {
+    return 4 + 4 + SESSION_TAGBYTES + l;
+}
+
+// writes header, source key and flags of packet p, timestamped now
+void packet_init(uint8_t* p, const uint8_t* src_pk, int is_nated);
+
+// if `kc` is not NULL, the shared key is looked up in and stored into the cache
+int auth_packet(struct keycache* kc, uint8_t* p, size_t l, const uint8_t* sk, const uint8_t* pk);
+int verify_packet(struct keycache* kc, const uint8_t* p, size_t pl, const uint8_t* sk);
+
+// derives the key of relay session `id`, from the key shared between `sk` and
+// `pk`
+int session_key(struct keycache* kc, const uint8_t* sk, const uint8_t* pk,
+                uint32_t id, uint8_t* key);
+
+// writes header, id and tag of session packet p, whose body is l bytes long
+void session_auth(uint8_t* p, uint32_t id, size_t l, const uint8_t* key);
+int session_verify(const uint8_t* p, size_t pl, const uint8_t* key);
 
 #endif  // PACKET_H
 
@@ -45,6 +45,10 @@ pcap_t* sniff(const char* interface, pcap_direction_t direction, enum sniff_prot
 
     // XXX COMPILER ASSERT
     assert(sizeof(wh_pkt_hdr)==4);
+    // all WireHub headers (see common.h) match once masked
+    assert(memcmp(wh_pkt_hdr+1, wh_session_hdr+1, 3) == 0);
+    assert(memcmp(wh_pkt_hdr+1, wh_cookie_hdr+1, 3) == 0);
+    assert(memcmp(wh_pkt_hdr+1, wh_cookie_reply_hdr+1, 3) == 0);
 
     char filter_exp[256];
     switch (proto) {
@@ -60,8 +64,8 @@ pcap_t* sniff(const char* interface, pcap_direction_t direction, enum sniff_prot
 
     case SNIFF_PROTO_WH:
         snprintf(filter_exp, sizeof(filter_exp),
-            "udp and udp[8]==%d and udp[9]==%d and udp[10]==%d and udp[11]==%d%s",
-            (int)wh_pkt_hdr[0],
+            "udp and udp[8] & 0xfc == %d and udp[9]==%d and udp[10]==%d and udp[11]==%d%s",
+            (int)wh_pkt_hdr[0] & 0xfc,
             (int)wh_pkt_hdr[1],
             (int)wh_pkt_hdr[2],
             (int)wh_pkt_hdr[3],
@@ -0,0 +1,168 @@
+#include "luawh.h"
+#include <sys/epoll.h>
+
+#define MT  "poller"
+
+/** Persistent I/O event poller, backed by epoll.
+ *
+ * Unlike wh.select, file descriptors are registered once and stay registered
+ * until they are unregistered.
+ */
+
+struct poller {
+    int epfd;
+    int count;
+    int max_events;
+    struct epoll_event* events;
+};
+
+static void delete_poller(struct poller* p) {
+    if (p->epfd != -1) { close(p->epfd), p->epfd = -1; }
+    if (p->events) { free(p->events), p->events = NULL; }
+
+    free(p);
+}
+
+static void delete_poller_pvoid(void* p) {
+    return delete_poller((struct poller*)p);
+}
+
+static int _tostring(lua_State* L) {
+    struct poller* p = luaW_toptr(L, 1, MT);
+
+    if (p) {
+        lua_pushfstring(L, "poller* (%d fds): %p", p->count, p);
+    } else {
+        lua_pushstring(L, "poller*: <dangling>");
+    }
+
+    return 1;
+}
+
+int luawh_pushpoller(lua_State* L) {
+    struct poller* p = calloc(1, sizeof(struct poller));
+    assert(p);
+
+    p->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (p->epfd == -1) {
+        delete_poller(p);
+        luaL_error(L, "epoll_create1() failed: %s", strerror(errno));
+    }
+
+    luaW_pushptr(L, MT, p);
+    return 1;
+}
+
+static uint32_t _checkmode(lua_State* L, int idx) {
+    static const char* const modes[] = {"level", "edge", NULL};
+
+    switch (luaL_checkoption(L, idx, "level", modes)) {
+    case 0: return EPOLLIN;
+    case 1: return EPOLLIN | EPOLLET;
+    default: assert(0); return 0;
+    };
+}
+
+static int _register(lua_State* L) {
+    struct poller* p = luaW_checkptr(L, 1, MT);
+    int fd = luaL_checkinteger(L, 2);
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = _checkmode(L, 3);
+    ev.data.fd = fd;
+
+    if (epoll_ctl(p->epfd, EPOLL_CTL_ADD, fd, &ev) == 0) {
+        ++p->count;
+    } else if (errno != EEXIST || epoll_ctl(p->epfd, EPOLL_CTL_MOD, fd, &ev) != 0) {
+        luaL_error(L, "epoll_ctl() failed: %s", strerror(errno));
+    }
+
+    return 0;
+}
+
+static int _unregister(lua_State* L) {
+    struct poller* p = luaW_checkptr(L, 1, MT);
+    int fd = luaL_checkinteger(L, 2);
+
+    if (epoll_ctl(p->epfd, EPOLL_CTL_DEL, fd, NULL) == 0) {
+        --p->count;
+    } else if (errno != ENOENT && errno != EBADF) {
+        luaL_error(L, "epoll_ctl() failed: %s", strerror(errno));
+    }
+
+    return 0;
+}
+
+static int _count(lua_State* L) {
+    struct poller* p = luaW_checkptr(L, 1, MT);
+    lua_pushinteger(L, p->count);
+    return 1;
+}
+
+// returns a set of readable file descriptors, {[fd]=true}
+static int _wait(lua_State* L) {
+    struct poller* p = luaW_checkptr(L, 1, MT);
+
+    int timeout = -1;
+    if (!lua_isnoneornil(L, 2)) {
+        lua_Number timeout_s = luaL_checknumber(L, 2);
+        // round up to the next millisecond to not wake up before deadline
+        timeout = timeout_s > 0 ? (int)(timeout_s * 1000 + .999) : 0;
+    }
+
+    int max_events = p->count > 0 ? p->count : 1;
+    if (max_events > p->max_events) {
+        struct epoll_event* events = realloc(p->events, max_events*sizeof(struct epoll_event));
+        if (!events) {
+            luaL_error(L, "out of memory");
+        }
+
+        p->events = events;
+        p->max_events = max_events;
+    }
+
+    int r = epoll_wait(p->epfd, p->events, max_events, timeout);
+    if (r == -1) {
+        luaL_error(L, "epoll_wait(): %s", strerror(errno));
+    }
+
+    lua_createtable(L, 0, r);
+    for (int i=0; i<r; ++i) {
+        lua_pushboolean(L, 1);
+        lua_rawseti(L, -2, p->events[i].data.fd);
+    }
+
+    return 1;
+}
+
+LUAMOD_API int luaopen_poller(lua_State* L) {
+    luaW_declptr(L, MT, delete_poller_pvoid);
+
+    luaL_getmetatable(L, MT);
+    lua_getfield(L, -1, "__index");
+
+    lua_pushcfunction(L, _count);
+    lua_setfield(L, -2, "count");
+
+    lua_pushcfunction(L, _register);
+    lua_setfield(L, -2, "register");
+
+    lua_pushcfunction(L, _unregister);
+    lua_setfield(L, -2, "unregister");
+
+    lua_pushcfunction(L, _wait);
+    lua_setfield(L, -2, "wait");
+
+    lua_pop(L, 1);
+
+    lua_pushcfunction(L, _tostring);
+    lua_setfield(L, -2, "__tostring");
+
+    lua_pop(L, 1);
+
+    lua_pushcfunction(L, luawh_pushpoller);
+
+    return 1;
+}
+
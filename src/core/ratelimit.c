@@ -0,0 +1,287 @@
+#include "ratelimit.h"
+#include "luawh.h"
+#include "os.h"
+#include <sodium.h>
+
+#define MT "ratelimit"
+
+#define WAYS        4
+#define SETS        (WH_RATELIMIT_BUCKETS/WAYS)     // power of two
+#define BURST_MS    1000
+
+// tokens are counted in thousandths, so that they are refilled every
+// millisecond by the budget per second
+#define UNIT        1000
+
+enum { SOURCE_KEY, SOURCE_IP };
+
+struct bucket {
+    uint64_t id;            // hash of (command, source). 0 if unused
+    uint64_t last;
+    uint64_t packets;
+    uint64_t bytes;
+};
+
+struct budget {
+    uint32_t pps;
+    uint32_t bps;
+};
+
+struct ratelimit {
+    uint8_t hash_k[crypto_shorthash_KEYBYTES];
+
+    struct budget budgets[RATELIMIT_COMMANDS];
+    struct ratelimit_stats st[RATELIMIT_COMMANDS];
+
+    struct bucket buckets[SETS][WAYS];
+};
+
+struct ratelimit* ratelimit_new(void) {
+    assert((SETS & (SETS-1)) == 0);
+
+    struct ratelimit* rl = calloc(1, sizeof(struct ratelimit));
+    if (!rl) {
+        return NULL;
+    }
+
+    randombytes_buf(rl->hash_k, sizeof(rl->hash_k));
+    return rl;
+}
+
+void ratelimit_free(struct ratelimit* rl) {
+    free(rl);
+}
+
+struct ratelimit* ratelimit_clone(const struct ratelimit* rl) {
+    struct ratelimit* c = ratelimit_new();
+    if (!c) {
+        return NULL;
+    }
+
+    memcpy(c->budgets, rl->budgets, sizeof(c->budgets));
+    return c;
+}
+
+void ratelimit_set(struct ratelimit* rl, uint8_t cmd, uint32_t pps, uint32_t bps) {
+    rl->budgets[cmd].pps = pps;
+    rl->budgets[cmd].bps = bps;
+}
+
+static uint64_t _id(const struct ratelimit* rl, uint8_t cmd, int source,
+                    const void* x, size_t l) {
+    uint8_t m[2+crypto_scalarmult_curve25519_BYTES];
+    assert(l <= sizeof(m)-2);
+    m[0] = cmd;
+    m[1] = source;
+    memcpy(m+2, x, l);
+
+    uint64_t id;
+    crypto_shorthash((uint8_t*)&id, m, 2+l, rl->hash_k);
+    return id ? id : 1;
+}
+
+// returns the bucket `id`, refilled at `now`
+static struct bucket* _bucket(struct ratelimit* rl, const struct budget* b,
+                              uint64_t id, uint64_t now) {
+    struct bucket* set = rl->buckets[id & (SETS-1)];
+    struct bucket* e = NULL;
+
+    for (int i=0; i<WAYS; ++i) {
+        if (set[i].id == id) {
+            e = &set[i];
+            break;
+        }
+
+        if (!e || set[i].last < e->last) {
+            e = &set[i];
+        }
+    }
+
+    if (e->id != id) {
+        e->id = id;
+        e->last = now;
+        e->packets = (uint64_t)b->pps * BURST_MS;
+        e->bytes = (uint64_t)b->bps * BURST_MS;
+        return e;
+    }
+
+    uint64_t elapsed = now > e->last ? now - e->last : 0;
+    if (elapsed > BURST_MS) {
+        elapsed = BURST_MS;
+    }
+
+    e->last = now;
+    e->packets += elapsed * b->pps;
+    if (e->packets > (uint64_t)b->pps * BURST_MS) {
+        e->packets = (uint64_t)b->pps * BURST_MS;
+    }
+
+    e->bytes += elapsed * b->bps;
+    if (e->bytes > (uint64_t)b->bps * BURST_MS) {
+        e->bytes = (uint64_t)b->bps * BURST_MS;
+    }
+
+    return e;
+}
+
+static int _has_tokens(const struct budget* b, const struct bucket* e, size_t sz) {
+    return (!b->pps || e->packets >= UNIT) && (!b->bps || e->bytes >= sz*UNIT);
+}
+
+static void _consume(const struct budget* b, struct bucket* e, size_t sz) {
+    if (b->pps) {
+        e->packets -= UNIT;
+    }
+
+    if (b->bps) {
+        e->bytes -= sz*UNIT;
+    }
+}
+
+int ratelimit_check(struct ratelimit* rl, uint8_t cmd, const struct address* src,
+                    size_t sz, uint64_t now) {
+    const struct budget* b = &rl->budgets[cmd];
+    struct ratelimit_stats* st = &rl->st[cmd];
+
+    if (!b->pps && !b->bps) {
+        return 1;
+    }
+
+    struct bucket* ip = NULL;
+    switch (src->sa_family) {
+    case AF_INET:
+        ip = _bucket(rl, b, _id(rl, cmd, SOURCE_IP, &src->in4.sin_addr, 4), now);
+        break;
+    case AF_INET6:
+        ip = _bucket(rl, b, _id(rl, cmd, SOURCE_IP, &src->in6.sin6_addr, 16), now);
+        break;
+    };
+
+    if (ip) {
+        if (!_has_tokens(b, ip, sz)) {
+            ++st->dropped_ip;
+            return 0;
+        }
+
+        _consume(b, ip, sz);
+    }
+
+    ++st->passed;
+    return 1;
+}
+
+int ratelimit_check_key(struct ratelimit* rl, uint8_t cmd, const uint8_t* k,
+                        size_t sz, uint64_t now) {
+    const struct budget* b = &rl->budgets[cmd];
+    struct ratelimit_stats* st = &rl->st[cmd];
+
+    if (!b->pps && !b->bps) {
+        return 1;
+    }
+
+    struct bucket* key = _bucket(rl, b, _id(rl, cmd, SOURCE_KEY, k, crypto_scalarmult_curve25519_BYTES), now);
+
+    if (!_has_tokens(b, key, sz)) {
+        // the packet was counted as passed by its IP address
+        --st->passed;
+        ++st->dropped_key;
+        return 0;
+    }
+
+    _consume(b, key, sz);
+    return 1;
+}
+
+int ratelimit_stats(const struct ratelimit* rl, uint8_t cmd, struct ratelimit_stats* st) {
+    const struct budget* b = &rl->budgets[cmd];
+
+    if (!b->pps && !b->bps) {
+        return 0;
+    }
+
+    *st = rl->st[cmd];
+    return 1;
+}
+
+/*** LUA *********************************************************************/
+
+static void _delete(void* ud) {
+    ratelimit_free(ud);
+}
+
+static int _close(lua_State* L) {
+    _delete(luaW_ownptr(L, 1, MT));
+    return 0;
+}
+
+static int _new(lua_State* L) {
+    struct ratelimit* rl = ratelimit_new();
+    if (!rl) {
+        luaL_error(L, "out of memory");
+    }
+
+    luaW_pushptr(L, MT, rl);
+    return 1;
+}
+
+static uint8_t _checkcmd(lua_State* L, int idx) {
+    lua_Integer cmd = luaL_checkinteger(L, idx);
+    luaL_argcheck(L, 0 <= cmd && cmd < RATELIMIT_COMMANDS, idx, "bad command");
+    return cmd;
+}
+
+static uint32_t _checkbudget(lua_State* L, int idx) {
+    lua_Integer v = luaL_optinteger(L, idx, 0);
+    luaL_argcheck(L, 0 <= v && v <= UINT32_MAX, idx, "bad budget");
+    return v;
+}
+
+// set(rl, cmd, pps, bps) sets the budget of command cmd, in packets and in
+// bytes per second. nil or 0 means unlimited.
+static int _set(lua_State* L) {
+    struct ratelimit* rl = luaW_checkptr(L, 1, MT);
+    uint8_t cmd = _checkcmd(L, 2);
+    uint32_t pps = _checkbudget(L, 3);
+    uint32_t bps = _checkbudget(L, 4);
+
+    ratelimit_set(rl, cmd, pps, bps);
+    return 0;
+}
+
+// stats(rl, cmd) -> stats, or nil if command cmd is not limited
+static int _stats(lua_State* L) {
+    struct ratelimit* rl = luaW_checkptr(L, 1, MT);
+    uint8_t cmd = _checkcmd(L, 2);
+
+    struct ratelimit_stats st;
+    if (!ratelimit_stats(rl, cmd, &st)) {
+        return 0;
+    }
+
+    lua_newtable(L);
+    lua_pushinteger(L, st.dropped_ip);
+    lua_setfield(L, -2, "dropped_ip");
+    lua_pushinteger(L, st.dropped_key);
+    lua_setfield(L, -2, "dropped_key");
+    lua_pushinteger(L, st.passed);
+    lua_setfield(L, -2, "passed");
+
+    return 1;
+}
+
+static const luaL_Reg funcs[] = {
+    {"close", _close},
+    {"new", _new},
+    {"set", _set},
+    {"stats", _stats},
+    {NULL, NULL},
+};
+
+LUAMOD_API int luaopen_ratelimit(lua_State* L) {
+    luaL_checkversion(L);
+    luaL_newlib(L, funcs);
+
+    luaW_declptr(L, MT, _delete);
+
+    return 1;
+}
@@ -0,0 +1,50 @@
+#ifndef WIREHUB_RATELIMIT_H
+#define WIREHUB_RATELIMIT_H
+
+#include "net.h"
+
+/** Per-source rate limiter.
+ *
+ * Received packets are accounted in token buckets indexed by their command and
+ * by their source: the source IP address, before the packet is verified, and
+ * the source key of the packet, once verified. Source keys are public: an
+ * unverified key could be spoofed to drain the budget of a peer. Each command
+ * may have a budget of packets and of bytes per second, with bursts of one
+ * second. Commands without budget are not limited.
+ *
+ * Buckets are stored in a set-associative table. When a set is full, the least
+ * recently used bucket of the set is reset for the new source.
+ */
+#define RATELIMIT_COMMANDS  256
+
+struct ratelimit;
+
+struct ratelimit_stats {
+    uint64_t passed;
+    uint64_t dropped_key;
+    uint64_t dropped_ip;
+};
+
+struct ratelimit* ratelimit_new(void);
+void ratelimit_free(struct ratelimit* rl);
+
+// returns a new rate limiter with the budgets of `rl`
+struct ratelimit* ratelimit_clone(const struct ratelimit* rl);
+
+// sets the budget of command `cmd`. 0 means unlimited.
+void ratelimit_set(struct ratelimit* rl, uint8_t cmd, uint32_t pps, uint32_t bps);
+
+// returns 1 if a packet of command `cmd` and of `sz` bytes, received from
+// `src`, is within the budget of its IP address, else 0. `now` is in
+// milliseconds.
+int ratelimit_check(struct ratelimit* rl, uint8_t cmd, const struct address* src,
+                    size_t sz, uint64_t now);
+
+// as ratelimit_check(), for the budget of source key `k` of a verified packet
+int ratelimit_check_key(struct ratelimit* rl, uint8_t cmd, const uint8_t* k,
+                        size_t sz, uint64_t now);
+
+// returns 1 and sets `st` if command `cmd` has a budget, else 0
+int ratelimit_stats(const struct ratelimit* rl, uint8_t cmd, struct ratelimit_stats* st);
+
+#endif  // WIREHUB_RATELIMIT_H
@@ -0,0 +1,248 @@
+#include "reasm.h"
+#include <sodium.h>
+
+#define NIL ((uint32_t)-1)
+#define BUCKETS 256     // power of two, at least WH_REASM_SESSIONS
+
+struct reasm_session {
+    uint8_t k[REASM_KEYBYTES];
+    uint16_t id;
+    int last;               // count of fragments, or -1 if unknown
+    uint64_t deadline;
+    uint64_t received;      // bitmap of received fragments
+    uint32_t frags[REASM_MAXFRAGS];
+
+    uint32_t hnext;         // hash chain, or free list
+    uint32_t prev, next;    // creation order
+};
+
+struct reasm {
+    unsigned int peer_max;
+    uint64_t timeout;
+    uint8_t hash_k[crypto_shorthash_KEYBYTES];
+
+    struct reasm_session sessions[WH_REASM_SESSIONS];
+    uint32_t buckets[BUCKETS];
+    uint32_t free;
+    uint32_t head, tail;    // oldest and newest sessions
+
+    uint16_t lens[WH_REASM_FRAGMENTS];
+    uint32_t free_bufs[WH_REASM_FRAGMENTS];
+    unsigned int free_buf_count;
+
+    struct reasm_stats st;
+
+    uint8_t bufs[WH_REASM_FRAGMENTS][WH_REASM_BUFSIZE];
+};
+
+static uint32_t* _bucket(struct reasm* r, const uint8_t* k) {
+    uint64_t h;
+    crypto_shorthash((uint8_t*)&h, k, REASM_KEYBYTES, r->hash_k);
+    return &r->buckets[h & (BUCKETS-1)];
+}
+
+struct reasm* reasm_new(unsigned int peer_max, uint64_t timeout) {
+    assert(WH_REASM_SESSIONS <= BUCKETS);
+
+    struct reasm* r = malloc(sizeof(struct reasm));
+    if (!r) {
+        return NULL;
+    }
+
+    memset(r, 0, offsetof(struct reasm, bufs));
+    r->peer_max = peer_max > 0 ? peer_max : 1;
+    r->timeout = timeout;
+    randombytes_buf(r->hash_k, sizeof(r->hash_k));
+    r->head = r->tail = NIL;
+
+    for (unsigned int i=0; i<BUCKETS; ++i) {
+        r->buckets[i] = NIL;
+    }
+
+    r->free = NIL;
+    for (unsigned int i=WH_REASM_SESSIONS; i>0; --i) {
+        r->sessions[i-1].hnext = r->free;
+        r->free = i-1;
+    }
+
+    for (unsigned int i=0; i<WH_REASM_FRAGMENTS; ++i) {
+        r->free_bufs[i] = WH_REASM_FRAGMENTS-1-i;
+    }
+    r->free_buf_count = WH_REASM_FRAGMENTS;
+
+    return r;
+}
+
+void reasm_free(struct reasm* r) {
+    free(r);
+}
+
+// releases session i. Its buffers are left untouched until reused.
+static void _release(struct reasm* r, uint32_t i) {
+    struct reasm_session* s = &r->sessions[i];
+
+    uint32_t* pi = _bucket(r, s->k);
+    while (*pi != i) {
+        assert(*pi != NIL);
+        pi = &r->sessions[*pi].hnext;
+    }
+    *pi = s->hnext;
+
+    if (s->prev != NIL) {
+        r->sessions[s->prev].next = s->next;
+    } else {
+        r->head = s->next;
+    }
+
+    if (s->next != NIL) {
+        r->sessions[s->next].prev = s->prev;
+    } else {
+        r->tail = s->prev;
+    }
+
+    uint64_t received = s->received;
+    while (received) {
+        int num = __builtin_ctzll(received);
+        received &= received-1;
+        r->free_bufs[r->free_buf_count++] = s->frags[num];
+        --r->st.fragments;
+    }
+
+    s->hnext = r->free;
+    r->free = i;
+    --r->st.sessions;
+}
+
+static void _drop(struct reasm* r, uint32_t i) {
+    _release(r, i);
+    ++r->st.dropped;
+}
+
+void reasm_expire(struct reasm* r, uint64_t now) {
+    while (r->head != NIL && r->sessions[r->head].deadline <= now) {
+        _release(r, r->head);
+        ++r->st.expired;
+    }
+}
+
+static uint32_t _session(struct reasm* r, const uint8_t* k, uint16_t id, uint64_t now) {
+    uint32_t* b = _bucket(r, k);
+    uint32_t oldest = NIL;
+    unsigned int count = 0;
+    uint32_t i;
+
+    for (i=*b; i!=NIL; i=r->sessions[i].hnext) {
+        struct reasm_session* s = &r->sessions[i];
+
+        if (memcmp(s->k, k, REASM_KEYBYTES) != 0) {
+            continue;
+        }
+
+        if (s->id == id) {
+            return i;
+        }
+
+        if (oldest == NIL || s->deadline < r->sessions[oldest].deadline) {
+            oldest = i;
+        }
+
+        ++count;
+    }
+
+    if (count >= r->peer_max) {
+        _drop(r, oldest);
+    }
+
+    if (r->free == NIL) {
+        _drop(r, r->head);
+    }
+
+    i = r->free;
+    struct reasm_session* s = &r->sessions[i];
+    r->free = s->hnext;
+
+    memcpy(s->k, k, REASM_KEYBYTES);
+    s->id = id;
+    s->last = -1;
+    s->deadline = now + r->timeout;
+    s->received = 0;
+
+    s->hnext = *b;
+    *b = i;
+
+    s->prev = r->tail;
+    s->next = NIL;
+    if (r->tail != NIL) {
+        r->sessions[r->tail].next = i;
+    } else {
+        r->head = i;
+    }
+    r->tail = i;
+
+    ++r->st.sessions;
+    return i;
+}
+
+int reasm_add(struct reasm* r, const uint8_t* k, uint16_t id, unsigned int num,
+              int mf, const void* m, size_t l, uint64_t now, struct iovec* iov) {
+    reasm_expire(r, now);
+
+    // malformed fragments must not evict sessions
+    if (num >= REASM_MAXFRAGS || l > WH_REASM_BUFSIZE) {
+        return -1;
+    }
+
+    uint32_t i = _session(r, k, id, now);
+    struct reasm_session* s = &r->sessions[i];
+
+    if ((s->last != -1 && (int)num >= s->last) ||
+        (!mf && (s->received >> num) > 1)) {
+        _drop(r, i);
+        return -1;
+    }
+
+    uint64_t bit = UINT64_C(1) << num;
+    if (s->received & bit) {
+        return 0;
+    }
+
+    // reclaim buffers of the oldest sessions
+    while (r->free_buf_count == 0 && r->head != i) {
+        _drop(r, r->head);
+    }
+
+    if (r->free_buf_count == 0) {
+        _drop(r, i);
+        return -1;
+    }
+
+    uint32_t buf = r->free_bufs[--r->free_buf_count];
+    memcpy(r->bufs[buf], m, l);
+    r->lens[buf] = l;
+    s->frags[num] = buf;
+    s->received |= bit;
+    ++r->st.fragments;
+
+    if (!mf) {
+        s->last = num+1;
+    }
+
+    if (s->last == -1 || s->received != (UINT64_MAX >> (64-s->last))) {
+        return 0;
+    }
+
+    int count = s->last;
+    for (int j=0; j<count; ++j) {
+        iov[j].iov_base = r->bufs[s->frags[j]];
+        iov[j].iov_len = r->lens[s->frags[j]];
+    }
+
+    _release(r, i);
+    ++r->st.completed;
+
+    return count;
+}
+
+void reasm_stats(const struct reasm* r, struct reasm_stats* st) {
+    *st = r->st;
+}
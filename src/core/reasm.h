@@ -0,0 +1,47 @@
+#ifndef WIREHUB_REASM_H
+#define WIREHUB_REASM_H
+
+#include "common.h"
+#include <sys/uio.h>
+
+/** Reassembly of fragmented datagrams.
+ *
+ * Fragments are copied into a slab of fixed-size buffers, and sessions are
+ * looked up by (source key, fragment id). Received fragments of a session are
+ * tracked in a bitmap. Sessions share the same timeout, hence expire in their
+ * creation order.
+ */
+#define REASM_KEYBYTES      32
+#define REASM_MAXFRAGS      64
+
+struct reasm;
+
+struct reasm_stats {
+    uint64_t completed;
+    uint64_t expired;
+    uint64_t dropped;
+    size_t sessions;
+    size_t fragments;
+};
+
+// `peer_max` is the maximum count of sessions per source. `timeout` is in
+// milliseconds.
+struct reasm* reasm_new(unsigned int peer_max, uint64_t timeout);
+void reasm_free(struct reasm* r);
+
+/** Adds fragment `num` of session (`k`, `id`). `mf` is set if more fragments
+ * follow.
+ *
+ * If the datagram is complete, returns the count of fragments and sets `iov`,
+ * which must be REASM_MAXFRAGS long. Buffers are valid until next call. Returns
+ * 0 if the datagram is incomplete, or -1 if the fragment was dropped.
+ */
+int reasm_add(struct reasm* r, const uint8_t* k, uint16_t id, unsigned int num,
+              int mf, const void* m, size_t l, uint64_t now, struct iovec* iov);
+
+// drops sessions whose deadline is lower or equal to `now`
+void reasm_expire(struct reasm* r, uint64_t now);
+
+void reasm_stats(const struct reasm* r, struct reasm_stats* st);
+
+#endif  // WIREHUB_REASM_H
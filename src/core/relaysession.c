@@ -0,0 +1,205 @@
+#include "relaysession.h"
+#include <sodium.h>
+
+#define NIL ((uint32_t)-1)
+#define BUCKETS 2048    // power of two, at least WH_RELAY_SESSIONS
+
+struct relaysessions {
+    uint64_t timeout;
+    uint8_t hash_k[crypto_shorthash_KEYBYTES];
+    size_t count;
+
+    uint32_t ids[BUCKETS];
+    uint32_t pairs[BUCKETS];
+    uint32_t free;
+    uint32_t head, tail;    // least and most recently bound sessions
+
+    struct relaysession sessions[WH_RELAY_SESSIONS];
+};
+
+// ids are drawn randomly by the relay
+static uint32_t* _id_bucket(struct relaysessions* t, uint32_t id) {
+    return &t->ids[id & (BUCKETS-1)];
+}
+
+static uint32_t* _pair_bucket(struct relaysessions* t, const uint8_t* src_k,
+                              const uint8_t* dst_k) {
+    uint8_t pair[2*RELAYSESSION_KEYBYTES];
+    memcpy(pair, src_k, RELAYSESSION_KEYBYTES);
+    memcpy(pair+RELAYSESSION_KEYBYTES, dst_k, RELAYSESSION_KEYBYTES);
+
+    uint64_t h;
+    crypto_shorthash((uint8_t*)&h, pair, sizeof(pair), t->hash_k);
+    return &t->pairs[h & (BUCKETS-1)];
+}
+
+struct relaysessions* relaysessions_new(uint64_t timeout) {
+    assert(WH_RELAY_SESSIONS <= BUCKETS);
+
+    struct relaysessions* t = sodium_malloc(sizeof(struct relaysessions));
+    if (!t) {
+        return NULL;
+    }
+
+    sodium_memzero(t, sizeof(*t));
+    t->timeout = timeout;
+    randombytes_buf(t->hash_k, sizeof(t->hash_k));
+    t->head = t->tail = NIL;
+
+    for (unsigned int i=0; i<BUCKETS; ++i) {
+        t->ids[i] = t->pairs[i] = NIL;
+    }
+
+    t->free = NIL;
+    for (unsigned int i=WH_RELAY_SESSIONS; i>0; --i) {
+        t->sessions[i-1].inext = t->free;
+        t->free = i-1;
+    }
+
+    return t;
+}
+
+void relaysessions_free(struct relaysessions* t) {
+    sodium_free(t);
+}
+
+size_t relaysessions_count(const struct relaysessions* t) {
+    return t->count;
+}
+
+static void _unlink_order(struct relaysessions* t, uint32_t i) {
+    struct relaysession* s = &t->sessions[i];
+
+    if (s->prev != NIL) {
+        t->sessions[s->prev].next = s->next;
+    } else {
+        t->head = s->next;
+    }
+
+    if (s->next != NIL) {
+        t->sessions[s->next].prev = s->prev;
+    } else {
+        t->tail = s->prev;
+    }
+}
+
+static void _link_order(struct relaysessions* t, uint32_t i) {
+    struct relaysession* s = &t->sessions[i];
+
+    s->prev = t->tail;
+    s->next = NIL;
+    if (t->tail != NIL) {
+        t->sessions[t->tail].next = i;
+    } else {
+        t->head = i;
+    }
+    t->tail = i;
+}
+
+static void _release(struct relaysessions* t, uint32_t i) {
+    struct relaysession* s = &t->sessions[i];
+
+    uint32_t* pi = _id_bucket(t, s->id);
+    while (*pi != i) {
+        assert(*pi != NIL);
+        pi = &t->sessions[*pi].inext;
+    }
+    *pi = s->inext;
+
+    pi = _pair_bucket(t, s->src_k, s->dst_k);
+    while (*pi != i) {
+        assert(*pi != NIL);
+        pi = &t->sessions[*pi].pnext;
+    }
+    *pi = s->pnext;
+
+    _unlink_order(t, i);
+
+    sodium_memzero(s, sizeof(*s));
+    s->inext = t->free;
+    t->free = i;
+    --t->count;
+}
+
+static void _expire(struct relaysessions* t, uint64_t now) {
+    while (t->head != NIL && t->sessions[t->head].deadline <= now) {
+        _release(t, t->head);
+    }
+}
+
+static uint32_t _find(struct relaysessions* t, uint32_t id) {
+    uint32_t i;
+    for (i=*_id_bucket(t, id); i!=NIL; i=t->sessions[i].inext) {
+        if (t->sessions[i].id == id) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+struct relaysession* relaysessions_bind(struct relaysessions* t,
+                                        const uint8_t* src_k,
+                                        const uint8_t* dst_k,
+                                        uint64_t now, int* is_new) {
+    _expire(t, now);
+
+    uint32_t* b = _pair_bucket(t, src_k, dst_k);
+    uint32_t i;
+    for (i=*b; i!=NIL; i=t->sessions[i].pnext) {
+        struct relaysession* s = &t->sessions[i];
+
+        if (memcmp(s->src_k, src_k, RELAYSESSION_KEYBYTES) == 0 &&
+            memcmp(s->dst_k, dst_k, RELAYSESSION_KEYBYTES) == 0) {
+            s->deadline = now + t->timeout;
+            _unlink_order(t, i);
+            _link_order(t, i);
+
+            *is_new = 0;
+            return s;
+        }
+    }
+
+    if (t->free == NIL) {
+        _release(t, t->head);
+    }
+
+    i = t->free;
+    struct relaysession* s = &t->sessions[i];
+    t->free = s->inext;
+
+    uint32_t id;
+    do {
+        id = randombytes_random();
+    } while (id == 0 || _find(t, id) != NIL);
+
+    s->id = id;
+    memcpy(s->src_k, src_k, RELAYSESSION_KEYBYTES);
+    memcpy(s->dst_k, dst_k, RELAYSESSION_KEYBYTES);
+    s->deadline = now + t->timeout;
+
+    uint32_t* ib = _id_bucket(t, id);
+    s->inext = *ib;
+    *ib = i;
+
+    s->pnext = *b;
+    *b = i;
+
+    _link_order(t, i);
+    ++t->count;
+
+    *is_new = 1;
+    return s;
+}
+
+const struct relaysession* relaysessions_get(struct relaysessions* t,
+                                             uint32_t id, uint64_t now) {
+    _expire(t, now);
+
+    uint32_t i = _find(t, id);
+    return i != NIL ? &t->sessions[i] : NULL;
+}
+
+void relaysessions_remove(struct relaysessions* t, const struct relaysession* s) {
+    _release(t, s - t->sessions);
+}
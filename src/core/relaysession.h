@@ -0,0 +1,56 @@
+#ifndef WIREHUB_RELAYSESSION_H
+#define WIREHUB_RELAYSESSION_H
+
+#include "common.h"
+
+/** Relay sessions.
+ *
+ * A relay session binds a random 32-bit id to a (source, destination) pair of
+ * peers. Sources send session packets to the relay, authenticated with a key
+ * derived from the id and from the key shared with the relay (see
+ * session_key()), which the relay forwards without opening a WireHub packet.
+ *
+ * Sessions are looked up by id and by (source, destination). Binding again a
+ * pair refreshes its session; sessions share the same timeout, hence expire in
+ * least-recently-bound order. The table is stored in locked memory.
+ */
+#define RELAYSESSION_KEYBYTES 32
+
+struct relaysession {
+    uint32_t id;
+    uint8_t src_k[RELAYSESSION_KEYBYTES];
+    uint8_t dst_k[RELAYSESSION_KEYBYTES];
+    uint8_t key[RELAYSESSION_KEYBYTES];
+    uint64_t deadline;
+
+    uint32_t inext, pnext;  // hash chains, by id and by pair. inext is also
+                            // the free list
+    uint32_t prev, next;    // binding order
+};
+
+struct relaysessions;
+
+// `timeout` is in milliseconds
+struct relaysessions* relaysessions_new(uint64_t timeout);
+void relaysessions_free(struct relaysessions* t);
+
+/** Binds a session to (`src_k`, `dst_k`), or refreshes it.
+ *
+ * If the session is new, `is_new` is set and the caller must write the key of
+ * the session. If the table is full, the least-recently-bound session is
+ * dropped.
+ */
+struct relaysession* relaysessions_bind(struct relaysessions* t,
+                                        const uint8_t* src_k,
+                                        const uint8_t* dst_k,
+                                        uint64_t now, int* is_new);
+
+// returns the session `id`, or NULL if unknown or expired
+const struct relaysession* relaysessions_get(struct relaysessions* t,
+                                             uint32_t id, uint64_t now);
+
+void relaysessions_remove(struct relaysessions* t, const struct relaysession* s);
+
+size_t relaysessions_count(const struct relaysessions* t);
+
+#endif  // WIREHUB_RELAYSESSION_H
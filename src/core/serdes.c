@@ -1,213 +1,366 @@
 #include <assert.h>
 #include <stdlib.h>
-#include <unistd.h>
+#include <string.h>
 #include "serdes.h"
 #include "luawh.h"
 
-struct load_ud {
-    int fd;
-    size_t sz;
-    char buf[256];
+// back-reference to a table already serialized in the frame
+#define TREF    0x100
+
+// tables are serialized recursively, so their nesting is bounded, as Lua bounds
+// the nesting of C calls (LUAI_MAXCCALLS)
+#define MAXDEPTH    200
+
+struct dump_ctx {
+    struct luaW_buf* b;
+    int seen;               // stack index of tables already serialized
+    uint32_t count;
+    unsigned int depth;
+    const char* err;
+    int type;               // unhandled type
 };
 
-static const char* _deser_load(lua_State* L, void* data, size_t* psize) {
-    (void)L;
+struct load_ctx {
+    const uint8_t* p;
+    size_t l;
+    int seen;               // stack index of tables already deserialized
+    uint32_t count;
+    unsigned int depth;
+};
 
-    struct load_ud* ld = (struct load_ud*)data;
+void luaW_buffree(struct luaW_buf* b) {
+    free(b->p);
+    b->p = NULL;
+    b->l = b->cap = 0;
+}
 
-    *psize = ld->sz;
+static int _bufreserve(struct luaW_buf* b, size_t l) {
+    if (b->l + l <= b->cap) {
+        return 0;
+    }
 
-    if (*psize > sizeof(ld->buf)) {
-        *psize = sizeof(ld->buf);
+    size_t cap = b->cap ? b->cap : 256;
+    while (cap < b->l + l) {
+        cap *= 2;
     }
 
-    if (*psize > 0) {
-        ssize_t ret = read(ld->fd, ld->buf, *psize);
-        assert(ret>=0);
-        assert((size_t)ret<=ld->sz);
-        *psize = ret;
-        ld->sz -= ret;
+    uint8_t* p = realloc(b->p, cap);
+    if (!p) {
+        return -1;
     }
 
-    return ld->buf;
+    b->p = p;
+    b->cap = cap;
+    return 0;
 }
 
-#define READ(var)   assert(read(fd, &var, sizeof(var)) == sizeof(var))
-int luaW_read(lua_State* L, int fd) {
-    int type;
+int luaW_bufadd(struct luaW_buf* b, const void* m, size_t l) {
+    if (_bufreserve(b, l) < 0) {
+        return -1;
+    }
+
+    memcpy(b->p + b->l, m, l);
+    b->l += l;
+    return 0;
+}
+
+static int _add(struct dump_ctx* c, const void* m, size_t l) {
+    if (luaW_bufadd(c->b, m, l) < 0) {
+        c->err = "out of memory";
+        return -1;
+    }
+
+    return 0;
+}
+
+static int _dump_writer(lua_State* L, const void* m, size_t l, void* ud) {
+    (void)L;
+    return _add((struct dump_ctx*)ud, m, l);
+}
+
+#define ADD(var)    if (_add(c, &var, sizeof(var)) < 0) { return -1; }
+// returns 1 if an element was serialized, 0 if element is LUA_TNONE, -1 if
+// something went wrong
+static int _dump(lua_State* L, int idx, struct dump_ctx* c) {
+    int type = lua_type(L, idx);
     uint8_t u8;
-    size_t sz;
     lua_Number number;
-    char* str;
-    int load_ret;
-    struct load_ud ld;
+    size_t sz;
+    size_t off;
+    const char* str;
 
-    READ(type);
+    if (type == LUA_TTABLE) {
+        lua_pushvalue(L, idx);
+        if (lua_rawget(L, c->seen) == LUA_TNUMBER) {
+            uint32_t ref = lua_tointeger(L, -1);
+            lua_pop(L, 1);
+
+            type = TREF;
+            ADD(type);
+            ADD(ref);
+            return 1;
+        }
+        lua_pop(L, 1);
+
+        lua_pushvalue(L, idx);
+        lua_pushinteger(L, c->count++);
+        lua_rawset(L, c->seen);
+    }
+
+    ADD(type);
 
     switch (type) {
     case LUA_TNONE:
         return 0;
 
     case LUA_TNIL:
-        lua_pushnil(L);
         break;
 
     case LUA_TBOOLEAN:
-        READ(u8);
-        lua_pushboolean(L, u8);
+        u8 = lua_toboolean(L, idx);
+        ADD(u8);
         break;
 
     case LUA_TNUMBER:
-        READ(number);
-        lua_pushnumber(L, number);
+        number = lua_tonumber(L, idx);
+        ADD(number);
         break;
 
     case LUA_TSTRING:
-        READ(sz);
-        // XXX stream?
-        str = malloc(sz);
-        assert(read(fd, str, sz) == (ssize_t)sz);
-        lua_pushlstring(L, str, sz);
-        free(str);
+        str = lua_tolstring(L, idx, &sz);
+        ADD(sz);
+        if (_add(c, str, sz) < 0) {
+            return -1;
+        }
         break;
 
     case LUA_TTABLE:
-        lua_newtable(L);
-        for (;;) {
-            int r = luaW_read(L, fd);
-            if (r == -1) {
-                return -1;
-            } else if (r == 0) {
-                break;
-            }
+        if (c->depth == MAXDEPTH) {
+            c->err = "tables nested too deep";
+            return -1;
+        }
+
+        if (!lua_checkstack(L, 4)) {
+            c->err = "stack overflow";
+            return -1;
+        }
 
-            if (luaW_read(L, fd) < 0) {
+        ++c->depth;
+        lua_pushnil(L);  /* first key */
+        while (lua_next(L, idx) != 0) {
+            if (_dump(L, lua_gettop(L)-1, c) < 0 ||
+                _dump(L, lua_gettop(L), c) < 0) {
                 return -1;
             }
-
-            lua_rawset(L, -3);
+            lua_pop(L, 1);
         }
+        --c->depth;
+        type = LUA_TNONE;
+        ADD(type);
         break;
 
     case LUA_TFUNCTION:
-        READ(ld.sz);
-        ld.fd = fd;
-        load_ret = lua_load(L, _deser_load, &ld, "work", NULL);
-        if (load_ret != LUA_OK) {
-            lua_pushnumber(L, load_ret);
-            lua_insert(L, -2);
-
-            while(lua_gettop(L) > 2) {
-                lua_remove(L, 1);
+        // size is written once the function is dumped
+        sz = 0;
+        off = c->b->l;
+        ADD(sz);
+        lua_pushvalue(L, idx);
+        if (lua_dump(L, _dump_writer, c, 0) != 0) {
+            if (!c->err) {
+                c->err = "unable to dump given function";
             }
-
             return -1;
         }
+        lua_pop(L, 1);
+        sz = c->b->l - off - sizeof(sz);
+        memcpy(c->b->p + off, &sz, sizeof(sz));
         break;
 
-    case LUA_TLIGHTUSERDATA:
-    case LUA_TUSERDATA:
-    case LUA_TTHREAD:
-        assert(0 && "unhandled type");
-    };
+    default:
+        c->err = "unhandled type";
+        c->type = type;
+        return -1;
+    }
 
     return 1;
 }
+#undef ADD
 
-int luaW_readstack(lua_State* L, int fd) {
-    int ret;
-    while((ret = luaW_read(L, fd)) != 0);
-    return ret;
+// serializes the stack from `idx`. returns 0 if succeed, else -1.
+static int _dumpstack(lua_State* L, int idx, struct dump_ctx* c) {
+    int top = lua_gettop(L);
+
+    if (idx < 0) {
+        idx = top+idx+1;
+    }
+
+    lua_newtable(L);
+    c->seen = lua_gettop(L);
+
+    for (; idx <= top; ++idx) {
+        if (_dump(L, idx, c) < 0) {
+            lua_settop(L, top);
+            return -1;
+        }
+    }
+
+    lua_settop(L, top);
+
+    int none = LUA_TNONE;
+    return _add(c, &none, sizeof(none));
 }
-#undef READ
-
-#define WRITE(var)  assert(write(fd, &var, sizeof(var)) == sizeof(var))
-static int _ser_dump(lua_State *L, const void* b, size_t size, void* ud) {
-  (void)L;
-  luaL_Buffer* buf = (luaL_Buffer*)ud;
-  luaL_addlstring(buf, (const char*)b, size);
-  return 0;
+
+static int _dump_error(lua_State* L, const struct dump_ctx* c) {
+    if (c->type != LUA_TNONE) {
+        return luaL_error(L, "unhandled type: %s", lua_typename(L, c->type));
+    }
+
+    return luaL_error(L, "serialization failed: %s", c->err);
 }
 
-int luaW_write(lua_State* L, int idx, int fd) {
-    int type = lua_type(L, idx);
+void luaW_dumpstack(lua_State* L, int idx, struct luaW_buf* b) {
+    struct dump_ctx c = { .b = b, .type = LUA_TNONE };
+
+    if (_dumpstack(L, idx, &c) < 0) {
+        _dump_error(L, &c);
+    }
+}
+
+static const char* _chunk_reader(lua_State* L, void* data, size_t* psize) {
+    (void)L;
+
+    struct load_ctx* chunk = (struct load_ctx*)data;
+
+    *psize = chunk->l;
+    chunk->l = 0;
+
+    return (const char*)chunk->p;
+}
+
+#define TAKE(var)   if (!_take(c, &var, sizeof(var))) { return -1; }
+static int _take(struct load_ctx* c, void* var, size_t l) {
+    if (c->l < l) {
+        return 0;
+    }
+
+    memcpy(var, c->p, l);
+    c->p += l;
+    c->l -= l;
+    return 1;
+}
+
+// returns 1 if an element was deserialized, 0 if element is LUA_TNONE, -1 if
+// frame is invalid
+static int _load(lua_State* L, struct load_ctx* c) {
+    int type;
     uint8_t u8;
-    lua_Number number;
+    uint32_t ref;
     size_t sz;
-    const char* str;
-    luaL_Buffer buf;
+    lua_Number number;
+    struct load_ctx chunk;
 
-    WRITE(type);
+    TAKE(type);
+
+    if (!lua_checkstack(L, 3)) {
+        return -1;
+    }
 
     switch (type) {
     case LUA_TNONE:
         return 0;
 
     case LUA_TNIL:
+        lua_pushnil(L);
         break;
 
     case LUA_TBOOLEAN:
-        u8 = lua_toboolean(L, idx);
-        WRITE(u8);
+        TAKE(u8);
+        lua_pushboolean(L, u8);
         break;
 
     case LUA_TNUMBER:
-        number = lua_tonumber(L, idx);
-        WRITE(number);
+        TAKE(number);
+        lua_pushnumber(L, number);
         break;
 
     case LUA_TSTRING:
-        str = lua_tolstring(L, idx, &sz);
-        WRITE(sz);
-        assert(write(fd, str, sz) == (ssize_t)sz);
+        TAKE(sz);
+        if (sz > c->l) {
+            return -1;
+        }
+        lua_pushlstring(L, (const char*)c->p, sz);
+        c->p += sz, c->l -= sz;
         break;
 
     case LUA_TTABLE:
-        lua_pushnil(L);  /* first key */
-        while (lua_next(L, idx) != 0) {
-            assert(luaW_write(L, lua_gettop(L)-1, fd) == 1);
-            assert(luaW_write(L, lua_gettop(L), fd) == 1);
-            lua_pop(L, 1);
+        if (c->depth == MAXDEPTH) {
+            return -1;
+        }
+
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, c->seen, c->count++);
+
+        ++c->depth;
+        for (;;) {
+            int r = _load(L, c);
+            if (r == -1) {
+                return -1;
+            } else if (r == 0) {
+                break;
+            }
+
+            if (_load(L, c) != 1 || lua_isnil(L, -2) ||
+                lua_tonumber(L, -2) != lua_tonumber(L, -2)) {
+                return -1;
+            }
+
+            lua_rawset(L, -3);
+        }
+        --c->depth;
+        break;
+
+    case TREF:
+        TAKE(ref);
+        if (lua_rawgeti(L, c->seen, ref) != LUA_TTABLE) {
+            return -1;
         }
-        type = LUA_TNONE;
-        WRITE(type);
         break;
 
     case LUA_TFUNCTION:
-        luaL_buffinit(L, &buf);
-        lua_pushvalue(L, idx);
-        if (lua_dump(L, _ser_dump, &buf, 0) != 0) {
-            return luaL_error(L, "unable to dump given function");
+        TAKE(sz);
+        if (sz > c->l) {
+            return -1;
+        }
+        chunk.p = c->p, chunk.l = sz;
+        c->p += sz, c->l -= sz;
+        if (lua_load(L, _chunk_reader, &chunk, "work", "b") != LUA_OK) {
+            lua_pop(L, 1);
+            return -1;
         }
-        lua_pop(L, 1);
-        luaL_pushresult(&buf);
-        str = lua_tolstring(L, -1, &sz);
-        WRITE(sz);
-        assert(write(fd, str, sz) == (ssize_t)sz);
-        lua_pop(L, 1);
         break;
 
-    case LUA_TLIGHTUSERDATA:
-    case LUA_TUSERDATA:
-    case LUA_TTHREAD:
-        luaL_error(L, "unhandled type: %s", lua_typename(L, type));
-    }
+    default:
+        return -1;
+    };
 
     return 1;
 }
+#undef TAKE
 
-void luaW_writestack(lua_State* L, int idx, int fd) {
-    if (idx < 0) {
-        idx = lua_gettop(L)+idx+1;
-    }
+int luaW_loadstack(lua_State* L, const void* p, size_t l) {
+    int top = lua_gettop(L);
+    lua_newtable(L);
 
-    for (; luaW_write(L, idx, fd); ++idx);
-}
+    struct load_ctx c = { .p = p, .l = l, .seen = top+1 };
+    int ret;
+    while ((ret = _load(L, &c)) == 1);
 
-void luaW_writenone(int fd) {
-    int type = LUA_TNONE;
-    assert(write(fd, &type, sizeof(int)) == sizeof(int));
-}
+    lua_remove(L, c.seen);
 
-#undef WRITE
+    if (ret == 0 && c.l > 0) {
+        ret = -1;
+    }
 
+    return ret;
+}
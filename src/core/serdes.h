@@ -2,38 +2,49 @@
 #define WH_SERDES_H
 
 #include <lua.h>
+#include <stddef.h>
+#include <stdint.h>
 
-/** Reads `fd`, deserializes one element and pushes it in the stack.
+/** Serialization of Lua values.
  *
- * Returns 1 if an element was read; 0 if none element was read; -1 if
- * deserialization failed.
- */
-int luaW_read(lua_State* L, int fd);
-
-/** Reads `fd`, deserializes all elements and pushes them in the stack.
+ * Nil, booleans, numbers, strings, functions and tables are serialized. Tables
+ * referenced several times, or cyclic tables, are serialized once and
+ * deserialized as a single table. Tables may be nested at most 200 deep.
  *
- * Returns 0 if succeed, else -1.
+ * A stack is serialized as a frame: its elements, terminated by element
+ * LUA_TNONE. Frames carry no size: they are exchanged through the queues of
+ * the worker threads, which keep the size of each frame (see spsc.h).
+ *
+ * Malformed frames are rejected when loaded (see tests/fuzz-serdes.c).
  */
-int luaW_readstack(lua_State* L, int fd);
 
-/** Serializes element at index `idx` and writes it in `fd`.
+/** Growable buffer of serialized elements.
  *
- * Returns 1 if an element was written; 0 if not element was written; raises a
- * Lua error if something went wrong.
+ * Buffers are zero-initialized and may be reused once cleared.
  */
-int luaW_write(lua_State* L, int idx, int fd);
+struct luaW_buf {
+    uint8_t* p;
+    size_t l;
+    size_t cap;
+};
 
-/** Serializes the stack from index `idx` and writes them in `fd`.
+void luaW_buffree(struct luaW_buf* b);
+
+// appends `l` bytes to `b`. returns -1 if allocation failed, else 0.
+int luaW_bufadd(struct luaW_buf* b, const void* m, size_t l);
+
+/** Serializes the stack from index `idx` and appends the frame to `b`.
  *
  * Raises a Lua error if something went wrong.
  */
-void luaW_writestack(lua_State* L, int idx, int fd);
+void luaW_dumpstack(lua_State* L, int idx, struct luaW_buf* b);
 
-/** Serializes element LUA_TNONE and writes it in `fd`.
+/** Deserializes the frame of `l` bytes at `m` and pushes its elements in the
+ * stack. Strings and functions are loaded from `m` without copy.
  *
- * Returns 1 if written; 0 if not.
+ * Returns 0 if succeed, else -1.
  */
-void luaW_writenone(int fd);
+int luaW_loadstack(lua_State* L, const void* m, size_t l);
 
 #endif  // WH_SERDES_H
 
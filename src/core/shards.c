@@ -0,0 +1,462 @@
+#include "shards.h"
+#include "ingress.h"
+#include "luawh.h"
+#include "mpsc.h"
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sodium.h>
+#include <sys/eventfd.h>
+
+#define MT "shards"
+
+struct shard {
+    struct shards* sh;
+    pthread_t thread;
+    int started;
+
+    // held while a batch is processed, and while Lua reads or configures the
+    // shard
+    pthread_mutex_t lock;
+
+    struct ingress* in;
+    struct keycache* kc;
+    struct egress* egress;
+    struct admission* adm;
+    struct ratelimit* rl;
+    struct datapath* dp;    // NULL if no native datapath
+
+    struct shards_stats st;
+};
+
+struct shards {
+    uint8_t* sk;
+    unsigned int count;
+
+    int event_fd;           // wakes up Lua
+    int stop_fd;            // stops the shards
+    struct mpsc* queue;
+
+    struct shard* shards;
+};
+
+// receives one batch of datagrams from socket fd. returns 1 if packets were
+// queued.
+static int _recv(struct shard* s, int fd) {
+    int queued = 0;
+    int count = ingress_recv(s->in, fd);
+    if (count <= 0) {
+        return 0;
+    }
+
+    s->st.received += count;
+
+    for (int i=0; i<count; ++i) {
+        const void* m;
+        size_t l;
+        struct address src;
+
+        if (ingress_datagram(s->in, i, &m, &l, &src) != 0) {
+            continue;
+        }
+
+        const uint8_t* p = m;
+        if (!datapath_receive(s->dp, s->kc, s->sh->sk, s->rl, s->adm, &p, &l, &src)) {
+            continue;
+        }
+
+        struct iovec iov[2] = {
+            { .iov_base = &src, .iov_len = sizeof(src) },
+            { .iov_base = (void*)p, .iov_len = l },
+        };
+
+        if (mpsc_push(s->sh->queue, iov, 2) < 0) {
+            ++s->st.dropped;
+            continue;
+        }
+
+        ++s->st.passed;
+        queued = 1;
+    }
+
+    return queued;
+}
+
+static void* _run(void* ud) {
+    struct shard* s = ud;
+
+    // signals are handled by the main thread
+    sigset_t set;
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    struct pollfd fds[3] = {
+        { .fd = ingress_fd(s->in, AF_INET), .events = POLLIN },
+        { .fd = ingress_fd(s->in, AF_INET6), .events = POLLIN },
+        { .fd = s->sh->stop_fd, .events = POLLIN },
+    };
+
+    for (;;) {
+        if (poll(fds, 3, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            fprintf(stderr, "error: shard poll() failed: %s\n", strerror(errno));
+            break;
+        }
+
+        if (fds[2].revents) {
+            break;
+        }
+
+        // one batch per socket and wakeup, so that the lock is released and
+        // replies are flushed while the sockets are not drained. poll() returns
+        // at once if datagrams are left.
+        int queued = 0;
+
+        pthread_mutex_lock(&s->lock);
+        for (int i=0; i<2; ++i) {
+            if (fds[i].revents & POLLIN) {
+                queued |= _recv(s, fds[i].fd);
+            }
+        }
+        egress_flush(s->egress);
+        pthread_mutex_unlock(&s->lock);
+
+        uint64_t one = 1;
+        if (queued && write(s->sh->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            fprintf(stderr, "error: shard write() failed: %s\n", strerror(errno));
+        }
+    }
+
+    return NULL;
+}
+
+static void _free_shard(struct shard* s) {
+    if (s->dp) {
+        datapath_free(s->dp);
+    }
+
+    if (s->rl) {
+        ratelimit_free(s->rl);
+    }
+
+    if (s->adm) {
+        admission_free(s->adm);
+    }
+
+    if (s->egress) {
+        egress_free(s->egress);
+    }
+
+    if (s->kc) {
+        keycache_free(s->kc);
+    }
+
+    if (s->in) {
+        ingress_free(s->in);
+    }
+
+    pthread_mutex_destroy(&s->lock);
+}
+
+static int _init_shard(struct shards* sh, unsigned int i, uint16_t port,
+                       unsigned int batch, int fd4, int fd6, struct egress* egress,
+                       uint32_t verify_rate, const struct datapath* dp,
+                       const struct ratelimit* rl) {
+    struct shard* s = &sh->shards[i];
+
+    s->sh = sh;
+    pthread_mutex_init(&s->lock, NULL);
+
+    uint32_t rate = verify_rate / sh->count;
+
+    if (!(s->in = ingress_new(port, batch, i, sh->count)) ||
+        !(s->kc = keycache_new(WH_KEYCACHE_SIZE)) ||
+        !(s->egress = egress_new(fd4, fd6, batch, egress)) ||
+        !(s->adm = admission_new(s->egress, port, rate > 0 ? rate : 1))) {
+        return -1;
+    }
+
+    if (rl && !(s->rl = ratelimit_clone(rl))) {
+        return -1;
+    }
+
+    if (dp) {
+        if (!(s->dp = datapath_new(dp->kad, s->egress, dp->port)) ||
+            datapath_configure(s->dp, dp) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+struct shards* shards_new(const uint8_t* sk, uint16_t port, unsigned int count,
+                          unsigned int batch, int fd4, int fd6,
+                          struct egress* egress, uint32_t verify_rate, const struct datapath* dp,
+                          const struct ratelimit* rl) {
+    assert(count > 0 && batch > 0);
+
+    struct shards* sh = calloc(1, sizeof(struct shards));
+    if (!sh) {
+        return NULL;
+    }
+
+    sh->event_fd = sh->stop_fd = -1;
+
+    if (!(sh->sk = sodium_malloc(crypto_scalarmult_curve25519_BYTES)) ||
+        !(sh->queue = mpsc_new(WH_SHARDS_QUEUE, sizeof(struct address)+WH_INGRESS_BUFSIZE)) ||
+        !(sh->shards = calloc(count, sizeof(struct shard)))) {
+        goto err;
+    }
+
+    memcpy(sh->sk, sk, crypto_scalarmult_curve25519_BYTES);
+
+    if ((sh->event_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) == -1 ||
+        (sh->stop_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) == -1) {
+        goto err;
+    }
+
+    for (; sh->count < count; ++sh->count) {
+        if (_init_shard(sh, sh->count, port, batch, fd4, fd6, egress, verify_rate, dp, rl) < 0) {
+            ++sh->count;
+            goto err;
+        }
+    }
+
+    for (unsigned int i=0; i<sh->count; ++i) {
+        struct shard* s = &sh->shards[i];
+
+        int err = pthread_create(&s->thread, NULL, _run, s);
+        if (err) {
+            errno = err;
+            goto err;
+        }
+
+        s->started = 1;
+    }
+
+    return sh;
+
+err:
+    {
+        int err = errno ? errno : ENOMEM;
+        shards_free(sh);
+        errno = err;
+    }
+    return NULL;
+}
+
+void shards_free(struct shards* sh) {
+    if (sh->stop_fd != -1) {
+        // shards could not be joined if they were not stopped
+        uint64_t one = 1;
+        if (write(sh->stop_fd, &one, sizeof(one)) != sizeof(one)) {
+            abort();
+        }
+    }
+
+    for (unsigned int i=0; i<sh->count; ++i) {
+        if (sh->shards[i].started) {
+            pthread_join(sh->shards[i].thread, NULL);
+        }
+    }
+
+    for (unsigned int i=0; i<sh->count; ++i) {
+        _free_shard(&sh->shards[i]);
+    }
+
+    if (sh->event_fd != -1) {
+        close(sh->event_fd);
+    }
+
+    if (sh->stop_fd != -1) {
+        close(sh->stop_fd);
+    }
+
+    if (sh->queue) {
+        mpsc_free(sh->queue);
+    }
+
+    if (sh->sk) {
+        sodium_free(sh->sk);
+    }
+
+    free(sh->shards);
+    free(sh);
+}
+
+int shards_fd(const struct shards* sh) {
+    return sh->event_fd;
+}
+
+unsigned int shards_count(const struct shards* sh) {
+    return sh->count;
+}
+
+int shards_sync(struct shards* sh, const struct datapath* dp) {
+    int r = 0;
+
+    for (unsigned int i=0; i<sh->count; ++i) {
+        struct shard* s = &sh->shards[i];
+
+        // versions of the shards' datapaths are only written by this thread
+        if (!s->dp || s->dp->version == dp->version) {
+            continue;
+        }
+
+        pthread_mutex_lock(&s->lock);
+        if (datapath_configure(s->dp, dp) < 0) {
+            r = -1;
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    return r;
+}
+
+void shards_clear(struct shards* sh) {
+    uint64_t v;
+    if (read(sh->event_fd, &v, sizeof(v)) < 0) {
+        assert(errno == EAGAIN);
+    }
+}
+
+const uint8_t* shards_front(struct shards* sh, size_t* l, struct address* src) {
+    size_t ml;
+    const uint8_t* m = mpsc_front(sh->queue, &ml);
+    if (!m) {
+        return NULL;
+    }
+
+    assert(ml >= sizeof(*src));
+    memcpy(src, m, sizeof(*src));
+    *l = ml - sizeof(*src);
+    return m + sizeof(*src);
+}
+
+void shards_pop(struct shards* sh) {
+    mpsc_pop(sh->queue);
+}
+
+void shards_stats(struct shards* sh, unsigned int i, struct shards_stats* st,
+                  struct datapath_stats* dst) {
+    assert(i < sh->count);
+    struct shard* s = &sh->shards[i];
+
+    pthread_mutex_lock(&s->lock);
+    *st = s->st;
+    if (dst && s->dp) {
+        *dst = s->dp->st;
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+/*** LUA *********************************************************************/
+
+static int _close(lua_State* L) {
+    shards_free(luaW_ownptr(L, 1, MT));
+    return 0;
+}
+
+static int _get_fd(lua_State* L) {
+    struct shards* sh = luaW_checkptr(L, 1, MT);
+    lua_pushinteger(L, sh->event_fd);
+    return 1;
+}
+
+// wh.shards.new(sk, port, count, batch, fd4, fd6, egress, verify_rate [, dp [, rl]])
+static int _new(lua_State* L) {
+    void* sk = luaW_checksecret(L, 1, crypto_scalarmult_curve25519_BYTES);
+    uint16_t port = luaW_checkport(L, 2);
+    lua_Integer count = luaL_checkinteger(L, 3);
+    lua_Integer batch = luaL_checkinteger(L, 4);
+    int fd4 = luaW_getfd(L, 5);
+    int fd6 = luaW_getfd(L, 6);
+    struct egress* egress = luaW_checkptr(L, 7, "egress");
+    lua_Integer verify_rate = luaL_checkinteger(L, 8);
+    struct datapath* dp = lua_isnoneornil(L, 9) ? NULL : luaW_checkptr(L, 9, "datapath");
+    struct ratelimit* rl = lua_isnoneornil(L, 10) ? NULL : luaW_checkptr(L, 10, "ratelimit");
+
+    if (count <= 0 || 256 < count) {
+        luaL_error(L, "bad shard count: %d", (int)count);
+    }
+
+    if (batch <= 0 || UIO_MAXIOV < batch) {
+        luaL_error(L, "bad batch size: %d", (int)batch);
+    }
+
+    if (verify_rate <= 0 || UINT32_MAX < verify_rate) {
+        luaL_error(L, "bad rate: %d", (int)verify_rate);
+    }
+
+    struct shards* sh = shards_new(sk, port, count, batch, fd4, fd6, egress, verify_rate, dp, rl);
+    if (!sh) {
+        luaL_error(L, "shards failed: %s", strerror(errno));
+    }
+
+    luaW_pushptr(L, MT, sh);
+    return 1;
+}
+
+static int _stats(lua_State* L) {
+    struct shards* sh = luaW_checkptr(L, 1, MT);
+
+    lua_createtable(L, sh->count, 0);
+    for (unsigned int i=0; i<sh->count; ++i) {
+        struct shards_stats st;
+        struct datapath_stats dst;
+        memset(&dst, 0, sizeof(dst));
+        shards_stats(sh, i, &st, &dst);
+
+        lua_newtable(L);
+        lua_pushinteger(L, st.dropped);
+        lua_setfield(L, -2, "dropped");
+        lua_pushinteger(L, st.passed);
+        lua_setfield(L, -2, "passed");
+        lua_pushinteger(L, st.received);
+        lua_setfield(L, -2, "received");
+        lua_pushinteger(L, dst.relayed);
+        lua_setfield(L, -2, "relayed");
+        lua_pushinteger(L, dst.relayed_bytes);
+        lua_setfield(L, -2, "relayed_bytes");
+        lua_pushinteger(L, dst.datagrams);
+        lua_setfield(L, -2, "datagrams");
+        lua_rawseti(L, -2, i+1);
+    }
+
+    return 1;
+}
+
+// sync(sh, dp) applies the configuration of datapath dp to the shards
+static int _sync(lua_State* L) {
+    struct shards* sh = luaW_checkptr(L, 1, MT);
+    struct datapath* dp = luaW_checkptr(L, 2, "datapath");
+
+    if (shards_sync(sh, dp) < 0) {
+        luaL_error(L, "out of memory");
+    }
+
+    return 0;
+}
+
+static const luaL_Reg funcs[] = {
+    {"close", _close},
+    {"get_fd", _get_fd},
+    {"new", _new},
+    {"stats", _stats},
+    {"sync", _sync},
+    {NULL, NULL},
+};
+
+LUAMOD_API int luaopen_shards(lua_State* L) {
+    luaL_checkversion(L);
+    luaL_newlib(L, funcs);
+
+    luaW_declptr(L, MT, (void(*)(void*))shards_free);
+
+    return 1;
+}
+
@@ -0,0 +1,63 @@
+#ifndef WIREHUB_SHARDS_H
+#define WIREHUB_SHARDS_H
+
+#include "datapath.h"
+
+/** Sharded ingress of WireHub packets.
+ *
+ * Received packets are processed by `count` native threads. Each shard
+ * receives the datagrams of its share of the sources (see ingress.h), and has
+ * its own cache of shared keys, egress queue, admission filter, rate limiter
+ * and datapath, so that shards never contend but on the routing table and on
+ * the cookies of egress queues.
+ *
+ * Shards verify the packets and handle those of the native datapath. Packets
+ * which must be handled by Lua are pushed on a lock-free queue consumed by the
+ * Lua state, which is woken up by an eventfd.
+ */
+struct shards;
+
+struct shards_stats {
+    uint64_t received;      // datagrams received
+    uint64_t passed;        // packets queued to Lua
+    uint64_t dropped;       // packets dropped as the queue was full
+};
+
+/** Starts `count` shards receiving WireHub packets sent to `port`, in batches
+ * of `batch` datagrams, and sending packets through raw UDP sockets fd4 and
+ * fd6. Shards' egress queues share the cookies of `egress` (see egress_new()).
+ *
+ * Secret key `sk` is copied. Each shard admits `verify_rate`/`count`
+ * verifications of unknown source keys per second. Shards' datapaths and rate
+ * limiters are configured as `dp` and `rl`, if not NULL. `dp` and its routing
+ * table must outlive the shards.
+ */
+struct shards* shards_new(const uint8_t* sk, uint16_t port, unsigned int count,
+                          unsigned int batch, int fd4, int fd6,
+                          struct egress* egress, uint32_t verify_rate, const struct datapath* dp,
+                          const struct ratelimit* rl);
+void shards_free(struct shards* sh);
+
+// returns the eventfd set when packets are queued
+int shards_fd(const struct shards* sh);
+
+unsigned int shards_count(const struct shards* sh);
+
+// applies the configuration of datapath `dp` to the shards' datapaths. returns
+// -1 if allocation failed.
+int shards_sync(struct shards* sh, const struct datapath* dp);
+
+// clears the eventfd. Must be called before the queue is drained.
+void shards_clear(struct shards* sh);
+
+// returns the oldest queued packet, its size `l` and source `src`, or NULL.
+// The packet is valid until shards_pop().
+const uint8_t* shards_front(struct shards* sh, size_t* l, struct address* src);
+void shards_pop(struct shards* sh);
+
+// sets statistics of shard `i`. `dst` may be NULL.
+void shards_stats(struct shards* sh, unsigned int i, struct shards_stats* st,
+                  struct datapath_stats* dst);
+
+#endif  // WIREHUB_SHARDS_H
+
@@ -0,0 +1,206 @@
+#include "spsc.h"
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#define CACHELINE 64
+#define ALIGN 8
+#define WRAP UINT64_MAX     // frame size marking the end of the ring
+
+struct spsc {
+    uint64_t tail __attribute__((aligned(CACHELINE)));
+    uint64_t head __attribute__((aligned(CACHELINE)));
+    int waiting;            // producer waits for space
+
+    size_t capacity;
+    int data_fd;            // set when frames are pushed
+    int own_fd;
+    int space_fd;           // set when frames are popped while producer waits
+    uint8_t* ring;
+};
+
+static size_t _align(size_t l) {
+    return (l + ALIGN-1) & ~(size_t)(ALIGN-1);
+}
+
+static void _signal(int fd) {
+    uint64_t one = 1;
+    if (write(fd, &one, sizeof(one)) < 0) {
+        assert(errno == EAGAIN);
+    }
+}
+
+static void _wait(int fd) {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    while (poll(&pfd, 1, -1) < 0 && errno == EINTR);
+}
+
+static int _drain(int fd) {
+    uint64_t v;
+    return read(fd, &v, sizeof(v)) == sizeof(v);
+}
+
+struct spsc* spsc_new(size_t capacity, int fd) {
+    assert(capacity >= CACHELINE && (capacity & (capacity-1)) == 0);
+
+    struct spsc* q = aligned_alloc(CACHELINE, sizeof(struct spsc));
+    if (!q) {
+        return NULL;
+    }
+
+    memset(q, 0, sizeof(*q));
+    q->capacity = capacity;
+    q->data_fd = fd;
+    q->own_fd = fd == -1;
+    q->space_fd = -1;
+
+    if (!(q->ring = aligned_alloc(CACHELINE, capacity)) ||
+        (q->own_fd && (q->data_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) == -1) ||
+        (q->space_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) == -1) {
+        int err = errno;
+        spsc_free(q);
+        errno = err;
+        return NULL;
+    }
+
+    return q;
+}
+
+void spsc_free(struct spsc* q) {
+    if (q->own_fd && q->data_fd != -1) {
+        close(q->data_fd);
+    }
+
+    if (q->space_fd != -1) {
+        close(q->space_fd);
+    }
+
+    free(q->ring);
+    free(q);
+}
+
+int spsc_fd(const struct spsc* q) {
+    return q->data_fd;
+}
+
+// returns the offset where a frame of `need` bytes is written, or -1 if the
+// queue is full
+static ssize_t _reserve(struct spsc* q, size_t need, int* wrap) {
+    uint64_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    size_t used = q->tail - head;
+    size_t off = q->tail & (q->capacity-1);
+
+    *wrap = off + need > q->capacity;
+    if (*wrap) {
+        // the end of the ring is skipped
+        need += q->capacity - off;
+        off = 0;
+    }
+
+    if (used + need > q->capacity) {
+        return -1;
+    }
+
+    return off;
+}
+
+int spsc_push(struct spsc* q, const void* m, size_t l) {
+    if (l > SPSC_MAXSIZE(q->capacity)) {
+        return -1;
+    }
+
+    size_t need = sizeof(uint64_t) + _align(l);
+
+    ssize_t off;
+    int wrap;
+    while ((off = _reserve(q, need, &wrap)) < 0) {
+        __atomic_store_n(&q->waiting, 1, __ATOMIC_SEQ_CST);
+
+        // consumer may have freed space before seeing the flag
+        if ((off = _reserve(q, need, &wrap)) >= 0) {
+            __atomic_store_n(&q->waiting, 0, __ATOMIC_RELAXED);
+            break;
+        }
+
+        _wait(q->space_fd);
+        _drain(q->space_fd);
+        __atomic_store_n(&q->waiting, 0, __ATOMIC_RELAXED);
+    }
+
+    uint64_t tail = q->tail;
+    if (wrap) {
+        size_t end = tail & (q->capacity-1);
+        uint64_t marker = WRAP;
+        memcpy(q->ring+end, &marker, sizeof(marker));
+        tail += q->capacity - end;
+    }
+
+    uint64_t sz = l;
+    memcpy(q->ring+off, &sz, sizeof(sz));
+    memcpy(q->ring+off+sizeof(sz), m, l);
+
+    __atomic_store_n(&q->tail, tail + need, __ATOMIC_RELEASE);
+    _signal(q->data_fd);
+
+    return 0;
+}
+
+const void* spsc_front(struct spsc* q, size_t* l) {
+    uint64_t tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+
+    while (q->head != tail) {
+        size_t off = q->head & (q->capacity-1);
+        uint64_t sz;
+        memcpy(&sz, q->ring+off, sizeof(sz));
+
+        if (sz == WRAP) {
+            // only the consumer reads head
+            __atomic_store_n(&q->head, q->head + q->capacity - off, __ATOMIC_RELEASE);
+            continue;
+        }
+
+        *l = sz;
+        return q->ring+off+sizeof(sz);
+    }
+
+    return NULL;
+}
+
+void spsc_pop(struct spsc* q) {
+    size_t off = q->head & (q->capacity-1);
+    uint64_t sz;
+    memcpy(&sz, q->ring+off, sizeof(sz));
+    assert(sz != WRAP);
+
+    __atomic_store_n(&q->head, q->head + sizeof(sz) + _align(sz), __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&q->waiting, __ATOMIC_SEQ_CST)) {
+        _signal(q->space_fd);
+    }
+}
+
+int spsc_clear(struct spsc* q) {
+    size_t l;
+    if (spsc_front(q, &l)) {
+        return 0;
+    }
+
+    _drain(q->data_fd);
+
+    // a frame pushed before the eventfd was cleared must keep it set
+    if (spsc_front(q, &l)) {
+        _signal(q->data_fd);
+        return 0;
+    }
+
+    return 1;
+}
+
+void spsc_wait(struct spsc* q) {
+    size_t l;
+    while (!spsc_front(q, &l)) {
+        _wait(q->data_fd);
+        _drain(q->data_fd);
+    }
+}
+
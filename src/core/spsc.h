@@ -0,0 +1,52 @@
+#ifndef WIREHUB_SPSC_H
+#define WIREHUB_SPSC_H
+
+#include "common.h"
+
+/** Bounded single-producer single-consumer queue of frames.
+ *
+ * Frames of variable size are copied in a ring of `capacity` bytes, shared by
+ * two threads. A frame is always contiguous: if it does not fit at the end of
+ * the ring, it is written at its start. The consumer reads frames in place.
+ *
+ * An eventfd is set when frames are pushed, so that the consumer may poll the
+ * queue. Several queues may share the same eventfd. A producer pushing in a
+ * full queue waits until the consumer frees enough space.
+ *
+ * Frames are at most half of the ring, so that an empty queue always has room
+ * for a frame, wherever the end of the ring falls.
+ */
+struct spsc;
+
+// maximum size of a frame of a queue of `capacity` bytes
+#define SPSC_MAXSIZE(capacity) ((capacity)/2 - sizeof(uint64_t))
+
+// capacity must be a power of two. `fd` is the eventfd set when frames are
+// pushed, or -1 to create one. The queue does not own a given eventfd.
+struct spsc* spsc_new(size_t capacity, int fd);
+void spsc_free(struct spsc* q);
+
+// returns the eventfd set when frames are pushed
+int spsc_fd(const struct spsc* q);
+
+// copies the frame `m` of `l` bytes. Blocks while the queue is full. returns -1
+// if the frame is larger than SPSC_MAXSIZE(capacity).
+int spsc_push(struct spsc* q, const void* m, size_t l);
+
+// returns the oldest frame and sets its size `l`, or NULL if the queue is
+// empty. The frame is valid until spsc_pop().
+const void* spsc_front(struct spsc* q, size_t* l);
+
+// releases the oldest frame
+void spsc_pop(struct spsc* q);
+
+// clears the eventfd if the queue is empty. returns 1 if it was cleared, else 0.
+// The eventfd is never cleared while frames are queued. Must not be used if the
+// eventfd is shared.
+int spsc_clear(struct spsc* q);
+
+// blocks until the queue is not empty
+void spsc_wait(struct spsc* q);
+
+#endif  // WIREHUB_SPSC_H
+
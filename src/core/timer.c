@@ -0,0 +1,288 @@
+#include "timer.h"
+
+#define TIMER_LEVELS    6
+#define SLOT_BITS       6
+#define SLOT_COUNT      (1 << SLOT_BITS)
+#define SLOT_MASK       (SLOT_COUNT-1)
+#define MAX_DELTA       ((UINT64_C(1) << (SLOT_BITS*TIMER_LEVELS)) - 1)
+#define NIL             ((uint32_t)-1)
+
+struct timer {
+    uint64_t deadline;
+    intptr_t ud;
+    uint32_t gen;
+    uint32_t prev, next;
+    uint8_t level, slot, used;
+};
+
+struct timerwheel {
+    uint64_t now;       // next tick to process
+    size_t count;
+
+    uint64_t bitmaps[TIMER_LEVELS];
+    uint32_t slots[TIMER_LEVELS][SLOT_COUNT];
+
+    struct timer* timers;
+    uint32_t capacity;
+    uint32_t free;
+};
+
+#define ID(i, gen) (((uint64_t)(gen) << 32) | (i))
+#define ID_INDEX(id) ((uint32_t)((id) & 0xffffffff))
+#define ID_GEN(id) ((uint32_t)((id) >> 32))
+
+struct timerwheel* timerwheel_new(void) {
+    struct timerwheel* w = calloc(1, sizeof(struct timerwheel));
+    if (!w) {
+        return NULL;
+    }
+
+    for (int l=0; l<TIMER_LEVELS; ++l) {
+        for (int s=0; s<SLOT_COUNT; ++s) {
+            w->slots[l][s] = NIL;
+        }
+    }
+
+    w->free = NIL;
+    return w;
+}
+
+void timerwheel_free(struct timerwheel* w) {
+    free(w->timers);
+    free(w);
+}
+
+size_t timer_count(const struct timerwheel* w) {
+    return w->count;
+}
+
+static void _link(struct timerwheel* w, uint32_t i) {
+    struct timer* t = &w->timers[i];
+
+    uint64_t d = t->deadline < w->now ? w->now : t->deadline;
+    uint64_t delta = d - w->now;
+    if (delta > MAX_DELTA) {
+        delta = MAX_DELTA;
+        d = w->now + delta;
+    }
+
+    int l = 0;
+    while (l < TIMER_LEVELS-1 && (delta >> (SLOT_BITS*(l+1)))) {
+        ++l;
+    }
+
+    int s = (d >> (SLOT_BITS*l)) & SLOT_MASK;
+    uint32_t* head = &w->slots[l][s];
+
+    t->level = l;
+    t->slot = s;
+    t->prev = NIL;
+    t->next = *head;
+    if (*head != NIL) {
+        w->timers[*head].prev = i;
+    }
+    *head = i;
+    w->bitmaps[l] |= UINT64_C(1) << s;
+}
+
+static void _unlink(struct timerwheel* w, uint32_t i) {
+    struct timer* t = &w->timers[i];
+    uint32_t* head = &w->slots[t->level][t->slot];
+
+    if (t->prev != NIL) {
+        w->timers[t->prev].next = t->next;
+    } else {
+        *head = t->next;
+    }
+
+    if (t->next != NIL) {
+        w->timers[t->next].prev = t->prev;
+    }
+
+    if (*head == NIL) {
+        w->bitmaps[t->level] &= ~(UINT64_C(1) << t->slot);
+    }
+}
+
+static void _release(struct timerwheel* w, uint32_t i) {
+    struct timer* t = &w->timers[i];
+
+    t->used = 0;
+    ++t->gen;
+    t->next = w->free;
+    w->free = i;
+    --w->count;
+}
+
+timer_id timer_add(struct timerwheel* w, uint64_t deadline, intptr_t ud) {
+    if (w->free == NIL) {
+        uint32_t capacity = w->capacity ? w->capacity*2 : 64;
+        struct timer* timers = realloc(w->timers, capacity*sizeof(struct timer));
+        if (!timers) {
+            return 0;
+        }
+
+        for (uint32_t i=capacity; i>w->capacity; --i) {
+            timers[i-1].used = 0;
+            timers[i-1].gen = 1;
+            timers[i-1].next = w->free;
+            w->free = i-1;
+        }
+
+        w->timers = timers;
+        w->capacity = capacity;
+    }
+
+    uint32_t i = w->free;
+    struct timer* t = &w->timers[i];
+    w->free = t->next;
+
+    t->deadline = deadline;
+    t->ud = ud;
+    t->used = 1;
+    ++w->count;
+    _link(w, i);
+
+    return ID(i, t->gen);
+}
+
+int timer_cancel(struct timerwheel* w, timer_id id, intptr_t* ud) {
+    uint32_t i = ID_INDEX(id);
+
+    if (i >= w->capacity) {
+        return 0;
+    }
+
+    struct timer* t = &w->timers[i];
+    if (!t->used || t->gen != ID_GEN(id)) {
+        return 0;
+    }
+
+    if (ud) {
+        *ud = t->ud;
+    }
+
+    _unlink(w, i);
+    _release(w, i);
+    return 1;
+}
+
+// returns the first non-empty slot of a level, starting from slot `from`, or
+// -1 if level is empty
+static int _first_slot(const struct timerwheel* w, int l, int from) {
+    uint64_t b = w->bitmaps[l];
+
+    if (!b) {
+        return -1;
+    }
+
+    b = (b >> from) | (from ? b << (SLOT_COUNT-from) : 0);
+    return (from + __builtin_ctzll(b)) & SLOT_MASK;
+}
+
+uint64_t timer_next(struct timerwheel* w) {
+    uint64_t best = UINT64_MAX;
+
+    if (w->count == 0) {
+        return best;
+    }
+
+    for (int l=0; l<TIMER_LEVELS; ++l) {
+        // level 0 starts at current tick, upper levels after current slot
+        int from = ((w->now >> (SLOT_BITS*l)) + (l ? 1 : 0)) & SLOT_MASK;
+        int s = _first_slot(w, l, from);
+
+        if (s == -1) {
+            continue;
+        }
+
+        uint32_t i;
+        for (i=w->slots[l][s]; i!=NIL; i=w->timers[i].next) {
+            if (w->timers[i].deadline < best) {
+                best = w->timers[i].deadline;
+            }
+        }
+    }
+
+    return best;
+}
+
+// advances wheel to tick `to`. No timer must be due before `to`. Timers of
+// upper levels whose slots were crossed cascade to lower levels.
+static void _advance(struct timerwheel* w, uint64_t to) {
+    uint32_t cascade = NIL;
+
+    if (to <= w->now) {
+        return;
+    }
+
+    for (int l=1; l<TIMER_LEVELS; ++l) {
+        uint64_t from_s = w->now >> (SLOT_BITS*l);
+        uint64_t to_s = to >> (SLOT_BITS*l);
+
+        if (from_s == to_s) {
+            break;
+        }
+
+        uint64_t crossed = to_s - from_s;
+        if (crossed > SLOT_COUNT) {
+            crossed = SLOT_COUNT;
+        }
+
+        for (uint64_t k=1; k<=crossed; ++k) {
+            int s = (from_s + k) & SLOT_MASK;
+            uint32_t i = w->slots[l][s];
+
+            while (i != NIL) {
+                uint32_t next = w->timers[i].next;
+                w->timers[i].next = cascade;
+                cascade = i;
+                i = next;
+            }
+
+            w->slots[l][s] = NIL;
+            w->bitmaps[l] &= ~(UINT64_C(1) << s);
+        }
+    }
+
+    w->now = to;
+
+    while (cascade != NIL) {
+        uint32_t next = w->timers[cascade].next;
+        _link(w, cascade);
+        cascade = next;
+    }
+}
+
+int timer_expired(struct timerwheel* w, uint64_t now, intptr_t* ud) {
+    uint64_t next = timer_next(w);
+
+    if (next > now) {
+        if (now != UINT64_MAX) {
+            _advance(w, now+1);
+        }
+
+        return 0;
+    }
+
+    // overdue timers are scheduled on the current tick
+    if (next < w->now) {
+        next = w->now;
+    }
+
+    _advance(w, next);
+
+    uint32_t i = w->slots[0][next & SLOT_MASK];
+    while (i != NIL && w->timers[i].deadline > now) {
+        i = w->timers[i].next;
+    }
+    assert(i != NIL);
+
+    if (ud) {
+        *ud = w->timers[i].ud;
+    }
+
+    _unlink(w, i);
+    _release(w, i);
+    return 1;
+}
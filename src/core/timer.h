@@ -0,0 +1,42 @@
+#ifndef WIREHUB_TIMER_H
+#define WIREHUB_TIMER_H
+
+#include "common.h"
+
+/** Hierarchical timer wheel.
+ *
+ * Timers are scheduled with a millisecond resolution on TIMER_LEVELS wheels of
+ * 64 slots each. Adding and cancelling a timer is O(1). Expiring timers only
+ * touches the slots holding due timers, and the timers cascading from upper
+ * wheels.
+ *
+ * Timer ids are never reused: cancelling an expired or cancelled timer is a
+ * no-op.
+ */
+struct timerwheel;
+
+typedef uint64_t timer_id;
+
+struct timerwheel* timerwheel_new(void);
+void timerwheel_free(struct timerwheel* w);
+
+// schedules a timer at tick `deadline`, in milliseconds. `ud` is returned when
+// timer expires. returns 0 if allocation failed.
+timer_id timer_add(struct timerwheel* w, uint64_t deadline, intptr_t ud);
+
+// cancels a timer. returns 1 and sets `ud` if timer was pending, else 0.
+int timer_cancel(struct timerwheel* w, timer_id id, intptr_t* ud);
+
+// pops one timer whose deadline is lower or equal to `now`. returns 1 and sets
+// `ud` if one was found, else 0. Timers are popped by tick order; overdue timers
+// are popped on the current tick.
+int timer_expired(struct timerwheel* w, uint64_t now, intptr_t* ud);
+
+// returns the earliest deadline of pending timers, or UINT64_MAX if none.
+uint64_t timer_next(struct timerwheel* w);
+
+// returns the count of pending timers
+size_t timer_count(const struct timerwheel* w);
+
+#endif  // WIREHUB_TIMER_H
+
@@ -0,0 +1,400 @@
+#include "verifier.h"
+#include "keycache.h"
+#include "luawh.h"
+#include "mpsc.h"
+#include "packet.h"
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sodium.h>
+#include <sys/eventfd.h>
+
+#define MT "verifier"
+#define SLOT_SIZE (sizeof(struct address)+WH_INGRESS_BUFSIZE)
+
+struct verifier_thread {
+    struct verifier* v;
+    pthread_t thread;
+    int started;
+
+    int wake_fd;
+    struct mpsc* queue;
+    struct keycache* kc;
+    int pending;            // packets were queued since last flush
+
+    // counters are written by one thread: queued and dropped inputs by Lua,
+    // others by the verifying thread
+    uint64_t queued;
+    uint64_t dropped_in;
+    uint64_t verified;
+    uint64_t rejected;
+    uint64_t dropped_out;
+};
+
+struct verifier {
+    uint8_t* sk;
+    uint8_t hash_k[crypto_shorthash_KEYBYTES];
+    unsigned int count;
+
+    int event_fd;           // wakes up Lua
+    int stop_fd;            // stops the threads
+    struct mpsc* queue;     // verified packets
+
+    struct verifier_thread* threads;
+};
+
+static void _inc(uint64_t* c) {
+    __atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED)+1, __ATOMIC_RELAXED);
+}
+
+static void _signal(int fd) {
+    uint64_t one = 1;
+    if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        fprintf(stderr, "error: verifier write() failed: %s\n", strerror(errno));
+    }
+}
+
+// verifies queued packets until drained. returns 1 if packets were verified.
+static int _verify(struct verifier_thread* t) {
+    int queued = 0;
+    const uint8_t* m;
+    size_t l;
+
+    while ((m = mpsc_front(t->queue, &l))) {
+        assert(l >= sizeof(struct address));
+        const uint8_t* p = m + sizeof(struct address);
+        size_t pl = l - sizeof(struct address);
+
+        if (verify_packet(t->kc, p, pl, t->v->sk) != 0) {
+            _inc(&t->rejected);
+        } else {
+            struct iovec iov = { .iov_base = (void*)m, .iov_len = l };
+
+            if (mpsc_push(t->v->queue, &iov, 1) < 0) {
+                _inc(&t->dropped_out);
+            } else {
+                _inc(&t->verified);
+                queued = 1;
+            }
+        }
+
+        mpsc_pop(t->queue);
+    }
+
+    return queued;
+}
+
+static void* _run(void* ud) {
+    struct verifier_thread* t = ud;
+
+    // signals are handled by the main thread
+    sigset_t set;
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    struct pollfd fds[2] = {
+        { .fd = t->wake_fd, .events = POLLIN },
+        { .fd = t->v->stop_fd, .events = POLLIN },
+    };
+
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            fprintf(stderr, "error: verifier poll() failed: %s\n", strerror(errno));
+            break;
+        }
+
+        if (fds[1].revents) {
+            break;
+        }
+
+        // packets queued from now on set the eventfd again
+        uint64_t v;
+        if (read(t->wake_fd, &v, sizeof(v)) < 0) {
+            assert(errno == EAGAIN);
+        }
+
+        if (_verify(t)) {
+            _signal(t->v->event_fd);
+        }
+    }
+
+    return NULL;
+}
+
+static void _free_thread(struct verifier_thread* t) {
+    if (t->kc) {
+        keycache_free(t->kc);
+    }
+
+    if (t->queue) {
+        mpsc_free(t->queue);
+    }
+
+    if (t->wake_fd != -1) {
+        close(t->wake_fd);
+    }
+}
+
+static int _init_thread(struct verifier* v, unsigned int i) {
+    struct verifier_thread* t = &v->threads[i];
+
+    t->v = v;
+
+    if ((t->wake_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) == -1 ||
+        !(t->queue = mpsc_new(WH_VERIFIER_QUEUE, SLOT_SIZE)) ||
+        !(t->kc = keycache_new(WH_KEYCACHE_SIZE))) {
+        return -1;
+    }
+
+    return 0;
+}
+
+struct verifier* verifier_new(const uint8_t* sk, unsigned int count) {
+    assert(count > 0);
+
+    struct verifier* v = calloc(1, sizeof(struct verifier));
+    if (!v) {
+        return NULL;
+    }
+
+    v->event_fd = v->stop_fd = -1;
+    randombytes_buf(v->hash_k, sizeof(v->hash_k));
+
+    if (!(v->sk = sodium_malloc(crypto_scalarmult_curve25519_BYTES)) ||
+        !(v->queue = mpsc_new(WH_VERIFIER_QUEUE, SLOT_SIZE)) ||
+        !(v->threads = calloc(count, sizeof(struct verifier_thread)))) {
+        goto err;
+    }
+
+    memcpy(v->sk, sk, crypto_scalarmult_curve25519_BYTES);
+
+    if ((v->event_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) == -1 ||
+        (v->stop_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) == -1) {
+        goto err;
+    }
+
+    for (; v->count < count; ++v->count) {
+        v->threads[v->count].wake_fd = -1;
+
+        if (_init_thread(v, v->count) < 0) {
+            ++v->count;
+            goto err;
+        }
+    }
+
+    for (unsigned int i=0; i<v->count; ++i) {
+        struct verifier_thread* t = &v->threads[i];
+
+        int err = pthread_create(&t->thread, NULL, _run, t);
+        if (err) {
+            errno = err;
+            goto err;
+        }
+
+        t->started = 1;
+    }
+
+    return v;
+
+err:
+    {
+        int err = errno ? errno : ENOMEM;
+        verifier_free(v);
+        errno = err;
+    }
+    return NULL;
+}
+
+void verifier_free(struct verifier* v) {
+    if (v->stop_fd != -1) {
+        // threads could not be joined if they were not stopped
+        uint64_t one = 1;
+        if (write(v->stop_fd, &one, sizeof(one)) != sizeof(one)) {
+            abort();
+        }
+    }
+
+    for (unsigned int i=0; i<v->count; ++i) {
+        if (v->threads[i].started) {
+            pthread_join(v->threads[i].thread, NULL);
+        }
+    }
+
+    for (unsigned int i=0; i<v->count; ++i) {
+        _free_thread(&v->threads[i]);
+    }
+
+    if (v->event_fd != -1) {
+        close(v->event_fd);
+    }
+
+    if (v->stop_fd != -1) {
+        close(v->stop_fd);
+    }
+
+    if (v->queue) {
+        mpsc_free(v->queue);
+    }
+
+    if (v->sk) {
+        sodium_free(v->sk);
+    }
+
+    free(v->threads);
+    free(v);
+}
+
+int verifier_fd(const struct verifier* v) {
+    return v->event_fd;
+}
+
+unsigned int verifier_count(const struct verifier* v) {
+    return v->count;
+}
+
+int verifier_push(struct verifier* v, const uint8_t* p, size_t l,
+                  const struct address* src) {
+    assert(l >= packet_size(0));
+
+    // packets of a source key are verified by the same thread
+    uint64_t h;
+    crypto_shorthash((uint8_t*)&h, packet_src(p), crypto_scalarmult_curve25519_BYTES,
+                     v->hash_k);
+    struct verifier_thread* t = &v->threads[h % v->count];
+
+    struct iovec iov[2] = {
+        { .iov_base = (void*)src, .iov_len = sizeof(*src) },
+        { .iov_base = (void*)p, .iov_len = l },
+    };
+
+    if (mpsc_push(t->queue, iov, 2) < 0) {
+        _inc(&t->dropped_in);
+        return -1;
+    }
+
+    _inc(&t->queued);
+    t->pending = 1;
+    return 0;
+}
+
+void verifier_flush(struct verifier* v) {
+    for (unsigned int i=0; i<v->count; ++i) {
+        struct verifier_thread* t = &v->threads[i];
+
+        if (t->pending) {
+            _signal(t->wake_fd);
+            t->pending = 0;
+        }
+    }
+}
+
+void verifier_clear(struct verifier* v) {
+    uint64_t val;
+    if (read(v->event_fd, &val, sizeof(val)) < 0) {
+        assert(errno == EAGAIN);
+    }
+}
+
+const uint8_t* verifier_front(struct verifier* v, size_t* l, struct address* src) {
+    size_t ml;
+    const uint8_t* m = mpsc_front(v->queue, &ml);
+    if (!m) {
+        return NULL;
+    }
+
+    assert(ml >= sizeof(*src));
+    memcpy(src, m, sizeof(*src));
+    *l = ml - sizeof(*src);
+    return m + sizeof(*src);
+}
+
+void verifier_pop(struct verifier* v) {
+    mpsc_pop(v->queue);
+}
+
+void verifier_stats(const struct verifier* v, unsigned int i,
+                    struct verifier_stats* st) {
+    assert(i < v->count);
+    const struct verifier_thread* t = &v->threads[i];
+
+    st->queued = __atomic_load_n(&t->queued, __ATOMIC_RELAXED);
+    st->verified = __atomic_load_n(&t->verified, __ATOMIC_RELAXED);
+    st->rejected = __atomic_load_n(&t->rejected, __ATOMIC_RELAXED);
+    st->dropped = __atomic_load_n(&t->dropped_in, __ATOMIC_RELAXED) +
+                  __atomic_load_n(&t->dropped_out, __ATOMIC_RELAXED);
+}
+
+/*** LUA *********************************************************************/
+
+static int _close(lua_State* L) {
+    verifier_free(luaW_ownptr(L, 1, MT));
+    return 0;
+}
+
+static int _get_fd(lua_State* L) {
+    struct verifier* v = luaW_checkptr(L, 1, MT);
+    lua_pushinteger(L, v->event_fd);
+    return 1;
+}
+
+// wh.verifier.new(sk, count)
+static int _new(lua_State* L) {
+    void* sk = luaW_checksecret(L, 1, crypto_scalarmult_curve25519_BYTES);
+    lua_Integer count = luaL_checkinteger(L, 2);
+
+    if (count <= 0 || 256 < count) {
+        luaL_error(L, "bad thread count: %d", (int)count);
+    }
+
+    struct verifier* v = verifier_new(sk, count);
+    if (!v) {
+        luaL_error(L, "verifier failed: %s", strerror(errno));
+    }
+
+    luaW_pushptr(L, MT, v);
+    return 1;
+}
+
+static int _stats(lua_State* L) {
+    struct verifier* v = luaW_checkptr(L, 1, MT);
+
+    lua_createtable(L, v->count, 0);
+    for (unsigned int i=0; i<v->count; ++i) {
+        struct verifier_stats st;
+        verifier_stats(v, i, &st);
+
+        lua_newtable(L);
+        lua_pushinteger(L, st.dropped);
+        lua_setfield(L, -2, "dropped");
+        lua_pushinteger(L, st.queued);
+        lua_setfield(L, -2, "queued");
+        lua_pushinteger(L, st.rejected);
+        lua_setfield(L, -2, "rejected");
+        lua_pushinteger(L, st.verified);
+        lua_setfield(L, -2, "verified");
+        lua_rawseti(L, -2, i+1);
+    }
+
+    return 1;
+}
+
+static const luaL_Reg funcs[] = {
+    {"close", _close},
+    {"get_fd", _get_fd},
+    {"new", _new},
+    {"stats", _stats},
+    {NULL, NULL},
+};
+
+LUAMOD_API int luaopen_verifier(lua_State* L) {
+    luaL_checkversion(L);
+    luaL_newlib(L, funcs);
+
+    luaW_declptr(L, MT, (void(*)(void*))verifier_free);
+
+    return 1;
+}
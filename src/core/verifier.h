@@ -0,0 +1,56 @@
+#ifndef WIREHUB_VERIFIER_H
+#define WIREHUB_VERIFIER_H
+
+#include "net.h"
+
+/** Pool of threads verifying WireHub packets.
+ *
+ * The Lua thread receives datagrams and filters them (see datapath_filter()),
+ * then queues the packets to be verified to the thread of their source key,
+ * so that packets of a peer are verified in order. Each thread has its own
+ * cache of shared keys.
+ *
+ * Verified packets are pushed on a lock-free queue consumed by the Lua thread,
+ * which is woken up by an eventfd. Packets of a peer are dequeued in the order
+ * they were received.
+ */
+struct verifier;
+
+struct verifier_stats {
+    uint64_t queued;        // packets queued to the thread
+    uint64_t verified;      // valid packets
+    uint64_t rejected;      // invalid packets
+    uint64_t dropped;       // packets dropped as a queue was full
+};
+
+// starts `count` threads. Secret key `sk` is copied.
+struct verifier* verifier_new(const uint8_t* sk, unsigned int count);
+void verifier_free(struct verifier* v);
+
+// returns the eventfd set when verified packets are queued
+int verifier_fd(const struct verifier* v);
+
+unsigned int verifier_count(const struct verifier* v);
+
+// queues packet `p` of `l` bytes, received from `src`, to be verified. returns
+// -1 if it was dropped.
+int verifier_push(struct verifier* v, const uint8_t* p, size_t l,
+                  const struct address* src);
+
+// wakes up the threads packets were queued to since the last call
+void verifier_flush(struct verifier* v);
+
+// clears the eventfd. Must be called before the queue is drained.
+void verifier_clear(struct verifier* v);
+
+// returns the oldest verified packet, its size `l` and source `src`, or NULL.
+// The packet is valid until verifier_pop().
+const uint8_t* verifier_front(struct verifier* v, size_t* l, struct address* src);
+void verifier_pop(struct verifier* v);
+
+// sets statistics of thread `i`
+void verifier_stats(const struct verifier* v, unsigned int i,
+                    struct verifier_stats* st);
+
+#endif  // WIREHUB_VERIFIER_H
+
@@ -1,9 +1,17 @@
+#include "admission.h"
+#include "datapath.h"
+#include "ingress.h"
 #include "key.h"
+#include "keycache.h"
 #include "luawh.h"
 #include "net.h"
 #include "os.h"
 #include "packet.h"
 #include "pcap.h"
+#include "ratelimit.h"
+#include "shards.h"
+#include "timer.h"
+#include "verifier.h"
 #include <dirent.h>
 #include <netinet/if_ether.h>
 #include <netinet/ip.h>
@@ -370,32 +378,10 @@ static int _unpack_address(lua_State* L) {
 
     struct address* a = luaW_newaddress(L);
 
-    switch (b[0]) {
-    case 0x04:
-        if (l < 1+4+2) {
-            luaL_error(L, "bad address");
-        }
-        l = 1+4+2;
-
-        a->sa_family = a->in4.sin_family = AF_INET;
-        memcpy(&a->in4.sin_addr, b+1, 4);
-        memcpy(&a->in4.sin_port, b+1+4, 2);
-        break;
-
-    case 0x06:
-        if (l < 1+16+2) {
-            luaL_error(L, "bad address");
-        }
-        l = 1+16+2;
-
-        a->sa_family = a->in6.sin6_family = AF_INET6;
-        memcpy(&a->in6.sin6_addr, b+1, 16);
-        memcpy(&a->in6.sin6_port, b+1+16, 2);
-        break;
-
-    default:
+    l = address_unpack(a, (const uint8_t*)b, l);
+    if (l == 0) {
         luaL_error(L, "bad packed address: %d", (int)b[0]);
-    };
+    }
 
     lua_pushinteger(L, l);
     return 2;
@@ -529,6 +515,7 @@ static int _socket_raw_udp(lua_State* L) {
     const char* proto = luaL_checkstring(L, 1);
 
     int hdrincl = 0;
+    int dontfrag = 0;
     sa_family_t sa_family;
     if (strcmp(proto, "ip4") == 0) {
         sa_family = AF_INET;
@@ -537,11 +524,17 @@ static int _socket_raw_udp(lua_State* L) {
     } else if (strcmp(proto, "ip4_hdrincl") == 0) {
         sa_family = AF_INET;
         hdrincl = 1;
+    } else if (strcmp(proto, "ip4_dontfrag") == 0) {
+        sa_family = AF_INET;
+        dontfrag = 1;
+    } else if (strcmp(proto, "ip6_dontfrag") == 0) {
+        sa_family = AF_INET6;
+        dontfrag = 1;
     } else {
         return luaL_error(L, "unknown protocol: %s", proto);
     }
 
-    int s = socket_raw_udp(sa_family, hdrincl);
+    int s = socket_raw_udp(sa_family, hdrincl, dontfrag);
     if (s == -1) {
         luaL_error(L, "socket error: %s", strerror(errno));
     }
@@ -596,18 +589,6 @@ static int _sendto_raw_udp(lua_State* L) {
         luaL_error(L, "packet too long");
     }
 
-    // prepare packet
-    void* pkt = malloc(UDP_HDRLEN+l);
-
-#define UDPHDR  ((struct udphdr*)(pkt+0))
-    UDPHDR->uh_sport = htons(src_port);
-    UDPHDR->uh_dport = htons(address_port(dst_addr));
-    UDPHDR->uh_ulen = htons(UDP_HDRLEN+l);
-    UDPHDR->uh_sum = 0x0000;
-#undef UDPHDR
-
-    memcpy(pkt+UDP_HDRLEN, m, l);
-
     int fd;
     switch (dst_addr->sa_family) {
     case AF_INET:  fd = fd4; break;
@@ -615,35 +596,17 @@ static int _sendto_raw_udp(lua_State* L) {
     default: return luaL_error(L, "bad address family");
     };
 
-#if 0
-    printf("sendto(fd=%d, #m=%d, #addr=%d)\n", fd, (int)(8+l), address_len(dst_addr));
-
-    printf("    \t");
-    for (int i=0; i<16; ++i) {
-        printf("%.2x ", i);
-    }
-    for (int i=0; i<(int)(8+l); ++i) {
-        if (i%16 == 0) {
-            printf("\n%.4x\t", i);
-        }
-
-        printf("%.2x ", (int)((uint8_t*)pkt)[i]);
-    }
-    printf("\n");
-#endif
-
-    const int flags = 0;
-    ssize_t r = sendto(fd, pkt, 8+l, flags, &dst_addr->in, address_len(dst_addr));
-
-    free(pkt);
+    // the UDP header is built on the stack, the payload is the Lua string
+    struct iovec iov = { .iov_base = (void*)m, .iov_len = l };
+    ssize_t r = sendto_raw_udp(fd, &iov, 1, src_port, dst_addr);
 
     if (r < 0) {
         lua_pushboolean(L, 0);
         lua_pushstring(L, strerror(errno));
         return 2;
-    } else if ((size_t)r != 8+l) {
+    } else if ((size_t)r != UDP_HDRLEN+l) {
         lua_pushboolean(L, 0);
-        lua_pushfstring(L, "truncated send: %dB != %dB", r, 8+l);
+        lua_pushfstring(L, "truncated send: %dB != %dB", (int)r, (int)(UDP_HDRLEN+l));
         return 2;
     } else {
         lua_pushboolean(L, 1);
@@ -746,68 +709,16 @@ static int _sendto_raw_wg(lua_State* L) {
         luaL_error(L, "packet too long");
     }
 
-    // prepare packet
-    void* pkt = malloc(IP4_HDRLEN+UDP_HDRLEN+l);
-
-    struct sockaddr_in dst_addr;
-    dst_addr.sin_family = AF_INET;
-    dst_addr.sin_addr.s_addr = htonl(0x7f000001);
-    dst_addr.sin_port = htons(wg_port);
-
-#define IPHDR   ((struct ip*)(pkt+0))
-    memset(IPHDR, 0, sizeof(struct ip));
-    IPHDR->ip_hl = IP4_HDRLEN/sizeof(uint32_t);
-    IPHDR->ip_v = 4;
-    IPHDR->ip_tos = 0;
-    IPHDR->ip_len = htons(IP4_HDRLEN+UDP_HDRLEN);
-    IPHDR->ip_id = 0;
-    IPHDR->ip_off = 0;
-    IPHDR->ip_ttl = 255;
-    IPHDR->ip_p = IPPROTO_UDP;
-    memcpy(&IPHDR->ip_src, &src_addr->in4.sin_addr, 4);
-    memcpy(&IPHDR->ip_dst, &dst_addr.sin_addr, 4);
-    IPHDR->ip_sum = 0;
-    //IPHDR->ip_sum = checksum_ip(IPHDR, IP4_HDRLEN);
-#undef IPHDR
-
-#define UDPHDR  ((struct udphdr*)(pkt+IP4_HDRLEN))
-    UDPHDR->uh_sport = htons(address_port(src_addr));
-    UDPHDR->uh_dport = dst_addr.sin_port;
-    UDPHDR->uh_ulen = htons(UDP_HDRLEN+l);
-    UDPHDR->uh_sum = 0x0000;
-#undef UDPHDR
-
-    memcpy(pkt+IP4_HDRLEN+UDP_HDRLEN, m, l);
-
-#if 0
-    printf("sendto_raw_wg(fd=%d, #m=%d, #addr=%d)\n", fd, (int)(8+l), address_len(dst_addr));
-
-    printf("    \t");
-    for (int i=0; i<16; ++i) {
-        printf("%.2x ", i);
-    }
-    for (int i=0; i<(int)(8+l); ++i) {
-        if (i%16 == 0) {
-            printf("\n%.4x\t", i);
-        }
-
-        printf("%.2x ", (int)((uint8_t*)pkt)[i]);
-    }
-    printf("\n");
-#endif
-
-    const int flags = 0;
-    ssize_t r = sendto(fd4, pkt, IP4_HDRLEN+UDP_HDRLEN+l, flags, (struct sockaddr*)&dst_addr, sizeof(dst_addr));
-
-    free(pkt);
+    struct iovec iov = { .iov_base = (void*)m, .iov_len = l };
+    ssize_t r = sendto_raw_wg(fd4, &iov, 1, src_addr, wg_port);
 
     if (r < 0) {
         lua_pushboolean(L, 0);
         lua_pushstring(L, strerror(errno));
         return 2;
-    } else if ((size_t)r != 0x1c+l) {
+    } else if ((size_t)r != IP4_HDRLEN+UDP_HDRLEN+l) {
         lua_pushboolean(L, 0);
-        lua_pushfstring(L, "truncated send: %dB != %dB", r, 8+l);
+        lua_pushfstring(L, "truncated send: %dB != %dB", (int)r, (int)(IP4_HDRLEN+UDP_HDRLEN+l));
         return 2;
     } else {
         lua_pushboolean(L, 1);
@@ -877,15 +788,17 @@ static int _get_pcap(lua_State* L) {
     return 2;
 }
 
-static int _pcap_next_udp(lua_State* L) {
-    pcap_t* h = luaW_checkptr(L, 1, "pcap");
-
+// reads next UDP datagram from pcap handler. returns 1 if a datagram was read,
+// 0 if none is available, -1 if the captured packet is not a valid IPv4 UDP
+// datagram and PCAP_ERROR on error.
+static int _pcap_read_udp(pcap_t* h, const void** m, size_t* l,
+                          struct address* src, struct address* dst) {
     struct pcap_pkthdr* hdr = NULL;
     const u_char* data = NULL;
     int r = pcap_next_ex(h, &hdr, &data);
 
     if (r == PCAP_ERROR) {
-        return luaL_error(L, "pcap_next_ex() failed: %s", pcap_geterr(h));
+        return PCAP_ERROR;
     }
 
     assert (hdr);
@@ -895,12 +808,12 @@ static int _pcap_next_udp(lua_State* L) {
     }
 
     if (hdr->caplen != hdr->len) {
-        return 0;
+        return -1;
     }
 
     const size_t pcap_hdr_sz = 16;
     if (hdr->len < pcap_hdr_sz) {
-        return 0;
+        return -1;
     }
 
     uint16_t proto;
@@ -908,16 +821,32 @@ static int _pcap_next_udp(lua_State* L) {
     proto = ntohs(proto);
 
     if (proto != ETHERTYPE_IP) {
-        return 0;
+        return -1;
     }
 
-    const void* m;
     const void* d = data + pcap_hdr_sz;
-    size_t l = hdr->len - pcap_hdr_sz;
+    *l = hdr->len - pcap_hdr_sz;
+    if (ip4_to_udp(d, m, l, src, dst) == -1) {
+        return -1;
+    }
+
+    return 1;
+}
+
+static int _pcap_next_udp(lua_State* L) {
+    pcap_t* h = luaW_checkptr(L, 1, "pcap");
+
+    const void* m;
+    size_t l;
     struct address* src = luaW_newaddress(L);
     struct address* dst = luaW_newaddress(L);
-    if (ip4_to_udp(d, &m, &l, src, dst) == -1) {
-        printf("FAILED! ip4_to_udp()\n");
+    int r = _pcap_read_udp(h, &m, &l, src, dst);
+
+    if (r == PCAP_ERROR) {
+        return luaL_error(L, "pcap_next_ex() failed: %s", pcap_geterr(h));
+    }
+
+    if (r != 1) {
         return 0;
     }
 
@@ -999,10 +928,11 @@ static int _select(lua_State* L) {
 
 static int _packet(lua_State* L) {
     size_t l;
+    struct keycache* kc = luaW_checkptr(L, lua_upvalueindex(1), "keycache");
     void* src_wg_sk = luaW_checksecret(L, 1, crypto_scalarmult_curve25519_BYTES);
 
-    uint8_t src_wg_pk[crypto_scalarmult_curve25519_BYTES];
-    if (crypto_scalarmult_base(src_wg_pk, src_wg_sk)) {
+    const uint8_t* src_wg_pk = keycache_publickey(kc, src_wg_sk);
+    if (!src_wg_pk) {
         luaL_error(L, "bad private key");
     }
 
@@ -1012,23 +942,18 @@ static int _packet(lua_State* L) {
     }
 
     luaL_checktype(L, 3, LUA_TBOOLEAN);
-    uint64_t is_nated = lua_toboolean(L, 3) ? 1 : 0;
+    int is_nated = lua_toboolean(L, 3);
 
     const void* m = luaL_checklstring(L, 4, &l);
-    uint64_t flags_time_b = 0;
-    flags_time_b |= (htobe64(now_seconds()) & packet_flags_TIMEMASK) << packet_flags_TIMESHIFT;
-    flags_time_b |= (is_nated & packet_flags_DIRECTMASK) << packet_flags_DIRECTSHIFT;
 
     size_t sz = packet_size(l);
     luaL_Buffer b;
-    void* pkt = luaL_buffinitsize(L, &b, sz);
+    uint8_t* pkt = (uint8_t*)luaL_buffinitsize(L, &b, sz);
 
-    memcpy(packet_hdr(pkt), wh_pkt_hdr, sizeof(wh_pkt_hdr));
-    memcpy(packet_src(pkt), src_wg_pk, crypto_scalarmult_curve25519_BYTES);
-    memcpy(packet_flags_time(pkt), &flags_time_b, sizeof(flags_time_b));
+    packet_init(pkt, src_wg_pk, is_nated);
     memcpy(packet_body(pkt), m, l);
 
-    if (auth_packet(pkt, l, src_wg_sk, dst_wg_pk)) {
+    if (auth_packet(kc, pkt, l, src_wg_sk, dst_wg_pk)) {
         luaL_error(L, "auth failed");
     }
 
@@ -1037,19 +962,62 @@ static int _packet(lua_State* L) {
     return 1;
 }
 
+// wh.session_packet(sk, relay_k, id, m) -> packet
+//
+// Builds a session packet of relay session id, bound with peer relay_k.
+static int _session_packet(lua_State* L) {
+    size_t l;
+    struct keycache* kc = luaW_checkptr(L, lua_upvalueindex(1), "keycache");
+    void* sk = luaW_checksecret(L, 1, crypto_scalarmult_curve25519_BYTES);
+
+    const void* relay_k = luaL_checklstring(L, 2, &l);
+    if (l != crypto_scalarmult_curve25519_BYTES) {
+        luaL_error(L, "bad public key");
+    }
+
+    lua_Integer id = luaL_checkinteger(L, 3);
+    luaL_argcheck(L, (id & 0xffffffff) == id, 3, "bad session id");
+
+    const void* m = luaL_checklstring(L, 4, &l);
+
+    uint8_t key[SESSION_KEYBYTES];
+    if (session_key(kc, sk, relay_k, id, key) != 0) {
+        luaL_error(L, "key exchange failed");
+    }
+
+    size_t sz = session_size(l);
+    luaL_Buffer b;
+    uint8_t* pkt = (uint8_t*)luaL_buffinitsize(L, &b, sz);
+
+    memcpy(session_body(pkt), m, l);
+    session_auth(pkt, id, l, key);
+    sodium_memzero(key, sizeof(key));
+
+    luaL_pushresultsize(&b, sz);
+
+    return 1;
+}
+
+static void _packet_flags_time(const uint8_t* pkt, uint64_t* time_s, int* is_nated) {
+    uint64_t flags_time_s;
+    memcpy(&flags_time_s, packet_flags_time(pkt), sizeof(flags_time_s));
+    *time_s = be64toh((flags_time_s >> packet_flags_TIMESHIFT) & packet_flags_TIMEMASK);
+    *is_nated = (flags_time_s >> packet_flags_DIRECTSHIFT) & packet_flags_DIRECTMASK;
+}
+
 static int _open_packet(lua_State* L) {
+    struct keycache* kc = luaW_checkptr(L, lua_upvalueindex(1), "keycache");
     void* dst_wg_sk = luaW_checksecret(L, 1, crypto_scalarmult_curve25519_BYTES);
     size_t sz;
     const void* pkt = luaL_checklstring(L, 2, &sz);
 
-    if (verify_packet(pkt, sz, dst_wg_sk)) {
+    if (verify_packet(kc, pkt, sz, dst_wg_sk)) {
         return 0;
     }
 
-    uint64_t flags_time_s;
-    memcpy(&flags_time_s, packet_flags_time(pkt), sizeof(flags_time_s));
-    uint64_t time_s = be64toh((flags_time_s >> packet_flags_TIMESHIFT) & packet_flags_TIMEMASK);
-    uint64_t is_nated = (flags_time_s >> packet_flags_DIRECTSHIFT) & packet_flags_DIRECTMASK;
+    uint64_t time_s;
+    int is_nated;
+    _packet_flags_time(pkt, &time_s, &is_nated);
 
     lua_pushlstring(L, packet_src(pkt), crypto_scalarmult_curve25519_BYTES);
     lua_pushboolean(L, is_nated);
@@ -1059,6 +1027,426 @@ static int _open_packet(lua_State* L) {
     return 4;
 }
 
+// Batched packet opening. Valid packets are appended to the table on top of
+// the stack as OPEN_PACKETS_STRIDE consecutive values: source (the value at
+// index src_idx), packet size, src_k, is_nated, time and body.
+#define OPEN_PACKETS_STRIDE 6
+
+static void _append_opened(lua_State* L, const uint8_t* pkt, size_t sz,
+                           int src_idx, lua_Integer* n) {
+    uint64_t time_s;
+    int is_nated;
+    _packet_flags_time(pkt, &time_s, &is_nated);
+
+    lua_pushvalue(L, src_idx);
+    lua_rawseti(L, -2, ++(*n));
+    lua_pushinteger(L, sz);
+    lua_rawseti(L, -2, ++(*n));
+    lua_pushlstring(L, (const char*)packet_src(pkt), crypto_scalarmult_curve25519_BYTES);
+    lua_rawseti(L, -2, ++(*n));
+    lua_pushboolean(L, is_nated);
+    lua_rawseti(L, -2, ++(*n));
+    lua_pushinteger(L, time_s);
+    lua_rawseti(L, -2, ++(*n));
+    lua_pushlstring(L, (const char*)packet_body(pkt), sz-packet_size(0));
+    lua_rawseti(L, -2, ++(*n));
+}
+
+static int _append_packet(lua_State* L, struct keycache* kc, const void* sk,
+                          const uint8_t* pkt, size_t sz, int src_idx,
+                          lua_Integer* n) {
+    if (verify_packet(kc, pkt, sz, sk)) {
+        return 0;
+    }
+
+    _append_opened(L, pkt, sz, src_idx, n);
+    return 1;
+}
+
+// as _append_packet, for a datagram received from address src. Datagrams
+// are received by datapath_receive(): dp, rl and adm may be NULL. If vf is not
+// NULL, packets are queued to be verified by its threads instead.
+static void _append_datagram(lua_State* L, struct keycache* kc, const void* sk,
+                             struct datapath* dp, struct ratelimit* rl,
+                             struct admission* adm, struct verifier* vf,
+                             const uint8_t* m, size_t l,
+                             const struct address* src, lua_Integer* n) {
+    if (vf) {
+        if (datapath_filter(dp, kc, sk, rl, adm, &m, &l, src)) {
+            verifier_push(vf, m, l, src);
+        }
+
+        return;
+    }
+
+    if (!datapath_receive(dp, kc, sk, rl, adm, &m, &l, src)) {
+        return;
+    }
+
+    struct address* a = luaW_newaddress(L);
+    memcpy(a, src, sizeof(*src));
+    lua_insert(L, -2);
+    _append_opened(L, m, l, -2, n);
+    lua_remove(L, -2);
+}
+
+static struct datapath* _optdatapath(lua_State* L, int idx) {
+    return lua_isnoneornil(L, idx) ? NULL : luaW_checkptr(L, idx, "datapath");
+}
+
+static struct ratelimit* _optratelimit(lua_State* L, int idx) {
+    return lua_isnoneornil(L, idx) ? NULL : luaW_checkptr(L, idx, "ratelimit");
+}
+
+static struct admission* _optadmission(lua_State* L, int idx) {
+    return lua_isnoneornil(L, idx) ? NULL : luaW_checkptr(L, idx, "admission");
+}
+
+static struct verifier* _optverifier(lua_State* L, int idx) {
+    return lua_isnoneornil(L, idx) ? NULL : luaW_checkptr(L, idx, "verifier");
+}
+
+// wh.open_packets(sk, packets [, srcs]) -> results
+//
+// Opens a list of packets. Source of each valid packet is srcs[i] if given,
+// else its index i in the list.
+static int _open_packets(lua_State* L) {
+    struct keycache* kc = luaW_checkptr(L, lua_upvalueindex(1), "keycache");
+    void* sk = luaW_checksecret(L, 1, crypto_scalarmult_curve25519_BYTES);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    int has_srcs = !lua_isnoneornil(L, 3);
+    if (has_srcs) {
+        luaL_checktype(L, 3, LUA_TTABLE);
+    }
+
+    lua_Integer count = luaL_len(L, 2);
+    lua_Integer n = 0;
+    lua_createtable(L, count*OPEN_PACKETS_STRIDE, 0);
+
+    for (lua_Integer i=1; i<=count; ++i) {
+        size_t sz;
+        lua_rawgeti(L, 2, i);
+        const uint8_t* pkt = (const uint8_t*)lua_tolstring(L, -1, &sz);
+
+        if (has_srcs) {
+            lua_rawgeti(L, 3, i);
+        } else {
+            lua_pushinteger(L, i);
+        }
+
+        if (pkt) {
+            lua_pushvalue(L, -3);
+            _append_packet(L, kc, sk, pkt, sz, -2, &n);
+            lua_pop(L, 1);
+        }
+
+        lua_pop(L, 2);
+    }
+
+    return 1;
+}
+
+// wh.pcap_open_packets(h, sk, max [, dp [, rl [, adm [, vf]]]]) -> results, count
+//
+// Reads and opens up to max datagrams from pcap handler h. Source of each
+// valid packet is its source address. count is the number of datagrams read,
+// valid or not; if lower than max, handler is drained. Packets handled by
+// datapath dp, over the budget of rate limiter rl, or not admitted by
+// admission filter adm, are not returned. If verifier vf is given, packets are
+// not returned but queued to vf (see wh.verifier_open_packets).
+static int _pcap_open_packets(lua_State* L) {
+    struct keycache* kc = luaW_checkptr(L, lua_upvalueindex(1), "keycache");
+    pcap_t* h = luaW_checkptr(L, 1, "pcap");
+    void* sk = luaW_checksecret(L, 2, crypto_scalarmult_curve25519_BYTES);
+    lua_Integer max = luaL_checkinteger(L, 3);
+    struct datapath* dp = _optdatapath(L, 4);
+    struct ratelimit* rl = _optratelimit(L, 5);
+    struct admission* adm = _optadmission(L, 6);
+    struct verifier* vf = _optverifier(L, 7);
+
+    lua_Integer n = 0;
+    lua_Integer count = 0;
+    lua_newtable(L);
+
+    while (count < max) {
+        const void* m;
+        size_t l;
+        struct address src, dst;
+        memset(&src, 0, sizeof(src));
+        memset(&dst, 0, sizeof(dst));
+        int r = _pcap_read_udp(h, &m, &l, &src, &dst);
+
+        if (r == PCAP_ERROR) {
+            return luaL_error(L, "pcap_next_ex() failed: %s", pcap_geterr(h));
+        }
+
+        if (r == 0) {
+            break;
+        }
+
+        ++count;
+
+        if (r == 1) {
+            _append_datagram(L, kc, sk, dp, rl, adm, vf, m, l, &src, &n);
+        }
+    }
+
+    if (vf) {
+        verifier_flush(vf);
+    }
+
+    lua_pushinteger(L, count);
+    return 2;
+}
+
+static int _keycache_forget(lua_State* L) {
+    struct keycache* kc = luaW_checkptr(L, lua_upvalueindex(1), "keycache");
+    size_t l;
+    const void* k = luaL_checklstring(L, 1, &l);
+    if (l != crypto_scalarmult_curve25519_BYTES) {
+        luaL_error(L, "bad public key");
+    }
+
+    lua_pushinteger(L, keycache_forget(kc, k));
+    return 1;
+}
+
+static int _keycache_stats(lua_State* L) {
+    struct keycache* kc = luaW_checkptr(L, lua_upvalueindex(1), "keycache");
+    struct keycache_stats st;
+    keycache_stats(kc, &st);
+
+    lua_newtable(L);
+    lua_pushinteger(L, st.hits);
+    lua_setfield(L, -2, "hits");
+    lua_pushinteger(L, st.misses);
+    lua_setfield(L, -2, "misses");
+    lua_pushinteger(L, st.evictions);
+    lua_setfield(L, -2, "evictions");
+    lua_pushinteger(L, st.size);
+    lua_setfield(L, -2, "size");
+    lua_pushinteger(L, st.capacity);
+    lua_setfield(L, -2, "capacity");
+
+    return 1;
+}
+
+// wh.ingress_open_packets(h, sk, fd [, dp [, rl [, adm [, vf]]]]) -> results, count
+//
+// Receives and opens one batch of datagrams from socket fd of ingress h.
+// Source of each valid packet is its source address. count is the number of
+// datagrams received, valid or not; if lower than the batch size, socket is
+// drained. Packets handled by datapath dp, over the budget of rate limiter rl,
+// or not admitted by admission filter adm, are not returned. If verifier vf is
+// given, packets are not returned but queued to vf.
+static int _ingress_open_packets(lua_State* L) {
+    struct keycache* kc = luaW_checkptr(L, lua_upvalueindex(1), "keycache");
+    struct ingress* in = luaW_checkptr(L, 1, "ingress");
+    void* sk = luaW_checksecret(L, 2, crypto_scalarmult_curve25519_BYTES);
+    int fd = luaL_checkinteger(L, 3);
+    struct datapath* dp = _optdatapath(L, 4);
+    struct ratelimit* rl = _optratelimit(L, 5);
+    struct admission* adm = _optadmission(L, 6);
+    struct verifier* vf = _optverifier(L, 7);
+
+    if (fd != ingress_fd(in, AF_INET) && fd != ingress_fd(in, AF_INET6)) {
+        luaL_error(L, "bad file descriptor: %d", fd);
+    }
+
+    int count = ingress_recv(in, fd);
+    if (count < 0) {
+        luaL_error(L, "recvmmsg() failed: %s", strerror(errno));
+    }
+
+    lua_Integer n = 0;
+    lua_newtable(L);
+
+    for (int i=0; i<count; ++i) {
+        const void* m;
+        size_t l;
+        struct address src;
+
+        if (ingress_datagram(in, i, &m, &l, &src) == 0) {
+            _append_datagram(L, kc, sk, dp, rl, adm, vf, m, l, &src, &n);
+        }
+    }
+
+    if (vf) {
+        verifier_flush(vf);
+    }
+
+    lua_pushinteger(L, count);
+    return 2;
+}
+
+// wh.shards_open_packets(sh, max) -> results, count
+//
+// Reads at most max packets queued by the shards of sh. Packets were verified
+// by the shards. count is the number of read packets; if lower than max, the
+// queue is drained.
+static int _shards_open_packets(lua_State* L) {
+    struct shards* sh = luaW_checkptr(L, 1, "shards");
+    lua_Integer max = luaL_checkinteger(L, 2);
+
+    // packets queued from now on set the eventfd again
+    shards_clear(sh);
+
+    lua_Integer n = 0;
+    lua_newtable(L);
+
+    lua_Integer count;
+    for (count=0; count<max; ++count) {
+        const uint8_t* m;
+        size_t l;
+        struct address src;
+
+        if (!(m = shards_front(sh, &l, &src))) {
+            break;
+        }
+
+        memcpy(luaW_newaddress(L), &src, sizeof(src));
+        lua_insert(L, -2);
+        _append_opened(L, m, l, -2, &n);
+        lua_remove(L, -2);
+
+        shards_pop(sh);
+    }
+
+    lua_pushinteger(L, count);
+    return 2;
+}
+
+// wh.verifier_open_packets(vf, sk, max [, dp [, rl [, adm]]]) -> results, count
+//
+// Reads at most max packets verified by the threads of vf. Packets handled by
+// datapath dp, or over the budget of their source key in rl, are not
+// returned. Cookies of their sources are dropped from admission filter adm. count is the number of read packets; if lower
+// than max, the queue is drained.
+static int _verifier_open_packets(lua_State* L) {
+    struct keycache* kc = luaW_checkptr(L, lua_upvalueindex(1), "keycache");
+    struct verifier* vf = luaW_checkptr(L, 1, "verifier");
+    void* sk = luaW_checksecret(L, 2, crypto_scalarmult_curve25519_BYTES);
+    lua_Integer max = luaL_checkinteger(L, 3);
+    struct datapath* dp = _optdatapath(L, 4);
+    struct ratelimit* rl = _optratelimit(L, 5);
+    struct admission* adm = _optadmission(L, 6);
+
+    // packets queued from now on set the eventfd again
+    verifier_clear(vf);
+
+    lua_Integer n = 0;
+    lua_newtable(L);
+
+    lua_Integer count;
+    for (count=0; count<max; ++count) {
+        const uint8_t* m;
+        size_t l;
+        struct address src;
+
+        if (!(m = verifier_front(vf, &l, &src))) {
+            break;
+        }
+
+        if (datapath_deliver(dp, kc, sk, rl, adm, m, l, &src)) {
+            memcpy(luaW_newaddress(L), &src, sizeof(src));
+            lua_insert(L, -2);
+            _append_opened(L, m, l, -2, &n);
+            lua_remove(L, -2);
+        }
+
+        verifier_pop(vf);
+    }
+
+    lua_pushinteger(L, count);
+    return 2;
+}
+
+/*** TIMERS ****************************************************************/
+
+// timers' deadlines are stored in milliseconds. Values are referenced in the
+// user value of the wheel.
+
+static int _timer_add(lua_State* L) {
+    struct timerwheel* w = luaW_checkptr(L, lua_upvalueindex(1), "timerwheel");
+    lua_Number deadline = luaL_checknumber(L, 1);
+    luaL_checkany(L, 2);
+    if (lua_isnil(L, 2)) {
+        luaL_error(L, "bad timer value (nil)");
+    }
+
+    if (deadline < 0) {
+        deadline = 0;
+    }
+
+    lua_getuservalue(L, lua_upvalueindex(1));
+    lua_pushvalue(L, 2);
+    int ref = luaL_ref(L, -2);
+
+    // round up, to never expire before deadline
+    uint64_t tick = (uint64_t)(deadline * 1000);
+    if ((lua_Number)tick < deadline * 1000) {
+        ++tick;
+    }
+
+    timer_id id = timer_add(w, tick, ref);
+    if (id == 0) {
+        luaL_unref(L, -1, ref);
+        luaL_error(L, "timer allocation failed");
+    }
+
+    lua_pushinteger(L, (lua_Integer)id);
+    return 1;
+}
+
+static int _timer_cancel(lua_State* L) {
+    struct timerwheel* w = luaW_checkptr(L, lua_upvalueindex(1), "timerwheel");
+    timer_id id = (timer_id)luaL_checkinteger(L, 1);
+
+    intptr_t ref;
+    int found = timer_cancel(w, id, &ref);
+    if (found) {
+        lua_getuservalue(L, lua_upvalueindex(1));
+        luaL_unref(L, -1, ref);
+        lua_pop(L, 1);
+    }
+
+    lua_pushboolean(L, found);
+    return 1;
+}
+
+// returns the values of all expired timers
+static int _timer_expired(lua_State* L) {
+    struct timerwheel* w = luaW_checkptr(L, lua_upvalueindex(1), "timerwheel");
+    lua_Number now = luaL_checknumber(L, 1);
+    uint64_t tick = now > 0 ? (uint64_t)(now * 1000) : 0;
+
+    lua_getuservalue(L, lua_upvalueindex(1));
+    int refs_idx = lua_gettop(L);
+    lua_newtable(L);
+
+    intptr_t ref;
+    lua_Integer n = 0;
+    while (timer_expired(w, tick, &ref)) {
+        lua_rawgeti(L, refs_idx, ref);
+        lua_rawseti(L, -2, ++n);
+        luaL_unref(L, refs_idx, ref);
+    }
+
+    return 1;
+}
+
+static int _timer_next(lua_State* L) {
+    struct timerwheel* w = luaW_checkptr(L, lua_upvalueindex(1), "timerwheel");
+    uint64_t tick = timer_next(w);
+
+    if (tick == UINT64_MAX) {
+        return 0;
+    }
+
+    lua_pushnumber(L, (lua_Number)tick / 1000);
+    return 1;
+}
+
 /*** DAEMON ******************************************************************/
 
 static int _syslog_print(lua_State* L) {
@@ -1195,9 +1583,7 @@ static const luaL_Reg funcs[] = {
     {"get_pcap", _get_pcap},
     {"netdevs", _netdevs},
     {"now", _now},
-    {"open_packet", _open_packet},
     {"orchid", _orchid},
-    {"packet", _packet},
     {"pcap_next_udp", _pcap_next_udp},
     {"publickey", _publickey},
     {"randombytes", _randombytes},
@@ -1210,6 +1596,7 @@ static const luaL_Reg funcs[] = {
     {"sendto", _sendto},
     {"sendto_raw_udp", _sendto_raw_udp},
     {"sendto_raw_wg", _sendto_raw_wg},
+    {"shards_open_packets", _shards_open_packets},
     {"set_address_port", _set_address_port},
     {"sniff", _sniff},
     {"socket_raw_udp", _socket_raw_udp},
@@ -1223,6 +1610,29 @@ static const luaL_Reg funcs[] = {
     {NULL, NULL},
 };
 
+// functions sharing the shared key cache as first upvalue
+static const luaL_Reg keycache_funcs[] = {
+    {"ingress_open_packets", _ingress_open_packets},
+    {"keycache_forget", _keycache_forget},
+    {"keycache_stats", _keycache_stats},
+    {"open_packet", _open_packet},
+    {"open_packets", _open_packets},
+    {"packet", _packet},
+    {"pcap_open_packets", _pcap_open_packets},
+    {"session_packet", _session_packet},
+    {"verifier_open_packets", _verifier_open_packets},
+    {NULL, NULL},
+};
+
+// functions sharing the timer wheel as first upvalue
+static const luaL_Reg timer_funcs[] = {
+    {"timer_add", _timer_add},
+    {"timer_cancel", _timer_cancel},
+    {"timer_expired", _timer_expired},
+    {"timer_next", _timer_next},
+    {NULL, NULL},
+};
+
 static void _pcap_close(void* ud) {
     fprintf(stderr, "warning: pcap handler %p not closed.\n", ud);
     pcap_close((pcap_t*)ud);
@@ -1238,14 +1648,42 @@ LUAMOD_API int luaopen_whcore(lua_State* L) {
 
     luaL_newlib(L, funcs);
 
+    struct keycache* kc = keycache_new(WH_KEYCACHE_SIZE);
+    if (!kc) {
+        luaL_error(L, "keycache allocation failed.");
+    }
+    luaW_declptr(L, "keycache", (void(*)(void*))keycache_free);
+    luaW_pushptr(L, "keycache", kc);
+    luaL_setfuncs(L, keycache_funcs, 1);
+
+    struct timerwheel* tw = timerwheel_new();
+    if (!tw) {
+        luaL_error(L, "timer wheel allocation failed.");
+    }
+    luaW_declptr(L, "timerwheel", (void(*)(void*))timerwheel_free);
+    luaW_pushptr(L, "timerwheel", tw);
+    lua_newtable(L);
+    lua_setuservalue(L, -2);
+    luaL_setfuncs(L, timer_funcs, 1);
+
 #define SUB_LUAOPEN(x)  \
     do { \
         assert(luaopen_##x(L) == 1); \
         lua_setfield(L, -2, #x); \
     } while(0)
 
+    SUB_LUAOPEN(admission);
+    SUB_LUAOPEN(datapath);
+    SUB_LUAOPEN(egress);
+    SUB_LUAOPEN(ingress);
     SUB_LUAOPEN(ipc);
     SUB_LUAOPEN(ipc_event);
+    SUB_LUAOPEN(kadtable);
+    SUB_LUAOPEN(loring);
+    SUB_LUAOPEN(poller);
+    SUB_LUAOPEN(ratelimit);
+    SUB_LUAOPEN(shards);
+    SUB_LUAOPEN(verifier);
     SUB_LUAOPEN(wg);
     SUB_LUAOPEN(worker);
 
@@ -1,23 +1,85 @@
 #include "luawh.h"
 #include <unistd.h>
 #include <pthread.h>
+#include <sys/eventfd.h>
 #include "serdes.h"
+#include "spsc.h"
 
 #define MT  "worker"
 
-struct pipefd {
-    int r_fd;
-    int w_fd;
+// maximum count of job classes of a pool
+#define CLASSES     16
+
+// count of functions loaded by a worker thread before its cache is reset
+#define CODE_CACHE  64
+
+/** Pool of worker threads.
+ *
+ * Each thread runs its own Lua state, and at most one job at a time. Jobs are
+ * queued by the Lua thread, which dispatches them to idle threads, in order,
+ * as long as the count of running jobs of their class is below the class'
+ * limit.
+ *
+ * Jobs and responses are exchanged through two SPSC queues per thread. The
+ * response queues share a single eventfd.
+ *
+ * Functions are dumped once: their bytecode is cached by the Lua thread, and
+ * functions are loaded once by each worker thread.
+ */
+struct job {
+    struct job* next;
+    int ref;                // callback
+    int cls;
+    size_t l;
+    uint8_t m[];
 };
 
-struct worker {
-    struct pipefd req, resp;
-    volatile int running;
+struct worker_class {
     char* name;
+    int limit;
+    int running;
+};
+
+struct worker_thread {
+    struct spsc* req;
+    struct spsc* resp;
+    struct luaW_buf buf;    // used by the worker thread
     lua_State* L;
     pthread_t thread;
+    int started;
+    unsigned int cache_count;
+
+    // used by the Lua thread
+    int busy;
+    int ref;
+    int cls;
+};
+
+struct worker {
+    char* name;
+    int event_fd;
+    uint32_t code_id;
+    int code_ref;           // weak table of function bytecodes
+    struct luaW_buf buf;
+
+    struct job* head;
+    struct job** tail;
+
+    struct worker_class classes[CLASSES];
+    unsigned int class_count;
+
+    unsigned int thread_count;
+    struct worker_thread threads[];
+};
+
+// a frame of job starts with the function's id and bytecode
+struct code_hdr {
+    uint32_t id;
+    size_t sz;
 };
 
+static int _code_key;
+
 static int _tostring(lua_State* L) {
     struct worker* w = luaW_toptr(L, 1, MT);
 
@@ -30,19 +92,35 @@ static int _tostring(lua_State* L) {
     return 1;
 }
 
-
 static void delete_worker(struct worker* w) {
-    if (w->running) {
-        luaW_writenone(w->req.w_fd);
-        pthread_join(w->thread, NULL);
+    for (unsigned int i=0; i<w->thread_count; ++i) {
+        struct worker_thread* t = &w->threads[i];
+
+        if (t->started) {
+            // an empty frame stops the thread
+            spsc_push(t->req, NULL, 0);
+            pthread_join(t->thread, NULL);
+        }
+
+        if (t->req) { spsc_free(t->req), t->req = NULL; }
+        if (t->resp) { spsc_free(t->resp), t->resp = NULL; }
+        luaW_buffree(&t->buf);
+        if (t->L) { lua_close(t->L), t->L = NULL; }
     }
 
-    if (w->req.r_fd != -1) { close(w->req.r_fd), w->req.r_fd = -1; }
-    if (w->req.w_fd != -1) { close(w->req.w_fd), w->req.w_fd = -1; }
-    if (w->resp.r_fd != -1) { close(w->resp.r_fd), w->resp.r_fd = -1; }
-    if (w->resp.w_fd != -1) { close(w->resp.w_fd), w->resp.w_fd = -1; }
-    if (w->name) { free(w->name), w->name = NULL; }
-    if (w->L) { lua_close(w->L), w->L = NULL; }
+    // callbacks of pending jobs are released with the Lua state
+    while (w->head) {
+        struct job* j = w->head;
+        w->head = j->next;
+        free(j);
+    }
+
+    for (unsigned int i=0; i<w->class_count; ++i) {
+        free(w->classes[i].name);
+    }
+
+    if (w->event_fd != -1) { close(w->event_fd), w->event_fd = -1; }
+    luaW_buffree(&w->buf);
     if (w->name) { free(w->name), w->name = NULL; }
 
     free(w);
@@ -52,60 +130,350 @@ static void delete_worker_pvoid(void* w) {
     return delete_worker((struct worker*)w);
 }
 
-static void* worker(void* ud) {
-    struct worker* w = ud;
-    lua_State* L = w->L;
+struct chunk {
+    const char* p;
+    size_t l;
+};
+
+static const char* _chunk_reader(lua_State* L, void* data, size_t* psize) {
+    (void)L;
+
+    struct chunk* c = (struct chunk*)data;
+    const char* p = c->p;
+
+    *psize = c->l;
+    c->l = 0;
+
+    return p;
+}
+
+// pushes the function of the job, loaded once
+static int _pushcode(struct worker_thread* t, const struct code_hdr* hdr,
+                     const void* code) {
+    lua_State* L = t->L;
+
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &_code_key);
+    if (lua_rawgeti(L, -1, hdr->id) == LUA_TFUNCTION) {
+        lua_remove(L, -2);
+        return 0;
+    }
+    lua_pop(L, 1);
+
+    if (t->cache_count >= CODE_CACHE) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, &_code_key);
+        t->cache_count = 0;
+    }
+
+    struct chunk c = { .p = code, .l = hdr->sz };
+    if (lua_load(L, _chunk_reader, &c, "work", "b") != LUA_OK) {
+        lua_pop(L, 2);
+        return -1;
+    }
+
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, -3, hdr->id);
+    lua_remove(L, -2);
+    ++t->cache_count;
+
+    return 0;
+}
+
+// dumps the stack from index 2 in the buffer of the thread at index 1. Called
+// protected, as serialization raises errors on unhandled types.
+static int _dump(lua_State* L) {
+    struct worker_thread* t = lua_touserdata(L, 1);
+
+    t->buf.l = 0;
+    luaW_dumpstack(L, 2, &t->buf);
+    return 0;
+}
+
+// pushes `false, err` as a response
+static void _respond_error(struct worker_thread* t, const char* err) {
+    lua_State* L = t->L;
+
+    lua_settop(L, 0);
+    lua_pushboolean(L, 0);
+    lua_pushstring(L, err);
+
+    t->buf.l = 0;
+    luaW_dumpstack(L, 1, &t->buf);
+    spsc_push(t->resp, t->buf.p, t->buf.l);
+}
+
+static void* worker_thread(void* ud) {
+    struct worker_thread* t = ud;
+    lua_State* L = t->L;
 
     for (;;) {
         lua_settop(L, 0);
 
-        int success = luaW_readstack(L, w->req.r_fd) == 0;
+        spsc_wait(t->req);
 
-        if (success && lua_gettop(L) < 2) {
+        size_t l;
+        const uint8_t* m = spsc_front(t->req, &l);
+        struct code_hdr hdr;
+
+        if (l < sizeof(hdr)) {
+            spsc_pop(t->req);
             break;
         }
 
-        success &= lua_pcall(L, lua_gettop(L)-2, LUA_MULTRET, 0) == LUA_OK;
+        memcpy(&hdr, m, sizeof(hdr));
+        m += sizeof(hdr), l -= sizeof(hdr);
+
+        int success = hdr.sz <= l &&
+                      _pushcode(t, &hdr, m) == 0 &&
+                      luaW_loadstack(L, m+hdr.sz, l-hdr.sz) == 0;
+        spsc_pop(t->req);
+
+        if (success) {
+            success = lua_pcall(L, lua_gettop(L)-1, LUA_MULTRET, 0) == LUA_OK;
+        } else {
+            lua_settop(L, 0);
+            lua_pushstring(L, "deserialization failed");
+        }
+
         lua_pushboolean(L, success);
-        lua_insert(L, 2);
-        luaW_writestack(L, 1, w->resp.w_fd);
-    }
+        lua_insert(L, 1);
 
-    luaW_writestack(L, 1, w->resp.w_fd);
-    w->running = 0;
+        lua_pushcfunction(L, _dump);
+        lua_pushlightuserdata(L, t);
+        lua_rotate(L, 1, 2);
+
+        if (lua_pcall(L, lua_gettop(L)-1, 0, 0) != LUA_OK) {
+            _respond_error(t, "unserializable result");
+        } else if (spsc_push(t->resp, t->buf.p, t->buf.l) < 0) {
+            _respond_error(t, "response too large");
+        }
+    }
 
     return NULL;
 }
 
+// returns the index of class `name`, declared if needed
+static int _class(lua_State* L, struct worker* w, const char* name) {
+    for (unsigned int i=0; i<w->class_count; ++i) {
+        if (strcmp(w->classes[i].name, name) == 0) {
+            return i;
+        }
+    }
+
+    if (w->class_count >= CLASSES) {
+        return luaL_error(L, "too many job classes");
+    }
+
+    struct worker_class* c = &w->classes[w->class_count];
+    if (!(c->name = strdup(name))) {
+        return luaL_error(L, "out of memory");
+    }
+    c->limit = w->thread_count;
+    c->running = 0;
+
+    return w->class_count++;
+}
+
+static int _code_writer(lua_State* L, const void* m, size_t l, void* ud) {
+    (void)L;
+    return luaW_bufadd((struct luaW_buf*)ud, m, l);
+}
+
+// pushes the header and bytecode of function at index `idx`, dumped once
+static void _pushcode_frame(lua_State* L, struct worker* w, int idx) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, w->code_ref);
+    lua_pushvalue(L, idx);
+
+    if (lua_rawget(L, -2) == LUA_TSTRING) {
+        lua_remove(L, -2);
+        return;
+    }
+    lua_pop(L, 1);
+
+    struct code_hdr hdr = { .id = w->code_id++, .sz = 0 };
+    w->buf.l = 0;
+
+    lua_pushvalue(L, idx);
+    if (luaW_bufadd(&w->buf, &hdr, sizeof(hdr)) < 0 ||
+        lua_dump(L, _code_writer, &w->buf, 0) != 0) {
+        luaL_error(L, "unable to dump given function");
+    }
+    lua_pop(L, 1);
+
+    hdr.sz = w->buf.l - sizeof(hdr);
+    memcpy(w->buf.p, &hdr, sizeof(hdr));
+
+    lua_pushlstring(L, (const char*)w->buf.p, w->buf.l);
+    lua_pushvalue(L, idx);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, -4);
+    lua_remove(L, -2);
+}
+
+// serializes function at index `idx` and the arguments following it in the
+// scratch buffer of the pool
+static void _frame(lua_State* L, struct worker* w, int idx) {
+    _pushcode_frame(L, w, idx);
+
+    size_t l;
+    const char* code = lua_tolstring(L, -1, &l);
+    w->buf.l = 0;
+    if (luaW_bufadd(&w->buf, code, l) < 0) {
+        luaL_error(L, "out of memory");
+    }
+    lua_pop(L, 1);
+
+    luaW_dumpstack(L, idx+1, &w->buf);
+}
+
+// dispatches pending jobs to idle threads
+static void _dispatch(struct worker* w) {
+    struct job** pj = &w->head;
+
+    while (*pj) {
+        struct job* j = *pj;
+        struct worker_class* c = &w->classes[j->cls];
+
+        if (c->running >= c->limit) {
+            pj = &j->next;
+            continue;
+        }
+
+        struct worker_thread* t = NULL;
+        for (unsigned int i=0; i<w->thread_count && !t; ++i) {
+            if (!w->threads[i].busy) {
+                t = &w->threads[i];
+            }
+        }
+
+        if (!t) {
+            break;
+        }
+
+        // queue of an idle thread is empty, and jobs are smaller than
+        // SPSC_MAXSIZE()
+        int ret = spsc_push(t->req, j->m, j->l);
+        assert(ret == 0);
+        (void)ret;
+
+        t->busy = 1;
+        t->ref = j->ref;
+        t->cls = j->cls;
+        ++c->running;
+
+        *pj = j->next;
+        if (!*pj) {
+            w->tail = pj;
+        }
+        free(j);
+    }
+}
+
+// queues the job calling function at index `idx+1` with the following
+// arguments. Function at index `idx` is called with the results.
+static void _submit(lua_State* L, struct worker* w, int cls, int idx) {
+    luaL_checktype(L, idx, LUA_TFUNCTION);
+    luaL_checktype(L, idx+1, LUA_TFUNCTION);
+
+    _frame(L, w, idx+1);
+
+    if (w->buf.l > SPSC_MAXSIZE(WH_WORKER_QUEUE)) {
+        luaL_error(L, "work too large");
+    }
+
+    struct job* j = malloc(sizeof(struct job) + w->buf.l);
+    if (!j) {
+        luaL_error(L, "out of memory");
+    }
+
+    lua_pushvalue(L, idx);
+    j->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    j->cls = cls;
+    j->l = w->buf.l;
+    memcpy(j->m, w->buf.p, w->buf.l);
+    j->next = NULL;
+
+    *w->tail = j;
+    w->tail = &j->next;
+
+    _dispatch(w);
+}
+
 int luawh_pushworker(lua_State* L) {
     const char* name = lua_tostring(L, 1);
+    lua_Integer thread_count = luaL_optinteger(L, 2, 1);
+    luaL_argcheck(L, 0 < thread_count && thread_count <= 256, 2, "invalid thread count");
+    if (!lua_isnoneornil(L, 3)) {
+        luaL_checktype(L, 3, LUA_TFUNCTION);
+    }
 
-    struct worker* w = calloc(1, sizeof(struct worker));
+    struct worker* w = calloc(1, sizeof(struct worker) +
+                                 thread_count*sizeof(struct worker_thread));
     assert(w);
 
     w->name = name ? strdup(name) : NULL;
-    w->req.r_fd = w->req.w_fd = -1;
-    w->resp.r_fd = w->resp.w_fd = -1;
-
-    if (pipe((int*)&w->req)) {
+    w->tail = &w->head;
+    w->thread_count = thread_count;
+
+    // functions are unique keys; their bytecodes are collected with them
+    lua_newtable(L);
+    lua_newtable(L);
+    lua_pushstring(L, "k");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    w->code_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    // the default class
+    _class(L, w, "");
+
+    if ((w->event_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) == -1) {
+        int err = errno;
         delete_worker(w);
-        luaL_error(L, "pipe() failed: %s", strerror(errno));
+        luaL_error(L, "eventfd() failed: %s", strerror(err));
     }
 
-    if (pipe((int*)&w->resp)) {
-        delete_worker(w);
-        luaL_error(L, "pipe() failed: %s", strerror(errno));
-    }
+    for (unsigned int i=0; i<w->thread_count; ++i) {
+        struct worker_thread* t = &w->threads[i];
 
-    w->L = luaL_newstate();
-    luaL_openlibs(w->L);
+        if (!(t->req = spsc_new(WH_WORKER_QUEUE, -1)) ||
+            !(t->resp = spsc_new(WH_WORKER_QUEUE, w->event_fd))) {
+            int err = errno;
+            delete_worker(w);
+            luaL_error(L, "spsc_new() failed: %s", strerror(err));
+        }
 
-    if (pthread_create(&w->thread, NULL, worker, w)) {
-        delete_worker(w);
-        luaL_error(L, "pthread_create() failed: %s", strerror(errno));
+        t->L = luaL_newstate();
+        luaL_openlibs(t->L);
+        lua_newtable(t->L);
+        lua_rawsetp(t->L, LUA_REGISTRYINDEX, &_code_key);
+
+        if (pthread_create(&t->thread, NULL, worker_thread, t)) {
+            delete_worker(w);
+            luaL_error(L, "pthread_create() failed: %s", strerror(errno));
+        }
+
+        t->started = 1;
     }
 
-    w->running = 1;
+    // every thread first runs the initialization function
+    if (!lua_isnoneornil(L, 3)) {
+        lua_settop(L, 3);
+        _frame(L, w, 3);
+
+        if (w->buf.l > SPSC_MAXSIZE(WH_WORKER_QUEUE)) {
+            luaL_error(L, "initialization function too large");
+        }
+
+        for (unsigned int i=0; i<w->thread_count; ++i) {
+            struct worker_thread* t = &w->threads[i];
+            spsc_push(t->req, w->buf.p, w->buf.l);
+            t->busy = 1;
+            t->ref = LUA_NOREF;
+            t->cls = -1;
+        }
+    }
 
     luaW_pushptr(L, MT, w);
     return 1;
@@ -113,22 +481,39 @@ int luawh_pushworker(lua_State* L) {
 
 static int _pushwork(lua_State* L) {
     struct worker* w = luaW_checkptr(L, 1, MT);
-    luaL_checktype(L, 2, LUA_TFUNCTION);
-    luaL_checktype(L, 3, LUA_TFUNCTION);
-    lua_pushvalue(L, 2);
-    int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    _submit(L, w, 0, 2);
+    return 0;
+}
+
+static int _pushwork_class(lua_State* L) {
+    struct worker* w = luaW_checkptr(L, 1, MT);
+    int cls = _class(L, w, luaL_checkstring(L, 2));
+    _submit(L, w, cls, 3);
+    return 0;
+}
+
+static int _set_limit(lua_State* L) {
+    struct worker* w = luaW_checkptr(L, 1, MT);
+    int cls = _class(L, w, luaL_checkstring(L, 2));
+    lua_Integer limit = luaL_checkinteger(L, 3);
+    luaL_argcheck(L, limit > 0, 3, "limit must be positive");
 
-    lua_pushinteger(L, ref);
-    lua_replace(L, 2);
-    luaW_writestack(L, 2, w->req.w_fd);
+    w->classes[cls].limit = limit;
+    _dispatch(w);
 
     return 0;
 }
 
+static int _get_fd(lua_State* L) {
+    struct worker* w = luaW_checkptr(L, 1, MT);
+    lua_pushinteger(L, w->event_fd);
+    return 1;
+}
+
 static int _update(lua_State* L) {
     struct worker* w = luaW_checkptr(L, 1, MT);
     luaL_checktype(L, 2, LUA_TTABLE);
-    lua_pushinteger(L, w->resp.r_fd);
+    lua_pushinteger(L, w->event_fd);
     lua_seti(L, 2, luaL_len(L, 2)+1);
 
     return 0;
@@ -138,37 +523,138 @@ static int _on_readable(lua_State* L) {
     struct worker* w = luaW_checkptr(L, 1, MT);
     luaL_checktype(L, 2, LUA_TTABLE);
 
-    lua_pushinteger(L, w->resp.r_fd);
+    lua_pushinteger(L, w->event_fd);
     lua_gettable(L, 2);
 
-    if (lua_toboolean(L, -1)) {
-        lua_settop(L, 1);
+    if (!lua_toboolean(L, -1)) {
+        return 0;
+    }
 
-        if (luaW_readstack(L, w->resp.r_fd) != 0) {
-            luaL_error(L, "deserialization failed");
-        }
+    // responses pushed once the eventfd is cleared set it again
+    uint64_t v;
+    if (read(w->event_fd, &v, sizeof(v)) < 0 && errno != EAGAIN) {
+        luaL_error(L, "read() failed: %s", strerror(errno));
+    }
 
-        int ref = lua_tointeger(L, 2);
-        lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
-        assert (lua_type(L, -1) == LUA_TFUNCTION);
-        lua_replace(L, 2);
-        lua_call(L, lua_gettop(L)-2, 0);
+    // all callbacks are called; the first error is raised once done
+    lua_settop(L, 2);
+    lua_pushnil(L);
+
+    for (unsigned int i=0; i<w->thread_count; ++i) {
+        struct worker_thread* t = &w->threads[i];
+        size_t l;
+        const void* m;
+
+        while (t->busy && (m = spsc_front(t->resp, &l))) {
+            int top = lua_gettop(L);
+            int init = t->ref == LUA_NOREF;
+
+            if (!init) {
+                lua_rawgeti(L, LUA_REGISTRYINDEX, t->ref);
+                luaL_unref(L, LUA_REGISTRYINDEX, t->ref);
+            } else {
+                lua_pushnil(L);
+            }
+
+            int ret = luaW_loadstack(L, m, l);
+            spsc_pop(t->resp);
+
+            t->busy = 0;
+            if (t->cls >= 0) {
+                --w->classes[t->cls].running;
+            }
+            _dispatch(w);
+
+            if (ret != 0) {
+                lua_settop(L, top);
+                if (lua_isnil(L, 3)) {
+                    lua_pushstring(L, "deserialization failed");
+                    lua_replace(L, 3);
+                }
+                continue;
+            }
+
+            // the error of the init function is raised, as later jobs would
+            // fail on its state
+            if (init) {
+                if (!lua_toboolean(L, top+2) && lua_isnil(L, 3)) {
+                    lua_pushfstring(L, "worker initialization failed: %s",
+                                    luaL_tolstring(L, top+3, NULL));
+                    lua_replace(L, 3);
+                }
+
+                lua_settop(L, top);
+                continue;
+            }
+
+            if (lua_isnil(L, top+1)) {
+                lua_settop(L, top);
+                continue;
+            }
+
+            if (lua_pcall(L, lua_gettop(L)-top-1, 0, 0) != LUA_OK) {
+                if (lua_isnil(L, 3)) {
+                    lua_replace(L, 3);
+                } else {
+                    lua_pop(L, 1);
+                }
+            }
+        }
+    }
 
-        luaL_unref(L, LUA_REGISTRYINDEX, ref);
+    if (!lua_isnil(L, 3)) {
+        lua_pushvalue(L, 3);
+        lua_error(L);
     }
 
     return 0;
 }
 
+static int _stats(lua_State* L) {
+    struct worker* w = luaW_checkptr(L, 1, MT);
+
+    unsigned int busy = 0;
+    for (unsigned int i=0; i<w->thread_count; ++i) {
+        busy += w->threads[i].busy;
+    }
+
+    unsigned int pending = 0;
+    for (struct job* j=w->head; j; j=j->next) {
+        ++pending;
+    }
+
+    lua_newtable(L);
+    lua_pushinteger(L, w->thread_count);
+    lua_setfield(L, -2, "threads");
+    lua_pushinteger(L, busy);
+    lua_setfield(L, -2, "busy");
+    lua_pushinteger(L, pending);
+    lua_setfield(L, -2, "pending");
+
+    return 1;
+}
+
 LUAMOD_API int luaopen_worker(lua_State* L) {
     luaW_declptr(L, MT, delete_worker_pvoid);
 
     luaL_getmetatable(L, MT);
     lua_getfield(L, -1, "__index");
 
+    lua_pushcfunction(L, _get_fd);
+    lua_setfield(L, -2, "get_fd");
+
     lua_pushcfunction(L, _pushwork);
     lua_setfield(L, -2, "pcall");
 
+    lua_pushcfunction(L, _pushwork_class);
+    lua_setfield(L, -2, "pcall_class");
+
+    lua_pushcfunction(L, _set_limit);
+    lua_setfield(L, -2, "set_limit");
+
+    lua_pushcfunction(L, _stats);
+    lua_setfield(L, -2, "stats");
+
     lua_pushcfunction(L, _update);
     lua_setfield(L, -2, "update");
 
@@ -186,4 +672,3 @@ LUAMOD_API int luaopen_worker(lua_State* L) {
 
     return 1;
 }
-
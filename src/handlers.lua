@@ -4,6 +4,8 @@ local peer = require('peer')
 local auth = require('auth')
 local kad = require('kad')
 local nat = require('nat')
+local pmtu = require('pmtu')
+local relaysession = require('relaysession')
 local search = require('search')
 
 local function log_cmd(n, m, src, fmt, ...)
@@ -24,10 +26,17 @@ H[packet.cmds.ping] = function(n, m, src, via)
         arg = 'swapsrc'
     elseif arg == '\x02' then
         arg = 'direct'
+    elseif arg == '\x03' then
+        arg = 'pmtu'
     end
 
     local body = string.sub(m, 3)
 
+    -- path MTU probes are padded. only the uid is echoed
+    if arg == 'pmtu' then
+        body = string.sub(body, 1, 8)
+    end
+
     --if src.lazy and (arg ~= "normal" or #body ~= 0) then return end
 
     -- ignore ping with body bigger than 8
@@ -80,8 +89,9 @@ H[packet.cmds.pong] = function(n, m, src)
 
     log_cmd(n, m, src, "$(yellow)pong$(reset)(%s, port_echo=%s, self=%s)", wh.tob64(body), src_addr_echo, public_addr)
 
-    kad.on_pong(n, src)
+    kad.on_pong(n, body, src)
     nat.on_pong(n, body, src)
+    pmtu.on_pong(n, body, src)
     search.on_pong(n, body, src)
 end
 
@@ -89,50 +99,34 @@ H[packet.cmds.search] = function(n, m, src)
     local k = string.sub(m, 2)
     log_cmd(n, m, src, "$(yellow)search$(reset)(%s)", n:key(k))
 
-    local closest = n.kad:kclosest(k, wh.KADEMILIA_K, function(p)
-        return p.k == k or p:state() == 'direct'
-    end)
-
-    n:_sendto{dst=src, m=packet.result(k, closest)}
+    n:_sendto{dst=src, m=n.kad:encode_result(k)}
 end
 
 H[packet.cmds.result] = function(n, m, src)
     if src.lazy then return end
 
-    local pks = string.sub(m, 2, 33)
-    local closest = {}
-    local i = 34
-    local l
-
-    while i < #m do
-        local p = {}
-
-        local flag = string.sub(m, i, i)
-        i = i + 1
-
-        do
-            p.k = string.sub(m, i, i+31)
-            i = i + 32
-
-            p.addr, l = wh.unpack_address(string.sub(m, i))
-            i = i + l
-        end
+    local pks, rs = n.kad:decode_result(m)
+    if not pks then
+        printf("$(red)malformed result from %s$(reset)", n:key(src))
+        return
+    end
 
-        if flag == '\x01' then
-            local relay = {}
-            relay.k = string.sub(m, i, i+31)
-            i = i + 32
-            relay.addr, l = wh.unpack_address(string.sub(m, i))
-            i = i + l
+    local closest = {}
+    for i = 1, #rs, 5 do
+        local p = {k=rs[i], addr=rs[i+1]}
+        local flag = rs[i+2]
 
-            -- prefer own source
-            p.relay = n.kad:get(relay.k) or peer(relay)
+        if flag == 'relay' then
+            -- prefer own source. The address of the relay is only decoded if
+            -- it is unknown.
+            local relay_k, relay_addr = rs[i+3], rs[i+4]
+            p.relay = n.kad:get(relay_k) or (relay_addr and peer{k=relay_k, addr=relay_addr})
 
-        elseif flag == '\x02' then
+        elseif flag == 'nated' then
             p.relay = src
         end
 
-        closest[#closest+1] = peer(p)
+        closest[#closest+1] = p
     end
 
     log_cmd(n, m, src, "$(yellow)result$(reset)(#%d)", #closest)
@@ -157,7 +151,8 @@ H[packet.cmds.relay] = function(n, m, src)
         return
     end
 
-    -- XXX bandwidth limit
+    -- bandwidth is limited per source before packets are verified (see
+    -- wh.ratelimit)
     -- XXX whitelist management
     -- XXX keep source in kademilia for some time as it is currently relaying
     -- with dst
@@ -262,6 +257,23 @@ H[packet.cmds.authed] = function(n, m, src)
     auth.on_authed(n, alias_k, src)
 end
 
+local function drop_fragment(src, sess)
+    if sess.timer then
+        wh.timer_cancel(sess.timer)
+        sess.timer = nil
+    end
+
+    src.fragments[sess.id] = nil
+    for i, v in ipairs(src.fragments) do
+        if v == sess then
+            table.remove(src.fragments, i)
+            break
+        end
+    end
+end
+
+-- relayed fragments of peers with a tunnel are reassembled by the native
+-- datapath. This handler reassembles the other ones.
 H[packet.cmds.fragment] = function(n, m, src)
     if not n.lo then
         return
@@ -284,11 +296,22 @@ H[packet.cmds.fragment] = function(n, m, src)
             deadline=now+wh.FRAGMENT_TIMEOUT,
             id=id,
         }
+
+        -- sessions share the same timeout, hence are sorted by deadline
         src.fragments[#src.fragments+1] = sess
-        table.sort(src.fragments, function(a, b)
-            return a.deadline < b.deadline
-        end)
         src.fragments[sess.id] = sess
+
+        sess.timer = wh.timer_add(sess.deadline, function()
+            sess.timer = nil
+            printf("$(red)drop fragment session %s$(reset)", wh.tob64(sess.id))
+            drop_fragment(src, sess)
+        end)
+
+        if #src.fragments > wh.FRAGMENT_MAX then
+            local oldest = src.fragments[1]
+            printf("$(red)drop fragment session %s$(reset)", wh.tob64(oldest.id))
+            drop_fragment(src, oldest)
+        end
     end
 
     sess[num+1] = m
@@ -306,19 +329,54 @@ H[packet.cmds.fragment] = function(n, m, src)
 
     n.lo:recv_datagram(src, m)
 
-    -- clean
-    src.fragments[id] = nil
-    for i, v in ipairs(src.fragments) do
-        if v == sess then
-            table.remove(src.fragments, i)
-            break
-        end
-    end
+    drop_fragment(src, sess)
 
     --if #src.fragments == 0 then
     --    src.fragments = nil
     --end
 end
 
-return H
+-- BIND packets are handled by the native datapath. Without it, no session is
+-- bound and the peer keeps on sending RELAY packets.
+H[packet.cmds.bind] = function(n, m, src)
+    log_cmd(n, m, src, "$(blue)bind$(reset)(%s)", n:key(string.sub(m, 2)))
+end
+
+H[packet.cmds.bound] = function(n, m, relay, via)
+    if via == 'relay' or #m ~= 1+32+4 then
+        return
+    end
+
+    local dst_k = string.sub(m, 2, 33)
+    local id = string.unpack(">I4", m, 34)
+
+    log_cmd(n, m, relay, "$(blue)bound$(reset)(%s, %.8x)", n:key(dst_k), id)
+
+    relaysession.on_bound(n, dst_k, id, relay)
+end
+
+-- DATA packets of peers with a tunnel are handled by the native datapath
+H[packet.cmds.data] = function(n, m, relay, via)
+    if via == 'relay' then
+        return
+    end
+
+    local src_k = string.sub(m, 2, 33)
+    local fragment_m = string.sub(m, 34)
+
+    log_cmd(n, m, relay, "$(blue)data$(reset)(%s, %d)", n:key(src_k), #fragment_m)
 
+    -- only the relay of the source can forward its fragments
+    local src = n.kad:get(src_k)
+    if not src or not src.relay or src.relay.k ~= relay.k or
+       string.sub(fragment_m, 1, 1) ~= packet.cmds.fragment then
+        printf("$(red)data packet dropped!$(reset)")
+        return
+    end
+
+    src.last_seen = now
+
+    return H[packet.cmds.fragment](n, fragment_m, src)
+end
+
+return H
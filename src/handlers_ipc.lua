@@ -1,6 +1,8 @@
 -- IPC command handlers
 -- See ipc.lua
 
+local packet = require('packet')
+
 return function(n)
     local H = {}
 
@@ -40,11 +42,24 @@ return function(n)
             return r
         end
 
+        local function ratelimit(rl)
+            local r = {}
+            for i, cmd in ipairs(packet.cmds) do
+                r[cmd] = wh.ratelimit.stats(rl, i-1)
+            end
+            return r
+        end
+
         local r = {
+            admission=wh.admission.stats(n.admission),
             auths=set(n.auths),
             connects=n.connects,
+            datapath=n.datapath and wh.datapath.stats(n.datapath),
             frag_counter=n.frag_counter,
+            egress=wh.egress.stats(n.egress),
             jitter_rand=n.jitter_rand,
+            keycache=wh.keycache_stats(),
+            lo_ring=n.lo and n.lo.sniff and wh.loring.stats(n.lo.sniff),
             mode=n.mode,
             namespace=n.namespace,
             nat=set(n.nat_detectors),
@@ -52,10 +67,14 @@ return function(n)
             p=n.p,
             peers={},
             port=n.port,
+            ratelimit=ratelimit(n.ratelimit),
             searches=set(n.searches),
+            shards=n.in_shards and wh.shards.stats(n.in_shards),
             subnet=n.subnet,
+            verifier=n.verifier and wh.verifier.stats(n.verifier),
             version=wh.version,
             workbit=n.workbit,
+            workers=n.worker and n.worker:stats(),
         }
 
         for bid, bucket in pairs(n.kad.buckets) do
@@ -17,6 +17,10 @@ local function close(ipc, sock)
         cpcall(state.close_cb)
     end
 
+    if ipc.poller then
+        ipc.poller:unregister(sock)
+    end
+
     wh.close(sock)
 end
 
@@ -27,6 +31,10 @@ function I.close(ipc)
     ipc.states = {}
 
     if ipc.listen_sock then
+        if ipc.poller then
+            ipc.poller:unregister(ipc.listen_sock)
+        end
+
         wh.close(ipc.listen_sock)
         ipc.listen_sock = nil
     end
@@ -103,6 +111,10 @@ function I.on_readable(ipc, r)
 
         local new_sock = wh.ipc.accept(ipc.listen_sock)
         ipc.states[new_sock] = {wait_cmd=true}
+
+        if ipc.poller then
+            ipc.poller:register(new_sock)
+        end
     end
 
     for sock in pairs(ipc.states) do
@@ -127,15 +139,22 @@ end
 
 local M = {}
 
-function M.bind(interface_name, h)
+-- if poller is set, IPC sockets are registered to it. Else, sockets must be
+-- polled with ipc:update()
+function M.bind(interface_name, h, poller)
     assert(interface_name and h)
     local listen_sock, close_cb = wh.ipc.bind(interface_name, false)
 
+    if poller then
+        poller:register(listen_sock)
+    end
+
     return setmetatable({
         close_cb=close_cb,
         states={},
         listen_sock=listen_sock,
         h=h,
+        poller=poller,
     }, MT)
 end
 
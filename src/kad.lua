@@ -7,30 +7,7 @@ local function explain(n, p, fmt, ...)
     return n:explain('peer %s', fmt, n:key(p), ...)
 end
 
-local function update_fragment(p)
-    if p.fragments then
-        local to_remove = {}
-        local count = #p.fragments
-        for i, sess in ipairs(p.fragments) do
-            if (count > wh.FRAGMENT_MAX or
-                sess.deadline <= now) then
-
-                to_remove[#to_remove+1] = i
-                count = count - 1
-            end
-        end
-
-        for i = #to_remove, 1, -1 do
-            local sess_i = to_remove[i]
-            local sess = p.fragments[sess_i]
-            printf("$(red)drop fragment session %s$(reset)", wh.tob64(sess.id))
-            p.fragments[sess.id] = nil
-            table.remove(p.fragments, sess_i)
-        end
-    end
-end
-
-local function update_peer(n, p, sess)
+local function update_peer(n, p, p_state)
     -- keeps aliases for ever
     if p.alias then
         return 'inf'
@@ -47,40 +24,30 @@ local function update_peer(n, p, sess)
         reason = 'wireguard is enabled'
         test_alive = true
 
-    elseif sess.p_state == 'direct' then
+    elseif p_state == 'direct' then
+        local c_direct = n.kad:bucket_counts(p)
+
         -- if there are too many direct peers in the bucket, make sure the stored
         -- ones are alive
-        if sess.c_direct > wh.KADEMILIA_K then
+        if c_direct > wh.KADEMILIA_K then
             -- XXX wh.ALIVE_INTERVAL may depend on the peer's uptime (see
             -- fig. 1 of the Kademilia paper)
             local deadline = (p.last_seen or 0) + wh.ALIVE_INTERVAL
 
-            -- if is peer considered as alive, do not ping, and ...
+            -- if is peer considered as alive, do not ping
             if now < deadline then
-                -- ... remove if peer is excedent and all previous peers were
-                -- checked as alive
-                if sess.i_direct > sess.c_direct and sess.all_direct_tested_alive then
-                    deadline = nil
-                end
-
                 return deadline
 
             -- else we do not if peer is alive
             -- if peer is in the Kth first, ping
-            elseif sess.i_direct <= wh.KADEMILIA_K then
+            elseif n.kad:rank(p) <= wh.KADEMILIA_K then
                 reason = 'too many directs in bucket. test if peers is alive'
                 test_alive = true
-                sess.all_directed_tested_alive = false
 
-            -- else, it must be a peer excedent peers.
-            -- if all previous direct peers are online, forget
-            elseif sess.all_directed_tested_alive then
-                return nil
-
-            -- else previous peers are being tested, therefore keep in the
-            -- meantime
+            -- else, it must be an excedent peer. keep it in the meantime and
+            -- check again later
             else
-                return 'inf'
+                return now + wh.ALIVE_INTERVAL
             end
 
         -- XXX should only ping the closest direct peers, not all!
@@ -119,6 +86,9 @@ local function update_peer(n, p, sess)
         if do_ping then
             explain(n, p, "alive? (%s)", reason)
             n:_sendto{dst=p, m=packet.ping()}
+
+            -- only the pong of a first ping is an unambiguous RTT sample
+            p.rtt_ts = p.ping_retry == 1 and now or nil
         end
 
         return deadline
@@ -133,16 +103,14 @@ local function update_peer(n, p, sess)
         end
     end
 
-    if sess.p_state == 'direct' then
-        return 'inf'
-    end
+    assert(p_state == 'nat' or p_state == 'relay')
 
+    -- owned peers are kept. Peers are not notified when released, check again
+    -- later
     if p:owned() then
-        return 'inf'
+        return now + wh.NAT_TIMEOUT
     end
 
-    assert(sess.p_state == 'nat' or sess.p_state == 'relay')
-
     -- p is NAT-ed. Forget if it does not contact current peer after a certain
     -- amount of time
     local deadline = (p.last_seen or 0) + wh.NAT_TIMEOUT * 2
@@ -153,90 +121,102 @@ local function update_peer(n, p, sess)
     return deadline
 end
 
+local function forget(n, p)
+    -- peers relayed by p must forget their relay
+    for q in pairs(n.kad.relayed[p] or {}) do
+        n.kad:revisit(q)
+    end
+    n.kad.relayed[p] = nil
+
+    p.addr = nil
+    p.addr_echo = nil
+    p.is_nated = nil
+    p.relay = nil
+    n.kad:mark(p)
+
+    if p.trust then
+        explain(n, p, "forget!")
+        n.kad.touched[p.k] = p
+        n.kad:account(p)
+    else
+        n.kad.touched[p.k] = nil
+
+        if not p:owned() then
+            explain(n, p, "remove!")
+            n.kad:unlink(p)
+        else
+            n.kad:account(p)
+        end
+    end
+end
+
+-- Maintains the Kademilia tree. Only peers which changed, or whose deadline is
+-- reached, are visited. Deadlines are scheduled on the timer wheel.
 function M.update(n, deadlines)
-    -- maintain the Kademilia tree
+    local t = n.kad
 
-    for bid, bucket in pairs(n.kad.buckets) do
-        table.sort(bucket, function(a, b) return (a.first_seen or 0) < (b.first_seen or 0) end)
+    -- the state of the node changes how direct peers are maintained
+    if t.is_nated ~= n.is_nated then
+        t.is_nated = n.is_nated
+        t:revisit_all()
+    end
 
-        local to_remove = {}
+    local pending = t.pending
+    if next(pending) == nil then
+        return
+    end
+    t.pending = {}
 
-        local sess = {
-            c_direct = 0,
-            c_nat = 0,
-            i_direct = 0,
-            i_nat = 0,
-            all_direct_tested_alive = true,
-        }
-        for i, p in ipairs(bucket) do
-            -- take advantage of iterating over all nodes to remove fragments,
-            -- without management of any deadlines
-            update_fragment(p)
+    -- first update the buckets' counters
+    for p in pairs(pending) do
+        if t:get(p.k) ~= p then
+            pending[p] = nil
 
+        else
             -- if relay was forgotten
             if p.relay and p.relay.addr == nil then
                 p.relay = nil
+                t:mark(p)
             end
 
-            local p_state = p:state()
-            if p_state == 'direct' then
-                sess.c_direct = sess.c_direct + 1
-            elseif p_state == 'nat' or p_state == 'relay' then
-                sess.c_nat = sess.c_nat + 1
+            if p.relay then
+                local r = t.relayed[p.relay]
+                if not r then
+                    r = setmetatable({}, {__mode='k'})
+                    t.relayed[p.relay] = r
+                end
+                r[p] = true
             end
-        end
 
-        for i, p in ipairs(bucket) do
-            sess.p_state = p:state()
-            if sess.p_state == 'direct' then
-                sess.i_direct = sess.i_direct + 1
-            elseif sess.p_state == 'nat' or sess.p_state == 'relay' then
-                sess.i_nat = sess.i_nat + 1
-            end
+            t:account(p)
+        end
+    end
 
-            local deadline = update_peer(n, p, sess)
+    for p in pairs(pending) do
+        -- peer may have been removed in the meantime
+        if t:get(p.k) == p then
+            local deadline = update_peer(n, p, t.states[p])
 
             if deadline == nil then
-                p.addr = nil
-                p.addr_echo = nil
-                p.is_nated = nil
-                p.relay = nil
+                forget(n, p)
+                deadline = 'inf'
+            end
 
-                if p.trust then
-                    explain(n, p, "forget!")
-                    n.kad.touched[p.k] = p
-                else
-                    n.kad.touched[p.k] = nil
-
-                    if not p:owned() then
-                        to_remove[#to_remove+1] = i
-                    --else
-                    --    dbg("notice: do not remove peer %s", wh.key(p.k))
-                    end
-
-                    if sess.p_state == 'direct' then
-                        sess.c_direct = sess.c_direct - 1
-                        sess.i_direct = sess.i_direct - 1
-                    elseif sess.p_state == 'nat' or sess.p_state == 'relay' then
-                        sess.c_nat = sess.c_nat - 1
-                        sess.i_nat = sess.i_nat - 1
-                    end
-                end
-            elseif deadline ~= 'inf' then
-                deadlines[#deadlines+1] = deadline
+            if deadline == 'inf' then
+                deadline = nil
             end
-        end
 
-        for i = #to_remove, 1, -1 do
-            local p = bucket[to_remove[i]]
-            explain(n, p, "remove!")
-            table.remove(bucket, to_remove[i])
-            bucket[p.k] = nil
+            t:schedule(p, deadline)
         end
     end
 end
 
-function M.on_pong(n, src)
+function M.on_pong(n, body, src)
+    if body == '' and src.rtt_ts then
+        time.rtt_sample(src, now - src.rtt_ts)
+        src.rtt_ts = nil
+    end
+
     if (src.ping_retry or 0) > 0 then
         explain(n, src, "alive!")
     end
@@ -33,6 +33,8 @@ function MT.__index.touch(t, k)
     end
 
     t.touched[p.k] = p
+    t.changed[p.k] = p
+    t.pending[p] = true
 
     return peer(p), new_p
 end
@@ -49,66 +51,301 @@ function MT.__index.get(t, k)
     return b[k]
 end
 
+-- Marks the routing attributes of a peer as changed. Touched peers are always
+-- marked.
+function MT.__index.mark(t, p)
+    if p ~= t.root then
+        t.changed[p.k] = p
+        t.pending[p] = true
+    end
+end
+
+-- Copies the routing attributes of changed peers into the native table
+function MT.__index.sync(t)
+    for k, p in pairs(t.changed) do
+        wh.kadtable.set(t.native, k,
+            p.addr,
+            p.is_nated,
+            p.relay and p.relay.k,
+            p.alias,
+            p.bootstrap,
+            p.tunnel and p.tunnel.lo_addr,
+            p.first_seen,
+            p.last_seen
+        )
+    end
+
+    t.changed = {}
+end
+
+-- Refreshes the peers seen by the native datapath. Bytes it received and sent
+-- are logged in bandwidth logger bw, if set.
+function MT.__index.update_seen(t, bw)
+    local seen, traffic = wh.kadtable.seen(t.native, now)
+
+    for _, k in ipairs(seen) do
+        local p = t:get(k)
+        if p then
+            p.last_seen = now
+        end
+    end
+
+    if bw then
+        for _, e in ipairs(traffic) do
+            local k, rx, tx = table.unpack(e)
+            if rx > 0 then bw:add_rx(k, rx) end
+            if tx > 0 then bw:add_tx(k, tx) end
+        end
+    end
+end
+
+-- Returns the RESULT packet of a search of key k
+function MT.__index.encode_result(t, k)
+    t:sync()
+    return wh.kadtable.encode_result(t.native, k, t.K)
+end
+
+-- Decodes RESULT packet m. Returns the searched key and the list of the
+-- RESULT's entries, as flat values (see wh.kadtable.decode_result), or nil if m
+-- is malformed.
+function MT.__index.decode_result(t, m)
+    t:sync()
+    return wh.kadtable.decode_result(t.native, m)
+end
+
+-- Writes a snapshot of the peers with an address at path
+function MT.__index.save(t, path)
+    t:sync()
+    return wh.kadtable.save(t.native, path)
+end
+
+-- Seeds the store with the peers of the snapshot at path. Known peers are kept
+-- as is. Peers are checked alive by their maintenance, as any other peer.
+-- Returns the count of loaded peers, or nil and an error message.
+function MT.__index.load(t, path)
+    local recs, err = wh.kadtable.load(path)
+    if not recs then
+        return nil, err
+    end
+
+    local count = 0
+    local relays = {}
+    for _, r in ipairs(recs) do
+        if r.k ~= t.root.k and not t:get(r.k) then
+            local p = t:touch(r.k)
+            p.addr = r.addr
+            p.is_nated = r.is_nated or nil
+            p.first_seen = r.first_seen > 0 and r.first_seen or nil
+            p.last_seen = r.last_seen > 0 and r.last_seen or nil
+            relays[p] = r.relay_k
+            count = count + 1
+        end
+    end
+
+    -- relays are linked once all peers are loaded
+    for p, relay_k in pairs(relays) do
+        local relay = t:get(relay_k)
+        if relay and relay.addr then
+            p.relay = relay
+        end
+    end
+
+    return count
+end
+
 function MT.__index.clear_touched(t)
+    t:sync()
     t.touched = {}
 end
 
-function MT.__index.kclosest(t, k, count, filter_cb)
-    local empty = {}
+-- Returns the `count` closest peers of key k, as a list of pairs {distance,
+-- peer}. Peers without address and aliases are ignored. The filter may be
+-- 'direct' (peers which may be reached directly, and peer k), 'bootstrap', or a
+-- function.
+function MT.__index.kclosest(t, k, count, filter)
     if count == nil then count = t.K end
-    local bid = wh.bid(t.root.k, k)
+    t:sync()
 
     local r = {}
+    local function add(pk)
+        local p = t:get(pk)
+        r[#r+1] = {wh.xor(pk, k), p}
+    end
+
+    if type(filter) == 'function' then
+        local all = wh.kadtable.count(t.native)
+        for _, pk in ipairs(wh.kadtable.kclosest(t.native, k, all)) do
+            if #r >= count then
+                break
+            end
 
-    local function extend(i)
-        for _, p in ipairs(t.buckets[i] or empty) do
-            if (p.k and
-                p.addr and
-                not p.alias and (
-                    not filter_cb or
-                    filter_cb(p)
-                )
-            ) then
-                r[#r+1] = {wh.xor(p.k, k), p}
+            if filter(t:get(pk)) then
+                add(pk)
             end
         end
+    else
+        for _, pk in ipairs(wh.kadtable.kclosest(t.native, k, count, filter)) do
+            add(pk)
+        end
     end
 
-    extend(bid)
+    return r
+end
+
+-- Peers' maintenance. kad.update only visits pending peers: touched or marked
+-- peers, and peers whose deadline is reached. The store keeps the state of
+-- each peer as last visited, the count of direct and NAT-ed peers of each
+-- bucket, and the peers relayed by each relay.
+
+local function state_class(s)
+    if s == 'direct' then
+        return 'direct'
+    elseif s == 'nat' or s == 'relay' then
+        return 'nat'
+    end
+end
 
-    if #r < count then
-        for i = bid+1, #t.root.k*8 do extend(i) end
+local function counts(t, bid)
+    local c = t.counts[bid]
+    if not c then
+        c = {direct=0, nat=0}
+        t.counts[bid] = c
     end
 
-    for i = bid-1, 1, -1 do
-        if #r >= count then
-            break
+    return c
+end
+
+-- Marks peer p to be visited by the next kad.update
+function MT.__index.revisit(t, p)
+    if p ~= t.root then
+        t.pending[p] = true
+    end
+end
+
+function MT.__index.revisit_all(t)
+    for _, b in pairs(t.buckets) do
+        for _, p in ipairs(b) do
+            t.pending[p] = true
         end
+    end
+end
+
+local function set_state(t, p, s)
+    local old = t.states[p]
+    t.states[p] = s
 
-        extend(i)
+    local oc, nc = state_class(old), state_class(s)
+    if oc == nc then
+        return
     end
 
-    table.sort(r, function(a, b) return a[1] < b[1] end)
-    return r
+    local bid = wh.bid(t.root.k, p.k)
+    local c = counts(t, bid)
+    local was_over = c.direct > t.K
+
+    if oc then c[oc] = c[oc] - 1 end
+    if nc then c[nc] = c[nc] + 1 end
+
+    if oc == 'direct' or nc == 'direct' then
+        c.ranks = nil
+
+        -- direct peers of buckets holding more than K direct peers are
+        -- maintained differently
+        if was_over ~= (c.direct > t.K) and t.buckets[bid] then
+            for _, q in ipairs(t.buckets[bid]) do
+                if t.states[q] == 'direct' then
+                    t.pending[q] = true
+                end
+            end
+        end
+    end
 end
 
-function MT.__index.unlink(t, p)
+-- Updates the counters of the bucket of peer p with its current state.
+-- Returns the state.
+function MT.__index.account(t, p)
+    local s = p:state()
+    set_state(t, p, s)
+    return s
+end
+
+-- Returns the count of direct and NAT-ed peers in the bucket of peer p
+function MT.__index.bucket_counts(t, p)
+    local c = counts(t, wh.bid(t.root.k, p.k))
+    return c.direct, c.nat
+end
+
+-- Returns the rank of direct peer p among the direct peers of its bucket, the
+-- oldest first
+function MT.__index.rank(t, p)
     local bid = wh.bid(t.root.k, p.k)
-    local b = t.buckets[bid]
-    if not b then return end
+    local c = counts(t, bid)
+
+    if not c.ranks then
+        local directs = {}
+        for _, q in ipairs(t.buckets[bid] or {}) do
+            if t.states[q] == 'direct' then
+                directs[#directs+1] = q
+            end
+        end
+
+        table.sort(directs, function(a, b) return (a.first_seen or 0) < (b.first_seen or 0) end)
+
+        c.ranks = {}
+        for i, q in ipairs(directs) do
+            c.ranks[q] = i
+        end
+    end
+
+    return c.ranks[p]
+end
 
-    local to_remove
-    for i, pi in ipairs(b) do
-        if p == pi then
-            to_remove = i
-            break
+-- Schedules the next visit of peer p at deadline, or none if deadline is nil
+function MT.__index.schedule(t, p, deadline)
+    local tm = t.timers[p]
+    if tm then
+        if tm.deadline == deadline then
+            return
         end
+
+        wh.timer_cancel(tm.id)
+        t.timers[p] = nil
+    end
+
+    if deadline then
+        tm = {deadline=deadline}
+        tm.id = wh.timer_add(deadline, function()
+            t.timers[p] = nil
+            t.pending[p] = true
+        end)
+        t.timers[p] = tm
     end
+end
+
+-- Removes peer p. If known, i is the index of p in its bucket.
+function MT.__index.unlink(t, p, i)
+    local bid = wh.bid(t.root.k, p.k)
+    local b = t.buckets[bid]
+    if not b or b[p.k] ~= p then return end
 
-    if to_remove then
-        table.remove(b, to_remove)
-        b[p.k] = nil
+    if b[i] ~= p then
+        for j, pj in ipairs(b) do
+            if p == pj then
+                i = j
+                break
+            end
+        end
     end
+
+    table.remove(b, i)
+    b[p.k] = nil
+    t.changed[p.k] = nil
+    t.pending[p] = nil
+    t:schedule(p, nil)
+    t.relayed[p] = nil
+    set_state(t, p, nil)
+    wh.kadtable.remove(t.native, p.k)
+    wh.keycache_forget(p.k)
 end
 
 return function(root_k, kad_k)
@@ -116,7 +353,14 @@ return function(root_k, kad_k)
 
     return setmetatable({
         buckets={},
+        changed={},
+        counts={},
         K=kad_k,
+        native=wh.kadtable.new(root_k),
+        pending={},
+        relayed=setmetatable({}, {__mode='k'}),
+        states={},
+        timers={},
         touched={},
         root={k=root_k},
     }, MT)
@@ -56,15 +56,8 @@ function MT.__index.free(lo, k)
     end
 end
 
-function MT.__index.update(lo, socks)
+function MT.__index.update(lo)
     local deadlines = {}
-    local timeout
-    lo.sniff_fd, timeout = wh.get_pcap(lo.sniff)
-
-    socks[#socks+1] = lo.sniff_fd
-    if timeout then
-        deadlines[#deadlines+1] = now+timeout
-    end
 
     for _, c in pairs(lo.connects) do
         if not c.ac_deadline then
@@ -84,6 +77,7 @@ function MT.__index.touch_tunnel(lo, p)
         p.tunnel = {
             lo_addr = lo:touch(p.k)
         }
+        lo.n.kad:mark(p)
     end
     return p.tunnel
 end
@@ -92,6 +86,7 @@ function MT.__index.free_tunnel(lo, p)
     if p.tunnel then
         lo:free(p.k)
         p.tunnel = nil
+        lo.n.kad:mark(p)
     end
 end
 
@@ -119,60 +114,68 @@ local function on_connect(lo, c, dst, p2p)
     c.ac_deadline = now + TRY_AUTOCONNECT_EVERY_S
 end
 
-function MT.__index.on_readable(lo, r)
-    while r[lo.sniff_fd] do
-        local src_addr, dst_lo_addr, m = wh.pcap_next_udp(lo.sniff)
+local function on_datagram(lo, dst_lo_addr, m)
+    local dst_k = lo.addr_ks[dst_lo_addr:pack()]
 
-        if not m then
-            break
-        end
+    if not dst_k then
+        printf("$(red)error: unknown lo addr: %s$(reset)", dst_lo_addr)
+        return
+    end
 
-        local dst_k = lo.addr_ks[dst_lo_addr:pack()]
+    local dst = lo.n.kad:get(dst_k)
+    if not dst then
+        return
+    end
 
-        if not dst_k then
-            printf("$(red)error: unknown lo addr: %s$(reset)", dst_lo_addr)
-            return
+    -- is peer set with a tunnel? if so, redirect the wireguard packet.
+    -- else, try to connect while buffering the packets
+
+    if lo.auto_connect then
+        local c = lo.connects[dst.k]
+        if not c then
+            printf("$(green)auto-connecting to %s$(reset)", lo.n:key(dst))
+            c = lo.n:connect(dst.k, nil, function(...)
+                return on_connect(lo, ...)
+            end)
+            lo.connects[dst.k] = c
         end
 
-        local dst = lo.n.kad:get(dst_k)
-        if not dst then
-            return
+        if not c.pkt_buf then
+            c.pkt_buf = {}
         end
 
-        -- is peer set with a tunnel? if so, redirect the wireguard packet.
-        -- else, try to connect while buffering the packets
-
-        if lo.auto_connect then
-            local c = lo.connects[dst.k]
-            if not c then
-                printf("$(green)auto-connecting to %s$(reset)", lo.n:key(dst))
-                c = lo.n:connect(dst.k, nil, function(...)
-                    return on_connect(lo, ...)
-                end)
-                lo.connects[dst.k] = c
-            end
-
-            if not c.pkt_buf then
-                c.pkt_buf = {}
-            end
-
-            c.pkt_buf[#c.pkt_buf+1] = m
-            if #c.pkt_buf > lo.buffer_max then
-                table.remove(c.pkt_buf, 1)
-            end
+        c.pkt_buf[#c.pkt_buf+1] = m
+        if #c.pkt_buf > lo.buffer_max then
+            table.remove(c.pkt_buf, 1)
         end
+    end
 
-        if dst.tunnel then
-            dst.tunnel.last_tx = now
-            local through_tunnel = lo.n:send_datagram(dst, m)
+    if dst.tunnel then
+        dst.tunnel.last_tx = now
+        local through_tunnel = lo.n:send_datagram(dst, m)
 
-            if not through_tunnel then
-                lo:free_tunnel(dst)
-            end
+        if not through_tunnel then
+            lo:free_tunnel(dst)
         end
     end
 end
 
+function MT.__index.on_readable(lo, r)
+    if not r[lo.sniff_fd] then
+        return
+    end
+
+    -- reads whole blocks of captured frames until the ring is drained
+    repeat
+        local rs, count = wh.loring.recv(lo.sniff)
+
+        for i = 1, #rs, 3 do
+            local _, dst_lo_addr, m = table.unpack(rs, i, i+2)
+            on_datagram(lo, dst_lo_addr, m)
+        end
+    until count == 0
+end
+
 function MT.__index.forget(lo, k)
     lo.connects[k] = nil
 end
@@ -192,13 +195,14 @@ end
 
 function MT.__index.close(lo)
     if lo.sniff then
-        wh.close_pcap(lo.sniff)
+        lo.n.poller:unregister(lo.sniff_fd)
+        wh.loring.close(lo.sniff)
         lo.sniff = nil
+        lo.sniff_fd = nil
     end
 
-    if lo.sniff_fd then
-        wh.close(lo.sniff_fd)
-        lo.sniff_fd = nil
+    if lo.n.datapath then
+        wh.datapath.set_lo(lo.n.datapath, nil)
     end
 
     if lo.sock then
@@ -247,9 +251,16 @@ return function(lo)
     end
 
     -- XXX lazy?
-    lo.sniff = wh.sniff('any', 'in', 'wg', " and dst net " .. lo.subnet)
+    lo.sniff = wh.loring.new(lo.addr, lo.cidr, wh.LO_RING_BLOCK_SIZE, wh.LO_RING_BLOCKS)
+    lo.sniff_fd = wh.loring.get_fd(lo.sniff)
+    lo.n.poller:register(lo.sniff_fd)
     lo.sock = wh.socket_raw_udp('ip4_hdrincl')
 
+    -- relayed fragments of peers with a tunnel are reassembled natively
+    if lo.n.datapath then
+        wh.datapath.set_lo(lo.n.datapath, lo.sock, wh.FRAGMENT_MAX, wh.FRAGMENT_TIMEOUT)
+    end
+
     return setmetatable(lo, MT)
 end
 
@@ -16,9 +16,7 @@ function M.detect_nat(n, k, cb)
     local p
     if k == nil then
         -- XXX get the closest node which is public!
-        local closest = n.kad:kclosest(n.k, 1, function(p)
-            return p.bootstrap
-        end)
+        local closest = n.kad:kclosest(n.k, 1, 'bootstrap')
         if #closest == 0 then
             return cb("offline")
         end
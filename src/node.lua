@@ -8,6 +8,8 @@ local time = require('time')
 local auth = require('auth')
 local kad = require('kad')
 local nat = require('nat')
+local pmtu = require('pmtu')
+local relaysession = require('relaysession')
 local search = require('search')
 local connectivity = require('connectivity')
 
@@ -84,38 +86,67 @@ function MT.__index._sendto(n, opts)
         n.bw:add_tx(udp_dst.k, #me)
     end
 
-    local ret, errmsg = wh.sendto_raw_udp(n.sock4_raw, n.sock6_raw, me, port, udp_dst_addr)
+    -- queued until next flush
+    wh.egress.push(opts.egress or n.egress, me, port, udp_dst_addr)
+end
 
-    if not ret then
-        printf('$(red)error: could not send packet: %s', errmsg)
+-- sends all queued packets
+function MT.__index.flush(n)
+    -- shards read the routing table, and the configuration of the datapath
+    if n.in_shards and n.datapath then
+        n.kad:sync()
+        wh.datapath.set_nated(n.datapath, n.is_nated)
+        wh.shards.sync(n.in_shards, n.datapath)
+    end
+
+    -- path MTU probes too large for the local interface fail
+    wh.egress.flush(n.probe_egress)
+
+    local _, failed, errmsg = wh.egress.flush(n.egress)
+
+    if failed > 0 then
+        printf('$(red)error: could not send %d packet(s): %s', failed, errmsg)
     end
 end
 
-function MT.__index.update(n, socks)
+function MT.__index.update(n)
     local timeout
     local deadlines = {}
 
-    socks[#socks+1] = n.sock_echo
-    socks[#socks+1] = wh.ipc_event.get_fd(n.pe)
-
-    n.in_udp_fd, timeout = wh.get_pcap(n.in_udp)
-    socks[#socks+1] = n.in_udp_fd
-    if timeout then
-        deadlines[#deadlines+1] = now+timeout
+    -- run expired timers
+    for _, cb in ipairs(wh.timer_expired(now)) do
+        cpcall(cb)
     end
 
-    if n.upnp then
-        n.upnp.worker:update(socks)
+    n.kad:update_seen(n.bw)
+
+    if n.in_udp then
+        n.in_udp_fd, timeout = wh.get_pcap(n.in_udp)
+        if timeout then
+            deadlines[#deadlines+1] = now+timeout
+        end
     end
 
     connectivity.update(n, deadlines)
 
-    if n.ns then
-        n.ns.worker:update(socks)
-    end
-
     kad.update(n, deadlines)
 
+    -- snapshot the routing table every now and then, to seed it on restart
+    if n.snapshot_path then
+        local deadline = n.last_snapshot + wh.SNAPSHOT_INTERVAL
+        if deadline <= now then
+            local ok, err = n.kad:save(n.snapshot_path)
+            if not ok then
+                printf("$(red)cannot save snapshot %s: %s$(reset)", n.snapshot_path, err)
+            end
+
+            n.last_snapshot = now
+            deadline = now + wh.SNAPSHOT_INTERVAL
+        end
+
+        deadlines[#deadlines+1] = deadline
+    end
+
     for d in pairs(n.nat_detectors) do
         nat.update(n, d, deadlines)
     end
@@ -129,11 +160,11 @@ function MT.__index.update(n, socks)
     end
 
     if n.lo then
-        deadlines[#deadlines+1] = n.lo:update(socks)
+        deadlines[#deadlines+1] = n.lo:update()
     end
 
     if n.wgsync then
-        deadlines[#deadlines+1] = n.wgsync:update(socks)
+        deadlines[#deadlines+1] = n.wgsync:update()
     end
 
     if (n.bw and
@@ -143,6 +174,8 @@ function MT.__index.update(n, socks)
         n.bw:collect()
     end
 
+    deadlines[#deadlines+1] = wh.timer_next()
+
     return min(deadlines)
 end
 
@@ -206,8 +239,13 @@ function MT.__index.forget(n, dst_k)
     p.last_seen = nil
     p.ping_retry = nil
     p.relay = nil
+    p.rtt_ts = nil
+    p.rttvar = nil
+    p.srtt = nil
     p.tunnel = nil
 
+    wh.keycache_forget(dst_k)
+
     if n.lo then
         n.lo:forget(dst_k)
     end
@@ -225,24 +263,34 @@ function MT.__index.send_datagram(n, dst, m)
     end
 
     if dst.relay then
+        pmtu.probe(n, dst)
+
+        local mtu = pmtu.fragment_size(dst)
+        local session_id = relaysession.id(n, dst)
         local num = 0
         while true do
-            local fragment = string.sub(m, num*wh.FRAGMENT_MTU+1, (num+1)*wh.FRAGMENT_MTU)
-            local mf = #m > ((num+1)*wh.FRAGMENT_MTU)
+            local fragment = string.sub(m, num*mtu+1, (num+1)*mtu)
+            local mf = #m > ((num+1)*mtu)
 
             if #fragment == 0 then
                 break
             end
 
-            n:_sendto{
-                dst=dst,
-                m=packet.fragment(
-                    n.frag_counter,
-                    num,
-                    mf,
-                    fragment
-                )
-            }
+            fragment = packet.fragment(
+                n.frag_counter,
+                num,
+                mf,
+                fragment
+            )
+
+            if session_id then
+                n:_sendto{
+                    dst=dst,
+                    me=wh.session_packet(n.sk, dst.relay.k, session_id, fragment),
+                }
+            else
+                n:_sendto{dst=dst, m=fragment}
+            end
 
             num = num + 1
             assert(num < 64)
@@ -311,7 +359,36 @@ function MT.__index.read(n, m, src_addr, src_k, src_is_nated, time, via, relay)
         printf("$(red)unknown cmd: {%d} (%dB)\t%s", string.byte(cmd), #m, src)
     end
 
-    src.relay = real_relay
+    -- the handler may have synced the temporary relay in the native table
+    if src.relay ~= real_relay then
+        src.relay = real_relay
+        n.kad:mark(src)
+    end
+end
+
+-- reads results of wh.open_packets or wh.pcap_open_packets
+local function read_packets(n, rs, via)
+    for i = 1, #rs, 6 do
+        local src_addr, sz, src_k, src_is_nated, time, m = table.unpack(rs, i, i+5)
+
+        -- XXX do something with time
+
+        if n.bw then
+            n.bw:add_rx(src_k, sz)
+        end
+
+        n:read(m, src_addr, src_k, src_is_nated, time, via)
+    end
+end
+
+-- returns the native datapath, if any, with up-to-date routes
+local function get_datapath(n)
+    if n.datapath then
+        n.kad:sync()
+        wh.datapath.set_nated(n.datapath, n.is_nated)
+    end
+
+    return n.datapath
 end
 
 function MT.__index.on_readable(n, r)
@@ -319,49 +396,56 @@ function MT.__index.on_readable(n, r)
         wh.ipc_event.clear(n.pe)
     end
 
-    if n.upnp then
-        n.upnp.worker:on_readable(r)
+    if n.worker then
+        n.worker:on_readable(r)
     end
 
-    if n.ns then
-        n.ns.worker:on_readable(r)
+    if n.in_udp and r[n.in_udp_fd] then
+        repeat
+            local rs, count = wh.pcap_open_packets(n.in_udp, n.sk, wh.RECV_BATCH, get_datapath(n), n.ratelimit, n.admission, n.verifier)
+            read_packets(n, rs, "normal")
+        until count < wh.RECV_BATCH
     end
 
-    while r[n.in_udp_fd] or r[n.sock_echo] do
-        local me, src_addr
-        local via
-
-        if r[n.in_udp_fd] then
-            src_addr, _, me = wh.pcap_next_udp(n.in_udp)
-            via = "normal"
+    if n.in_shards and r[wh.shards.get_fd(n.in_shards)] then
+        repeat
+            local rs, count = wh.shards_open_packets(n.in_shards, wh.RECV_BATCH)
+            read_packets(n, rs, "normal")
+        until count < wh.RECV_BATCH
+    end
 
-            if not me then
-                r[n.in_udp_fd] = nil
+    if n.in_sock then
+        for _, fd in ipairs{wh.ingress.get_fds(n.in_sock)} do
+            if r[fd] then
+                repeat
+                    local rs, count = wh.ingress_open_packets(n.in_sock, n.sk, fd, get_datapath(n), n.ratelimit, n.admission, n.verifier)
+                    read_packets(n, rs, "normal")
+                until count < wh.RECV_BATCH
             end
         end
+    end
 
-        if r[n.sock_echo] then
-            me, src_addr = wh.recvfrom(n.sock_echo, 1500) -- XXX MTU?
-            via = "echo"
-        end
-
-        -- if no more packet, break
-        if me == nil then
-            break
-        else
-            local src_k, src_is_nated, time, m = wh.open_packet(n.sk, me)
-
-            -- XXX do something with time
-
-            -- if message is valid,
-            if m ~= nil then
-                if n.bw then
-                    n.bw:add_rx(src_k, #me)
-                end
+    if n.verifier and r[wh.verifier.get_fd(n.verifier)] then
+        repeat
+            local rs, count = wh.verifier_open_packets(n.verifier, n.sk, wh.RECV_BATCH, get_datapath(n), n.ratelimit, n.admission)
+            read_packets(n, rs, "normal")
+        until count < wh.RECV_BATCH
+    end
 
-                n:read(m, src_addr, src_k, src_is_nated, time, via)
+    while r[n.sock_echo] do
+        local mes, src_addrs = {}, {}
+        while #mes < wh.RECV_BATCH do
+            local me, src_addr = wh.recvfrom(n.sock_echo, 1500) -- XXX MTU?
+            if me == nil then
+                r[n.sock_echo] = nil
+                break
             end
+
+            mes[#mes+1] = me
+            src_addrs[#src_addrs+1] = src_addr
         end
+
+        read_packets(n, wh.open_packets(n.sk, mes, src_addrs), "echo")
     end
 
     if n.lo then
@@ -370,12 +454,22 @@ function MT.__index.on_readable(n, r)
 end
 
 function MT.__index.close(n)
-    if n.upnp then
-        n.upnp.worker:free()
+    -- shards use the datapath, the rate limiter and the raw sockets
+    if n.in_shards then
+        n.poller:unregister(wh.shards.get_fd(n.in_shards))
+        wh.shards.close(n.in_shards)
+        n.in_shards = nil
     end
 
-    if n.ns then
-        n.ns.worker:free()
+    if n.verifier then
+        n.poller:unregister(wh.verifier.get_fd(n.verifier))
+        wh.verifier.close(n.verifier)
+        n.verifier = nil
+    end
+
+    if n.worker then
+        n.poller:unregister(n.worker:get_fd())
+        n.worker:free()
     end
 
     if n.lo then
@@ -386,18 +480,59 @@ function MT.__index.close(n)
         n.wgsync:close()
     end
 
+    if n.snapshot_path then
+        n.kad:save(n.snapshot_path)
+    end
+
+    if n.datapath then
+        wh.datapath.close(n.datapath)
+        n.datapath = nil
+    end
+
+    wh.ratelimit.close(n.ratelimit)
+    n.ratelimit = nil
+
+    wh.admission.close(n.admission)
+    n.admission = nil
+
+    wh.egress.close(n.probe_egress)
+    n.probe_egress = nil
+
+    wh.egress.close(n.egress)
+    n.egress = nil
+
+    wh.close(n.sock4_probe)
+    n.sock4_probe = nil
+
+    wh.close(n.sock6_probe)
+    n.sock6_probe = nil
+
     wh.close(n.sock4_raw)
     n.sock4_raw = nil
 
     wh.close(n.sock6_raw)
     n.sock6_raw = nil
 
+    n.poller:unregister(n.sock_echo)
     wh.close(n.sock_echo)
     n.sock_echo = nil
 
-    wh.close_pcap(n.in_udp)
-    n.in_udp = nil
+    if n.in_udp then
+        n.poller:unregister(n.in_udp_fd)
+        wh.close_pcap(n.in_udp)
+        n.in_udp = nil
+    end
 
+    if n.in_sock then
+        for _, fd in ipairs{wh.ingress.get_fds(n.in_sock)} do
+            n.poller:unregister(fd)
+        end
+
+        wh.ingress.close(n.in_sock)
+        n.in_sock = nil
+    end
+
+    n.poller:unregister(wh.ipc_event.get_fd(n.pe))
     wh.ipc_event.close(n.pe)
     n.pe = nil
 
@@ -474,7 +609,7 @@ function MT.__index.describe(n, mode)
 
             r[#r+1] = string.format("    %s (%d queued, closest %d)\n",
                 n:key(s), #s.closest,
-                s.closest[1] and wh.bid(s.k, s.closest[1][1]) or 0
+                #s.closest > 0 and wh.bid(s.k, s.closest:list()[1][1]) or 0
             )
 
             if s.deadline-now<5 then
@@ -713,13 +848,12 @@ function MT.__index.reload(n, conf)
             elseif p.trust and (not pconf or not pconf.trust) then
                 n:explain('conf', "remove %s from trusted peers", n:key(p))
                 p.trust = false
+                n.kad:revisit(p)
             end
+        end
 
-            for i = #to_remove, 1, -1 do
-                local p = bucket[to_remove[i]]
-                table.remove(bucket, to_remove[i])
-                bucket[p.k] = nil
-            end
+        for _, p in ipairs(to_remove) do
+            n.kad:unlink(p)
         end
     end
 
@@ -775,6 +909,14 @@ function M.new(n)
 
     if n.mode == nil then n.mode = 'unknown' end
     if n.bw == nil then n.bw = true end
+    if n.ingress == nil then n.ingress = 'pcap' end
+    assert(n.ingress == 'pcap' or n.ingress == 'socket')
+    if n.shards == nil then n.shards = 0 end
+    assert(n.shards == 0 or n.ingress == 'socket', "shards require the socket ingress")
+    if n.verifiers == nil then n.verifiers = 0 end
+    assert(n.verifiers == 0 or n.shards == 0, "shards verify their packets")
+    if n.worker_threads == nil then n.worker_threads = wh.WORKER_THREADS end
+    if n.snapshot_path == nil and n.confpath then n.snapshot_path = n.confpath .. '.peers' end
 
     if n.workbit == nil then
         n.workbit = 0
@@ -791,18 +933,64 @@ function M.new(n)
 
     n.log = n.log or 0
     n.running = true
-    n.in_udp = wh.sniff('any', 'in', 'wh', " and dst port " .. tostring(n.port))
+    n.poller = n.poller or wh.poller()
+
+    -- sharded ingress is started once the datapath is created
+    if n.ingress == 'socket' and n.shards == 0 then
+        n.in_sock = wh.ingress.new(n.port, wh.RECV_BATCH)
+        for _, fd in ipairs{wh.ingress.get_fds(n.in_sock)} do
+            n.poller:register(fd)
+        end
+    elseif n.ingress == 'pcap' then
+        n.in_udp = wh.sniff('any', 'in', 'wh', " and dst port " .. tostring(n.port))
+        n.in_udp_fd = wh.get_pcap(n.in_udp)
+        n.poller:register(n.in_udp_fd)
+    end
     n.sock_echo = wh.socket_udp(wh.address('0.0.0.0', n.port_echo))
+    n.poller:register(n.sock_echo)
     n.sock4_raw = wh.socket_raw_udp("ip4")
     n.sock6_raw = wh.socket_raw_udp("ip6")
+    n.egress = wh.egress.new(n.sock4_raw, n.sock6_raw, wh.SEND_BATCH)
+
+    -- path MTU probes are never fragmented (see pmtu.lua)
+    n.sock4_probe = wh.socket_raw_udp("ip4_dontfrag")
+    n.sock6_probe = wh.socket_raw_udp("ip6_dontfrag")
+    n.probe_egress = wh.egress.new(n.sock4_probe, n.sock6_probe, wh.SEND_BATCH,
+        n.egress)
+
+    n.admission = wh.admission.new(n.egress, n.port, wh.ADMISSION_VERIFY_RATE)
+    n.ratelimit = wh.ratelimit.new()
+    for _, cmd in ipairs{'relay', 'search'} do
+        local prefix = 'RATELIMIT_' .. string.upper(cmd)
+        wh.ratelimit.set(
+            n.ratelimit,
+            string.byte(packet.cmds[cmd]),
+            wh[prefix .. '_PPS'],
+            wh[prefix .. '_BPS']
+        )
+    end
+
     n.kad = require('kadstore')(n.k, wh.KADEMILIA_K)
     n.p = n.kad.root
+
+    -- warm restart: seed the routing table with the peers of the last run
+    if n.snapshot_path then
+        local count, err = n.kad:load(n.snapshot_path)
+        if count then
+            printf("loaded %d peer(s) from %s", count, n.snapshot_path)
+        elseif n.log > 0 then
+            printf("no snapshot loaded: %s", err)
+        end
+
+        n.last_snapshot = wh.now()
+    end
     n.searches = {}
     n.connects = {}
     n.auths = {}
     n.nat_detectors = {}
     n.jitter_rand = math.random() * 1
     n.pe = wh.ipc_event.new()
+    n.poller:register(wh.ipc_event.get_fd(n.pe))
     n.frag_counter = math.floor(math.random() * 0xffff)
 
     if n.bw then
@@ -811,27 +999,45 @@ function M.new(n)
 
     n.is_nated = n.mode ~= 'direct'
 
-    if wh.upnp then
-        n.upnp = {
-            worker = wh.worker('upnp'),
-            enabled = false,
-            last_check = 0,
-            checking = false,
-        }
-
-        n.upnp.worker:pcall(function() end, function()
-            require('wh')
-            require('helpers')
-        end)
+    -- RELAY packets and relay sessions are forwarded natively. Their bytes are
+    -- logged when the native routing table is collected (see n:update()).
+    n.datapath = wh.datapath.new(n.kad.native, n.egress, n.port)
+    wh.datapath.set_sessions(n.datapath, wh.RELAY_SESSION_TIMEOUT)
+
+    -- packets are received, verified and, if possible, handled natively by
+    -- shard threads. Shards only pass the other packets to Lua.
+    if n.shards > 0 then
+        n.in_shards = wh.shards.new(n.sk, n.port, n.shards, wh.RECV_BATCH,
+            n.sock4_raw, n.sock6_raw, n.egress, wh.ADMISSION_VERIFY_RATE,
+            n.datapath, n.ratelimit)
+        n.poller:register(wh.shards.get_fd(n.in_shards))
     end
 
-    if n.ns then
-        n.ns.worker = wh.worker('ns')
+    -- packets received by the main thread are verified by a pool of threads.
+    -- Verified packets are read from the verifier.
+    if n.verifiers > 0 then
+        n.verifier = wh.verifier.new(n.sk, n.verifiers)
+        n.poller:register(wh.verifier.get_fd(n.verifier))
+    end
 
-        n.ns.worker:pcall(function() end, function()
+    -- UPnP and name resolution jobs share a pool of worker threads
+    if wh.upnp or n.ns then
+        n.worker = wh.worker('wh', n.worker_threads, function()
             require('wh')
             require('helpers')
         end)
+
+        n.worker:set_limit('upnp', wh.WORKER_UPNP_JOBS)
+        n.worker:set_limit('ns', wh.WORKER_NS_JOBS)
+        n.poller:register(n.worker:get_fd())
+    end
+
+    if wh.upnp then
+        n.upnp = {
+            enabled = false,
+            last_check = 0,
+            checking = false,
+        }
     end
 
     return setmetatable(n, MT)
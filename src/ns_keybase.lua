@@ -43,6 +43,11 @@ local function generate_url(path)
     return string.format("https://%s.keybase.pub/wirehub/%s", user, hostname)
 end
 
+-- run by a worker thread. Defined once, so that its bytecode is cached.
+local function fetch(cmd)
+    return io.popen(cmd):read()
+end
+
 return function(n, k, cb)
     local path = string.match(k, "(.+)%.kb.wh")
 
@@ -53,7 +58,7 @@ return function(n, k, cb)
     local url = generate_url(path)
     local cmd = CMD .. url
 
-    n.ns.worker:pcall(
+    n.worker:pcall_class('ns',
         function(ok, resp)
             if resp then
                 local ok, k = pcall(wh.fromb64, resp)
@@ -65,9 +70,7 @@ return function(n, k, cb)
 
             return cb(nil)
         end,
-        function(cmd)
-            return io.popen(cmd):read()
-        end,
+        fetch,
         cmd
     )
 end
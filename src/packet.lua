@@ -2,6 +2,7 @@
 
 local M = {}
 
+-- order must match packet_cmd_* of src/core/packet.h
 local cmds = {
     -- PING. Requests a peer to PONG.
     'ping',
@@ -12,7 +13,8 @@ local cmds = {
     -- SEARCH. Search for closest peers for a given key.
     'search',
 
-    -- RESULT. Response of a SEARCH.
+    -- RESULT. Response of a SEARCH. Encoded and decoded by the native routing
+    -- table (see kadstore's encode_result and decode_result).
     'result',
 
     -- RELAY. Request recipient to relay WireHub packet to a given peer.
@@ -30,6 +32,16 @@ local cmds = {
 
     -- FRAGMENT. Send fragments of raw data. Used to relay WireGuard packets.
     'fragment',
+
+    -- BIND. Request recipient to bind a relay session to a given peer.
+    'bind',
+
+    -- BOUND. Response of a BIND, with the id of the relay session.
+    'bound',
+
+    -- DATA. Relays a FRAGMENT received through a relay session to and for a
+    -- recipient.
+    'data',
 }
 for i, str in ipairs(cmds) do cmds[str] = string.pack("B", i-1) end
 
@@ -37,7 +49,7 @@ M.cmds = cmds
 
 function M.ping(arg, body)
     body = body or ''
-    assert(#body <= 8)
+    assert(#body <= 8 or arg == 'pmtu')
 
     if arg == nil or arg == 'normal' then
         arg = "\x00"
@@ -45,10 +57,22 @@ function M.ping(arg, body)
         arg = "\x01"
     elseif arg == 'direct' then
         arg = "\x02"
+    elseif arg == 'pmtu' then
+        arg = "\x03"
     end
 
     return table.concat{cmds.ping, arg, body or ''}
 end
+-- PING padded to the size of a FRAGMENT packet carrying `size` bytes. The PONG
+-- only echoes the uid.
+function M.pmtu_probe(uid, size)
+    assert(#uid == 8)
+    local pad = size - 6
+    assert(pad >= 0)
+
+    return M.ping('pmtu', uid .. string.rep('\x00', pad))
+end
+
 function M.pong(port_echo, src, body)
     return table.concat{
         cmds.pong,
@@ -61,38 +85,6 @@ function M.search(k)
     return table.concat{cmds.search, k}
 end
 
-function M.result(k, closest)
-    local m = {cmds.result, k}
-
-    for i, c in ipairs(closest) do
-        local p = c[2]
-
-        if i > wh.KADEMILIA_K then
-            break
-        end
-
-        if p.relay then
-            m[#m+1] = "\x01"
-        elseif p.is_nated then
-            m[#m+1] = "\x02"
-        else
-            m[#m+1] = "\x00"
-        end
-
-        do
-            m[#m+1] = p.k
-            m[#m+1] = p.addr:pack()
-        end
-
-        if p.relay then
-            m[#m+1] = p.relay.k
-            m[#m+1] = p.relay.addr:pack()
-        end
-    end
-
-    return table.concat(m)
-end
-
 function M.relay(dst, body)
     assert(#dst == 32)
     assert(type(body) == "string")
@@ -127,13 +119,21 @@ function M.authed(alias_k)
     }
 end
 
+function M.bind(dst_k)
+    assert(#dst_k == 32)
+    return table.concat{
+        cmds.bind,
+        dst_k,
+    }
+end
+
 function M.fragment(id, num, mf, m)
     -- mf: More Fragment
 
     assert(id&0xffff==id)
     assert(num&0x7f==num)
 
-    assert(#m <= wh.FRAGMENT_MTU)
+    assert(#m <= math.max(wh.PMTU_PROBES.ip4[1], wh.PMTU_PROBES.ip6[1]))
 
     local b = num
     if mf then
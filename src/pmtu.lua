@@ -0,0 +1,82 @@
+-- Path MTU discovery of relayed peers
+--
+-- WireGuard datagrams sent to relayed peers are split into FRAGMENT packets
+-- (see n:send_datagram()). To send as few fragments as possible, the largest
+-- fragment size going through the relay is probed with padded PINGs, as large
+-- as the FRAGMENT packets they stand for. Probes are sent every
+-- PMTU_PROBE_EVERY seconds while datagrams are sent to the peer, through
+-- sockets which never fragment them, so that those too large are dropped.
+
+local packet = require('packet')
+
+local M = {}
+
+local function explain(n, p, fmt, ...)
+    return n:explain("pmtu %s", fmt, n:key(p), ...)
+end
+
+-- Returns the fragment size to use with peer p
+function M.fragment_size(p)
+    return p.pmtu and p.pmtu.size or wh.FRAGMENT_MTU
+end
+
+-- Probes the path MTU of peer p, if not probed recently
+function M.probe(n, p)
+    local family = p.relay.addr and p.relay.addr:family()
+    local sizes = wh.PMTU_PROBES[family]
+    if not sizes then
+        return
+    end
+
+    -- sizes probed through a relay of another family do not apply
+    local pm = p.pmtu
+    if pm and pm.family ~= family then
+        pm = nil
+    end
+
+    if pm and now < pm.deadline then
+        return
+    end
+
+    if not pm then
+        pm = {family=family, size=wh.FRAGMENT_MTU}
+        p.pmtu = pm
+    end
+
+    -- the path may have shrunk since the last probes
+    if pm.probes and (pm.best or wh.FRAGMENT_MTU) < pm.size then
+        explain(n, p, "%d bytes do not go through anymore", pm.size)
+        pm.size = pm.best or wh.FRAGMENT_MTU
+    end
+
+    pm.deadline = now + wh.PMTU_PROBE_EVERY
+    pm.best = nil
+    pm.probes = {}
+
+    for _, size in ipairs(sizes) do
+        local uid = wh.randombytes(8)
+        pm.probes[uid] = size
+        n:_sendto{dst=p, m=packet.pmtu_probe(uid, size), egress=n.probe_egress}
+    end
+end
+
+function M.on_pong(n, body, src)
+    local pm = src.pmtu
+    local size = pm and pm.probes and pm.probes[body]
+    if not size then
+        return
+    end
+
+    pm.probes[body] = nil
+
+    if size > (pm.best or 0) then
+        pm.best = size
+    end
+
+    if size > pm.size then
+        explain(n, src, "fragments of %d bytes go through", size)
+        pm.size = size
+    end
+end
+
+return M
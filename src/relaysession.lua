@@ -0,0 +1,60 @@
+-- Relay sessions
+--
+-- FRAGMENT packets sent to a relayed peer are wrapped in two authenticated
+-- WireHub packets, one for the peer and one for the relay. Once the relay bound
+-- a session to the peer (BIND, BOUND), fragments are sent in session packets
+-- instead, only authenticated with the key of the session (see
+-- wh.session_packet()). The relay forwards them to the peer in DATA packets.
+--
+-- Relays forget the sessions which are not bound again within
+-- RELAY_SESSION_TIMEOUT seconds. Sessions are bound again well before.
+
+local packet = require('packet')
+
+local M = {}
+
+local function explain(n, p, fmt, ...)
+    return n:explain("session %s", fmt, n:key(p), ...)
+end
+
+-- Returns the id of the session bound to relayed peer p, or nil if fragments
+-- must be wrapped in WireHub packets. Binds a session if needed.
+function M.id(n, p)
+    local s = p.relay_session
+    if s and (s.relay_k ~= p.relay.k or now >= s.deadline) then
+        explain(n, p, "session %.8x expired", s.id)
+        p.relay_session = nil
+        s = nil
+    end
+
+    local bind_deadline = (p.relay_bind_at or -math.huge) + wh.RELAY_SESSION_TIMEOUT/3
+    if (not s or now >= s.rebind) and now >= bind_deadline then
+        p.relay_bind_at = now
+        n:_sendto{dst=p.relay, m=packet.bind(p.k)}
+    end
+
+    return s and s.id
+end
+
+function M.on_bound(n, dst_k, id, relay)
+    local p = n.kad:get(dst_k)
+
+    -- relays not handling sessions never answer
+    if not p or not p.relay_bind_at or not p.relay or p.relay.k ~= relay.k then
+        return
+    end
+
+    if not p.relay_session or p.relay_session.id ~= id then
+        explain(n, p, "bound session %.8x with relay %s", id, n:key(relay))
+    end
+
+    -- the relay's deadline started before the BOUND was received
+    p.relay_session = {
+        deadline = now + wh.RELAY_SESSION_TIMEOUT/2,
+        id = id,
+        rebind = now + wh.RELAY_SESSION_TIMEOUT/3,
+        relay_k = relay.k,
+    }
+end
+
+return M
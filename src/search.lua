@@ -14,10 +14,17 @@
 -- * 'p2p':    like 'ping', but initialize a peer-to-peer communication with UDP
 --             hole punching, if necessary.
 --
+-- Intermediate peers are queried by distance, wh.SEARCH_ALPHA at a time. A
+-- request is late when the retransmission timeout of its peer, estimated from
+-- its round-trip time, is elapsed. Late requests do not gate the search: the
+-- next closest peer is queried meanwhile.
+--
 
 
 local peer = require('peer')
 local packet = require('packet')
+local time = require('time')
+local topk = require('topk')
 
 local M = {}
 
@@ -32,12 +39,6 @@ end
 function M._extend(n, s, closest, src)
     s.states[src.k] = {retry=0, rep=true}
 
-    local set = {}
-    for _, c in ipairs(s.closest) do
-        local p = c[2]
-        set[p:pack()] = true
-    end
-
     for _, c in ipairs(closest) do
         local dist = c[1]
         local p = c[2]
@@ -52,18 +53,26 @@ function M._extend(n, s, closest, src)
             (st == nil or not st.rep) and
 
             -- ignore doublons
-            not set[p:pack()]
+            not s.closest:has(p.k)
         ) then
             --printf('extend $(cyan)%s', p)
-            p = n:add(p):acquire(s)
-            s.closest[#s.closest+1] = {dist, p}
-            set[p:pack()] = true
+            p = n:add(p)
+
+            -- keep only the closest peers
+            local inserted, evicted = s.closest:insert(dist, p)
+            if evicted then
+                evicted:release(s)
+            end
+
+            if inserted then
+                p:acquire(s)
+            end
 
-            if s.cb and (s.return_all or p.k == s.k) then
+            if inserted and s.cb and (s.return_all or p.k == s.k) then
                 cpcall(s.cb, s, p, src)
             end
 
-            if s.probe_cb then s:probe_cb{
+            if inserted and s.probe_cb then s:probe_cb{
                 action="extend",
                 p=p,
                 st=st,
@@ -73,11 +82,10 @@ function M._extend(n, s, closest, src)
 
     -- XXX maybe give a preference to trusted peers, or peers which are public
     -- or geographically close
-    table.sort(s.closest, function(a, b) return a[1] < b[1] end)
 
     if s.probe_cb then s:probe_cb{
         action="closest",
-        closest=s.closest,
+        closest=s.closest:list(),
         states=s.states,
     } end
 end
@@ -105,11 +113,11 @@ function M.search(n, k, opts, cb)
         error("arg #3 must be 'p2p', 'lookup' or 'ping'")
     end
     if opts.count == nil then opts.count = wh.SEARCH_COUNT end
-    if timeout == nil then opts.timeout = wh.SEARCH_TIMEOUT end
+    if opts.timeout == nil then opts.timeout = wh.SEARCH_TIMEOUT end
 
     local s = setmetatable({
         cb=cb,
-        closest={},
+        closest=topk(opts.count),
         count=opts.count,
         deadline=now+opts.timeout,
         k=k,
@@ -127,6 +135,12 @@ function M.search(n, k, opts, cb)
 
     n.searches[s] = true
 
+    s.timer = wh.timer_add(s.deadline, function()
+        s.timer = nil
+        explain(n, s, "stop")
+        n:stop_search(s)
+    end)
+
     if s.probe_cb then s:probe_cb{
         action="start",
         from=n.p,
@@ -135,9 +149,7 @@ function M.search(n, k, opts, cb)
     } end
 
     -- bootstrap
-    local closest = n.kad:kclosest(k, wh.KADEMILIA_K, function(p)
-        return p.k == k or p:state() == 'direct'
-    end)
+    local closest = n.kad:kclosest(k, wh.KADEMILIA_K, 'direct')
 
     n:_extend(s, closest, n.kad.root)
 
@@ -148,6 +160,11 @@ function M.stop_search(n, s)
     if s.running then
         s.running = false
 
+        if s.timer then
+            wh.timer_cancel(s.timer)
+            s.timer = nil
+        end
+
         --printf('stop search $(cyan)%s', n:key(s))
 
         if s.probe_cb then s:probe_cb{
@@ -160,11 +177,11 @@ function M.stop_search(n, s)
             cpcall(s.cb, s, nil)
         end
 
-        for i, c in ipairs(s.closest) do
+        for _, c in ipairs(s.closest:list()) do
             local p = c[2]
             p:release(s)
         end
-        s.closest = {}
+        s.closest = topk(s.count)
     end
 end
 
@@ -199,18 +216,19 @@ end
 function M.update(n, s, deadlines)
     local to_remove = {}
 
-    if s.deadline ~= nil then
-        -- if search timeout, remove search
-        if now >= s.deadline then
-            explain(n, s, "stop")
-            n:stop_search(s)
-            return
-        end
+    -- count requests in flight, which are neither answered nor late
+    local inflight = 0
+    for _, c in ipairs(s.closest:list()) do
+        local p = c[2]
+        local st = s.states[p.k]
 
-        deadlines[#deadlines+1] = s.deadline
+        if p.k ~= s.k and st and st.req_ts and not st.rep and
+           now < st.req_ts + time.rto(p) then
+            inflight = inflight + 1
+        end
     end
 
-    for i, c in ipairs(s.closest) do
+    for _, c in ipairs(s.closest:list()) do
         local p = c[2]
 
         local deadline
@@ -278,24 +296,39 @@ function M.update(n, s, deadlines)
         elseif p.k == n.k then
             -- keep deadline to nil
 
-        -- remove if search has too many nodes
-        elseif i > s.count then
-            -- keep deadline to nil
-
         -- ignore if node does not have any address
         elseif not p.addr then
             -- keep deadline to nil
 
-        -- no response and not enough retry, send a find and wait retry sec
+        -- no response and not enough retry, send a find and wait for the
+        -- retransmission timeout of the peer
         elseif not st.rep and st.retry <= wh.PING_RETRY then
-            deadline = (st.req_ts or 0)+st.retry+1
+            local rto = time.rto(p)
+
+            if st.retry > 0 then
+                deadline = st.req_ts + rto * (st.retry+1)
+
+                -- the request becomes late, wake up to query the next peer
+                if now < st.req_ts + rto then
+                    deadlines[#deadlines+1] = st.req_ts + rto
+                end
+
+            -- wait for a request in flight to be answered or to be late
+            elseif inflight >= wh.SEARCH_ALPHA then
+                deadline = s.deadline
+
+            else
+                deadline = now
+                inflight = inflight + 1
+            end
 
             if now >= deadline then
                 n:_sendto{dst=p, m=packet.search(s.k)}
                 st.retry = st.retry + 1
                 st.req_ts = now
                 st.rep = false
-                deadline = st.req_ts+st.retry+1
+                deadline = st.req_ts + rto * (st.retry+1)
+                deadlines[#deadlines+1] = st.req_ts + rto
 
                 if s.probe_cb then s:probe_cb{
                     action='request',
@@ -312,18 +345,18 @@ function M.update(n, s, deadlines)
 
         else
             p:release(s)
-            to_remove[#to_remove+1] = i
+            to_remove[#to_remove+1] = p
         end
     end
 
-    for i = #to_remove, 1, -1 do
-        table.remove(s.closest, to_remove[i])
+    for _, p in ipairs(to_remove) do
+        s.closest:remove(p)
     end
 
     if s.probe_cb then s:probe_cb{
         action="closest",
-        closest=s.closest,
-        states=states,
+        closest=s.closest:list(),
+        states=s.states,
     } end
 
     if #s.closest == 0 then
@@ -340,6 +373,10 @@ function M.on_pong(n, body, src)
                 if s.uid1 == body then
                     explain(n, s, "%s is alive!", n:key(src))
 
+                    if st and st.retry == 1 and st.req_ts then
+                        time.rtt_sample(src, now - st.req_ts)
+                    end
+
                     cpcall(s.cb, s, src, src)
                     n:stop_search(s)
                 end
@@ -373,6 +410,12 @@ function M.on_result(n, pks, closest, src)
         if pks == s.k then
             local st = s.states[src.k]
             if st then
+                -- only the response of a first request is an unambiguous RTT
+                -- sample
+                if st.retry == 1 and st.req_ts and not st.rep then
+                    time.rtt_sample(src, now - st.req_ts)
+                end
+
                 st.rep = true
 
                 local s_closest = {}
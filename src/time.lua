@@ -83,5 +83,27 @@ function M.retry_ping_backoff(p, retry_every, retry_max, backoff)
     return true, deadline
 end
 
+-- Round-trip time estimation, as TCP's (RFC 6298). Samples of retransmitted
+-- requests are ambiguous and must not be taken into account.
+function M.rtt_sample(p, rtt)
+    if p.srtt == nil then
+        p.srtt = rtt
+        p.rttvar = rtt / 2
+    else
+        p.rttvar = .75 * p.rttvar + .25 * math.abs(p.srtt - rtt)
+        p.srtt = .875 * p.srtt + .125 * rtt
+    end
+end
+
+-- Returns the retransmission timeout of peer p
+function M.rto(p)
+    if p.srtt == nil then
+        return wh.RTO_INITIAL
+    end
+
+    local rto = p.srtt + 4 * p.rttvar
+    return math.min(math.max(rto, wh.RTO_MIN), wh.RTO_MAX)
+end
+
 return M
 
@@ -13,8 +13,8 @@
 --   Initialize WireGuard <-> WireHub synchronization manager
 --
 --   while running do    -- main loop
---       list file descriptors to wait for and ...
---       ... calculate next deadline for the I/O event poller
+--       calculate next deadline for the I/O event poller
+--       send queued packets
 --
 --       wait for I/O events
 --
@@ -30,7 +30,7 @@ local cmd = arg[1]
 
 function help()
     printf(
-"Usage: wh up <network file path> [private-key <file path>] [interface <interface>] [listen-port <port>] [mode {unknown | direct | nat}]\n" ..
+"Usage: wh up <network file path> [private-key <file path>] [interface <interface>] [listen-port <port>] [mode {unknown | direct | nat}] [ingress {pcap | socket}] [shards <count>] [verifiers <count>] [workers <count>]\n" ..
 "\n" ..
 "If the argument 'private-key' is not set, one ephemeron key will be generated\n" ..
 "for the session, and destroyed when the daemon stops.\n" ..
@@ -41,6 +41,18 @@ function help()
 "If 'listen-port' is not set, it will be by default 0. If 'listen-port is 0,\n" ..
 "WireHub will pick a random listen port between 1024 and 65535.\n" ..
 "\n" ..
+"'ingress' selects how WireHub packets are received: 'pcap' (default) captures\n" ..
+"them with libpcap, 'socket' reads them in batches from raw UDP sockets.\n" ..
+"\n" ..
+"'shards' sets the count of threads receiving, verifying and relaying WireHub\n" ..
+"packets with the 'socket' ingress. If 0 (default), the main thread does.\n" ..
+"\n" ..
+"'verifiers' sets the count of threads verifying the WireHub packets received\n" ..
+"by the main thread. If 0 (default), the main thread verifies them.\n" ..
+"\n" ..
+"'workers' sets the count of threads running blocking jobs, such as UPnP and\n" ..
+"name resolution.\n" ..
+"\n" ..
 "Example:\n" ..
 "  Starts an ephemeron peer for network 'public'\n" ..
 "    wh up public\n" ..
@@ -97,6 +109,15 @@ local opts = parsearg(3, {
        end
        return s
    end,
+    ingress = function(s)
+        if s ~= 'pcap' and s ~= 'socket' then
+            s = nil
+        end
+        return s
+    end,
+    shards = tonumber,
+    verifiers = tonumber,
+    workers = tonumber,
 })
 
 if not opts then
@@ -147,6 +168,10 @@ local n = wh.new{
     namespace=conf.namespace,
     workbit=conf.workbit,
     mode=opts.mode,
+    ingress=opts.ingress,
+    shards=opts.shards,
+    verifiers=opts.verifiers,
+    worker_threads=opts.workers,
     log=tonumber(os.getenv('LOG')),
     ns={
         require('ns_keybase'),
@@ -172,7 +197,7 @@ end
 
 local ipc_conn
 local handlers = require('handlers_ipc')(n)
-ipc_conn = require('ipc').bind(opts.interface or wh.tob64(n.k), handlers)
+ipc_conn = require('ipc').bind(opts.interface or wh.tob64(n.k), handlers, n.poller)
 atexit(ipc_conn.close, ipc_conn)
 
 -- log
@@ -200,18 +225,14 @@ local lc_idx = 1
 -- main loop
 now = wh.now()
 while n.running do
-    local socks = {}
     local timeout
 
-    -- update file descriptors to poll and next deadlines
+    -- update next deadlines. file descriptors are registered to the node's
+    -- poller
     do
         local deadlines = {}
 
-        if ipc_conn then
-            deadlines[#deadlines+1] = ipc_conn:update(socks)
-        end
-
-        deadlines[#deadlines+1] = n:update(socks)
+        deadlines[#deadlines+1] = n:update()
 
         --
 
@@ -226,18 +247,21 @@ while n.running do
     status(
         '%s waiting (fds: %d, timeout: %s)',
         LOADING_CHARS[lc_idx],
-        #socks,
+        n.poller:count(),
         timeout and string.format('%.1fs', timeout) or '(none)'
     )
 
     n.kad:clear_touched()
 
+    -- send packets queued during this iteration
+    n:flush()
+
     -- I/O event poller
     local r
     do
         -- Not sure why, but one pcall is not enough to catch the "interrupted"
         -- launched by lua if the user press CTRL+C
-        pcall(pcall, function() r = wh.select(socks, {}, {}, timeout) end)
+        pcall(pcall, function() r = n.poller:wait(timeout) end)
         if not r then break end
         now = wh.now()
     end
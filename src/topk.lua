@@ -0,0 +1,130 @@
+-- Bounded set of the closest peers to a key
+--
+-- Peers are kept in a max-heap on their XOR distance, so the farthest peer is
+-- evicted in O(log K) when a closer one is inserted. Peers are indexed by key.
+-- The list of peers sorted by distance is built on demand and cached until the
+-- set changes.
+
+local MT = {
+    __index = {},
+}
+
+function MT.__len(h)
+    return h.n
+end
+
+local function swap(h, i, j)
+    h.d[i], h.d[j] = h.d[j], h.d[i]
+    h.p[i], h.p[j] = h.p[j], h.p[i]
+    h.pos[h.p[i].k] = i
+    h.pos[h.p[j].k] = j
+end
+
+local function up(h, i)
+    while i > 1 do
+        local parent = i // 2
+        if h.d[i] <= h.d[parent] then
+            break
+        end
+
+        swap(h, i, parent)
+        i = parent
+    end
+end
+
+local function down(h, i)
+    while true do
+        local m, l, r = i, 2*i, 2*i+1
+
+        if l <= h.n and h.d[l] > h.d[m] then m = l end
+        if r <= h.n and h.d[r] > h.d[m] then m = r end
+        if m == i then
+            break
+        end
+
+        swap(h, i, m)
+        i = m
+    end
+end
+
+function MT.__index.has(h, k)
+    return h.pos[k] ~= nil
+end
+
+-- Inserts peer p at distance dist. Returns true if p was inserted, and the
+-- evicted peer, if any.
+function MT.__index.insert(h, dist, p)
+    if h.pos[p.k] then
+        return false
+    end
+
+    local evicted
+    if h.n < h.count then
+        h.n = h.n + 1
+        h.d[h.n], h.p[h.n] = dist, p
+        h.pos[p.k] = h.n
+        up(h, h.n)
+
+    elseif h.n > 0 and dist < h.d[1] then
+        evicted = h.p[1]
+        h.pos[evicted.k] = nil
+        h.d[1], h.p[1] = dist, p
+        h.pos[p.k] = 1
+        down(h, 1)
+
+    else
+        return false
+    end
+
+    h.sorted = nil
+    return true, evicted
+end
+
+-- Removes peer p. Returns true if p was in the set.
+function MT.__index.remove(h, p)
+    local i = h.pos[p.k]
+    if not i then
+        return false
+    end
+
+    swap(h, i, h.n)
+    h.pos[p.k] = nil
+    h.d[h.n], h.p[h.n] = nil, nil
+    h.n = h.n - 1
+
+    if i <= h.n then
+        up(h, i)
+        down(h, i)
+    end
+
+    h.sorted = nil
+    return true
+end
+
+-- Returns the list of pairs {distance, peer}, closest first. The list must not
+-- be modified.
+function MT.__index.list(h)
+    if not h.sorted then
+        local r = {}
+        for i = 1, h.n do
+            r[i] = {h.d[i], h.p[i]}
+        end
+
+        table.sort(r, function(a, b) return a[1] < b[1] end)
+        h.sorted = r
+    end
+
+    return h.sorted
+end
+
+return function(count)
+    assert(count > 0)
+
+    return setmetatable({
+        count=count,
+        d={},
+        n=0,
+        p={},
+        pos={},
+    }, MT)
+end
@@ -145,7 +145,7 @@ local function update_touched_peers(sy)
     set_peers(sy, wg_peers_update)
 end
 
-function MT.__index.update(sy, socks)
+function MT.__index.update(sy)
     -- if wireguard is disabled, do nothing
     if not sy.wg_enabled then
         return
@@ -162,7 +162,11 @@ function MT.__index.update(sy, socks)
             local p = sy.n.kad:get(k)
 
             if p then
-                p.wg_connected = wg_p.last_handshake_time > 0
+                local wg_connected = wg_p.last_handshake_time > 0
+                if p.wg_connected ~= wg_connected then
+                    p.wg_connected = wg_connected
+                    sy.n.kad:revisit(p)
+                end
 
                 if (p.last_seen or 0) < wg_p.last_handshake_time then
                     p.last_seen = wg_p.last_handshake_time
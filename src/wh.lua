@@ -59,7 +59,7 @@
 -- * me: Message Encrypted. Content of a received packet, but still encrypted.
 -- * n: wirehub Node. See 'node.lua'
 -- * now: Current timestamp. Global. Updated after every return of the polling
---        function (wh.select).
+--        function (n.poller:wait).
 -- * ns: Name reSolver. See 'ns_*.lua'.
 -- * p: Peer table, contains all information regarding a peer. See 'peer.lua'.
 -- * s: Search session. See 'n.search()' and 'search.lua'
@@ -94,6 +94,11 @@ end
 
 do  -- constants
     local constants = {
+        -- Verifications per second of packets of unknown source keys, over
+        -- which these packets are answered a cookie and dropped until the
+        -- cookie is echoed.
+        ADMISSION_VERIFY_RATE = 1000,
+
         -- Seconds. Minimum interval between checking if peers are alive. If one
         -- peer appears to be alive, it will not be checked during this amount
         -- of seconds)
@@ -121,8 +126,8 @@ do  -- constants
         -- connect to a peer.
         FRAGMENT_MAX = 4,
 
-        -- Bytes. WireHub fragment MTU.
-        FRAGMENT_MTU = 1024,   -- XXX
+        -- Bytes. WireHub fragment MTU, used until a larger path MTU is probed.
+        FRAGMENT_MTU = 1024,
 
         -- Seconds. Timeout when to discard a fragment packet.
         FRAGMENT_TIMEOUT = 4,
@@ -137,6 +142,12 @@ do  -- constants
         -- Seconds. Keep-alive timeout for NAT-ed peers. Should be less than NAT timeout.
         KEEPALIVE_NAT_TIMEOUT = 25,
 
+        -- Bytes and count. Size of the blocks and count of blocks of the ring
+        -- capturing WireGuard traffic to loopback tunnels. Block size must be a
+        -- multiple of the page size.
+        LO_RING_BLOCK_SIZE = 64*1024,
+        LO_RING_BLOCKS = 64,
+
         -- Boolean. True if a WireGuard tunnel should be instantiated when IP
         -- traffic may be routed. If false, the WireHub peer will never share IP
         -- traffic, and will just be a "headless" part of the network.
@@ -157,14 +168,73 @@ do  -- constants
         -- Maximum tentative of PING before stating peer is offline.
         PING_RETRY = 4,
 
+        -- Seconds. Interval to probe the path MTU of relayed peers receiving
+        -- datagrams.
+        PMTU_PROBE_EVERY = 10*60,
+
+        -- Bytes. Fragment sizes probed for relayed peers, largest first, by
+        -- address family of the relay. 1452 bytes fit a whole datagram of a
+        -- WireGuard interface with a MTU of 1420. The other sizes are the
+        -- largest fragments relayed on paths with a MTU of 1500: a fragment
+        -- of n bytes is sent to the relay in a RELAY packet of n+189 bytes,
+        -- larger than the RELAYED packet of n+164 (IPv4) or n+176 (IPv6) bytes
+        -- sent by the relay. Both may be prefixed with a cookie of 20 bytes,
+        -- and are sent in UDP datagrams (8 bytes) over IPv4 (20 bytes) or IPv6
+        -- (40 bytes).
+        PMTU_PROBES = {
+            ip4={1452, 1500-20-8-20-189},
+            ip6={1452, 1500-40-8-20-189},
+        },
+
+        -- Seconds. Timeout of relay sessions of relays.
+        RELAY_SESSION_TIMEOUT = 60,
+
+        -- Packets and bytes per second. Budgets of RELAY packets (and of
+        -- session packets) per source key and per source IP address. Packets
+        -- over budget are dropped before being verified. 0 means unlimited.
+        RATELIMIT_RELAY_BPS = 4*1024*1024,
+        RATELIMIT_RELAY_PPS = 4000,
+
+        -- Packets and bytes per second. Budgets of SEARCH packets per source
+        -- key and per source IP address.
+        RATELIMIT_SEARCH_BPS = 0,
+        RATELIMIT_SEARCH_PPS = 50,
+
+        -- Maximum count of datagrams read and opened in one batch.
+        RECV_BATCH = 64,
+
+        -- Seconds. Retransmission timeout of a peer whose round-trip time is
+        -- not estimated yet, and bounds of estimated timeouts.
+        RTO_INITIAL = 1,
+        RTO_MAX = 3,
+        RTO_MIN = .1,
+
+        -- Count of search requests in flight. A request whose response is
+        -- late is not in flight anymore.
+        SEARCH_ALPHA = 3,
+
         -- Maximum count of peers to keep while searching for a node.
         SEARCH_COUNT = 20,
 
         -- Seconds. Default peer searching timeout before search is stopped.
         SEARCH_TIMEOUT = 5,
 
+        -- Maximum count of packets queued before being sent in one batch.
+        SEND_BATCH = 64,
+
+        -- Seconds. Interval between two snapshots of the routing table.
+        SNAPSHOT_INTERVAL = 5*60,
+
         -- Seconds. Interval to refresh UPnP IGD router with port mapping.
         UPNP_REFRESH_EVERY = 10*60,
+
+        -- Count of threads running blocking jobs (UPnP, name resolution).
+        WORKER_THREADS = 4,
+
+        -- Maximum count of name resolution jobs and of UPnP jobs running at
+        -- the same time.
+        WORKER_NS_JOBS = 3,
+        WORKER_UPNP_JOBS = 1,
     }
 
     local env_prefix = 'WH_'
@@ -189,6 +259,11 @@ end
 
 -- sanity check (see n.send_datagram())
 assert(wh.FRAGMENT_MTU >= 1024, "65536/MTU <= 64")
+for _, sizes in pairs(wh.PMTU_PROBES) do
+    for _, size in ipairs(sizes) do
+        assert(size >= wh.FRAGMENT_MTU, "probed MTU lower than FRAGMENT_MTU")
+    end
+end
 
 -- additional extensions
 require('key')  -- add method wh.key
@@ -0,0 +1,52 @@
+/* Fuzzing harness of the deserialization of Lua values (see src/core/serdes.h)
+ *
+ *   make fuzz-serdes
+ *   .obj/fuzz-serdes [corpus directory]
+ *
+ * Arbitrary frames must be rejected, or loaded. Loaded frames must serialize
+ * into frames which load into as many elements.
+ *
+ * Loaded functions are never called: frames are exchanged between the threads
+ * of a node, and Lua does not check bytecode.
+ */
+
+#include "serdes.h"
+#include <lauxlib.h>
+#include <stdlib.h>
+
+static int _dump(lua_State* L) {
+    struct luaW_buf* b = lua_touserdata(L, 1);
+    luaW_dumpstack(L, 2, b);
+    return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    static lua_State* L;
+    if (!L && !(L = luaL_newstate())) {
+        abort();
+    }
+
+    lua_settop(L, 0);
+    if (luaW_loadstack(L, data, size) != 0) {
+        return 0;
+    }
+
+    int count = lua_gettop(L);
+
+    struct luaW_buf b = {0};
+    lua_pushcfunction(L, _dump);
+    lua_pushlightuserdata(L, &b);
+    lua_rotate(L, 1, 2);
+
+    if (lua_pcall(L, count+1, 0, 0) != LUA_OK) {
+        abort();
+    }
+
+    lua_settop(L, 0);
+    if (luaW_loadstack(L, b.p, b.l) != 0 || lua_gettop(L) != count) {
+        abort();
+    }
+
+    luaW_buffree(&b);
+    return 0;
+}